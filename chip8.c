@@ -1,16 +1,13 @@
 #include "chip8.h"
+#include "chip8_internal.h"
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
-#define unknown_opcode(op)                                                     \
-    do                                                                         \
-    {                                                                          \
-        fprintf(stderr, "Unknown opcode: 0x%x\n", op);                         \
-        fprintf(stderr, "kk: 0x%02x\n", kk);                                   \
-        exit(42);                                                              \
-    } while (0)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifdef DEBUG
 #define p(...) printf(__VA_ARGS__);
@@ -18,11 +15,7 @@
 #define p(...)
 #endif
 
-#define IS_BIT_SET(byte, bit) (((0x80 >> (bit)) & (byte)) != 0x0)
-
-#define FONTSET_ADDRESS 0x00
-#define FONTSET_BYTES_PER_CHAR 5
-unsigned char chip8_fontset[80] = {
+static const uint8_t chip8_fontset[CHIP8_FONTSET_SIZE] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
     0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -41,375 +34,1574 @@ unsigned char chip8_fontset[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-uint16_t opcode;
-uint8_t memory[CHIP8_MEMORY_SIZE];
-uint8_t V[CHIP8_REGISTER_COUNT]; // 16 registers, V0-VF. VF is the carry flag.
-uint16_t I;  // Index register. Used to store memory addresses.
-uint16_t PC; // Program counter. Used to store the address of the next
-             // instruction to be executed.
-uint8_t frame_buffer[CHIP8_SCREEN_HEIGHT][CHIP8_SCREEN_WIDTH];
-
-uint8_t delay_timer; // 8-bit timer. Decrements at a rate of 60Hz.
-uint8_t sound_timer; // 8-bit timer. Beeps when it reaches 0. Decrements at a
-                     // rate of 60Hz.
-uint16_t stack[CHIP8_STACK_SIZE]; // 16-level stack. Used to store the address
-                                  // of the next instruction to be executed.
-uint16_t SP; // Stack pointer. Used to store the address of the next instruction
-             // to be executed.
-uint8_t keypad[CHIP8_KEY_SIZE]; // 16 keys. 0-9, A-F. 0 is not pressed, 1 is
-                                // pressed.
-bool draw_flag; // Set to true when the screen should be drawn. Cleared when the
-                // screen is drawn.
-
-void chip8_init()
+// The large digits Fx30 points at. SUPER-CHIP only had 0-9; A-F are Octo's.
+static const uint8_t chip8_hires_fontset[CHIP8_HIRES_FONTSET_SIZE] = {
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
+static const char *const trap_names[CHIP8_TRAP_COUNT] = {
+    [CHIP8_TRAP_NONE] = "none",
+    [CHIP8_TRAP_BAD_OPCODE] = "bad opcode",
+    [CHIP8_TRAP_STACK_OVERFLOW] = "stack overflow",
+    [CHIP8_TRAP_STACK_UNDERFLOW] = "stack underflow",
+    [CHIP8_TRAP_BAD_ADDRESS] = "address out of memory",
+    [CHIP8_TRAP_HALTED] = "halted",
+};
+
+static const char *const quirks_names[CHIP8_QUIRKS_COUNT] = {
+    [CHIP8_QUIRKS_MODERN] = "modern",
+    [CHIP8_QUIRKS_VIP] = "vip",
+    [CHIP8_QUIRKS_SCHIP] = "schip",
+    [CHIP8_QUIRKS_XOCHIP] = "xochip",
+};
+
+// Programs that need a profile other than CHIP8_QUIRKS_MODERN, by the hash of
+// their bytes.
+static const struct known_rom
 {
-    int i;
+    uint64_t hash;
+    size_t size;
+    uint8_t quirks;
+} known_roms[] = {
+    {0x64E45391BA0238A1u, 132, CHIP8_QUIRKS_VIP}, // IBM Logo.
+};
 
-    PC = CHIP8_PROGRAM_START_ADDRESS; // Start at address 0x200.
-    opcode = 0;                       // Reset the opcode.
-    I = 0;                            // Reset the index register.
-    SP = 0;                           // Reset the stack pointer.
-    delay_timer = 0;                  // Reset the delay timer.
+void chip8_init(chip8_t *c)
+{
+    int i;
 
-    memset(memory, 0, sizeof(memory));             // Clear the memory.
-    memset(V, 0, sizeof(V));                       // Clear the registers.
-    memset(stack, 0, sizeof(stack));               // Clear the stack.
-    memset(keypad, 0, sizeof(keypad));             // Clear the keypad.
-    memset(frame_buffer, 0, sizeof(frame_buffer)); // Clear the frame buffer.
-    draw_flag = false;                             // Clear the draw flag.
+    c->jit = NULL;     // Interpreter only until chip8_jit_enable.
+    c->profile = NULL; // Not counting until chip8_profile_enable.
+    c->trace = NULL;   // Not recording until chip8_trace_start.
+    c->shm = NULL;     // Not exported until chip8_shm_attach.
+    c->hires = 0;
+    memset(c->frame_buffer, 0, sizeof(c->frame_buffer)); // May hold anything.
+    chip8_reset(c);
 
+    memset(c->memory, 0, sizeof(c->memory)); // Clear the memory.
     for (i = 0; i < sizeof(chip8_fontset); i++)
     {
-        memory[FONTSET_ADDRESS + i] = chip8_fontset[i];
+        c->memory[FONTSET_ADDRESS + i] = chip8_fontset[i];
+    }
+    for (i = 0; i < sizeof(chip8_hires_fontset); i++)
+    {
+        c->memory[HIRES_FONTSET_ADDRESS + i] = chip8_hires_fontset[i];
     }
-
-    draw_flag = true;
-    delay_timer = 0;   // Reset the delay timer.
-    sound_timer = 0;   // Reset the sound timer.
-    srand(time(NULL)); // Seed the random number generator.
 }
 
-void chip8_load_game(const char *game)
+void chip8_reset(chip8_t *c)
 {
-    FILE *fgame;
+    int words = chip8_screen_height(c) * chip8_row_words(c);
+    int plane;
 
-    fgame = fopen(game, "rb");
+    c->PC = CHIP8_PROGRAM_START_ADDRESS; // Start at address 0x200.
+    c->opcode = 0;                       // Reset the opcode.
+    c->I = 0;                            // Reset the index register.
+    c->SP = 0;                           // Reset the stack pointer.
 
-    if (NULL == fgame)
+    memset(c->V, 0, sizeof(c->V));                       // Clear the registers.
+    memset(c->stack, 0, sizeof(c->stack));               // Clear the stack.
+    memset(c->keypad, 0, sizeof(c->keypad));             // Clear the keypad.
+    memset(c->flags, 0, sizeof(c->flags));               // Clear the flags.
+    memset(c->decode_cache, 0, sizeof(c->decode_cache)); // Nothing decoded.
+
+    // Only the rows of the current mode can be lit, so only those are
+    // cleared: restarting a 64x32 machine touches 256 bytes of each plane.
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
     {
-        fprintf(stderr, "Unable to open game: %s\n", game);
-        exit(42);
+        memset(c->frame_buffer[plane], 0, words * sizeof(uint64_t));
     }
 
-    fread(&memory[0x200], 1, MAX_GAME_SIZE, fgame);
+    c->draw_flag = true;
+    c->dirty_rows = UINT64_MAX;     // The whole screen needs a first upload.
+    c->hires = 0;                   // 64x32.
+    c->planes = 1;                  // Drawing on plane 0 only.
+    c->rom = NULL;                  // Memory is all private.
+    c->shared_pages = 0;
+    c->state = CHIP8_STATE_RUNNING; // Not waiting for a key.
+    c->wait_reg = 0;                // No Fx0A pending.
+    c->trap = CHIP8_TRAP_NONE;      // Not stopped.
+    c->quirks = CHIP8_QUIRKS_MODERN;
+    c->cycles = 0;                  // Reset the cycle counters.
+    c->idle_cycles = 0;             // Reset the idle cycle counter.
+    c->ips = CHIP8_DEFAULT_IPS;     // Default emulated clock.
+    c->tick_phase = 0;              // Next timer tick is a full period away.
+    c->ticks = 0;                   // Reset the timer clock.
+    c->delay_until = 0;             // Delay timer at 0.
+    c->sound_until = 0;             // Sound timer at 0.
+    c->sound_head = 0;              // No buzzer edges queued.
+    c->sound_count = 0;
+    chip8_seed(c, CHIP8_DEFAULT_SEED); // Same random numbers every run.
+}
+
+typedef void (*chip8_handler_t)(chip8_t *c, const chip8_insn_t *e);
 
-    fclose(fgame);
+// Map an opcode to its handler index. This is the two-level switch that
+// chip8_emulate_cycle used to run on every instruction; it now only runs when
+// an address is executed for the first time or after its bytes changed.
+static uint8_t decode_op(uint16_t opcode)
+{
+    uint8_t kk = opcode & 0x00FF;
+
+    switch (opcode & 0xF000)
+    {
+    case 0x0000:
+        switch (opcode & 0x0FF0)
+        {
+        case 0x00C0:
+            return OP_SCD;
+        case 0x00D0:
+            return OP_SCU;
+        }
+        switch (kk)
+        {
+        case 0xE0:
+            return OP_CLS;
+        case 0xEE:
+            return OP_RET;
+        case 0xFB:
+            return OP_SCR;
+        case 0xFC:
+            return OP_SCL;
+        case 0xFD:
+            return OP_EXIT;
+        case 0xFE:
+            return OP_LOW;
+        case 0xFF:
+            return OP_HIGH;
+        default: // 0nnn - SYS addr is not supported.
+            return OP_UNKNOWN;
+        }
+    case 0x1000:
+        return OP_JP;
+    case 0x2000:
+        return OP_CALL;
+    case 0x3000:
+        return OP_SE_VX_KK;
+    case 0x4000:
+        return OP_SNE_VX_KK;
+    case 0x5000:
+        switch (opcode & 0x000F)
+        {
+        case 0x2:
+            return OP_SAVE_RANGE;
+        case 0x3:
+            return OP_LOAD_RANGE;
+        default: // The low nibble of 5xy0 was never checked.
+            return OP_SE_VX_VY;
+        }
+    case 0x6000:
+        return OP_LD_VX_KK;
+    case 0x7000:
+        return OP_ADD_VX_KK;
+    case 0x8000:
+        switch (opcode & 0x000F)
+        {
+        case 0x0:
+            return OP_LD_VX_VY;
+        case 0x1:
+            return OP_OR;
+        case 0x2:
+            return OP_AND;
+        case 0x3:
+            return OP_XOR;
+        case 0x4:
+            return OP_ADD_VX_VY;
+        case 0x5:
+            return OP_SUB;
+        case 0x6:
+            return OP_SHR;
+        case 0x7:
+            return OP_SUBN;
+        case 0xE:
+            return OP_SHL;
+        default:
+            return OP_UNKNOWN;
+        }
+    case 0x9000:
+        return OP_SNE_VX_VY;
+    case 0xA000:
+        return OP_LD_I;
+    case 0xB000:
+        return OP_JP_V0;
+    case 0xC000:
+        return OP_RND;
+    case 0xD000:
+        return OP_DRW;
+    case 0xE000:
+        switch (kk)
+        {
+        case 0x9E:
+            return OP_SKP;
+        case 0xA1:
+            return OP_SKNP;
+        default: // Ignored without advancing the program counter.
+            return OP_NOP;
+        }
+    default: // 0xF000
+        switch (kk)
+        {
+        case 0x01:
+            return OP_PLANE;
+        case 0x07:
+            return OP_LD_VX_DT;
+        case 0x0A:
+            return OP_LD_VX_K;
+        case 0x15:
+            return OP_LD_DT_VX;
+        case 0x18:
+            return OP_LD_ST_VX;
+        case 0x1E:
+            return OP_ADD_I_VX;
+        case 0x29:
+            return OP_LD_F_VX;
+        case 0x30:
+            return OP_LD_HF_VX;
+        case 0x33:
+            return OP_LD_B_VX;
+        case 0x55:
+            return OP_LD_MEM_VX;
+        case 0x65:
+            return OP_LD_VX_MEM;
+        case 0x75:
+            return OP_LD_R_VX;
+        case 0x85:
+            return OP_LD_VX_R;
+        default:
+            return OP_UNKNOWN;
+        }
+    }
 }
 
-void chip8_emulate_cycle()
+void chip8_invalidate(chip8_t *c, uint16_t addr, int len)
 {
-    uint8_t x;
-    uint8_t y;
-    uint8_t n;
-    uint16_t nnn;
-    uint8_t kk;
     int i;
 
-    opcode = memory[PC] << 8 | memory[PC + 1]; // Fetch the opcode.
-    x = (opcode & 0x0F00) >> 8;                // Get the x register.
-    y = (opcode & 0x00F0) >> 4;                // Get the y register.
-    n = (opcode & 0x000F);                     // Get the n register.
-    nnn = opcode & 0x0FFF;                     // Get the nnn register.
-    kk = opcode & 0x00FF;                      // Get the kk register.
+    for (i = -1; i < len; i++)
+    {
+        c->decode_cache[(addr + i) & CHIP8_ADDRESS_MASK].op = OP_DECODE;
+    }
+#ifdef CHIP8_JIT
+    if (c->jit != NULL)
+    {
+        chip8_jit_invalidate(c, addr, len);
+    }
+#endif
+}
+
+const char *chip8_trap_name(chip8_trap_t trap)
+{
+    return trap < CHIP8_TRAP_COUNT ? trap_names[trap] : "unknown trap";
+}
 
-    p("opcode: 0x%04x\n", opcode);
+// Stop the machine on the current instruction.
+static void trap(chip8_t *c, chip8_trap_t code)
+{
+    c->state = CHIP8_STATE_TRAPPED;
+    c->trap = code;
+}
 
-    switch (opcode & 0xF000)
+// Traps unless memory[I, I + len) lies inside memory. Accesses are masked
+// to memory anyway; this only makes the program's mistake visible.
+static inline bool out_of_memory(chip8_t *c, int len)
+{
+    if ((uint32_t)c->I + len <= CHIP8_MEMORY_SIZE)
     {
-    case 0x0000:
-        switch (kk)
+        return false;
+    }
+    trap(c, CHIP8_TRAP_BAD_ADDRESS);
+    return true;
+}
+
+// Queue a buzzer edge, dropping the oldest one when the queue is full.
+static void push_sound(chip8_t *c, uint64_t tick, bool on)
+{
+    chip8_sound_event_t *event;
+
+    if (c->sound_count == CHIP8_SOUND_EVENTS)
+    {
+        c->sound_head = (c->sound_head + 1) % CHIP8_SOUND_EVENTS;
+        c->sound_count--;
+    }
+    event = &c->sound_events[(c->sound_head + c->sound_count++) %
+                             CHIP8_SOUND_EVENTS];
+    event->tick = tick;
+    event->on = on;
+}
+
+// Restart the sound timer at value, queueing an edge when that starts or
+// stops the buzzer.
+static void set_sound_timer(chip8_t *c, uint8_t value)
+{
+    bool was_on = c->sound_until > c->ticks;
+
+    c->sound_until = c->ticks + value;
+    if (was_on != (value > 0))
+    {
+        push_sound(c, c->ticks, value > 0);
+    }
+}
+
+// XOR len frame buffer words with the sprite words in rows and return
+// non-zero if any lit pixel was turned off. The collision test is an AND
+// with the old words and drawing is an XOR, several words per vector.
+static inline uint64_t xor_words(uint64_t *fb, const uint64_t *rows, int len)
+{
+    uint64_t hit = 0;
+    int i = 0;
+
+#if defined(__AVX2__)
+    {
+        __m256i acc = _mm256_setzero_si256();
+
+        for (; i + 4 <= len; i += 4)
         {
-        case 0x00E0: // 00E0 - CLS - Clear the display.
-            memset(frame_buffer, 0, sizeof(frame_buffer));
-            draw_flag = true;
-            PC += 2; // Increment the program counter by 2.
-            break;
-        case 0x00EE:          // 00EE - RET - Return from a subroutine.
-            PC = stack[--SP]; // Pop the stack and set the program counter to
-                              // the value.
-            break;
-        default: // 0nnn - SYS addr - Jump to a machine code routine at nnn.
-            unknown_opcode(opcode); // Unknown opcode.
-            break;
+            __m256i old = _mm256_loadu_si256((const __m256i *)&fb[i]);
+            __m256i spr = _mm256_loadu_si256((const __m256i *)&rows[i]);
+
+            acc = _mm256_or_si256(acc, _mm256_and_si256(old, spr));
+            _mm256_storeu_si256((__m256i *)&fb[i], _mm256_xor_si256(old, spr));
         }
-        break;
-    case 0x1000:  // 1nnn - JP addr - Jump to location nnn.
-        PC = nnn; // Set the program counter to the value of nnn.
-        break;
-    case 0x2000:              // 2nnn - CALL addr - Call subroutine at nnn.
-        stack[SP++] = PC + 2; // Push the current program counter to the stack
-                              // and increment the stack pointer.
-        PC = nnn;             // Set the program counter to the value of nnn.
-        break;
-    case 0x3000: // 3xkk - SE Vx, byte - Skip next instruction if Vx = kk.
-        if (V[x] == kk)
-        {            // If the value of Vx is equal to kk.
-            PC += 2; // Increment the program counter by 2.
+        hit |= !_mm256_testz_si256(acc, acc);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i acc = _mm_setzero_si128();
+
+        for (; i + 2 <= len; i += 2)
+        {
+            __m128i old = _mm_loadu_si128((const __m128i *)&fb[i]);
+            __m128i spr = _mm_loadu_si128((const __m128i *)&rows[i]);
+
+            acc = _mm_or_si128(acc, _mm_and_si128(old, spr));
+            _mm_storeu_si128((__m128i *)&fb[i], _mm_xor_si128(old, spr));
         }
-        else
-        {            // If the value of Vx is not equal to kk.
-            PC += 4; // Increment the program counter by 4.
+        hit |= _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+               0xFFFF;
+    }
+#endif
+    for (; i < len; i++)
+    {
+        hit |= fb[i] & rows[i];
+        fb[i] ^= rows[i];
+    }
+
+    return hit;
+}
+
+// Bytes of sprite Dxyn reads per plane.
+static inline int sprite_size(uint8_t n)
+{
+    return n == 0 ? 32 : n;
+}
+
+// Planes selected by Fn01.
+static inline int selected_planes(const chip8_t *c)
+{
+    return (c->planes & 1) + (c->planes >> 1 & 1);
+}
+
+// XOR the sprite at memory[I] onto every selected plane at (vx, vy), laid out
+// by chip8_sprite_rows, and return 1 if any lit pixel was turned off. With
+// both planes selected, the sprite for plane 1 follows the one for plane 0.
+//
+// Every screen row is one or two 64-bit words with x = 0 in the top bit, so
+// a sprite row is a shift or two into place. The rows of a sprite are
+// contiguous in the frame buffer up to where it wraps past the bottom, which
+// lets the AND/XOR run over several rows per vector.
+static uint8_t draw_sprite(chip8_t *c, uint8_t vx, uint8_t vy, uint8_t n,
+                           bool wrap)
+{
+    uint64_t rows[2 * 16];
+    int words = chip8_row_words(c);
+    int height = chip8_screen_height(c);
+    uint16_t addr = c->I;
+    uint64_t hit = 0;
+    int plane, top, count, above;
+
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        if (!(c->planes >> plane & 1))
+        {
+            continue;
         }
-        break;
-    case 0x4000: // 4xkk - SNE Vx, byte - Skip next instruction if Vx != kk.
-        if (V[x] != kk)
-        {            // If the value of Vx is not equal to kk.
-            PC += 2; // Increment the program counter by 2.
+        count = chip8_sprite_rows(c, addr, vx, vy, n, wrap, &top, rows);
+        above = count < height - top ? count : height - top;
+        hit |= xor_words(&c->frame_buffer[plane][top * words], rows,
+                         above * words);
+        c->dirty_rows |= (((uint64_t)1 << above) - 1) << top;
+        if (above < count) // Wrapped to the top.
+        {
+            hit |= xor_words(c->frame_buffer[plane], &rows[above * words],
+                             (count - above) * words);
+            c->dirty_rows |= ((uint64_t)1 << (count - above)) - 1;
         }
-        else
+        addr += sprite_size(n);
+    }
+
+    return hit != 0;
+}
+
+// Clear the selected planes.
+static void clear_planes(chip8_t *c)
+{
+    int words = chip8_screen_height(c) * chip8_row_words(c);
+    int plane;
+
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        if (c->planes >> plane & 1)
+        {
+            memset(c->frame_buffer[plane], 0, words * sizeof(uint64_t));
+        }
+    }
+    c->dirty_rows = UINT64_MAX; // Every row may have changed.
+    c->draw_flag = true;
+}
+
+// Move the selected planes down by n rows, or up when n is negative, and
+// clear the rows that come in. Rows are contiguous, so this is one move.
+static void scroll_rows(chip8_t *c, int n)
+{
+    int words = chip8_row_words(c);
+    int total = chip8_screen_height(c) * words;
+    int moved = (n < 0 ? -n : n) * words;
+    int plane;
+
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        uint64_t *fb = c->frame_buffer[plane];
+
+        if (!(c->planes >> plane & 1))
         {
-            PC += 4; // Increment the program counter by 4.
+            continue;
         }
-        break;
-    case 0x5000: // 5xy0 - SE Vx, Vy - Skip next instruction if Vx = Vy.
-        if (V[x] == V[y])
+        if (n > 0)
         {
-            PC += 2; // Increment the program counter by 2.
+            memmove(fb + moved, fb, (total - moved) * sizeof(uint64_t));
+            memset(fb, 0, moved * sizeof(uint64_t));
         }
         else
         {
-            PC += 4; // Increment the program counter by 4.
+            memmove(fb, fb + moved, (total - moved) * sizeof(uint64_t));
+            memset(fb + total - moved, 0, moved * sizeof(uint64_t));
         }
-        break;
-    case 0x6000:   // 6xkk - LD Vx, byte - Set Vx = kk.
-        V[x] = kk; // Set the value of Vx to kk.
-        PC += 2;   // Increment the program counter by 2.
-        break;
-    case 0x7000:    // 7xkk - ADD Vx, byte - Set Vx = Vx + kk.
-        V[x] += kk; // Set the value of Vx to Vx + kk.
-        PC += 2;    // Increment the program counter by 2.
-        break;
-    case 0x8000: // 8xy0 - LD Vx, Vy - Set Vx = Vy.
-        switch (n)
+    }
+    c->dirty_rows = UINT64_MAX;
+    c->draw_flag = true;
+}
+
+// Shift total words of one plane 4 pixels right, or left, clearing the
+// columns that come in. A 64-pixel row is one word shifted on its own. A
+// 128-pixel row is two, and the bits leaving one word enter the other: a
+// vector holds whole rows, so that carry is the vector shifted across by one
+// word and then back by 60 bits. Inlined with words and right constant, so
+// no loop tests either.
+static inline void shift_words(uint64_t *fb, int total, int words, bool right)
+{
+    int i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 4 <= total; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&fb[i]);
+        __m256i carry = _mm256_setzero_si256();
+
+        if (words == 2)
         {
-        case 0x0000:
-            V[x] = V[y]; // Set the value of Vx to Vy.
-            PC += 2;     // Increment the program counter by 2.
-            break;
-        case 0x0001:      // 8xy1 - OR Vx, Vy - Set Vx = Vx | Vy.
-            V[x] |= V[y]; // Set the value of Vx to Vx | Vy.
-            PC += 2;      // Increment the program counter by 2.
-            break;
-        case 0x0002:      // 8xy2 - AND Vx, Vy - Set Vx = Vx & Vy.
-            V[x] &= V[y]; // Set the value of Vx to Vx & Vy.
-            PC += 2;      // Increment the program counter by 2.
-            break;
-        case 0x0003:      // 8xy3 - XOR Vx, Vy - Set Vx = Vx ^ Vy.
-            V[x] ^= V[y]; // Set the value of Vx to Vx ^ Vy.
-            PC += 2;      // Increment the program counter by 2.
-            break;
-        case 0x0004: // 8xy4 - ADD Vx, Vy - Set Vx = Vx + Vy, set VF = carry.
-            if (V[y] > (0xFF - V[x]))
-            { // If the value of Vy is greater than the maximum value that can
-              // be stored in Vx.
-                V[0xF] = 1; // Set the value of VF to 1.
-            }
-            else
-            { // If the value of Vy is less than or equal to the maximum value
-              // that can be stored in Vx.
-                V[0xF] = 0; // Set the value of VF to 0.
-            }
-            V[x] += V[y]; // Set the value of Vx to Vx + Vy.
-            PC += 2;      // Increment the program counter by 2.
-            break;
-        case 0x0005: // 8xy5 - SUB Vx, Vy - Set Vx = Vx - Vy, set VF = NOT
-                     // borrow.
-            if (V[x] > V[y])
-            {               // If the value of Vx is greater than Vy.
-                V[0xF] = 1; // Set the value of VF to 1.
-            }
-            else
-            {               // If the value of Vx is less than or equal to Vy.
-                V[0xF] = 0; // Set the value of VF to 0.
-            }
-            V[x] -= V[y]; // Set the value of Vx to Vx - Vy.
-            PC += 2;      // Increment the program counter by 2.
-            break;
-        case 0x0006: // 8xy6 - SHR Vx {, Vy} - Set Vx = Vx SHR 1.
-            V[0xF] = V[x] & 0x1;
-            V[x] = V[x] >> 1; // Set the value of Vx to Vx SHR 1.
-            PC += 2;          // Increment the program counter by 2.
-            break;
-        case 0x0007: // 8xy7 - SUBN Vx, Vy - Set Vx = Vy - Vx, set VF = NOT
-                     // borrow.
-            if (V[y] > V[x])
-            {               // If the value of Vy is greater than Vx.
-                V[0xF] = 1; // Set the value of VF to 1.
-            }
-            else
-            {               // If the value of Vy is less than or equal to Vx.
-                V[0xF] = 0; // Set the value of VF to 0.
-            }
-            V[x] = V[y] - V[x]; // Set the value of Vx to Vy - Vx.
-            PC += 2;            // Increment the program counter by 2.
-            break;
-        case 0x000E: // 8xyE - SHL Vx {, Vy} - Set Vx = Vx SHL 1.
-            V[0xF] = V[x] & 0x01;
-            V[x] = V[x] << 1; // Set the value of Vx to Vx SHL 1.
-            PC += 2;          // Increment the program counter by 2.
-            break;
-        default:                    // Unknown opcode.
-            unknown_opcode(opcode); // Unknown opcode.
-            break;
+            carry = right ? _mm256_slli_epi64(_mm256_slli_si256(v, 8), 60)
+                          : _mm256_srli_epi64(_mm256_srli_si256(v, 8), 60);
         }
+        v = right ? _mm256_srli_epi64(v, 4) : _mm256_slli_epi64(v, 4);
+        _mm256_storeu_si256((__m256i *)&fb[i], _mm256_or_si256(v, carry));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 2 <= total; i += 2)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&fb[i]);
+        __m128i carry = _mm_setzero_si128();
 
-        break;
-    case 0x9000: // 9xy0 - SNE Vx, Vy - Skip next instruction if Vx != Vy.
-        if (V[x] != V[y])
-        {            // If the value of Vx is not equal to Vy.
-            PC += 2; // Increment the program counter by 2.
+        if (words == 2)
+        {
+            carry = right ? _mm_slli_epi64(_mm_slli_si128(v, 8), 60)
+                          : _mm_srli_epi64(_mm_srli_si128(v, 8), 60);
         }
-        break;
-    case 0xA000: // Annn - LD I, addr - Set I = nnn.
-        I = nnn; // Set the value of I to nnn.
-        PC += 2; // Increment the program counter by 2.
-        break;
-    case 0xB000:         // Bnnn - JP V0, addr - Jump to location nnn + V0.
-        PC = nnn + V[0]; // Set the program counter to nnn + V0.
-        break;
-    case 0xC000: // Cxkk - RND Vx, byte - Set Vx = random byte AND kk.
-        V[x] = (rand() % 0xFF) & kk; // Set the value of Vx to a random byte AND
-                                     // kk.
-        PC += 2;                     // Increment the program counter by 2.
-        break;
-    case 0xD000:
-#if 0
-        draw_sprite(V[x], V[y], n); // Draw a sprite at location (Vx, Vy) with a
-                                    // height of n.
+        v = right ? _mm_srli_epi64(v, 4) : _mm_slli_epi64(v, 4);
+        _mm_storeu_si128((__m128i *)&fb[i], _mm_or_si128(v, carry));
+    }
 #endif
-        PC += 2;          // Increment the program counter by 2.
-        draw_flag = true; // Set the draw flag to true.
-        break;
-    case 0xE000: // Ex9E - SKP Vx - Skip next instruction if key with the value
-                 // of Vx is pressed .
-        switch (kk)
+    for (; i < total; i += words)
+    {
+        if (words == 1)
         {
-        case 0x9E: // Ex9E - SKP Vx - Skip next instruction if key with the
-                   // value of Vx is pressed.
-            if (keypad[V[x]] == 1)
-            {            // If the key with the value of Vx is pressed.
-                PC += 2; // Increment the program counter by 2.
-            }
-            break;
-        case 0xA1: // ExA1 - SKNP Vx - Skip next instruction if key with the
-                   // value of Vx is not pressed.
-            if (keypad[V[x]] == 0)
-            {            // If the key with the value of Vx is not pressed.
-                PC += 2; // Increment the program counter by 2.
-            }
-            break;
+            fb[i] = right ? fb[i] >> 4 : fb[i] << 4;
         }
-        break;
-    case 0xF000: // Fx07 - LD Vx, DT - Set Vx = delay timer value.
-        switch (kk)
+        else if (right)
         {
-        case 0x07: // Fx07 - LD Vx, DT - Set Vx = delay timer value.
-            V[x] = delay_timer; // Set the value of Vx to the value of the
-                                // delay timer.
-            PC += 2;            // Increment the program counter by 2.
-            break;
-        case 0x0A: // Fx0A - LD Vx, K - Wait for a key press, store the value
-                   // of the key in Vx.
-            while (true)
-            {
+            fb[i + 1] = fb[i + 1] >> 4 | fb[i] << 60;
+            fb[i] >>= 4;
+        }
+        else
+        {
+            fb[i] = fb[i] << 4 | fb[i + 1] >> 60;
+            fb[i + 1] <<= 4;
+        }
+    }
+}
 
-                for (i = 0; i < CHIP8_KEY_SIZE; i++)
-                {
-                    if (keypad[i] == 1)
-                    { // If the key with the value of Vx is pressed.
-                        V[x] = i;
-                        goto got_key_press;
-                    }
-                }
-            }
-        got_key_press:
-            PC += 2; // Increment the program counter by 2.
-            break;
-        case 0x15:              // Fx15 - LD DT, Vx - Set delay timer = Vx.
-            delay_timer = V[x]; // Set the value of the delay timer to the
-                                // value of Vx.
-            PC += 2;            // Increment the program counter by 2.
-            break;
-        case 0x18:              // Fx18 - LD ST, Vx - Set sound timer = Vx.
-            sound_timer = V[x]; // Set the value of the sound timer to the
-                                // value of Vx.
-            PC += 2;            // Increment the program counter by 2.
-            break;
-        case 0x1E:     // Fx1E - ADD I, Vx - Set I = I + Vx.
-            I += V[x]; // Set the value of I to I + Vx.
-            PC += 2;   // Increment the program counter by 2.
-            break;
-        case 0x29: // Fx29 - LD F, Vx - Set I = location of sprite for digit Vx.
-            I = V[x] * FONTSET_BYTES_PER_CHAR; // Set the value of I to the
-                                               // location of the sprite for the
-                                               // digit Vx.
+// Move the selected planes 4 pixels right, or left.
+static void scroll_sideways(chip8_t *c, bool right)
+{
+    int words = chip8_row_words(c);
+    int total = chip8_screen_height(c) * words;
+    int plane;
 
-            PC += 2; // Increment the program counter by 2.
-            break;
-        case 0x33: // Fx33 - LD B, Vx - Store BCD representation of Vx in memory
-                   // locations I, I+1, and I+2.
-            memory[I] = V[x] / 100; // Store the hundreds digit of Vx in memory
-                                    // location I.
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        uint64_t *fb = c->frame_buffer[plane];
 
-            memory[I + 1] = (V[x] / 10) % 10; // Store the tens digit of Vx in
-                                              // memory location I+1.
+        if (!(c->planes >> plane & 1))
+        {
+            continue;
+        }
+        if (words == 1)
+        {
+            right ? shift_words(fb, total, 1, true)
+                  : shift_words(fb, total, 1, false);
+        }
+        else
+        {
+            right ? shift_words(fb, total, 2, true)
+                  : shift_words(fb, total, 2, false);
+        }
+    }
+    c->dirty_rows = UINT64_MAX;
+    c->draw_flag = true;
+}
 
-            memory[I + 2] = V[x] % 10; // Store the ones digit of Vx in memory
-                                       // location I+2.
+// Switch between 64x32 and 128x64. Rows change shape, so every plane is
+// cleared. Only the rows of the old mode can be lit, so only those are.
+static void set_mode(chip8_t *c, bool hires)
+{
+    int words = chip8_screen_height(c) * chip8_row_words(c);
+    int plane;
 
-            PC += 2; // Increment the program counter by 2.
-            break;
-        case 0x55: // Fx55 - LD [I], Vx - Store registers V0 through Vx in
-                   // memory starting at location I.
-            for (i = 0; i <= x; i++)
-            {
-                memory[I + i] = V[i];
-            }
-            I += x + 1; // Increment the value of I by x+1.
-            PC += 2;    // Increment the program counter by 2.
-            break;
-        case 0x65: // Fx65 - LD Vx, [I] - Read registers V0 through Vx from
-                   // memory starting at location I.
-            for (i = 0; i <= x; i++)
-            {
-                V[i] = memory[I + i];
-            }
-            I += x + 1; // Increment the value of I by x+1.
-            PC += 2;    // Increment the program counter by 2.
-            break;
-        default:                    // Unknown opcode.
-            unknown_opcode(opcode); // Unknown opcode.
-            break;
-        }
-        break;
-    default:                    // Unknown opcode.
-        unknown_opcode(opcode); // Unknown opcode.
-        break;
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        memset(c->frame_buffer[plane], 0, words * sizeof(uint64_t));
+    }
+    c->hires = hires;
+    c->dirty_rows = UINT64_MAX;
+    c->draw_flag = true;
+}
+
+// Instruction handlers. Each one takes the quirk bits of the profile it is
+// compiled into as q, which is a constant in every copy of the interpreter
+// chip8_core.h makes, so a handler only pays for the quirks of its profile.
+static inline void op_unknown(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    trap(c, CHIP8_TRAP_BAD_OPCODE); // Unknown opcode.
+}
+
+static inline void op_nop(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+}
+
+static inline void op_cls(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00E0 - CLS - Clear the display.
+    clear_planes(c);
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+static inline void op_ret(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00EE - RET - Return from a subroutine.
+    if (c->SP == 0)
+    {
+        trap(c, CHIP8_TRAP_STACK_UNDERFLOW);
+        return;
     }
+    // Pop the stack and set the program counter to the value. The mask keeps
+    // a corrupt SP inside the stack.
+    c->PC = c->stack[--c->SP & (CHIP8_STACK_SIZE - 1)];
+}
+
+static inline void op_jp(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 1nnn - JP addr - Jump to location nnn.
+    c->PC = e->nnn; // Set the program counter to the value of nnn.
 }
 
-void chip8_tick()
+static inline void op_call(chip8_t *c, const chip8_insn_t *e, unsigned q)
 {
-    if (delay_timer > 0)
+    // 2nnn - CALL addr - Call subroutine at nnn.
+    if (c->SP >= CHIP8_STACK_SIZE)
     {
-        --delay_timer; // Decrement the delay timer.
+        trap(c, CHIP8_TRAP_STACK_OVERFLOW);
+        return;
+    }
+    // Push the current program counter to the stack and increment the stack
+    // pointer.
+    c->stack[c->SP++ & (CHIP8_STACK_SIZE - 1)] = c->PC + 2;
+    c->PC = e->nnn; // Set the program counter to the value of nnn.
+}
+
+static inline void op_se_vx_kk(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 3xkk - SE Vx, byte - Skip next instruction if Vx = kk.
+    if (c->V[e->x] == e->kk)
+    {               // If the value of Vx is equal to kk.
+        c->PC += 4; // Increment the program counter by 4.
+    }
+    else
+    {               // If the value of Vx is not equal to kk.
+        c->PC += 2; // Increment the program counter by 2.
+    }
+}
+
+static inline void op_sne_vx_kk(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 4xkk - SNE Vx, byte - Skip next instruction if Vx != kk.
+    if (c->V[e->x] != e->kk)
+    {               // If the value of Vx is not equal to kk.
+        c->PC += 4; // Increment the program counter by 4.
     }
-    if (sound_timer > 0)
+    else
     {
-        --sound_timer; // Decrement the sound timer.
-        if (sound_timer == 0)
-        {
-            // TODO: Beep!
-        }
+        c->PC += 2; // Increment the program counter by 2.
     }
-}
\ No newline at end of file
+}
+
+static inline void op_se_vx_vy(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 5xy0 - SE Vx, Vy - Skip next instruction if Vx = Vy.
+    if (c->V[e->x] == c->V[e->y])
+    {
+        c->PC += 4; // Increment the program counter by 4.
+    }
+    else
+    {
+        c->PC += 2; // Increment the program counter by 2.
+    }
+}
+
+static inline void op_ld_vx_kk(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 6xkk - LD Vx, byte - Set Vx = kk.
+    c->V[e->x] = e->kk; // Set the value of Vx to kk.
+    c->PC += 2;         // Increment the program counter by 2.
+}
+
+static inline void op_add_vx_kk(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 7xkk - ADD Vx, byte - Set Vx = Vx + kk.
+    c->V[e->x] += e->kk; // Set the value of Vx to Vx + kk.
+    c->PC += 2;          // Increment the program counter by 2.
+}
+
+static inline void op_ld_vx_vy(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 8xy0 - LD Vx, Vy - Set Vx = Vy.
+    c->V[e->x] = c->V[e->y]; // Set the value of Vx to Vy.
+    c->PC += 2;              // Increment the program counter by 2.
+}
+
+static inline void op_or(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 8xy1 - OR Vx, Vy - Set Vx = Vx | Vy.
+    c->V[e->x] |= c->V[e->y]; // Set the value of Vx to Vx | Vy.
+    if (q & CHIP8_QUIRK_VF_RESET)
+    {
+        c->V[0xF] = 0;
+    }
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+static inline void op_and(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 8xy2 - AND Vx, Vy - Set Vx = Vx & Vy.
+    c->V[e->x] &= c->V[e->y]; // Set the value of Vx to Vx & Vy.
+    if (q & CHIP8_QUIRK_VF_RESET)
+    {
+        c->V[0xF] = 0;
+    }
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+static inline void op_xor(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 8xy3 - XOR Vx, Vy - Set Vx = Vx ^ Vy.
+    c->V[e->x] ^= c->V[e->y]; // Set the value of Vx to Vx ^ Vy.
+    if (q & CHIP8_QUIRK_VF_RESET)
+    {
+        c->V[0xF] = 0;
+    }
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+// The 8xy_ instructions that set VF compute the flag from the operands as
+// they were and write it after Vx, so that with x = F the flag is what VF
+// ends up holding.
+static inline void op_add_vx_vy(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    uint8_t carry = c->V[e->y] > 0xFF - c->V[e->x]; // Vx + Vy overflows.
+
+    // 8xy4 - ADD Vx, Vy - Set Vx = Vx + Vy, set VF = carry.
+    c->V[e->x] += c->V[e->y]; // Set the value of Vx to Vx + Vy.
+    c->V[0xF] = carry;        // Set the value of VF to the carry.
+    c->PC += 2;               // Increment the program counter by 2.
+}
+
+static inline void op_sub(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    uint8_t no_borrow = c->V[e->x] >= c->V[e->y];
+
+    // 8xy5 - SUB Vx, Vy - Set Vx = Vx - Vy, set VF = NOT borrow.
+    c->V[e->x] -= c->V[e->y]; // Set the value of Vx to Vx - Vy.
+    c->V[0xF] = no_borrow;    // Set VF to 1 unless Vy was greater than Vx.
+    c->PC += 2;               // Increment the program counter by 2.
+}
+
+static inline void op_shr(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    uint8_t y = q & CHIP8_QUIRK_SHIFT ? e->x : e->y; // Register shifted.
+    uint8_t out = c->V[y] & 0x1;                      // Bit shifted out.
+
+    // 8xy6 - SHR Vx {, Vy} - Set Vx = Vy SHR 1, or Vx SHR 1.
+    c->V[e->x] = c->V[y] >> 1; // Set the value of Vx to Vy SHR 1.
+    c->V[0xF] = out;           // Set the value of VF to the bit shifted out.
+    c->PC += 2;                // Increment the program counter by 2.
+}
+
+static inline void op_subn(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    uint8_t no_borrow = c->V[e->y] >= c->V[e->x];
+
+    // 8xy7 - SUBN Vx, Vy - Set Vx = Vy - Vx, set VF = NOT borrow.
+    c->V[e->x] = c->V[e->y] - c->V[e->x]; // Set the value of Vx to Vy - Vx.
+    c->V[0xF] = no_borrow; // Set VF to 1 unless Vx was greater than Vy.
+    c->PC += 2;            // Increment the program counter by 2.
+}
+
+static inline void op_shl(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    uint8_t y = q & CHIP8_QUIRK_SHIFT ? e->x : e->y; // Register shifted.
+    uint8_t out = c->V[y] >> 7;                       // Bit shifted out.
+
+    // 8xyE - SHL Vx {, Vy} - Set Vx = Vy SHL 1, or Vx SHL 1.
+    c->V[e->x] = c->V[y] << 1; // Set the value of Vx to Vy SHL 1.
+    c->V[0xF] = out;           // Set the value of VF to the bit shifted out.
+    c->PC += 2;                // Increment the program counter by 2.
+}
+
+static inline void op_sne_vx_vy(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 9xy0 - SNE Vx, Vy - Skip next instruction if Vx != Vy.
+    if (c->V[e->x] != c->V[e->y])
+    {               // If the value of Vx is not equal to Vy.
+        c->PC += 4; // Increment the program counter by 4.
+    }
+    else
+    {
+        c->PC += 2; // Increment the program counter by 2.
+    }
+}
+
+static inline void op_ld_i(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Annn - LD I, addr - Set I = nnn.
+    c->I = e->nnn; // Set the value of I to nnn.
+    c->PC += 2;    // Increment the program counter by 2.
+}
+
+static inline void op_jp_v0(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Bnnn - JP V0, addr - Jump to location nnn + V0, or Bxnn to xnn + Vx.
+    c->PC = e->nnn + c->V[q & CHIP8_QUIRK_JUMP ? e->x : 0];
+}
+
+static inline void op_rnd(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Cxkk - RND Vx, byte - Set Vx = random byte AND kk.
+    c->V[e->x] = chip8_random(&c->rng) & e->kk; // Set the value of Vx to a
+                                                // random byte AND kk.
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+static inline void op_drw(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    uint8_t n = e->kk & 0xF;
+
+    // Dxyn - DRW Vx, Vy, nibble - Display n-byte sprite starting at memory
+    // location I at (Vx, Vy), set VF = collision. Dxy0 draws a 16x16 sprite.
+    if (out_of_memory(c, sprite_size(n) * selected_planes(c)))
+    {
+        return;
+    }
+#ifdef CHIP8_PROFILE
+    if (CHIP8_PROFILING(c))
+    {
+        chip8_profile_draw(c, c->V[e->x], c->V[e->y], n);
+    }
+#endif
+    c->V[0xF] = draw_sprite(c, c->V[e->x], c->V[e->y], n,
+                            q & CHIP8_QUIRK_WRAP);
+    c->PC += 2;          // Increment the program counter by 2.
+    c->draw_flag = true; // Set the draw flag to true.
+    if (q & CHIP8_QUIRK_DISPLAY_WAIT)
+    {
+        c->state = CHIP8_STATE_WAIT_TICK; // Nothing else runs this frame.
+    }
+}
+
+static inline void op_skp(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Ex9E - SKP Vx - Skip next instruction if key with the value of Vx is
+    // pressed.
+    if (c->keypad[c->V[e->x] & 0xF] == 1)
+    {               // If the key with the value of Vx is pressed.
+        c->PC += 4; // Increment the program counter by 4.
+    }
+    else
+    {
+        c->PC += 2; // Increment the program counter by 2.
+    }
+}
+
+static inline void op_sknp(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // ExA1 - SKNP Vx - Skip next instruction if key with the value of Vx is
+    // not pressed.
+    if (c->keypad[c->V[e->x] & 0xF] == 0)
+    {               // If the key with the value of Vx is not pressed.
+        c->PC += 4; // Increment the program counter by 4.
+    }
+    else
+    {
+        c->PC += 2; // Increment the program counter by 2.
+    }
+}
+
+static inline void op_ld_vx_dt(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fx07 - LD Vx, DT - Set Vx = delay timer value.
+    c->V[e->x] = chip8_delay_timer(c); // Set the value of Vx to the value of
+                                       // the delay timer.
+    c->PC += 2;                        // Increment the program counter by 2.
+}
+
+static inline void op_ld_vx_k(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    int i;
+
+    // Fx0A - LD Vx, K - Wait for a key press, store the value of the key in
+    // Vx.
+    for (i = 0; i < CHIP8_KEY_SIZE; i++)
+    {
+        if (c->keypad[i] == 1)
+        { // If the key with the value of Vx is pressed.
+            c->V[e->x] = i;
+            c->PC += 2; // Increment the program counter by 2.
+            c->state = CHIP8_STATE_RUNNING;
+            return;
+        }
+    }
+
+    // No key is down. Park on this instruction and hand control back to the
+    // caller; chip8_set_key finishes the instruction when a key is pressed.
+    c->state = CHIP8_STATE_WAIT_KEY;
+    c->wait_reg = e->x;
+}
+
+static inline void op_ld_dt_vx(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fx15 - LD DT, Vx - Set delay timer = Vx.
+    c->delay_until = c->ticks + c->V[e->x]; // Set the value of the delay
+                                            // timer to the value of Vx.
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+static inline void op_ld_st_vx(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fx18 - LD ST, Vx - Set sound timer = Vx.
+    set_sound_timer(c, c->V[e->x]); // Set the value of the sound timer to the
+                                    // value of Vx.
+    c->PC += 2;                     // Increment the program counter by 2.
+}
+
+static inline void op_add_i_vx(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fx1E - ADD I, Vx - Set I = I + Vx.
+    c->I += c->V[e->x]; // Set the value of I to I + Vx.
+    c->PC += 2;         // Increment the program counter by 2.
+}
+
+static inline void op_ld_f_vx(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fx29 - LD F, Vx - Set I = location of sprite for digit Vx.
+    c->I = c->V[e->x] * FONTSET_BYTES_PER_CHAR; // Set the value of I to the
+                                                // location of the sprite for
+                                                // the digit Vx.
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+static inline void op_ld_b_vx(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    uint8_t v = c->V[e->x];
+
+    // Fx33 - LD B, Vx - Store BCD representation of Vx in memory locations I,
+    // I+1, and I+2.
+    // Store the hundreds, tens and ones digits of Vx in memory locations I,
+    // I+1 and I+2.
+    if (out_of_memory(c, 3))
+    {
+        return;
+    }
+    CHIP8_OWN(c, c->I, 3);
+    c->memory[c->I & CHIP8_ADDRESS_MASK] = v / 100;
+    c->memory[(c->I + 1) & CHIP8_ADDRESS_MASK] = (v / 10) % 10;
+    c->memory[(c->I + 2) & CHIP8_ADDRESS_MASK] = v % 10;
+    chip8_invalidate(c, c->I, 3); // The digits may have overwritten code.
+    c->PC += 2;                   // Increment the program counter by 2.
+}
+
+static inline void op_ld_mem_vx(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    int i;
+
+    // Fx55 - LD [I], Vx - Store registers V0 through Vx in memory starting at
+    // location I.
+    if (out_of_memory(c, e->x + 1))
+    {
+        return;
+    }
+    CHIP8_OWN(c, c->I, e->x + 1);
+    for (i = 0; i <= e->x; i++)
+    {
+        c->memory[(c->I + i) & CHIP8_ADDRESS_MASK] = c->V[i];
+    }
+    chip8_invalidate(c, c->I, e->x + 1); // The registers may have
+                                         // overwritten code.
+    if (q & CHIP8_QUIRK_MEMORY)
+    {
+        c->I += e->x + 1; // Increment the value of I by x+1.
+    }
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+static inline void op_ld_vx_mem(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    int i;
+
+    // Fx65 - LD Vx, [I] - Read registers V0 through Vx from memory starting at
+    // location I.
+    if (out_of_memory(c, e->x + 1))
+    {
+        return;
+    }
+    for (i = 0; i <= e->x; i++)
+    {
+        c->V[i] = chip8_peek(c, c->I + i);
+    }
+    if (q & CHIP8_QUIRK_MEMORY)
+    {
+        c->I += e->x + 1; // Increment the value of I by x+1.
+    }
+    c->PC += 2; // Increment the program counter by 2.
+}
+
+static inline void op_scd(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00Cn - SCD nibble - Scroll the display down n rows.
+    scroll_rows(c, e->kk & 0xF);
+    c->PC += 2;
+}
+
+static inline void op_scu(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00Dn - SCU nibble - Scroll the display up n rows. XO-CHIP.
+    scroll_rows(c, -(e->kk & 0xF));
+    c->PC += 2;
+}
+
+static inline void op_scr(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00FB - SCR - Scroll the display right 4 pixels.
+    scroll_sideways(c, true);
+    c->PC += 2;
+}
+
+static inline void op_scl(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00FC - SCL - Scroll the display left 4 pixels.
+    scroll_sideways(c, false);
+    c->PC += 2;
+}
+
+static inline void op_exit(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00FD - EXIT - Stop the interpreter.
+    trap(c, CHIP8_TRAP_HALTED);
+}
+
+static inline void op_low(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00FE - LOW - Switch to the 64x32 display.
+    set_mode(c, false);
+    c->PC += 2;
+}
+
+static inline void op_high(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // 00FF - HIGH - Switch to the 128x64 display.
+    set_mode(c, true);
+    c->PC += 2;
+}
+
+static inline void op_save_range(chip8_t *c, const chip8_insn_t *e,
+                                 unsigned q)
+{
+    int step = e->x <= e->y ? 1 : -1;
+    int len = (e->y - e->x) * step + 1;
+    int i;
+
+    // 5xy2 - LD [I], Vx-Vy - Store registers Vx through Vy, in that order, in
+    // memory starting at location I. I is left alone. XO-CHIP.
+    if (out_of_memory(c, len))
+    {
+        return;
+    }
+    CHIP8_OWN(c, c->I, len);
+    for (i = 0; i < len; i++)
+    {
+        c->memory[(c->I + i) & CHIP8_ADDRESS_MASK] = c->V[e->x + i * step];
+    }
+    chip8_invalidate(c, c->I, len); // The registers may have overwritten code.
+    c->PC += 2;
+}
+
+static inline void op_load_range(chip8_t *c, const chip8_insn_t *e,
+                                 unsigned q)
+{
+    int step = e->x <= e->y ? 1 : -1;
+    int len = (e->y - e->x) * step + 1;
+    int i;
+
+    // 5xy3 - LD Vx-Vy, [I] - Read registers Vx through Vy, in that order,
+    // from memory starting at location I. I is left alone. XO-CHIP.
+    if (out_of_memory(c, len))
+    {
+        return;
+    }
+    for (i = 0; i < len; i++)
+    {
+        c->V[e->x + i * step] = chip8_peek(c, c->I + i);
+    }
+    c->PC += 2;
+}
+
+static inline void op_plane(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fn01 - PLANE n - Draw, clear and scroll the planes in bits 0 and 1 of
+    // n. XO-CHIP.
+    c->planes = e->x & ((1 << CHIP8_PLANES) - 1);
+    c->PC += 2;
+}
+
+static inline void op_ld_hf_vx(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fx30 - LD HF, Vx - Set I = location of the large sprite for digit Vx.
+    c->I = HIRES_FONTSET_ADDRESS + c->V[e->x] * HIRES_FONTSET_BYTES_PER_CHAR;
+    c->PC += 2;
+}
+
+static inline void op_ld_r_vx(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fx75 - LD R, Vx - Store registers V0 through Vx in the flags.
+    memcpy(c->flags, c->V, e->x + 1);
+    c->PC += 2;
+}
+
+static inline void op_ld_vx_r(chip8_t *c, const chip8_insn_t *e, unsigned q)
+{
+    // Fx85 - LD Vx, R - Read registers V0 through Vx from the flags.
+    memcpy(c->V, c->flags, e->x + 1);
+    c->PC += 2;
+}
+
+chip8_insn_t *chip8_decode(chip8_t *c, uint16_t addr)
+{
+    uint16_t pc = addr & CHIP8_ADDRESS_MASK;
+    chip8_insn_t *slot = &c->decode_cache[pc];
+    uint16_t opcode;
+
+#ifdef CHIP8_ROM_CACHE
+    if (chip8_page_shared(c, pc / CHIP8_PAGE_SIZE) &&
+        chip8_page_shared(c, ((pc + 1) & CHIP8_ADDRESS_MASK) / CHIP8_PAGE_SIZE))
+    {
+        *slot = c->rom->code[pc]; // Decoded when the ROM was cached.
+        return slot;
+    }
+#endif
+
+    // Fetch the opcode.
+    opcode = chip8_peek(c, pc) << 8 | chip8_peek(c, pc + 1);
+    slot->op = decode_op(opcode);
+    slot->x = (opcode & 0x0F00) >> 8; // Get the x register.
+    slot->y = (opcode & 0x00F0) >> 4; // Get the y register.
+    slot->kk = opcode & 0x00FF;       // Get the kk byte.
+    slot->nnn = opcode & 0x0FFF;      // Get the nnn address.
+    slot->opcode = opcode;
+
+    return slot;
+}
+
+bool chip8_load_game(chip8_t *c, const char *game)
+{
+    FILE *fgame;
+    uint8_t rom[MAX_GAME_SIZE + 1];
+    size_t size;
+    bool failed;
+
+    fgame = fopen(game, "rb");
+
+    if (NULL == fgame)
+    {
+        return false;
+    }
+
+    // One byte more than fits, so that an oversize file is noticed.
+    size = fread(rom, 1, sizeof(rom), fgame);
+    failed = ferror(fgame);
+
+    fclose(fgame);
+
+    return !failed && chip8_load_rom(c, rom, size);
+}
+
+bool chip8_load_rom(chip8_t *c, const uint8_t *rom, size_t size)
+{
+    if (size > MAX_GAME_SIZE)
+    {
+        return false;
+    }
+
+    CHIP8_OWN(c, 0, CHIP8_MEMORY_SIZE);
+    memcpy(&c->memory[CHIP8_PROGRAM_START_ADDRESS], rom, size);
+    c->quirks = chip8_quirks_for(rom, size);
+
+    memset(c->decode_cache, 0, sizeof(c->decode_cache)); // Drop stale code.
+#ifdef CHIP8_JIT
+    if (c->jit != NULL)
+    {
+        chip8_jit_invalidate(c, 0, CHIP8_MEMORY_SIZE);
+    }
+#endif
+    return true;
+}
+
+// Whether an instruction of kind op can leave the RUNNING state: Fx0A,
+// Dxyn waiting for the display, 00FD, and the instructions that trap.
+#define CAN_STOP(op)                                                           \
+    ((op) == OP_LD_VX_K || (op) == OP_UNKNOWN || (op) == OP_CALL ||            \
+     (op) == OP_RET || (op) == OP_DRW || (op) == OP_LD_B_VX ||                 \
+     (op) == OP_LD_MEM_VX || (op) == OP_LD_VX_MEM || (op) == OP_EXIT ||        \
+     (op) == OP_SAVE_RANGE || (op) == OP_LOAD_RANGE)
+
+// The interpreter, once per quirk profile.
+#define CORE(name) CORE_NAME(name, PROFILE)
+#define CORE_NAME(name, profile) CORE_PASTE(name, profile)
+#define CORE_PASTE(name, profile) name##_##profile
+
+#define PROFILE modern
+#define QUIRKS CHIP8_MODERN_QUIRKS
+#include "chip8_core.h"
+#undef QUIRKS
+#undef PROFILE
+
+#define PROFILE vip
+#define QUIRKS CHIP8_VIP_QUIRKS
+#include "chip8_core.h"
+#undef QUIRKS
+#undef PROFILE
+
+#define PROFILE schip
+#define QUIRKS CHIP8_SCHIP_QUIRKS
+#include "chip8_core.h"
+#undef QUIRKS
+#undef PROFILE
+
+#define PROFILE xochip
+#define QUIRKS CHIP8_XOCHIP_QUIRKS
+#include "chip8_core.h"
+#undef QUIRKS
+#undef PROFILE
+
+static const struct core
+{
+    const chip8_handler_t *handlers;
+    int (*run)(chip8_t *c, int cycles);
+} cores[CHIP8_QUIRKS_COUNT] = {
+    [CHIP8_QUIRKS_MODERN] = {handlers_modern, run_modern},
+    [CHIP8_QUIRKS_VIP] = {handlers_vip, run_vip},
+    [CHIP8_QUIRKS_SCHIP] = {handlers_schip, run_schip},
+    [CHIP8_QUIRKS_XOCHIP] = {handlers_xochip, run_xochip},
+};
+
+chip8_trap_t chip8_emulate_cycle(chip8_t *c)
+{
+    const chip8_insn_t *e = &c->decode_cache[c->PC & CHIP8_ADDRESS_MASK];
+
+    if (c->state != CHIP8_STATE_RUNNING)
+    {
+        return (chip8_trap_t)c->trap; // Waiting for a key, or trapped.
+    }
+    if (CHIP8_TRACING(c))
+    {
+        (void)CHIP8_TRACE_ROOM(c, 1);
+    }
+    CHIP8_PROFILE_INSN(c, e);
+    CHIP8_TRACE_INSN(c, e);
+    c->opcode = e->opcode;
+    cores[c->quirks].handlers[e->op](c, e);
+
+    p("opcode: 0x%04x\n", c->opcode);
+    return (chip8_trap_t)c->trap;
+}
+
+// A traced machine runs in slices that each fit in the trace block and end
+// before the next keyframe, so the core's loop never checks for either.
+static int run_traced(chip8_t *c, int cycles)
+{
+    int ran = 0;
+
+    do
+    {
+        ran += cores[c->quirks].run(c, CHIP8_TRACE_ROOM(c, cycles - ran));
+    } while (ran < cycles && c->state == CHIP8_STATE_RUNNING);
+
+    return ran;
+}
+
+int chip8_run(chip8_t *c, int cycles)
+{
+    int ran;
+
+    if (c->state != CHIP8_STATE_RUNNING)
+    {
+        return 0; // Waiting for a key, or trapped.
+    }
+#ifdef CHIP8_JIT
+    // Blocks are neither counted nor traced.
+    if (c->jit != NULL && !CHIP8_PROFILING(c) && !CHIP8_TRACING(c))
+    {
+        ran = chip8_jit_run(c, cycles);
+    }
+    else
+#endif
+    if (CHIP8_TRACING(c))
+    {
+        ran = run_traced(c, cycles);
+    }
+    else
+    {
+        ran = cores[c->quirks].run(c, cycles);
+    }
+    c->cycles += ran;
+
+    return ran;
+}
+
+enum idle_kind
+{
+    IDLE_NONE,
+    IDLE_UNTIL_TICK,  // Nothing changes before the next timer tick.
+    IDLE_UNTIL_INPUT, // Nothing changes before the next chip8_set_key.
+};
+
+static const chip8_insn_t *insn_at(chip8_t *c, uint16_t addr)
+{
+    const chip8_insn_t *e = &c->decode_cache[addr & CHIP8_ADDRESS_MASK];
+
+    return e->op == OP_DECODE ? chip8_decode(c, addr & CHIP8_ADDRESS_MASK) : e;
+}
+
+// Matches the loop starting at head against the idle loops games use to
+// wait: a jump to itself, a key poll (Ex9E or ExA1 and a jump back) and a
+// delay timer poll (Fx07, 3xkk or 4xkk on the same register, and a jump
+// back). Stores the loop length in instructions.
+static int idle_pattern(chip8_t *c, uint16_t head, int *length)
+{
+    const chip8_insn_t *a = insn_at(c, head);
+    const chip8_insn_t *b = insn_at(c, head + 2);
+    const chip8_insn_t *d = insn_at(c, head + 4);
+
+    if (a->op == OP_JP && a->nnn == head)
+    {
+        *length = 1;
+        return IDLE_UNTIL_INPUT;
+    }
+    if ((a->op == OP_SKP || a->op == OP_SKNP) && b->op == OP_JP &&
+        b->nnn == head)
+    {
+        *length = 2;
+        return IDLE_UNTIL_INPUT;
+    }
+    if (a->op == OP_LD_VX_DT &&
+        (b->op == OP_SE_VX_KK || b->op == OP_SNE_VX_KK) && b->x == a->x &&
+        d->op == OP_JP && d->nnn == head)
+    {
+        *length = 3;
+        return IDLE_UNTIL_TICK;
+    }
+    return IDLE_NONE;
+}
+
+// Looks for an idle loop around PC and confirms it by running the rest of
+// the current iteration and then one whole iteration: when that comes back
+// to the loop head, every further iteration repeats it exactly until the
+// state the loop polls changes. Stores the instructions it ran.
+static int idle_check(chip8_t *c, int budget, int *ran)
+{
+    uint16_t head = 0;
+    int kind = IDLE_NONE;
+    int length = 0;
+    int off, i;
+
+    *ran = 0;
+    for (off = 0; off <= 4 && kind == IDLE_NONE; off += 2)
+    {
+        head = (c->PC - off) & CHIP8_ADDRESS_MASK;
+        kind = idle_pattern(c, head, &length);
+        if (off >= 2 * length)
+        {
+            kind = IDLE_NONE; // PC is not inside this loop.
+        }
+    }
+    if (kind == IDLE_NONE || budget < 2 * length)
+    {
+        return IDLE_NONE;
+    }
+
+    for (i = 0; i < length && c->PC != head; i++)
+    {
+        *ran += chip8_run(c, 1);
+    }
+    if (c->PC != head)
+    {
+        return IDLE_NONE;
+    }
+    *ran += chip8_run(c, length);
+    if (c->PC != head)
+    {
+        return IDLE_NONE;
+    }
+
+    // A jump to itself waits for nothing at all: the program has ended.
+    if (length == 1 && c->state == CHIP8_STATE_RUNNING)
+    {
+        trap(c, CHIP8_TRAP_HALTED);
+    }
+    return kind;
+}
+
+// Apply count timer ticks at once. Traces record every tick, so a traced
+// machine still takes them one at a time.
+static void advance_ticks(chip8_t *c, uint64_t count)
+{
+    uint64_t from = c->ticks;
+
+    if (count == 0)
+    {
+        return;
+    }
+    if (CHIP8_TRACING(c))
+    {
+        while (count-- > 0)
+        {
+            chip8_tick(c);
+        }
+        return;
+    }
+    c->ticks += count;
+    if (c->sound_until > from && c->sound_until <= c->ticks)
+    {
+        push_sound(c, c->sound_until, false);
+    }
+    if (c->state == CHIP8_STATE_WAIT_TICK)
+    {
+        c->state = CHIP8_STATE_RUNNING;
+    }
+    CHIP8_SHM_TICK(c);
+}
+
+// Runs cycles instructions and applies the timer ticks that fall inside them.
+// A tick is due every ips / CHIP8_TIMER_HZ instructions; tick_phase carries
+// the remainder between calls, so timers stay exact for any clock and any
+// batch size, independent of how often the host calls in.
+//
+// Cycles the program would spend waiting are skipped instead of executed:
+// while the program sits in a loop polling the delay timer the clock jumps
+// straight to the next timer tick, and while Fx0A waits or only a key press
+// can wake the program, straight to the end of the batch, since keys only
+// change between calls; a trapped machine idles the same way. Timers are
+// lazy, so that last jump costs the same for any number of ticks. Dxyn
+// waiting for the display idles until the tick that ends its frame.
+int chip8_step(chip8_t *c, int cycles)
+{
+    int left = cycles;
+    bool until_input = false;
+
+    while (left > 0)
+    {
+        // Instructions until tick_phase reaches ips, rounded up.
+        uint32_t due = (c->ips - c->tick_phase + CHIP8_TIMER_HZ - 1) /
+                       CHIP8_TIMER_HZ;
+        int n = due < (uint32_t)left ? (int)due : left;
+        int ran = 0;
+
+        if ((c->state != CHIP8_STATE_RUNNING &&
+             c->state != CHIP8_STATE_WAIT_TICK) ||
+            until_input)
+        {
+            uint64_t phase = c->tick_phase + (uint64_t)left * CHIP8_TIMER_HZ;
+
+            c->cycles += left;
+            c->idle_cycles += left;
+            c->tick_phase = (uint32_t)(phase % c->ips);
+            advance_ticks(c, phase / c->ips);
+            break;
+        }
+
+        if (c->state == CHIP8_STATE_RUNNING)
+        {
+            switch (idle_check(c, n, &ran))
+            {
+            case IDLE_NONE:
+                ran += chip8_run(c, n - ran);
+                break;
+            case IDLE_UNTIL_INPUT:
+                until_input = true;
+                break;
+            }
+        }
+        c->cycles += n - ran;
+        c->idle_cycles += n - ran;
+
+        left -= n;
+        c->tick_phase += (uint32_t)n * CHIP8_TIMER_HZ;
+        while (c->tick_phase >= c->ips)
+        {
+            c->tick_phase -= c->ips;
+            chip8_tick(c);
+        }
+    }
+
+    return cycles;
+}
+
+void chip8_set_quirks(chip8_t *c, chip8_quirks_t quirks)
+{
+    c->quirks = quirks < CHIP8_QUIRKS_COUNT ? quirks : CHIP8_QUIRKS_MODERN;
+    CHIP8_TRACE_EVENT(c, CHIP8_TRACE_STATE, 0); // Replays need the change.
+}
+
+chip8_quirks_t chip8_quirks_for(const uint8_t *rom, size_t size)
+{
+    uint64_t hash = chip8_hash(rom, size);
+    size_t i;
+
+    for (i = 0; i < sizeof(known_roms) / sizeof(known_roms[0]); i++)
+    {
+        if (known_roms[i].hash == hash && known_roms[i].size == size)
+        {
+            return (chip8_quirks_t)known_roms[i].quirks;
+        }
+    }
+    return CHIP8_QUIRKS_MODERN;
+}
+
+const char *chip8_quirks_name(chip8_quirks_t quirks)
+{
+    return quirks < CHIP8_QUIRKS_COUNT ? quirks_names[quirks] : "unknown";
+}
+
+void chip8_set_clock(chip8_t *c, uint32_t ips)
+{
+    c->ips = ips > 0 ? ips : CHIP8_DEFAULT_IPS;
+    c->tick_phase = 0;
+}
+
+void chip8_seed(chip8_t *c, uint64_t seed)
+{
+    // splitmix64, so that nearby seeds start unrelated sequences.
+    uint64_t z = seed + 0x9E3779B97F4A7C15u;
+
+    z = (z ^ z >> 30) * 0xBF58476D1CE4E5B9u;
+    z = (z ^ z >> 27) * 0x94D049BB133111EBu;
+    z ^= z >> 31;
+    c->rng = z != 0 ? z : 0x9E3779B97F4A7C15u; // xorshift sticks at 0.
+}
+
+void chip8_tick(chip8_t *c)
+{
+    CHIP8_TRACE_EVENT(c, CHIP8_TRACE_TICK, 0);
+    if (++c->ticks == c->sound_until)
+    {
+        push_sound(c, c->ticks, false); // The sound timer ran out.
+    }
+    if (c->state == CHIP8_STATE_WAIT_TICK)
+    {
+        c->state = CHIP8_STATE_RUNNING; // The display caught up with Dxyn.
+    }
+    CHIP8_SHM_TICK(c);
+}
+
+void chip8_set_timers(chip8_t *c, uint8_t delay, uint8_t sound)
+{
+    c->delay_until = c->ticks + delay;
+    set_sound_timer(c, sound);
+}
+
+bool chip8_poll_sound(chip8_t *c, chip8_sound_event_t *event)
+{
+    if (c->sound_count == 0)
+    {
+        return false;
+    }
+    *event = c->sound_events[c->sound_head];
+    c->sound_head = (c->sound_head + 1) % CHIP8_SOUND_EVENTS;
+    c->sound_count--;
+    return true;
+}
+
+void chip8_set_key(chip8_t *c, uint8_t key, bool state)
+{
+    CHIP8_TRACE_EVENT(c, CHIP8_TRACE_KEY, (key & 0xF) | (state ? 0x80 : 0));
+    c->keypad[key & 0xF] = state ? 1 : 0;
+
+    if (state && c->state == CHIP8_STATE_WAIT_KEY)
+    {
+        c->V[c->wait_reg] = key & 0xF; // Finish the pending Fx0A.
+        c->PC += 2;
+        c->state = CHIP8_STATE_RUNNING;
+    }
+}
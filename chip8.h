@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #define CHIP8_MEMORY_SIZE 4096
 #define CHIP8_REGISTER_COUNT 16
@@ -11,15 +12,262 @@
 #define CHIP8_SCREEN_WIDTH 64
 #define CHIP8_SCREEN_HEIGHT 32
 #define CHIP8_SCREEN_SIZE (CHIP8_SCREEN_WIDTH * CHIP8_SCREEN_HEIGHT)
+#define CHIP8_HIRES_WIDTH 128
+#define CHIP8_HIRES_HEIGHT 64
+#define CHIP8_PLANES 2
+#define CHIP8_PLANE_WORDS (CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT / 64)
+#define CHIP8_FLAG_COUNT 16
 #define CHIP8_PIXEL_SIZE 4
 #define CHIP8_FONTSET_SIZE 80
+#define CHIP8_HIRES_FONTSET_SIZE 160
 #define CHIP8_PROGRAM_START_ADDRESS 0x200
 #define MAX_GAME_SIZE (CHIP8_MEMORY_SIZE - CHIP8_PROGRAM_START_ADDRESS)
+#define CHIP8_TIMER_HZ 60
+#define CHIP8_DEFAULT_IPS 700
+#define CHIP8_DEFAULT_SEED 0
+#define CHIP8_SOUND_EVENTS 16
 
-void chip8_init();
-void chip8_load_game(const char *rom_path);
-void chip8_emulate_cycle();
-void chip8_set_key(uint8_t key, bool state);
-void chip8_tick();
+// The buzzer starting or stopping, at a timer tick. Ticks are counted from
+// chip8_init; tick t is t / CHIP8_TIMER_HZ seconds of emulated time.
+typedef struct chip8_sound_event
+{
+    uint64_t tick;
+    bool on;
+} chip8_sound_event_t;
 
-#endif
\ No newline at end of file
+// What the CPU is doing between calls to chip8_run.
+typedef enum chip8_state
+{
+    CHIP8_STATE_RUNNING,  // Executing instructions.
+    CHIP8_STATE_WAIT_KEY, // Parked on Fx0A until chip8_set_key reports a key
+                          // press, which completes the instruction.
+    CHIP8_STATE_TRAPPED,  // Stopped for good by the trap in chip8_t.trap.
+                          // Time still passes, but nothing runs until the
+                          // machine is reinitialised or loads a state.
+    CHIP8_STATE_WAIT_TICK, // Parked after Dxyn until the next timer tick,
+                           // under a profile that waits for the display.
+} chip8_state_t;
+
+// Interpreter a program was written for. The original interpreters disagree
+// on a handful of instructions, which programs came to rely on:
+//
+//              8xy6, 8xyE   Fx55, Fx65    Bnnn        8xy1-8xy3   Dxyn
+//     MODERN   shift Vx     I += x + 1    nnn + V0    -           -
+//     VIP      shift Vy     I += x + 1    nnn + V0    VF = 0      waits
+//     SCHIP    shift Vx     I unchanged   xnn + Vx    -           -
+//
+//     XOCHIP   shift Vy     I += x + 1    nnn + V0    -           wraps
+//
+// where "waits" means nothing else runs until the next timer tick, as the
+// VIP drew during its display interrupt, and "wraps" that sprites crossing an
+// edge of the screen come back in on the other side instead of being clipped.
+typedef enum chip8_quirks
+{
+    CHIP8_QUIRKS_MODERN, // What most current interpreters do. The default.
+    CHIP8_QUIRKS_VIP,    // The COSMAC VIP's original interpreter.
+    CHIP8_QUIRKS_SCHIP,  // SUPER-CHIP 1.1 on the HP 48.
+    CHIP8_QUIRKS_XOCHIP, // XO-CHIP, as Octo runs it.
+    CHIP8_QUIRKS_COUNT
+} chip8_quirks_t;
+
+// Why a machine stopped. A trapping instruction changes nothing and leaves
+// PC on itself, so the machine can be inspected where it failed.
+typedef enum chip8_trap
+{
+    CHIP8_TRAP_NONE,            // Running, or waiting for a key.
+    CHIP8_TRAP_BAD_OPCODE,      // Not a CHIP-8 or SUPER-CHIP instruction
+                                // nor one of the XO-CHIP instructions that
+                                // fit in 4K, including 0nnn.
+    CHIP8_TRAP_STACK_OVERFLOW,  // 2nnn with all 16 stack levels in use.
+    CHIP8_TRAP_STACK_UNDERFLOW, // 00EE with nothing on the stack.
+    CHIP8_TRAP_BAD_ADDRESS,     // Dxyn, Fx33, Fx55, Fx65, 5xy2 or 5xy3
+                                // reaching past the end of memory.
+    CHIP8_TRAP_HALTED,          // The program exited with 00FD, or jumped to
+                                // itself, which only chip8_step notices.
+    CHIP8_TRAP_COUNT
+} chip8_trap_t;
+
+// One predecoded instruction. chip8_emulate_cycle keeps one of these for
+// every address in memory so the fetch, operand extraction and two-level
+// opcode switch only run the first time an address is executed. An entry
+// with op == 0 has not been decoded yet.
+typedef struct chip8_insn
+{
+    uint8_t op;      // Handler index, private to chip8.c.
+    uint8_t x;       // Register index from bits 8-11.
+    uint8_t y;       // Register index from bits 4-7.
+    uint8_t kk;      // Low byte. The low nibble doubles as n.
+    uint16_t nnn;    // Low 12 bits, an address.
+    uint16_t opcode; // The raw opcode the entry was decoded from.
+} chip8_insn_t;
+
+// Complete state of one CHIP-8 machine. Nothing in chip8.c is shared between
+// instances, so any number of them can live in one process and each one can
+// be stepped from whichever thread owns it.
+//
+// Fields are ordered by how often the interpreter touches them: the
+// registers used by almost every instruction sit together in the first cache
+// line, followed by the stack and keypad, and the large frame buffer and
+// memory arrays come last, followed by the decode cache which is only read
+// through the program counter.
+typedef struct chip8
+{
+    uint16_t PC;                     // Program counter. Address of the next
+                                     // instruction.
+    uint16_t I;                      // Index register. Used to store memory
+                                     // addresses.
+    uint16_t opcode;                 // Opcode currently being executed.
+    uint8_t SP;                      // Stack pointer. Index of the next free
+                                     // stack slot.
+    bool draw_flag;                  // Set to true when the screen should be
+                                     // drawn. Cleared by the frontend when the
+                                     // screen is drawn.
+    uint8_t V[CHIP8_REGISTER_COUNT]; // 16 registers, V0-VF. VF is the carry
+                                     // flag.
+    uint8_t state;                   // A chip8_state_t.
+    uint8_t wait_reg;                // Register Fx0A stores the key in while
+                                     // waiting.
+    uint8_t trap;                    // A chip8_trap_t, CHIP8_TRAP_NONE unless
+                                     // state is CHIP8_STATE_TRAPPED.
+    uint8_t quirks;                  // A chip8_quirks_t.
+    uint8_t hires;                   // Non-zero in the 128x64 mode 00FF
+                                     // selects, 0 in the 64x32 one.
+    uint8_t planes;                  // Bit p is set when Dxyn, 00E0 and the
+                                     // scrolls act on plane p, see Fn01.
+    uint64_t dirty_rows; // Bit y is set when screen row y changed. Cleared by
+                         // the frontend once the row is uploaded.
+
+    struct chip8_jit *jit;         // Translated code cache, or NULL to
+                                   // interpret.
+    struct chip8_profile *profile; // Instrumentation counters, or NULL.
+    struct chip8_trace *trace;     // Execution trace recorder, or NULL.
+    struct chip8_shm_port *shm;    // Shared-memory export, or NULL.
+
+    uint64_t cycles;      // Clock cycles since chip8_init, executed or idle.
+    uint64_t idle_cycles; // Cycles chip8_step skipped because the program was
+                          // waiting for a key or a timer.
+    uint32_t ips;         // Emulated clock, in instructions per second.
+    uint32_t tick_phase;  // Progress towards the next timer tick, in units of
+                          // 1 / (ips * CHIP8_TIMER_HZ) seconds. Always < ips.
+    uint64_t rng;         // xorshift64* state behind Cxkk. Never 0.
+
+    // The timers are not counted down. Each one is stored as the tick at
+    // which it reaches 0 and read back with chip8_delay_timer and
+    // chip8_sound_timer, so skipping any number of ticks costs nothing.
+    uint64_t ticks;       // Timer ticks since chip8_init.
+    uint64_t delay_until; // Tick at which the delay timer reaches 0.
+    uint64_t sound_until; // Tick at which the sound timer reaches 0.
+
+    uint16_t stack[CHIP8_STACK_SIZE]; // 16-level stack of return addresses.
+    uint8_t keypad[CHIP8_KEY_SIZE];   // 16 keys. 0-9, A-F. 0 is not pressed, 1
+                                      // is pressed.
+    uint8_t flags[CHIP8_FLAG_COUNT];  // Where Fx75 saves registers and Fx85
+                                      // restores them from.
+
+    // The screen, one bit per pixel and one array per plane. Row y of the
+    // current mode is the chip8_row_words(c) words starting at word
+    // y * chip8_row_words(c), with x = 0 in bit 63 of the first. Words past
+    // the last row of the current mode are always zero and nothing at 64x32
+    // touches them, so a program drawing on plane 0 only works on the first
+    // 256 bytes, as it did before there was a 128x64 mode.
+    uint64_t frame_buffer[CHIP8_PLANES][CHIP8_PLANE_WORDS];
+    uint8_t memory[CHIP8_MEMORY_SIZE];
+    const struct chip8_rom *rom; // Cached program the shared pages belong to.
+    uint16_t shared_pages;       // Bit p is set while the 256 bytes of memory
+                                 // page p are still read from rom, see
+                                 // chip8_rom.h. Always 0 without the cache.
+
+    chip8_insn_t decode_cache[CHIP8_MEMORY_SIZE]; // Predecoded instruction for
+                                                  // every address.
+
+    // Buzzer edges not yet taken by chip8_poll_sound, oldest first. When the
+    // queue is full the oldest edge is dropped.
+    chip8_sound_event_t sound_events[CHIP8_SOUND_EVENTS];
+    uint8_t sound_head;  // Index of the oldest queued edge.
+    uint8_t sound_count; // Edges queued.
+} chip8_t;
+
+// Size of the screen in the current mode.
+static inline int chip8_screen_width(const chip8_t *c)
+{
+    return c->hires ? CHIP8_HIRES_WIDTH : CHIP8_SCREEN_WIDTH;
+}
+
+static inline int chip8_screen_height(const chip8_t *c)
+{
+    return c->hires ? CHIP8_HIRES_HEIGHT : CHIP8_SCREEN_HEIGHT;
+}
+
+// Frame buffer words per screen row in the current mode.
+static inline int chip8_row_words(const chip8_t *c)
+{
+    return c->hires ? 2 : 1;
+}
+
+// Colour of the pixel at (x, y): bit p is set when it is lit on plane p.
+static inline uint8_t chip8_pixel(const chip8_t *c, int x, int y)
+{
+    int word = y * chip8_row_words(c) + x / 64;
+    int shift = 63 - x % 64;
+
+    return (c->frame_buffer[0][word] >> shift & 1) |
+           (c->frame_buffer[1][word] >> shift & 1) << 1;
+}
+
+// Current values of the 60Hz timers.
+static inline uint8_t chip8_delay_timer(const chip8_t *c)
+{
+    return c->delay_until > c->ticks ? (uint8_t)(c->delay_until - c->ticks)
+                                     : 0;
+}
+
+static inline uint8_t chip8_sound_timer(const chip8_t *c)
+{
+    return c->sound_until > c->ticks ? (uint8_t)(c->sound_until - c->ticks)
+                                     : 0;
+}
+
+// Sets up c from scratch, whatever it held before: anything still attached
+// with chip8_jit_enable, chip8_profile_enable, chip8_trace_start or
+// chip8_shm_attach is forgotten rather than released.
+void chip8_init(chip8_t *c);
+// Loads the program in the file at rom_path. Returns false, leaving c
+// untouched, when the file cannot be read or does not fit.
+bool chip8_load_game(chip8_t *c, const char *rom_path);
+// Copies size bytes of program to 0x200 and picks its profile with
+// chip8_quirks_for. Returns false, leaving c untouched, when the program does
+// not fit.
+bool chip8_load_rom(chip8_t *c, const uint8_t *rom, size_t size);
+// Runs one instruction and returns c->trap, which is not CHIP8_TRAP_NONE once
+// the machine has stopped on a fault. Like chip8_run, runs nothing unless
+// c->state is CHIP8_STATE_RUNNING.
+chip8_trap_t chip8_emulate_cycle(chip8_t *c);
+// chip8_run stops early, and chip8_step lets the rest of the time pass idle,
+// once the machine waits for a key or the display or has trapped; check
+// c->state.
+int chip8_run(chip8_t *c, int cycles);
+int chip8_step(chip8_t *c, int cycles);
+// Short description of a trap, e.g. "stack overflow".
+const char *chip8_trap_name(chip8_trap_t trap);
+// Run c with the quirks of another profile. chip8_init starts with
+// CHIP8_QUIRKS_MODERN and loading a program picks a profile for it, so
+// override that after loading.
+void chip8_set_quirks(chip8_t *c, chip8_quirks_t quirks);
+// Profile the built-in database lists for size bytes of program, looked up
+// by its hash, or CHIP8_QUIRKS_MODERN for programs it does not know.
+chip8_quirks_t chip8_quirks_for(const uint8_t *rom, size_t size);
+// Short name of a profile, e.g. "vip".
+const char *chip8_quirks_name(chip8_quirks_t quirks);
+void chip8_set_clock(chip8_t *c, uint32_t ips);
+// Restart the random numbers Cxkk draws from. Equal seeds give equal
+// sequences; chip8_init seeds with CHIP8_DEFAULT_SEED.
+void chip8_seed(chip8_t *c, uint64_t seed);
+void chip8_set_key(chip8_t *c, uint8_t key, bool state);
+// Set both timers, as Fx15 and Fx18 would.
+void chip8_set_timers(chip8_t *c, uint8_t delay, uint8_t sound);
+// One 60Hz timer tick. chip8_step applies ticks on its own.
+void chip8_tick(chip8_t *c);
+// Take the oldest buzzer edge. Returns false when there is none.
+bool chip8_poll_sound(chip8_t *c, chip8_sound_event_t *event);
+
+#endif
@@ -0,0 +1,763 @@
+#include "chip8_batch.h"
+#include "chip8_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Byte-lane vector operations. Every target provides the same set, so the
+// instruction kernels below are written once; without SIMD a "vector" is a
+// single lane.
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i vec_t;
+#define VEC_WIDTH 32
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_store(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define vec_set1(b) _mm256_set1_epi8((char)(b))
+#define vec_add _mm256_add_epi8
+#define vec_sub _mm256_sub_epi8
+#define vec_and _mm256_and_si256
+#define vec_or _mm256_or_si256
+#define vec_xor _mm256_xor_si256
+#define vec_eq _mm256_cmpeq_epi8
+#define vec_max _mm256_max_epu8
+#define vec_dec_sat(v) _mm256_subs_epu8((v), vec_set1(1))
+#define vec_shr1(v) vec_and(_mm256_srli_epi16((v), 1), vec_set1(0x7F))
+#define vec_blend(m, n, o) _mm256_blendv_epi8((o), (n), (m))
+#define vec_none(v) _mm256_testz_si256((v), (v))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i vec_t;
+#define VEC_WIDTH 16
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_store(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define vec_set1(b) _mm_set1_epi8((char)(b))
+#define vec_add _mm_add_epi8
+#define vec_sub _mm_sub_epi8
+#define vec_and _mm_and_si128
+#define vec_or _mm_or_si128
+#define vec_xor _mm_xor_si128
+#define vec_eq _mm_cmpeq_epi8
+#define vec_max _mm_max_epu8
+#define vec_dec_sat(v) _mm_subs_epu8((v), vec_set1(1))
+#define vec_shr1(v) vec_and(_mm_srli_epi16((v), 1), vec_set1(0x7F))
+#define vec_blend(m, n, o)                                                     \
+    _mm_or_si128(_mm_and_si128((m), (n)), _mm_andnot_si128((m), (o)))
+#define vec_none(v) (_mm_movemask_epi8(v) == 0)
+#else
+typedef uint8_t vec_t;
+#define VEC_WIDTH 1
+#define vec_load(p) (*(const uint8_t *)(p))
+#define vec_store(p, v) (*(uint8_t *)(p) = (v))
+#define vec_set1(b) ((uint8_t)(b))
+#define vec_add(a, b) ((uint8_t)((a) + (b)))
+#define vec_sub(a, b) ((uint8_t)((a) - (b)))
+#define vec_and(a, b) ((uint8_t)((a) & (b)))
+#define vec_or(a, b) ((uint8_t)((a) | (b)))
+#define vec_xor(a, b) ((uint8_t)((a) ^ (b)))
+#define vec_eq(a, b) ((uint8_t)((a) == (b) ? 0xFF : 0))
+#define vec_max(a, b) ((a) > (b) ? (a) : (b))
+#define vec_dec_sat(v) ((uint8_t)((v) ? (v) - 1 : 0))
+#define vec_shr1(v) ((uint8_t)((v) >> 1))
+#define vec_blend(m, n, o) ((uint8_t)(((m) & (n)) | (~(m) & (o))))
+#define vec_none(v) ((v) == 0)
+#endif
+
+// 0xFF in each lane where a > b, unsigned.
+static inline vec_t vec_gt(vec_t a, vec_t b)
+{
+    return vec_xor(vec_eq(vec_max(a, b), b), vec_set1(0xFF));
+}
+
+// Rows are padded to a whole number of the widest vector so every load and
+// store stays in bounds. Padding lanes never join a group.
+#define LANE_ALIGN 32
+
+// A lane that is alone at its program counter runs this many instructions
+// per visit, so fully diverged lanes do not pay for a scan of every lane per
+// instruction.
+#define SCALAR_CHUNK 32
+
+struct chip8_batch
+{
+    int lanes;         // Lanes in use.
+    int padded;        // lanes rounded up to LANE_ALIGN.
+    uint8_t *V;        // Register rows, V[r * padded + lane].
+    uint16_t *PC;
+    uint16_t *I;
+    uint8_t *SP;
+    uint16_t *stack;   // Stack rows, stack[level * padded + lane].
+    uint8_t *delay;
+    uint8_t *sound;
+    uint8_t *mask;     // 0xFF for the lanes in the group being executed.
+    uint8_t *advance;  // Program counter step chosen by a skip.
+    int32_t *left;     // Instructions each lane still owes this batch.
+    int32_t *ran;      // Instructions each lane ran this batch.
+    uint8_t *stored;   // Nonzero once a lane's memory may differ from image.
+    chip8_t *machines; // Memory, keypad and screen of each lane. Their
+                       // registers are only current during a scalar step.
+    chip8_batch_stats_t stats;
+    uint8_t image[CHIP8_MEMORY_SIZE]; // Memory of every lane not stored to.
+};
+
+#define ROW(b, r) ((b)->V + (size_t)(r) * (b)->padded)
+#define STACK(b, s) ((b)->stack + (size_t)(s) * (b)->padded)
+
+// Copy lane's registers from the rows into its machine, leaving out the
+// stack unless asked for it.
+static void gather(const chip8_batch_t *b, int lane, chip8_t *c, bool stack)
+{
+    int r;
+
+    for (r = 0; r < CHIP8_REGISTER_COUNT; r++)
+    {
+        c->V[r] = ROW(b, r)[lane];
+    }
+    for (r = 0; stack && r < CHIP8_STACK_SIZE; r++)
+    {
+        c->stack[r] = STACK(b, r)[lane];
+    }
+    c->PC = b->PC[lane];
+    c->I = b->I[lane];
+    c->SP = b->SP[lane];
+    // Not chip8_set_timers: restoring a timer is not the buzzer changing.
+    c->delay_until = c->ticks + b->delay[lane];
+    c->sound_until = c->ticks + b->sound[lane];
+}
+
+// Copy lane's registers from its machine back into the rows.
+static void scatter(chip8_batch_t *b, int lane, const chip8_t *c, bool stack)
+{
+    int r;
+
+    for (r = 0; r < CHIP8_REGISTER_COUNT; r++)
+    {
+        ROW(b, r)[lane] = c->V[r];
+    }
+    for (r = 0; stack && r < CHIP8_STACK_SIZE; r++)
+    {
+        STACK(b, r)[lane] = c->stack[r];
+    }
+    b->PC[lane] = c->PC;
+    b->I[lane] = c->I;
+    b->SP[lane] = c->SP;
+    b->delay[lane] = chip8_delay_timer(c);
+    b->sound[lane] = chip8_sound_timer(c);
+}
+
+chip8_batch_t *chip8_batch_create(int lanes)
+{
+    chip8_batch_t *b;
+    size_t n;
+    int l;
+
+    if (lanes <= 0)
+    {
+        return NULL;
+    }
+    b = calloc(1, sizeof(*b));
+    if (b == NULL)
+    {
+        return NULL;
+    }
+    b->lanes = lanes;
+    b->padded = (lanes + LANE_ALIGN - 1) / LANE_ALIGN * LANE_ALIGN;
+    n = b->padded;
+
+    b->V = calloc(CHIP8_REGISTER_COUNT * n, 1);
+    b->PC = calloc(n, sizeof(*b->PC));
+    b->I = calloc(n, sizeof(*b->I));
+    b->SP = calloc(n, 1);
+    b->stack = calloc(CHIP8_STACK_SIZE * n, sizeof(*b->stack));
+    b->delay = calloc(n, 1);
+    b->sound = calloc(n, 1);
+    b->mask = calloc(n, 1);
+    b->advance = calloc(n, 1);
+    b->left = calloc(n, sizeof(*b->left));
+    b->ran = calloc(n, sizeof(*b->ran));
+    b->stored = calloc(n, 1);
+    b->machines = malloc(lanes * sizeof(*b->machines));
+    if (b->V == NULL || b->PC == NULL || b->I == NULL || b->SP == NULL ||
+        b->stack == NULL || b->delay == NULL || b->sound == NULL ||
+        b->mask == NULL || b->advance == NULL || b->left == NULL ||
+        b->ran == NULL || b->stored == NULL || b->machines == NULL)
+    {
+        chip8_batch_destroy(b);
+        return NULL;
+    }
+
+    for (l = 0; l < lanes; l++)
+    {
+        chip8_init(&b->machines[l]);
+        scatter(b, l, &b->machines[l], true);
+    }
+    memcpy(b->image, b->machines[0].memory, sizeof(b->image));
+    return b;
+}
+
+void chip8_batch_destroy(chip8_batch_t *b)
+{
+    if (b == NULL)
+    {
+        return;
+    }
+    free(b->V);
+    free(b->PC);
+    free(b->I);
+    free(b->SP);
+    free(b->stack);
+    free(b->delay);
+    free(b->sound);
+    free(b->mask);
+    free(b->advance);
+    free(b->left);
+    free(b->ran);
+    free(b->stored);
+    free(b->machines);
+    free(b);
+}
+
+int chip8_batch_lanes(const chip8_batch_t *b)
+{
+    return b->lanes;
+}
+
+bool chip8_batch_load_rom(chip8_batch_t *b, const uint8_t *rom, size_t size)
+{
+    int l;
+
+    if (size > MAX_GAME_SIZE)
+    {
+        return false;
+    }
+    for (l = 0; l < b->lanes; l++)
+    {
+        chip8_load_rom(&b->machines[l], rom, size);
+        b->stored[l] = 0;
+    }
+    memcpy(b->image, b->machines[0].memory, sizeof(b->image));
+    return true;
+}
+
+void chip8_batch_get(const chip8_batch_t *b, int lane, chip8_t *c)
+{
+    *c = b->machines[lane];
+    gather(b, lane, c, true);
+}
+
+void chip8_batch_put(chip8_batch_t *b, int lane, const chip8_t *c)
+{
+    b->machines[lane] = *c;
+    // Lanes always interpret and are never profiled, traced or exported.
+    b->machines[lane].jit = NULL;
+    b->machines[lane].profile = NULL;
+    b->machines[lane].trace = NULL;
+    b->machines[lane].shm = NULL;
+    b->machines[lane].sound_count = 0; // Nor do they queue buzzer edges.
+    // Lanes fetch from their memory array directly, so nothing stays shared.
+    CHIP8_OWN(&b->machines[lane], 0, CHIP8_MEMORY_SIZE);
+    b->stored[lane] = 1;
+    scatter(b, lane, c, true);
+}
+
+void chip8_batch_set_key(chip8_batch_t *b, int lane, uint8_t key, bool state)
+{
+    chip8_t *c = &b->machines[lane];
+
+    gather(b, lane, c, false);
+    chip8_set_key(c, key, state);
+    scatter(b, lane, c, false);
+}
+
+void chip8_batch_seed(chip8_batch_t *b, int lane, uint64_t seed)
+{
+    chip8_seed(&b->machines[lane], seed);
+}
+
+// How a group instruction left the program counters.
+typedef enum group_step
+{
+    STEP_NONE,  // No vector form; nothing was executed.
+    STEP_SAME,  // Every lane of the group is at *pc.
+    STEP_SPLIT, // The lanes went different ways; PC holds each of them.
+} group_step_t;
+
+// Apply body to every vector of lanes, with m holding the group mask.
+#define FOR_LANES(...)                                                         \
+    for (i = 0; i < n; i += VEC_WIDTH)                                         \
+    {                                                                          \
+        vec_t m = vec_load(mask + i);                                          \
+        __VA_ARGS__                                                            \
+    }
+
+// Vx = expr for the lanes in the group. a is Vx and c is Vy.
+#define VX_OP(expr)                                                            \
+    FOR_LANES(vec_t a = vec_load(vx + i); vec_t c = vec_load(vy + i);         \
+              (void)c; vec_store(vx + i, vec_blend(m, (expr), a));)
+
+// The 8xy_ instructions that set VF: flag and Vx = expr on the registers as
+// they were, then Vx and VF in that order, so that with x = F the flag wins,
+// exactly as the interpreter orders it.
+#define VX_OP_VF(flag, expr)                                                   \
+    FOR_LANES(vec_t a = vec_load(vx + i); vec_t c = vec_load(vy + i);         \
+              vec_t f = vec_and((flag), vec_set1(1));                         \
+              vec_store(vx + i, vec_blend(m, (expr), a));                     \
+              vec_store(vf + i, vec_blend(m, f, vec_load(vf + i)));)
+
+// VF = 0 for the lanes in the group.
+#define VF_CLEAR()                                                             \
+    FOR_LANES(vec_store(vf + i, vec_blend(m, vec_set1(0), vec_load(vf + i)));)
+
+// Program counter step for each lane, chosen by a per-lane condition.
+#define SKIP(cond, taken, not_taken)                                           \
+    FOR_LANES(vec_t a = vec_load(vx + i); vec_t c = vec_load(vy + i);         \
+              (void)a; (void)c;                                               \
+              vec_store(advance + i,                                          \
+                        vec_and(m, vec_blend((cond), vec_set1(taken),         \
+                                             vec_set1(not_taken))));)         \
+    return advance_group(b, at, pc);
+
+// After a skip has set each lane's step in advance, whether the group still
+// agrees. If not, the lanes' PC rows are brought up to date.
+static group_step_t advance_group(chip8_batch_t *b, uint16_t at, uint16_t *pc)
+{
+    uint8_t lo = UINT8_MAX, hi = 0;
+    int i;
+
+    for (i = 0; i < b->padded; i++)
+    {
+        uint8_t step = b->advance[i];
+        lo = b->mask[i] && step < lo ? step : lo;
+        hi = b->mask[i] && step > hi ? step : hi;
+    }
+    if (lo == hi)
+    {
+        *pc = at + lo;
+        return STEP_SAME;
+    }
+    for (i = 0; i < b->padded; i++)
+    {
+        b->PC[i] = b->mask[i] ? at + b->advance[i] : b->PC[i];
+    }
+    return STEP_SPLIT;
+}
+
+// After a jump that wrote each lane's PC, whether the group still agrees.
+static group_step_t same_target(const chip8_batch_t *b, uint16_t *pc)
+{
+    uint16_t lo = UINT16_MAX, hi = 0;
+    int i;
+
+    for (i = 0; i < b->padded; i++)
+    {
+        uint16_t to = b->PC[i];
+        lo = b->mask[i] && to < lo ? to : lo;
+        hi = b->mask[i] && to > hi ? to : hi;
+    }
+    if (lo != hi)
+    {
+        return STEP_SPLIT;
+    }
+    *pc = lo;
+    return STEP_SAME;
+}
+
+// Execute e on every lane in the group at once, with the quirk bits q the
+// group shares. The group is at *pc, which the PC row does not reflect until
+// the group is done. The quirks are tested once per instruction for the whole
+// group rather than once per lane.
+static group_step_t vector_step(chip8_batch_t *b, const chip8_insn_t *e,
+                                unsigned q, uint16_t *pc)
+{
+    uint8_t *vx = ROW(b, e->x);
+    uint8_t *vy = ROW(b, e->y);
+    uint8_t *vf = ROW(b, 0xF);
+    uint8_t *vs = q & CHIP8_QUIRK_SHIFT ? vx : vy; // Shifted by 8xy6, 8xyE.
+    uint8_t *vj = ROW(b, q & CHIP8_QUIRK_JUMP ? e->x : 0); // Added by Bnnn.
+    const uint8_t *mask = b->mask;
+    uint8_t *advance = b->advance;
+    uint8_t *SP = b->SP;
+    uint16_t *PC = b->PC;
+    uint16_t *I = b->I;
+    uint16_t *stack = b->stack;
+    uint16_t at = *pc;
+    vec_t kk = vec_set1(e->kk);
+    uint8_t stop = 0;
+    int n = b->padded, i;
+
+    switch (e->op)
+    {
+    case OP_LD_VX_KK:
+        VX_OP(kk);
+        break;
+    case OP_ADD_VX_KK:
+        VX_OP(vec_add(a, kk));
+        break;
+    case OP_LD_VX_VY:
+        VX_OP(c);
+        break;
+    case OP_OR:
+        VX_OP(vec_or(a, c));
+        if (q & CHIP8_QUIRK_VF_RESET)
+        {
+            VF_CLEAR();
+        }
+        break;
+    case OP_AND:
+        VX_OP(vec_and(a, c));
+        if (q & CHIP8_QUIRK_VF_RESET)
+        {
+            VF_CLEAR();
+        }
+        break;
+    case OP_XOR:
+        VX_OP(vec_xor(a, c));
+        if (q & CHIP8_QUIRK_VF_RESET)
+        {
+            VF_CLEAR();
+        }
+        break;
+    case OP_ADD_VX_VY:
+        VX_OP_VF(vec_gt(c, vec_xor(a, vec_set1(0xFF))), vec_add(a, c));
+        break;
+    case OP_SUB:
+        VX_OP_VF(vec_eq(vec_max(a, c), a), vec_sub(a, c)); // a >= c.
+        break;
+    case OP_SHR:
+        vy = vs; // c is the register shifted.
+        VX_OP_VF(c, vec_shr1(c));
+        break;
+    case OP_SUBN:
+        VX_OP_VF(vec_eq(vec_max(c, a), c), vec_sub(c, a)); // c >= a.
+        break;
+    case OP_SHL:
+        vy = vs; // c is the register shifted.
+        VX_OP_VF(vec_gt(c, vec_set1(0x7F)), vec_add(c, c));
+        break;
+    case OP_LD_VX_DT:
+        FOR_LANES(vec_t a = vec_load(vx + i);
+                  vec_store(vx + i, vec_blend(m, vec_load(b->delay + i), a));)
+        break;
+    case OP_LD_DT_VX:
+        FOR_LANES(vec_t d = vec_load(b->delay + i);
+                  vec_store(b->delay + i, vec_blend(m, vec_load(vx + i), d));)
+        break;
+    case OP_LD_ST_VX:
+        FOR_LANES(vec_t t = vec_load(b->sound + i);
+                  vec_store(b->sound + i, vec_blend(m, vec_load(vx + i), t));)
+        break;
+
+    // Skips, with the same program counter steps as their handlers.
+    case OP_SE_VX_KK:
+        SKIP(vec_eq(a, kk), 4, 2);
+    case OP_SNE_VX_KK:
+        SKIP(vec_eq(a, kk), 2, 4);
+    case OP_SE_VX_VY:
+        SKIP(vec_eq(a, c), 4, 2);
+    case OP_SNE_VX_VY:
+        SKIP(vec_eq(a, c), 2, 4);
+
+    // Keys and random number generators are per lane.
+    case OP_SKP:
+    case OP_SKNP:
+        for (i = 0; i < b->lanes; i++)
+        {
+            uint8_t want = e->op == OP_SKP ? 1 : 0;
+            advance[i] = !mask[i] ? 0
+                         : b->machines[i].keypad[vx[i] & 0xF] == want ? 4
+                                                                      : 2;
+        }
+        return advance_group(b, at, pc);
+    case OP_RND:
+        for (i = 0; i < b->lanes; i++)
+        {
+            if (mask[i])
+            {
+                vx[i] = chip8_random(&b->machines[i].rng) & e->kk;
+            }
+        }
+        break;
+
+    case OP_JP:
+        *pc = e->nnn;
+        return STEP_SAME;
+    case OP_JP_V0:
+        for (i = 0; i < n; i++)
+        {
+            PC[i] = mask[i] ? e->nnn + vj[i] : PC[i];
+        }
+        return same_target(b, pc);
+
+    // The stack pointer can differ between lanes at the same address, so
+    // these index the stack rows one lane at a time. A lane about to run
+    // off either end of the stack sends the group to the interpreter.
+    case OP_CALL:
+        for (i = 0; i < n; i++)
+        {
+            stop |= mask[i] & (SP[i] >= CHIP8_STACK_SIZE ? 0xFF : 0);
+        }
+        if (stop)
+        {
+            return STEP_NONE;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (mask[i])
+            {
+                stack[SP[i]++ * n + i] = at + 2;
+            }
+        }
+        *pc = e->nnn;
+        return STEP_SAME;
+    case OP_RET:
+        for (i = 0; i < n; i++)
+        {
+            stop |= mask[i] & (SP[i] == 0 ? 0xFF : 0);
+        }
+        if (stop)
+        {
+            return STEP_NONE;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (mask[i])
+            {
+                PC[i] = stack[--SP[i] * n + i];
+            }
+        }
+        return same_target(b, pc);
+
+    // The lanes of a group share e, so these are plain masked loops the
+    // compiler vectorises on its own.
+    case OP_LD_I:
+        for (i = 0; i < n; i++)
+        {
+            I[i] = mask[i] ? e->nnn : I[i];
+        }
+        break;
+    case OP_ADD_I_VX:
+        for (i = 0; i < n; i++)
+        {
+            I[i] += mask[i] & vx[i];
+        }
+        break;
+    case OP_LD_F_VX:
+        for (i = 0; i < n; i++)
+        {
+            I[i] = mask[i] ? vx[i] * FONTSET_BYTES_PER_CHAR : I[i];
+        }
+        break;
+    default:
+        return STEP_NONE;
+    }
+
+    *pc = at + 2;
+    return STEP_SAME;
+}
+
+#undef SKIP
+#undef VF_CLEAR
+#undef VX_OP_VF
+#undef VX_OP
+#undef FOR_LANES
+
+// Run the group in mask, count lanes at pc, for up to budget instructions
+// while it stays together. Each lane's memory must match that of leader
+// unless shared is false, in which case the group runs one instruction and
+// lets the caller regroup. Returns the instructions executed per lane.
+static int group_run(chip8_batch_t *b, chip8_t *leader, uint16_t pc,
+                     int count, int budget, bool shared)
+{
+    unsigned q = chip8_quirk_bits(leader);
+    const chip8_insn_t *e;
+    group_step_t step = STEP_SAME;
+    int n = 0, l;
+
+    while (n < budget && (n == 0 || shared))
+    {
+        e = &leader->decode_cache[pc & CHIP8_ADDRESS_MASK];
+        if (e->op == OP_DECODE)
+        {
+            e = chip8_decode(leader, pc & CHIP8_ADDRESS_MASK);
+        }
+        step = vector_step(b, e, q, &pc);
+        if (step == STEP_NONE)
+        {
+            break;
+        }
+        n++;
+        if (step == STEP_SPLIT)
+        {
+            break;
+        }
+    }
+
+    for (l = 0; l < b->lanes; l++)
+    {
+        if (b->mask[l])
+        {
+            b->PC[l] = step == STEP_SPLIT ? b->PC[l] : pc;
+            b->left[l] -= n;
+            b->ran[l] += n;
+        }
+    }
+    b->stats.vector_steps += n;
+    b->stats.vector_insns += (uint64_t)n * count;
+    return n;
+}
+
+// Run up to n instructions on one lane through the interpreter. stack says
+// whether they may use the stack.
+static void scalar_run(chip8_batch_t *b, int lane, int n, bool stack)
+{
+    chip8_t *c = &b->machines[lane];
+    int i;
+
+    if (n > b->left[lane])
+    {
+        n = b->left[lane];
+    }
+    gather(b, lane, c, stack);
+    for (i = 0; i < n && c->state == CHIP8_STATE_RUNNING; i++)
+    {
+        chip8_emulate_cycle(c);
+        if ((c->opcode & 0xF0FF) == 0xF033 || (c->opcode & 0xF0FF) == 0xF055 ||
+            (c->opcode & 0xF00F) == 0x5002)
+        {
+            b->stored[lane] = 1;
+        }
+    }
+    c->sound_count = 0; // Only Fx18 run here would queue one.
+    scatter(b, lane, c, stack);
+
+    b->ran[lane] += i;
+    b->left[lane] = c->state == CHIP8_STATE_RUNNING ? b->left[lane] - i : 0;
+    b->stats.scalar_insns += i;
+}
+
+static uint16_t fetch(const uint8_t *memory, uint16_t pc)
+{
+    return memory[pc & CHIP8_ADDRESS_MASK] << 8 |
+           memory[(pc + 1) & CHIP8_ADDRESS_MASK];
+}
+
+// Each round picks the group of lanes at the lowest program counter and runs
+// it, so lanes that took different branches wait for each other at the first
+// address they share again.
+int chip8_batch_run(chip8_batch_t *b, int cycles)
+{
+    chip8_t *leader;
+    uint32_t pc;
+    uint16_t opcode = 0;
+    int count, budget, l;
+    int trapped = 0;
+    bool shared, stack;
+
+    for (l = 0; l < b->lanes; l++)
+    {
+        b->left[l] =
+            b->machines[l].state == CHIP8_STATE_RUNNING ? cycles : 0;
+        b->ran[l] = 0;
+    }
+
+    for (;;)
+    {
+        pc = UINT32_MAX;
+        for (l = 0; l < b->lanes; l++)
+        {
+            if (b->left[l] > 0 && b->PC[l] < pc)
+            {
+                pc = b->PC[l];
+            }
+        }
+        if (pc == UINT32_MAX)
+        {
+            break;
+        }
+
+        // Lanes can hold different code at the same address once they have
+        // stored to memory, so the group is the lanes at pc that also agree
+        // on the opcode. Only those lanes need their own memory read. Lanes
+        // only group with lanes of the same quirk profile.
+        leader = NULL;
+        count = 0;
+        budget = cycles;
+        shared = true;
+        for (l = 0; l < b->lanes; l++)
+        {
+            bool in = b->left[l] > 0 && b->PC[l] == pc;
+            if (in && leader == NULL)
+            {
+                leader = &b->machines[l];
+                opcode = fetch(b->stored[l] ? leader->memory : b->image, pc);
+            }
+            in = in && fetch(b->stored[l] ? b->machines[l].memory : b->image,
+                             pc) == opcode;
+            in = in && b->machines[l].quirks == leader->quirks;
+            b->mask[l] = in ? 0xFF : 0;
+            if (in)
+            {
+                count++;
+                budget = b->left[l] < budget ? b->left[l] : budget;
+                shared = shared && !b->stored[l];
+            }
+        }
+
+        if (count > 1 && group_run(b, leader, pc, count, budget, shared) > 0)
+        {
+            continue;
+        }
+
+        // Otherwise the interpreter runs the group one instruction per lane,
+        // or a lane on its own a chunk at a time.
+        stack = count == 1 || (opcode & 0xF000) == 0x2000 || opcode == 0x00EE;
+        for (l = 0; l < b->lanes; l++)
+        {
+            if (b->mask[l])
+            {
+                scalar_run(b, l, count > 1 ? 1 : SCALAR_CHUNK, stack);
+            }
+        }
+    }
+
+    for (l = 0; l < b->lanes; l++)
+    {
+        b->machines[l].cycles += b->ran[l];
+        b->stats.insns += b->ran[l];
+        trapped += b->machines[l].state == CHIP8_STATE_TRAPPED;
+    }
+    return trapped;
+}
+
+chip8_trap_t chip8_batch_trap(const chip8_batch_t *b, int lane)
+{
+    return (chip8_trap_t)b->machines[lane].trap;
+}
+
+void chip8_batch_tick(chip8_batch_t *b)
+{
+    int i;
+
+    for (i = 0; i < b->padded; i += VEC_WIDTH)
+    {
+        vec_store(b->delay + i, vec_dec_sat(vec_load(b->delay + i)));
+        vec_store(b->sound + i, vec_dec_sat(vec_load(b->sound + i)));
+    }
+    for (i = 0; i < b->lanes; i++)
+    {
+        b->machines[i].ticks++;
+        if (b->machines[i].state == CHIP8_STATE_WAIT_TICK)
+        {
+            b->machines[i].state = CHIP8_STATE_RUNNING; // Dxyn's frame is over.
+        }
+    }
+}
+
+void chip8_batch_get_stats(const chip8_batch_t *b, chip8_batch_stats_t *stats)
+{
+    *stats = b->stats;
+    stats->occupancy =
+        b->stats.vector_steps > 0
+            ? (double)b->stats.vector_insns /
+                  ((double)b->stats.vector_steps * b->lanes)
+            : 0.0;
+}
@@ -0,0 +1,62 @@
+#ifndef CHIP8_BATCH_H
+#define CHIP8_BATCH_H
+
+#include "chip8.h"
+#include <stddef.h>
+
+// Lock-step engine for many machines running the same program, e.g. one ROM
+// fuzzed with different inputs. The registers and stacks of all lanes live
+// in structure-of-arrays form, one row per register with one byte or word per
+// lane, so that an instruction the lanes agree on executes as a few vector
+// operations across every lane at once. Instructions that touch memory or the
+// screen, and lanes whose program counter has diverged from the group being
+// executed, go through chip8_emulate_cycle one lane at a time, so both paths
+// share the interpreter's semantics.
+
+typedef struct chip8_batch chip8_batch_t;
+
+typedef struct chip8_batch_stats
+{
+    uint64_t insns;        // Instructions executed over all lanes.
+    uint64_t vector_steps; // Instructions executed as one vector operation.
+    uint64_t vector_insns; // Lane instructions covered by those operations.
+    uint64_t scalar_insns; // Lane instructions executed one lane at a time.
+    double occupancy;      // vector_insns / (vector_steps * lanes).
+} chip8_batch_stats_t;
+
+// Create lanes machines, each initialised with chip8_init. Returns NULL when
+// out of memory.
+chip8_batch_t *chip8_batch_create(int lanes);
+void chip8_batch_destroy(chip8_batch_t *b);
+int chip8_batch_lanes(const chip8_batch_t *b);
+
+// Load the same program into every lane. Returns false, changing nothing,
+// when the program does not fit.
+bool chip8_batch_load_rom(chip8_batch_t *b, const uint8_t *rom, size_t size);
+
+// Copy one lane out to, or in from, an ordinary machine. Use these to give
+// lanes different starting states and to read results back.
+void chip8_batch_get(const chip8_batch_t *b, int lane, chip8_t *c);
+void chip8_batch_put(chip8_batch_t *b, int lane, const chip8_t *c);
+
+void chip8_batch_set_key(chip8_batch_t *b, int lane, uint8_t key, bool state);
+// chip8_seed on one lane. Every lane starts with CHIP8_DEFAULT_SEED, so lanes
+// that should see different random numbers need different seeds.
+void chip8_batch_seed(chip8_batch_t *b, int lane, uint64_t seed);
+
+// Run cycles instructions on every lane, like chip8_run on each of them. A
+// lane parked on Fx0A or waiting for the display, or stopped by a trap,
+// stops early. Returns the number of
+// lanes that are trapped; the others keep running regardless.
+int chip8_batch_run(chip8_batch_t *b, int cycles);
+
+// Why lane stopped, CHIP8_TRAP_NONE while it can still run.
+chip8_trap_t chip8_batch_trap(const chip8_batch_t *b, int lane);
+
+// chip8_tick on every lane. Lanes keep their timers but queue no buzzer
+// edges; read the sound timer of a lane copied out with chip8_batch_get.
+void chip8_batch_tick(chip8_batch_t *b);
+
+void chip8_batch_get_stats(const chip8_batch_t *b, chip8_batch_stats_t *stats);
+
+#endif
@@ -0,0 +1,983 @@
+// Headless benchmark for the interpreter core. Runs a few synthetic kernels,
+// most of them dominated by one class of instructions, plus IBM_Logo.ch8 and
+// any ROMs named on the command line, and prints the results as JSON on
+// stdout:
+//
+//     chip8-bench [-n instructions] [-r repeats] [-c ips] [--jit] [--profile]
+//                 [--trace file] [rom ...]
+//
+// Every benchmark is run repeats times on a fresh machine clocked at ips and
+// the fastest run is reported. Cycles chip8_step skips as idle, waiting or
+// trapped are reported on their own and left out of ips and ns_per_insn,
+// which only count the instructions that ran; a benchmark whose program
+// trapped also names the trap. The opcode mix of each benchmark comes from a
+// separate, untimed pass through chip8_emulate_cycle, and the per-class cost
+// is the solution of mix * cost = ns_per_insn over the built-in kernels.
+// The built-in kernels are then run again on a lock-step batch of identical
+// machines, which reports its throughput over all lanes, and on a chip8_env
+// set with 1, 2, 4... worker threads up to the number of processors, which
+// reports how throughput scales with threads. With tracing built in, the
+// built-in kernels are timed once more while traced to a scratch file, for
+// the overhead of recording. Last comes the cost of every chip8_scale filter
+// on the screens the draw and hires kernels leave behind, scaled to fit a
+// 1280x720 window.
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8.h"
+#include "chip8_batch.h"
+#include "chip8_scale.h"
+#include "chip8_state.h"
+#ifdef CHIP8_JIT
+#include "chip8_jit.h"
+#endif
+#ifdef CHIP8_PROFILE
+#include "chip8_profile.h"
+#endif
+#ifdef CHIP8_TRACE
+#include "chip8_trace.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef CHIP8_ENV
+#include "chip8_env.h"
+#include <unistd.h>
+#endif
+#ifdef CHIP8_ROM_CACHE
+#include "chip8_rom.h"
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#ifndef CHIP8_BENCH_CORE
+#define CHIP8_BENCH_CORE "unknown"
+#endif
+#ifndef CHIP8_BENCH_ROM_DIR
+#define CHIP8_BENCH_ROM_DIR "."
+#endif
+
+#define BENCH_BATCH 100000     // Instructions per chip8_step call.
+#define BENCH_MIX_LIMIT 1000000 // Instructions sampled for the opcode mix.
+#define BENCH_STATE_FRAMES 10000 // Frames of save states and rewind.
+#define BENCH_LANES 64           // Machines in the lock-step batch.
+#define BENCH_ENVS 256           // Machines in the chip8_env set.
+#define BENCH_ENV_FRAMES 4       // Frames per chip8_env_step.
+#define BENCH_ROM_LOADS 10000    // Machines started on IBM_Logo.ch8.
+#define BENCH_SCALE_FRAMES 200   // Whole screens scaled per filter.
+#define BENCH_SCALE_WIDTH 1280   // Window the screens are scaled to fit.
+#define BENCH_SCALE_HEIGHT 720
+
+enum bench_class
+{
+    CLASS_FLOW, // 0nnn, 1nnn, 2nnn, Bnnn.
+    CLASS_SKIP, // 3xkk, 4xkk, 5xy0, 9xy0, Ex9E, ExA1.
+    CLASS_ALU,  // 6xkk, 7xkk, 8xyn, Annn, Cxkk.
+    CLASS_DRAW, // Dxyn.
+    CLASS_MISC, // Fxkk: timers, keys, BCD, register loads and stores.
+    CLASS_COUNT
+};
+
+static const char *const class_names[CLASS_COUNT] = {"flow", "skip", "alu",
+                                                     "draw", "misc"};
+
+// Class of each opcode, by its top nibble.
+static const uint8_t opcode_class[16] = {
+    CLASS_FLOW, CLASS_FLOW, CLASS_FLOW, CLASS_SKIP, CLASS_SKIP, CLASS_SKIP,
+    CLASS_ALU,  CLASS_ALU,  CLASS_ALU,  CLASS_SKIP, CLASS_ALU,  CLASS_FLOW,
+    CLASS_ALU,  CLASS_DRAW, CLASS_SKIP, CLASS_MISC};
+
+typedef struct bench_kernel
+{
+    const char *name;
+    int class;         // Class the kernel is meant to stress, or -1.
+    const uint8_t *rom;
+    size_t size;
+    const char *path;  // Loaded from disk instead when rom is NULL.
+} bench_kernel_t;
+
+// Register arithmetic in a tight loop.
+static const uint8_t kernel_alu[] = {
+    0x60, 0x01, // 200: LD V0, 1
+    0x61, 0x03, // 202: LD V1, 3
+    0x80, 0x14, // 204: ADD V0, V1
+    0x81, 0x05, // 206: SUB V1, V0
+    0x80, 0x12, // 208: AND V0, V1
+    0x80, 0x13, // 20A: XOR V0, V1
+    0x80, 0x11, // 20C: OR V0, V1
+    0x81, 0x06, // 20E: SHR V1
+    0x81, 0x0E, // 210: SHL V1
+    0x72, 0x05, // 212: ADD V2, 5
+    0xA3, 0x00, // 214: LD I, 0x300
+    0xF2, 0x1E, // 216: ADD I, V2
+    0xC3, 0xFF, // 218: RND V3, 0xFF
+    0x12, 0x04, // 21A: JP 0x204
+};
+
+// Nested calls and returns, closed by a computed jump.
+static const uint8_t kernel_flow[] = {
+    0x60, 0x00, // 200: LD V0, 0
+    0x22, 0x0A, // 202: CALL 0x20A
+    0x22, 0x10, // 204: CALL 0x210
+    0xB2, 0x02, // 206: JP V0, 0x202
+    0x00, 0x00, // 208:
+    0x22, 0x10, // 20A: CALL 0x210
+    0x00, 0xEE, // 20C: RET
+    0x00, 0x00, // 20E:
+    0x00, 0xEE, // 210: RET
+};
+
+// Conditional skips. Every skip is followed by a harmless load so the kernel
+// runs the same loop whether or not the skip is taken.
+static const uint8_t kernel_skip[] = {
+    0x60, 0x05, // 200: LD V0, 5
+    0x61, 0x05, // 202: LD V1, 5
+    0x62, 0x07, // 204: LD V2, 7
+    0x30, 0x05, // 206: SE V0, 5
+    0x6A, 0x01, // 208: LD VA, 1
+    0x40, 0x05, // 20A: SNE V0, 5
+    0x6A, 0x02, // 20C: LD VA, 2
+    0x50, 0x10, // 20E: SE V0, V1
+    0x6A, 0x03, // 210: LD VA, 3
+    0x90, 0x20, // 212: SNE V0, V2
+    0x6A, 0x04, // 214: LD VA, 4
+    0xE0, 0xA1, // 216: SKNP V0
+    0x6A, 0x05, // 218: LD VA, 5
+    0x12, 0x06, // 21A: JP 0x206
+};
+
+// Font sprites drawn at a moving, wrapping position.
+static const uint8_t kernel_draw[] = {
+    0x60, 0x00, // 200: LD V0, 0
+    0x61, 0x00, // 202: LD V1, 0
+    0x62, 0x00, // 204: LD V2, 0
+    0xF2, 0x29, // 206: LD F, V2
+    0xD0, 0x15, // 208: DRW V0, V1, 5
+    0x70, 0x07, // 20A: ADD V0, 7
+    0x71, 0x03, // 20C: ADD V1, 3
+    0x72, 0x01, // 20E: ADD V2, 1
+    0x12, 0x06, // 210: JP 0x206
+};
+
+// BCD, register stores and loads to a data area, and timer accesses.
+static const uint8_t kernel_misc[] = {
+    0x6A, 0x7B, // 200: LD VA, 123
+    0xA4, 0x00, // 202: LD I, 0x400
+    0xFA, 0x33, // 204: LD B, VA
+    0xF2, 0x55, // 206: LD [I], V2
+    0xA4, 0x00, // 208: LD I, 0x400
+    0xF2, 0x65, // 20A: LD V2, [I]
+    0x7A, 0x01, // 20C: ADD VA, 1
+    0xF0, 0x15, // 20E: LD DT, V0
+    0xF1, 0x07, // 210: LD V1, DT
+    0x12, 0x02, // 212: JP 0x202
+};
+
+// 16x16 sprites drawn on both planes of the 128x64 screen, which scrolls
+// under them. The sprites are the kernel's own bytes.
+static const uint8_t kernel_hires[] = {
+    0x00, 0xFF, // 200: HIGH
+    0xF3, 0x01, // 202: PLANE 3
+    0x60, 0x00, // 204: LD V0, 0
+    0x61, 0x00, // 206: LD V1, 0
+    0xA2, 0x00, // 208: LD I, 0x200
+    0xD0, 0x10, // 20A: DRW V0, V1, 0
+    0x70, 0x0B, // 20C: ADD V0, 11
+    0x71, 0x05, // 20E: ADD V1, 5
+    0x00, 0xC1, // 210: SCD 1
+    0x00, 0xFB, // 212: SCR
+    0x00, 0xFC, // 214: SCL
+    0x12, 0x0A, // 216: JP 0x20A
+};
+
+#define KERNEL(name, class)                                                    \
+    {#name, class, kernel_##name, sizeof(kernel_##name), NULL}
+
+static const bench_kernel_t builtin_kernels[] = {
+    KERNEL(alu, CLASS_ALU),   KERNEL(flow, CLASS_FLOW),
+    KERNEL(skip, CLASS_SKIP), KERNEL(draw, CLASS_DRAW),
+    KERNEL(misc, CLASS_MISC), KERNEL(hires, -1),
+};
+
+#define BUILTIN_COUNT (sizeof(builtin_kernels) / sizeof(builtin_kernels[0]))
+
+typedef struct bench_result
+{
+    double seconds;             // Fastest timed run.
+    uint64_t mix[CLASS_COUNT];  // Instructions executed per class.
+    uint64_t mix_total;
+    uint64_t idle_cycles;       // Cycles chip8_step skipped in the fastest run.
+    uint8_t trap;               // chip8_trap_t that ended it, if any.
+    size_t jit_code_bytes;
+} bench_result_t;
+
+static chip8_t machine;
+static uint8_t rom_buffer[MAX_GAME_SIZE];
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t clock_ips = 1000000; // High enough that timer ticks, and
+                                     // the idle checks done at each one, are
+                                     // rare next to the instructions.
+
+static bool profile; // Count every timed instruction with chip8_profile.
+static const char *trace_path; // Trace every timed run to this file, each
+                               // run replacing the last one.
+
+static bool load(chip8_t *c, const bench_kernel_t *k, bool jit)
+{
+    chip8_init(c);
+    chip8_set_clock(c, clock_ips);
+#ifdef CHIP8_PROFILE
+    if (profile && !chip8_profile_enable(c))
+    {
+        return false;
+    }
+#endif
+#ifdef CHIP8_JIT
+    if (jit && !chip8_jit_enable(c))
+    {
+        fprintf(stderr, "JIT unavailable\n");
+        return false;
+    }
+#else
+    (void)jit;
+#endif
+    return chip8_load_rom(c, k->rom, k->size);
+}
+
+static void unload(chip8_t *c)
+{
+#ifdef CHIP8_JIT
+    chip8_jit_disable(c);
+#endif
+#ifdef CHIP8_PROFILE
+    chip8_profile_disable(c);
+#endif
+#ifdef CHIP8_TRACE
+    if (c->trace != NULL && !chip8_trace_stop(c))
+    {
+        fprintf(stderr, "Cannot write %s\n", trace_path);
+    }
+#endif
+    (void)c;
+}
+
+static bool run(const bench_kernel_t *k, uint64_t instructions, int repeats,
+                bool jit, bench_result_t *r)
+{
+    chip8_t *c = &machine;
+    uint64_t done;
+    double start, elapsed;
+    int i;
+
+    memset(r, 0, sizeof(*r));
+
+    for (i = 0; i < repeats; i++)
+    {
+        if (!load(c, k, jit))
+        {
+            return false;
+        }
+#ifdef CHIP8_TRACE
+        if (trace_path != NULL && !chip8_trace_start(c, trace_path))
+        {
+            fprintf(stderr, "Cannot trace to %s\n", trace_path);
+            return false;
+        }
+#endif
+        start = now_seconds();
+        for (done = 0; done < instructions; done += BENCH_BATCH)
+        {
+            uint64_t left = instructions - done;
+            chip8_step(c, left < BENCH_BATCH ? (int)left : BENCH_BATCH);
+        }
+        elapsed = now_seconds() - start;
+        if (i == 0 || elapsed < r->seconds)
+        {
+            r->seconds = elapsed;
+            r->idle_cycles = c->idle_cycles;
+            r->trap = c->trap;
+        }
+#ifdef CHIP8_JIT
+        if (c->jit != NULL)
+        {
+            chip8_jit_stats_t stats;
+            chip8_jit_get_stats(c, &stats);
+            r->jit_code_bytes = stats.code_bytes;
+        }
+#endif
+        unload(c);
+    }
+
+    // Opcode mix, one instruction at a time so every opcode can be seen.
+    load(c, k, false);
+    r->mix_total = instructions < BENCH_MIX_LIMIT ? instructions
+                                                  : BENCH_MIX_LIMIT;
+    for (done = 0; done < r->mix_total; done++)
+    {
+        chip8_emulate_cycle(c);
+
+        r->mix[opcode_class[c->opcode >> 12]]++;
+        if (c->state != CHIP8_STATE_RUNNING)
+        {
+            r->mix_total = done + 1; // Nothing runs past a trap or a wait.
+            break;
+        }
+    }
+    unload(c);
+
+    return true;
+}
+
+// Solves a * x = b by Gaussian elimination with partial pivoting. a and b
+// are destroyed. Returns false when a is singular.
+static bool solve(double a[CLASS_COUNT][CLASS_COUNT], double b[CLASS_COUNT],
+                  double x[CLASS_COUNT])
+{
+    int i, j, k, pivot;
+
+    for (i = 0; i < CLASS_COUNT; i++)
+    {
+        pivot = i;
+        for (j = i + 1; j < CLASS_COUNT; j++)
+        {
+            if (fabs(a[j][i]) > fabs(a[pivot][i]))
+            {
+                pivot = j;
+            }
+        }
+        if (fabs(a[pivot][i]) < 1e-9)
+        {
+            return false;
+        }
+        for (k = 0; k < CLASS_COUNT; k++)
+        {
+            double t = a[i][k];
+            a[i][k] = a[pivot][k];
+            a[pivot][k] = t;
+        }
+        double t = b[i];
+        b[i] = b[pivot];
+        b[pivot] = t;
+
+        for (j = i + 1; j < CLASS_COUNT; j++)
+        {
+            double f = a[j][i] / a[i][i];
+            for (k = i; k < CLASS_COUNT; k++)
+            {
+                a[j][k] -= f * a[i][k];
+            }
+            b[j] -= f * b[i];
+        }
+    }
+    for (i = CLASS_COUNT - 1; i >= 0; i--)
+    {
+        x[i] = b[i];
+        for (k = i + 1; k < CLASS_COUNT; k++)
+        {
+            x[i] -= a[i][k] * x[k];
+        }
+        x[i] /= a[i][i];
+    }
+    return true;
+}
+
+static void print_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            putchar('\\');
+        }
+        if ((unsigned char)*s >= 0x20)
+        {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+// Cost of a save state and of one frame of rewind history, on the draw
+// kernel running at 700 instructions per second so that every frame
+// changes the screen.
+static void print_state_costs(void)
+{
+    static uint8_t buf[CHIP8_STATE_SIZE];
+    static const bench_kernel_t k = KERNEL(draw, CLASS_DRAW);
+    chip8_t *c = &machine;
+    chip8_rewind_t *r;
+    double save_s, load_s, push_s, pop_s, start;
+    size_t frames, bytes;
+    int i;
+
+    r = chip8_rewind_create(64 * 1024 * 1024);
+    if (r == NULL)
+    {
+        return;
+    }
+    load(c, &k, false);
+    chip8_set_clock(c, 700);
+
+    start = now_seconds();
+    for (i = 0; i < BENCH_STATE_FRAMES; i++)
+    {
+        chip8_save_state(c, buf, sizeof(buf));
+    }
+    save_s = now_seconds() - start;
+    start = now_seconds();
+    for (i = 0; i < BENCH_STATE_FRAMES; i++)
+    {
+        chip8_load_state(c, buf, sizeof(buf));
+    }
+    load_s = now_seconds() - start;
+
+    push_s = 0;
+    for (i = 0; i < BENCH_STATE_FRAMES; i++)
+    {
+        chip8_step(c, 700 / CHIP8_TIMER_HZ);
+        start = now_seconds();
+        chip8_rewind_push(r, c);
+        push_s += now_seconds() - start;
+    }
+    frames = chip8_rewind_frames(r);
+    bytes = chip8_rewind_bytes(r);
+    start = now_seconds();
+    while (chip8_rewind_pop(r, c))
+    {
+    }
+    pop_s = now_seconds() - start;
+    chip8_rewind_destroy(r);
+    unload(c);
+
+    printf("  \"state\": {\n");
+    printf("    \"size\": %d,\n", CHIP8_STATE_SIZE);
+    printf("    \"save_ns\": %.1f,\n", save_s * 1e9 / BENCH_STATE_FRAMES);
+    printf("    \"load_ns\": %.1f,\n", load_s * 1e9 / BENCH_STATE_FRAMES);
+    printf("    \"rewind_push_ns\": %.1f,\n", push_s * 1e9 / BENCH_STATE_FRAMES);
+    printf("    \"rewind_pop_ns\": %.1f,\n", pop_s * 1e9 / frames);
+    printf("    \"rewind_bytes_per_frame\": %.1f\n", (double)bytes / frames);
+    printf("  },\n");
+}
+
+// Throughput of chip8_batch_run on each built-in kernel, with instructions
+// spread over the lanes and a timer tick every 1/60 s of emulated time.
+static void print_batch_costs(uint64_t instructions)
+{
+    int chunk = clock_ips / CHIP8_TIMER_HZ > 0 ? clock_ips / CHIP8_TIMER_HZ : 1;
+    uint64_t per_lane = instructions / BENCH_LANES;
+    size_t i;
+
+    printf("  \"batch\": {\"lanes\": %d, \"kernels\": [", BENCH_LANES);
+    for (i = 0; i < BUILTIN_COUNT; i++)
+    {
+        const bench_kernel_t *k = &builtin_kernels[i];
+        chip8_batch_t *b = chip8_batch_create(BENCH_LANES);
+        chip8_batch_stats_t stats;
+        uint64_t done;
+        double seconds;
+
+        if (b == NULL || !chip8_batch_load_rom(b, k->rom, k->size))
+        {
+            chip8_batch_destroy(b);
+            continue;
+        }
+        seconds = now_seconds();
+        for (done = 0; done < per_lane; done += chunk)
+        {
+            uint64_t left = per_lane - done;
+            chip8_batch_run(b, left < (uint64_t)chunk ? (int)left : chunk);
+            chip8_batch_tick(b);
+        }
+        seconds = now_seconds() - seconds;
+        chip8_batch_get_stats(b, &stats);
+        chip8_batch_destroy(b);
+
+        printf("%s\n    {\"name\": ", i == 0 ? "" : ",");
+        print_string(k->name);
+        printf(", \"seconds\": %.6f, \"ips\": %.0f, \"ns_per_insn\": %.3f, "
+               "\"vector_share\": %.4f, \"occupancy\": %.4f}",
+               seconds, stats.insns / seconds, seconds * 1e9 / stats.insns,
+               (double)stats.vector_insns / stats.insns, stats.occupancy);
+    }
+    printf("\n  ]},\n");
+}
+
+#ifdef CHIP8_ENV
+// Throughput of chip8_env_step on the alu kernel, writing pixel observations,
+// for growing numbers of worker threads.
+static void print_env_costs(uint64_t instructions)
+{
+    const bench_kernel_t *k = &builtin_kernels[0];
+    uint64_t per_frame = clock_ips / CHIP8_TIMER_HZ > 0
+                             ? clock_ips / CHIP8_TIMER_HZ
+                             : 1;
+    uint64_t steps = instructions / (per_frame * BENCH_ENVS * BENCH_ENV_FRAMES);
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint16_t actions[BENCH_ENVS];
+    uint8_t *obs = malloc(BENCH_ENVS * chip8_obs_size(CHIP8_OBS_PIXELS));
+    double base = 0;
+    int threads, last = online > 0 ? (int)online : 1;
+    bool first = true;
+
+    steps = steps > 0 ? steps : 1;
+    printf("  \"env\": {\"machines\": %d, \"frames_per_step\": %d, "
+           "\"kernel\": ", BENCH_ENVS, BENCH_ENV_FRAMES);
+    print_string(k->name);
+    printf(", \"threads\": [");
+    for (threads = 1; obs != NULL && threads <= last;
+         threads = threads < last && threads * 2 > last ? last : threads * 2)
+    {
+        chip8_env_t *e = chip8_env_create(BENCH_ENVS, threads,
+                                          CHIP8_OBS_PIXELS);
+        uint64_t cycles = 0, s;
+        double seconds;
+        int i;
+
+        if (e == NULL || !chip8_env_load_rom(e, k->rom, k->size))
+        {
+            chip8_env_destroy(e);
+            break;
+        }
+        for (i = 0; i < BENCH_ENVS; i++)
+        {
+            chip8_set_clock(chip8_env_machine(e, i), clock_ips);
+        }
+        seconds = now_seconds();
+        for (s = 0; s < steps; s++)
+        {
+            for (i = 0; i < BENCH_ENVS; i++)
+            {
+                actions[i] = (uint16_t)(1u << ((s + i) & 0xF));
+            }
+            chip8_env_step(e, BENCH_ENVS, actions, BENCH_ENV_FRAMES, obs);
+        }
+        seconds = now_seconds() - seconds;
+        for (i = 0; i < BENCH_ENVS; i++)
+        {
+            cycles += chip8_env_machine(e, i)->cycles;
+        }
+        chip8_env_destroy(e);
+
+        if (first)
+        {
+            base = seconds;
+        }
+        printf("%s\n    {\"threads\": %d, \"seconds\": %.6f, "
+               "\"frames_per_sec\": %.0f, \"ips\": %.0f, "
+               "\"speedup\": %.3f}",
+               first ? "" : ",", threads, seconds,
+               (double)steps * BENCH_ENVS * BENCH_ENV_FRAMES / seconds,
+               cycles / seconds, base / seconds);
+        first = false;
+        if (threads == last)
+        {
+            break;
+        }
+    }
+    printf("\n  ]},\n");
+    free(obs);
+}
+#endif
+
+// Cost of each filter scaling a whole screen to fit the window, and so of
+// each dirty row, on the screens the draw and hires kernels leave after ten
+// frames, with lit pixels white and the rest black as the frontend shows
+// them.
+static void print_scale_costs(void)
+{
+    static const bench_kernel_t kernels[] = {KERNEL(draw, CLASS_DRAW),
+                                             KERNEL(hires, -1)};
+    static uint32_t src[CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT];
+    chip8_t *c = &machine;
+    uint32_t *out;
+    int width, height, scale, filter, x, y;
+    double start, s;
+    size_t i;
+
+    printf("  \"scale\": {\"window\": [%d, %d], \"filters\": [",
+           BENCH_SCALE_WIDTH, BENCH_SCALE_HEIGHT);
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        load(c, &kernels[i], false);
+        chip8_set_clock(c, 700);
+        chip8_step(c, 700 / CHIP8_TIMER_HZ * 10);
+        width = chip8_screen_width(c);
+        height = chip8_screen_height(c);
+        for (y = 0; y < height; y++)
+        {
+            for (x = 0; x < width; x++)
+            {
+                src[y * width + x] =
+                    chip8_pixel(c, x, y) ? 0xFFFFFFFF : 0x000000FF;
+            }
+        }
+        unload(c);
+
+        for (filter = 0; filter < CHIP8_FILTER_COUNT; filter++)
+        {
+            scale = chip8_filter_scale(filter, width, height,
+                                       BENCH_SCALE_WIDTH, BENCH_SCALE_HEIGHT);
+            out = malloc((size_t)width * height * scale * scale *
+                         sizeof(uint32_t));
+            if (out == NULL)
+            {
+                continue;
+            }
+            start = now_seconds();
+            for (y = 0; y < BENCH_SCALE_FRAMES; y++)
+            {
+                chip8_scale_rows(filter, scale, src, width, height, 0, height,
+                                 out, width * scale * sizeof(uint32_t));
+            }
+            s = (now_seconds() - start) / BENCH_SCALE_FRAMES;
+            free(out);
+
+            printf("%s\n    {\"name\": ", i == 0 && filter == 0 ? "" : ",");
+            print_string(kernels[i].name);
+            printf(", \"filter\": ");
+            print_string(chip8_filter_name(filter));
+            printf(", \"screen\": \"%dx%d\", \"scale\": %d, "
+                   "\"frame_ns\": %.1f, \"row_ns\": %.1f}",
+                   width, height, scale, s * 1e9, s * 1e9 / height);
+        }
+    }
+    printf("\n  ]},\n");
+}
+
+#ifdef CHIP8_ROM_CACHE
+// Cost of starting a machine on IBM_Logo.ch8 by reading the file, and by
+// opening it through a ROM cache that has already seen it.
+static void print_rom_costs(void)
+{
+    const char *path = CHIP8_BENCH_ROM_DIR "/IBM_Logo.ch8";
+    chip8_rom_cache_t *cache = chip8_rom_cache_create();
+    const chip8_rom_t *rom;
+    double file_s, cache_s, start;
+    int i;
+
+    rom = cache != NULL ? chip8_rom_cache_open(cache, path) : NULL;
+    if (rom == NULL)
+    {
+        chip8_rom_cache_destroy(cache);
+        return;
+    }
+    start = now_seconds();
+    for (i = 0; i < BENCH_ROM_LOADS; i++)
+    {
+        chip8_init(&machine);
+        chip8_load_game(&machine, path);
+    }
+    file_s = now_seconds() - start;
+    start = now_seconds();
+    for (i = 0; i < BENCH_ROM_LOADS; i++)
+    {
+        chip8_rom_init(&machine, chip8_rom_cache_open(cache, path));
+    }
+    cache_s = now_seconds() - start;
+
+    printf("  \"rom\": {\"file_load_ns\": %.1f, \"cached_load_ns\": %.1f},\n",
+           file_s * 1e9 / BENCH_ROM_LOADS, cache_s * 1e9 / BENCH_ROM_LOADS);
+    chip8_init(&machine);
+    chip8_rom_cache_destroy(cache);
+}
+#endif
+
+#ifdef CHIP8_TRACE
+// Every built-in kernel run plain and traced to a scratch file, both timed
+// like the benchmarks above.
+static void print_trace_costs(uint64_t instructions, int repeats)
+{
+    const char *saved = trace_path;
+    const char *dir = getenv("TMPDIR");
+    char path[512];
+    struct stat st;
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s/chip8-bench-%ld.trace",
+             dir != NULL && dir[0] != '\0' ? dir : "/tmp", (long)getpid());
+    printf("  \"trace\": {\"kernels\": [");
+    for (i = 0; i < BUILTIN_COUNT; i++)
+    {
+        const bench_kernel_t *k = &builtin_kernels[i];
+        bench_result_t plain, traced;
+        double plain_ns, traced_ns;
+
+        trace_path = NULL;
+        if (!run(k, instructions, repeats, false, &plain))
+        {
+            continue;
+        }
+        trace_path = path;
+        if (!run(k, instructions, repeats, false, &traced) ||
+            stat(path, &st) != 0)
+        {
+            continue;
+        }
+        plain_ns = plain.seconds * 1e9 / instructions;
+        traced_ns = traced.seconds * 1e9 / instructions;
+
+        printf("%s\n    {\"name\": ", i == 0 ? "" : ",");
+        print_string(k->name);
+        printf(", \"plain_ns_per_insn\": %.3f, \"traced_ns_per_insn\": %.3f, "
+               "\"overhead\": %.4f, \"bytes_per_insn\": %.3f}",
+               plain_ns, traced_ns, traced_ns / plain_ns - 1,
+               (double)st.st_size / instructions);
+    }
+    printf("\n  ]},\n");
+    remove(path);
+    trace_path = saved;
+}
+#endif
+
+static void print_footprint(size_t jit_code_bytes)
+{
+    long max_rss_kb = -1;
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        max_rss_kb = usage.ru_maxrss;
+#ifdef __APPLE__
+        max_rss_kb /= 1024; // Reported in bytes on macOS.
+#endif
+    }
+#endif
+
+    printf("  \"footprint\": {\n");
+    printf("    \"chip8_t\": %zu,\n", sizeof(chip8_t));
+    printf("    \"memory\": %zu,\n", sizeof(machine.memory));
+    printf("    \"decode_cache\": %zu,\n", sizeof(machine.decode_cache));
+    printf("    \"frame_buffer\": %zu,\n", sizeof(machine.frame_buffer));
+    printf("    \"jit_code_bytes\": %zu,\n", jit_code_bytes);
+    printf("    \"max_rss_kb\": %ld\n", max_rss_kb);
+    printf("  }");
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-n instructions] [-r repeats] [-c ips] [--jit] "
+            "[--profile] [--trace file] [rom ...]\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t instructions = 10000000;
+    int repeats = 3;
+    bool jit = false;
+    bench_kernel_t kernels[BUILTIN_COUNT + 1 + 64];
+    size_t count = 0, i;
+    double mix[CLASS_COUNT][CLASS_COUNT], kernel_ns[CLASS_COUNT];
+    double class_ns[CLASS_COUNT];
+    bool have_kernel[CLASS_COUNT] = {false};
+    bool solved;
+    size_t jit_code_bytes = 0;
+    int a;
+
+    for (i = 0; i < BUILTIN_COUNT; i++)
+    {
+        kernels[count++] = builtin_kernels[i];
+    }
+    kernels[count++] = (bench_kernel_t){"IBM_Logo", -1, NULL, 0,
+                                        CHIP8_BENCH_ROM_DIR "/IBM_Logo.ch8"};
+
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-n") == 0 && a + 1 < argc)
+        {
+            instructions = strtoull(argv[++a], NULL, 10);
+        }
+        else if (strcmp(argv[a], "-r") == 0 && a + 1 < argc)
+        {
+            repeats = atoi(argv[++a]);
+        }
+        else if (strcmp(argv[a], "-c") == 0 && a + 1 < argc)
+        {
+            clock_ips = (uint32_t)strtoul(argv[++a], NULL, 10);
+        }
+        else if (strcmp(argv[a], "--jit") == 0)
+        {
+#ifdef CHIP8_JIT
+            jit = true;
+#else
+            fprintf(stderr, "Built without CHIP8_JIT\n");
+            return 1;
+#endif
+        }
+        else if (strcmp(argv[a], "--profile") == 0)
+        {
+#ifdef CHIP8_PROFILE
+            profile = true;
+#else
+            fprintf(stderr, "Built without CHIP8_PROFILE\n");
+            return 1;
+#endif
+        }
+        else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc)
+        {
+#ifdef CHIP8_TRACE
+            trace_path = argv[++a];
+#else
+            fprintf(stderr, "Built without CHIP8_TRACE\n");
+            return 1;
+#endif
+        }
+        else if (argv[a][0] != '-' &&
+                 count < sizeof(kernels) / sizeof(kernels[0]))
+        {
+            const char *name = strrchr(argv[a], '/');
+            kernels[count++] = (bench_kernel_t){name ? name + 1 : argv[a], -1,
+                                                NULL, 0, argv[a]};
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (instructions == 0 || repeats <= 0 || clock_ips == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"core\": \"%s\",\n", CHIP8_BENCH_CORE);
+    printf("  \"jit\": %s,\n", jit ? "true" : "false");
+    printf("  \"profile\": %s,\n", profile ? "true" : "false");
+    printf("  \"trace\": %s,\n", trace_path != NULL ? "true" : "false");
+    printf("  \"instructions\": %llu,\n", (unsigned long long)instructions);
+    printf("  \"repeats\": %d,\n", repeats);
+    printf("  \"clock_ips\": %u,\n", clock_ips);
+    printf("  \"benchmarks\": [");
+
+    for (i = 0; i < count; i++)
+    {
+        bench_kernel_t *k = &kernels[i];
+        bench_result_t r;
+        uint64_t executed;
+        double ns;
+        int j;
+
+        if (k->rom == NULL)
+        {
+            FILE *f = fopen(k->path, "rb");
+            if (f == NULL)
+            {
+                fprintf(stderr, "Skipping %s: cannot open\n", k->path);
+                continue;
+            }
+            k->size = fread(rom_buffer, 1, sizeof(rom_buffer), f);
+            k->rom = rom_buffer;
+            fclose(f);
+        }
+        if (!run(k, instructions, repeats, jit, &r))
+        {
+            fprintf(stderr, "Skipping %s: cannot load\n", k->name);
+            continue;
+        }
+        if (r.jit_code_bytes > jit_code_bytes)
+        {
+            jit_code_bytes = r.jit_code_bytes;
+        }
+
+        executed = instructions - r.idle_cycles;
+        ns = executed > 0 ? r.seconds * 1e9 / executed : 0.0;
+        if (k->class >= 0 && executed > 0)
+        {
+            for (j = 0; j < CLASS_COUNT; j++)
+            {
+                mix[k->class][j] = (double)r.mix[j] / r.mix_total;
+            }
+            kernel_ns[k->class] = ns;
+            have_kernel[k->class] = true;
+        }
+
+        printf("%s\n    {\"name\": ", i == 0 ? "" : ",");
+        print_string(k->name);
+        printf(", \"class\": ");
+        print_string(k->class >= 0 ? class_names[k->class] : "mixed");
+        printf(", \"seconds\": %.6f, \"executed\": %llu", r.seconds,
+               (unsigned long long)executed);
+        if (executed > 0)
+        {
+            printf(", \"ips\": %.0f, \"ns_per_insn\": %.3f",
+                   executed / r.seconds, ns);
+        }
+        else
+        {
+            printf(", \"ips\": null, \"ns_per_insn\": null");
+        }
+        printf(", \"idle_cycles\": %llu, \"trap\": ",
+               (unsigned long long)r.idle_cycles);
+        if (r.trap != CHIP8_TRAP_NONE)
+        {
+            print_string(chip8_trap_name((chip8_trap_t)r.trap));
+        }
+        else
+        {
+            printf("null");
+        }
+        printf(", \"mix\": {");
+        for (j = 0; j < CLASS_COUNT; j++)
+        {
+            printf("%s\"%s\": %.4f", j == 0 ? "" : ", ", class_names[j],
+                   (double)r.mix[j] / r.mix_total);
+        }
+        printf("}}");
+    }
+
+    solved = true;
+    for (i = 0; i < CLASS_COUNT; i++)
+    {
+        solved = solved && have_kernel[i];
+    }
+    solved = solved && solve(mix, kernel_ns, class_ns);
+
+    printf("\n  ],\n  \"ns_per_insn_by_class\": {");
+    for (i = 0; i < CLASS_COUNT; i++)
+    {
+        printf("%s\"%s\": ", i == 0 ? "" : ", ", class_names[i]);
+        if (!solved)
+        {
+            printf("null");
+        }
+        else
+        {
+            printf("%.3f", class_ns[i]);
+        }
+    }
+    printf("},\n");
+    print_state_costs();
+    print_batch_costs(instructions);
+#ifdef CHIP8_ENV
+    print_env_costs(instructions);
+#endif
+#ifdef CHIP8_ROM_CACHE
+    print_rom_costs();
+#endif
+#ifdef CHIP8_TRACE
+    print_trace_costs(instructions, repeats);
+#endif
+    print_scale_costs();
+    print_footprint(jit_code_bytes);
+    printf("\n}\n");
+
+    return 0;
+}
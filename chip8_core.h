@@ -0,0 +1,140 @@
+// One copy of the interpreter, compiled for one quirk profile. chip8.c
+// includes this once per profile, with QUIRKS defined as the profile's quirk
+// bits and CORE(name) giving every name defined here the profile's suffix.
+// The handlers are inlined with QUIRKS as their q, so each copy only contains
+// the behaviour of its own profile, and the profile is chosen once per
+// chip8_run or chip8_emulate_cycle instead of tested by every instruction.
+//
+// There is deliberately no include guard.
+
+// The handlers of this profile, in the shape the handler table calls.
+#define OP_SPECIALISE(name, fn)                                                \
+    static void CORE(fn)(chip8_t *c, const chip8_insn_t *e)                    \
+    {                                                                          \
+        op_##fn(c, e, QUIRKS);                                                 \
+    }
+CHIP8_EXEC_OPS(OP_SPECIALISE)
+#undef OP_SPECIALISE
+
+static void CORE(decode)(chip8_t *c, const chip8_insn_t *e);
+
+#define OP_HANDLER(name, fn) [OP_##name] = CORE(fn),
+static const chip8_handler_t CORE(handlers)[OP_COUNT] = {
+    CHIP8_OPS(OP_HANDLER)};
+#undef OP_HANDLER
+
+// Cache miss: decode the instruction at PC and run it.
+static void CORE(decode)(chip8_t *c, const chip8_insn_t *e)
+{
+    e = chip8_decode(c, c->PC);
+    c->opcode = e->opcode;
+    CORE(handlers)[e->op](c, e);
+}
+
+#if defined(CHIP8_CORE_THREADED) && defined(__GNUC__)
+// Direct-threaded core. Every handler is inlined behind its own label and
+// ends by jumping straight to the label of the next instruction, so each
+// instruction costs one indirect jump that the branch predictor can learn
+// per call site instead of one shared call through the handler table.
+static int CORE(run)(chip8_t *c, int cycles)
+{
+#define OP_LABEL(name, fn) [OP_##name] = &&l_##fn,
+    static void *const labels[OP_COUNT] = {CHIP8_OPS(OP_LABEL)};
+#undef OP_LABEL
+    const chip8_insn_t *e;
+    int left = cycles;
+
+#define DISPATCH()                                                             \
+    do                                                                         \
+    {                                                                          \
+        if (left-- <= 0)                                                       \
+        {                                                                      \
+            return cycles;                                                     \
+        }                                                                      \
+        e = &c->decode_cache[c->PC & CHIP8_ADDRESS_MASK];                      \
+        c->opcode = e->opcode;                                                 \
+        goto *labels[e->op];                                                   \
+    } while (0)
+
+    DISPATCH();
+
+l_decode:
+    e = chip8_decode(c, c->PC);
+    c->opcode = e->opcode;
+    goto *labels[e->op];
+
+// Only Fx0A, Dxyn and traps can stop the CPU, and the check folds away for
+// every other op.
+#define OP_BODY(name, fn)                                                      \
+    l_##fn:                                                                    \
+    CHIP8_PROFILE_INSN(c, e);                                                  \
+    CHIP8_TRACE_INSN(c, e);                                                    \
+    op_##fn(c, e, QUIRKS);                                                     \
+    if (CAN_STOP(OP_##name) && c->state != CHIP8_STATE_RUNNING)                \
+    {                                                                          \
+        return cycles - left;                                                  \
+    }                                                                          \
+    DISPATCH();
+    CHIP8_EXEC_OPS(OP_BODY)
+#undef OP_BODY
+#undef DISPATCH
+}
+#elif defined(CHIP8_CORE_THREADED)
+// Compilers without computed goto get the same inlined handlers behind a
+// single switch.
+static int CORE(run)(chip8_t *c, int cycles)
+{
+    const chip8_insn_t *e;
+    int left;
+
+    for (left = cycles; left > 0; left--)
+    {
+        e = &c->decode_cache[c->PC & CHIP8_ADDRESS_MASK];
+        if (e->op == OP_DECODE)
+        {
+            e = chip8_decode(c, c->PC);
+        }
+        CHIP8_PROFILE_INSN(c, e);
+        CHIP8_TRACE_INSN(c, e);
+        c->opcode = e->opcode;
+
+        switch (e->op)
+        {
+#define OP_CASE(name, fn)                                                      \
+    case OP_##name:                                                            \
+        op_##fn(c, e, QUIRKS);                                                 \
+        break;
+            CHIP8_EXEC_OPS(OP_CASE)
+#undef OP_CASE
+        }
+
+        if (c->state != CHIP8_STATE_RUNNING)
+        {
+            return cycles - left + 1;
+        }
+    }
+
+    return cycles;
+}
+#else
+static int CORE(run)(chip8_t *c, int cycles)
+{
+    const chip8_insn_t *e;
+    int i;
+
+    for (i = 0; i < cycles; i++)
+    {
+        e = &c->decode_cache[c->PC & CHIP8_ADDRESS_MASK];
+        CHIP8_PROFILE_INSN(c, e);
+        CHIP8_TRACE_INSN(c, e);
+        c->opcode = e->opcode;
+        CORE(handlers)[e->op](c, e);
+        if (c->state != CHIP8_STATE_RUNNING)
+        {
+            return i + 1;
+        }
+    }
+
+    return cycles;
+}
+#endif
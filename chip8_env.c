@@ -0,0 +1,533 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_env.h"
+#ifdef CHIP8_ROM_CACHE
+#include "chip8_rom.h"
+#endif
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+
+// The machines a worker still has to run this step: indices begin to end - 1,
+// packed as begin | end << 32 so the owner taking from the front and thieves
+// cutting off the back agree through a single compare-and-swap. Each queue
+// sits in its own cache line.
+typedef struct env_queue
+{
+    _Alignas(CACHE_LINE) _Atomic uint64_t range;
+} env_queue_t;
+
+#define RANGE(begin, end) ((uint64_t)(uint32_t)(begin) | (uint64_t)(end) << 32)
+#define RANGE_BEGIN(r) ((int)(uint32_t)(r))
+#define RANGE_END(r) ((int)((r) >> 32))
+
+typedef struct env_worker
+{
+    chip8_env_t *env;
+    int id;
+    pthread_t thread;
+} env_worker_t;
+
+struct chip8_env
+{
+    int count;
+    int threads;
+    chip8_obs_t format;
+    size_t obs_size;
+    chip8_t *machines;
+    env_queue_t *queues;     // One per worker, the caller's is queues[0].
+    env_worker_t *workers;   // threads - 1 of them, the caller is not here.
+    int started;             // Workers whose thread is running.
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;    // A step was posted, or the pool is stopping.
+    pthread_cond_t done;     // The last worker finished its part of a step.
+    uint64_t generation;     // Steps posted so far.
+    int active;              // Workers still busy with the current step.
+    bool stopping;
+
+    // The step being run, set before it is posted.
+    const uint16_t *actions;
+    int frames;
+    uint8_t *obs;
+
+    uint8_t spread[256][8]; // Byte b of a packed row as 8 pixels of 0 or 255.
+    uint8_t rom[MAX_GAME_SIZE];
+    size_t rom_size;
+#ifdef CHIP8_ROM_CACHE
+    chip8_rom_cache_t *roms;
+    const chip8_rom_t *program; // rom, shared by every machine, or NULL.
+#endif
+};
+
+static const uint8_t half_levels[5] = {0, 64, 128, 191, 255};
+
+size_t chip8_obs_size(chip8_obs_t format)
+{
+    switch (format)
+    {
+    case CHIP8_OBS_PACKED:
+        return CHIP8_OBS_PACKED_SIZE;
+    case CHIP8_OBS_PIXELS:
+        return CHIP8_OBS_PIXELS_SIZE;
+    case CHIP8_OBS_HALF:
+        return CHIP8_OBS_HALF_SIZE;
+    default:
+        return 0;
+    }
+}
+
+// The 64 pixels of a pair of 128x64 rows, each lit when any of the four
+// pixels under it is: OR neighbouring bits together, then pack every second
+// bit into the low half of the word.
+static uint32_t squeeze(uint64_t top, uint64_t bottom)
+{
+    uint64_t v = top | bottom;
+
+    v = (v | v >> 1) & 0x5555555555555555u;
+    v = (v | v >> 1) & 0x3333333333333333u;
+    v = (v | v >> 2) & 0x0F0F0F0F0F0F0F0Fu;
+    v = (v | v >> 4) & 0x00FF00FF00FF00FFu;
+    v = (v | v >> 8) & 0x0000FFFF0000FFFFu;
+    v = (v | v >> 16) & 0x00000000FFFFFFFFu;
+    return (uint32_t)v;
+}
+
+// c's screen as 64x32 rows, one word each, laid out like the frame buffer.
+static void screen_rows(const chip8_t *c, uint64_t *rows)
+{
+    const uint64_t *p0 = c->frame_buffer[0];
+    const uint64_t *p1 = c->frame_buffer[1];
+    int y;
+
+    for (y = 0; y < CHIP8_SCREEN_HEIGHT; y++)
+    {
+        if (!c->hires)
+        {
+            rows[y] = p0[y] | p1[y];
+            continue;
+        }
+        rows[y] = (uint64_t)squeeze(p0[4 * y] | p1[4 * y],
+                                    p0[4 * y + 2] | p1[4 * y + 2])
+                      << 32 |
+                  squeeze(p0[4 * y + 1] | p1[4 * y + 1],
+                          p0[4 * y + 3] | p1[4 * y + 3]);
+    }
+}
+
+static void observe(const chip8_env_t *e, const chip8_t *c, uint8_t *out)
+{
+    uint64_t rows[CHIP8_SCREEN_HEIGHT];
+    int x, y, k;
+
+    screen_rows(c, rows);
+    switch (e->format)
+    {
+    case CHIP8_OBS_PACKED:
+        for (y = 0; y < CHIP8_SCREEN_HEIGHT; y++)
+        {
+            for (k = 0; k < 8; k++)
+            {
+                *out++ = (uint8_t)(rows[y] >> (56 - 8 * k));
+            }
+        }
+        break;
+    case CHIP8_OBS_PIXELS:
+        for (y = 0; y < CHIP8_SCREEN_HEIGHT; y++)
+        {
+            for (k = 0; k < 8; k++, out += 8)
+            {
+                memcpy(out, e->spread[(uint8_t)(rows[y] >> (56 - 8 * k))], 8);
+            }
+        }
+        break;
+    case CHIP8_OBS_HALF:
+        for (y = 0; y < CHIP8_SCREEN_HEIGHT; y += 2)
+        {
+            // Lit pixels in each horizontal pair, two bits per pair.
+            const uint64_t m = 0x5555555555555555u;
+            uint64_t top = rows[y];
+            uint64_t bottom = rows[y + 1];
+            uint64_t a = (top & m) + (top >> 1 & m);
+            uint64_t b = (bottom & m) + (bottom >> 1 & m);
+
+            for (x = 0; x < CHIP8_SCREEN_WIDTH / 2; x++)
+            {
+                int shift = CHIP8_SCREEN_WIDTH - 2 - 2 * x;
+                *out++ = half_levels[(a >> shift & 3) + (b >> shift & 3)];
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Apply machine i's action, run its frames and write its observation.
+static void run_machine(chip8_env_t *e, int i)
+{
+    chip8_t *c = &e->machines[i];
+    unsigned keys = e->actions != NULL ? e->actions[i] : 0;
+    int f, k;
+
+    for (k = 0; k < CHIP8_KEY_SIZE; k++)
+    {
+        bool down = (keys >> k) & 1;
+        if ((c->keypad[k] != 0) != down)
+        {
+            chip8_set_key(c, (uint8_t)k, down);
+        }
+    }
+    for (f = 0; f < e->frames; f++)
+    {
+        // Instructions until tick_phase reaches ips, rounded up, so the
+        // frame ends on exactly one tick.
+        uint32_t due = (c->ips - c->tick_phase + CHIP8_TIMER_HZ - 1) /
+                       CHIP8_TIMER_HZ;
+        chip8_step(c, (int)due);
+    }
+    if (e->obs != NULL)
+    {
+        observe(e, c, e->obs + (size_t)i * e->obs_size);
+    }
+}
+
+// Take the next machine from the front of a worker's own queue, or -1 when
+// it is empty.
+static int take(env_queue_t *q)
+{
+    uint64_t r = atomic_load_explicit(&q->range, memory_order_relaxed);
+
+    while (RANGE_BEGIN(r) < RANGE_END(r))
+    {
+        if (atomic_compare_exchange_weak_explicit(
+                &q->range, &r, RANGE(RANGE_BEGIN(r) + 1, RANGE_END(r)),
+                memory_order_acquire, memory_order_relaxed))
+        {
+            return RANGE_BEGIN(r);
+        }
+    }
+    return -1;
+}
+
+// Cut the back half off the fullest other queue. The first machine stolen is
+// returned and the rest become the thief's own queue, which is empty when it
+// steals, so no other worker can be touching it. Returns -1 when every queue
+// is empty.
+static int steal(chip8_env_t *e, int self)
+{
+    for (;;)
+    {
+        int victim = -1, most = 0, w;
+        uint64_t r = 0;
+
+        for (w = 0; w < e->threads; w++)
+        {
+            uint64_t s = atomic_load_explicit(&e->queues[w].range,
+                                              memory_order_relaxed);
+            if (w != self && RANGE_END(s) - RANGE_BEGIN(s) > most)
+            {
+                victim = w;
+                most = RANGE_END(s) - RANGE_BEGIN(s);
+                r = s;
+            }
+        }
+        if (victim < 0)
+        {
+            return -1;
+        }
+
+        int cut = RANGE_END(r) - (most + 1) / 2;
+        if (atomic_compare_exchange_strong_explicit(
+                &e->queues[victim].range, &r, RANGE(RANGE_BEGIN(r), cut),
+                memory_order_acquire, memory_order_relaxed))
+        {
+            atomic_store_explicit(&e->queues[self].range,
+                                  RANGE(cut + 1, RANGE_END(r)),
+                                  memory_order_relaxed);
+            return cut;
+        }
+    }
+}
+
+static void work(chip8_env_t *e, int self)
+{
+    int i;
+
+    while ((i = take(&e->queues[self])) >= 0 || (i = steal(e, self)) >= 0)
+    {
+        run_machine(e, i);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    env_worker_t *w = arg;
+    chip8_env_t *e = w->env;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&e->lock);
+    for (;;)
+    {
+        while (e->generation == seen && !e->stopping)
+        {
+            pthread_cond_wait(&e->start, &e->lock);
+        }
+        if (e->stopping)
+        {
+            break;
+        }
+        seen = e->generation;
+        pthread_mutex_unlock(&e->lock);
+
+        work(e, w->id);
+
+        pthread_mutex_lock(&e->lock);
+        if (--e->active == 0)
+        {
+            pthread_cond_signal(&e->done);
+        }
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+chip8_env_t *chip8_env_create(int count, int threads, chip8_obs_t format)
+{
+    chip8_env_t *e;
+    int i, b;
+
+    if (count <= 0)
+    {
+        return NULL;
+    }
+    if (threads <= 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (int)online : 1;
+    }
+    if (threads > count)
+    {
+        threads = count;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL)
+    {
+        return NULL;
+    }
+    e->count = count;
+    e->threads = threads;
+    e->format = format;
+    e->obs_size = chip8_obs_size(format);
+    e->machines = malloc(count * sizeof(*e->machines));
+    e->queues = aligned_alloc(CACHE_LINE, threads * sizeof(*e->queues));
+    e->workers = calloc(threads, sizeof(*e->workers));
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->start, NULL);
+    pthread_cond_init(&e->done, NULL);
+#ifdef CHIP8_ROM_CACHE
+    e->roms = chip8_rom_cache_create();
+    if (e->roms == NULL)
+    {
+        chip8_env_destroy(e);
+        return NULL;
+    }
+#endif
+    if (e->machines == NULL || e->queues == NULL || e->workers == NULL)
+    {
+        chip8_env_destroy(e);
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        chip8_init(&e->machines[i]);
+    }
+    for (i = 0; i < threads; i++)
+    {
+        atomic_init(&e->queues[i].range, 0);
+    }
+    for (b = 0; b < 256; b++)
+    {
+        for (i = 0; i < 8; i++)
+        {
+            e->spread[b][i] = (b >> (7 - i)) & 1 ? 255 : 0;
+        }
+    }
+
+    for (i = 1; i < threads; i++)
+    {
+        env_worker_t *w = &e->workers[i - 1];
+        w->env = e;
+        w->id = i;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+        {
+            chip8_env_destroy(e);
+            return NULL;
+        }
+        e->started++;
+    }
+    return e;
+}
+
+void chip8_env_destroy(chip8_env_t *e)
+{
+    int i;
+
+    if (e == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&e->lock);
+    e->stopping = true;
+    pthread_cond_broadcast(&e->start);
+    pthread_mutex_unlock(&e->lock);
+    for (i = 0; i < e->started; i++)
+    {
+        pthread_join(e->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&e->done);
+    pthread_cond_destroy(&e->start);
+    pthread_mutex_destroy(&e->lock);
+    free(e->workers);
+    free(e->queues);
+    free(e->machines);
+#ifdef CHIP8_ROM_CACHE
+    chip8_rom_cache_destroy(e->roms);
+#endif
+    free(e);
+}
+
+int chip8_env_count(const chip8_env_t *e)
+{
+    return e->count;
+}
+
+int chip8_env_threads(const chip8_env_t *e)
+{
+    return e->threads;
+}
+
+chip8_t *chip8_env_machine(chip8_env_t *e, int i)
+{
+    return &e->machines[i];
+}
+
+bool chip8_env_load_rom(chip8_env_t *e, const uint8_t *rom, size_t size)
+{
+    int i;
+
+    if (size > sizeof(e->rom))
+    {
+        return false;
+    }
+#ifdef CHIP8_ROM_CACHE
+    // The machines share one read-only copy of the program.
+    e->program = chip8_rom_cache_add(e->roms, rom, size);
+    if (e->program == NULL)
+    {
+        return false;
+    }
+#endif
+    memcpy(e->rom, rom, size);
+    e->rom_size = size;
+    for (i = 0; i < e->count; i++)
+    {
+#ifdef CHIP8_ROM_CACHE
+        chip8_rom_load(&e->machines[i], e->program);
+#else
+        chip8_load_rom(&e->machines[i], rom, size);
+#endif
+    }
+    return true;
+}
+
+void chip8_env_reset(chip8_env_t *e, int i, uint64_t seed)
+{
+    chip8_t *c = &e->machines[i];
+    uint32_t ips = c->ips;
+    chip8_quirks_t quirks = (chip8_quirks_t)c->quirks;
+
+#ifdef CHIP8_ROM_CACHE
+    if (e->program != NULL)
+    {
+        chip8_rom_init(c, e->program); // No memory to clear or copy.
+    }
+    else
+#endif
+    {
+        chip8_init(c);
+        chip8_load_rom(c, e->rom, e->rom_size);
+    }
+    chip8_set_clock(c, ips);
+    c->quirks = quirks;
+    chip8_seed(c, seed);
+}
+
+// Machines among the first n that have trapped.
+static int count_trapped(const chip8_env_t *e, int n)
+{
+    int trapped = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        trapped += e->machines[i].state == CHIP8_STATE_TRAPPED;
+    }
+    return trapped;
+}
+
+int chip8_env_step(chip8_env_t *envs, int n, const uint16_t *actions,
+                   int frames_to_run, uint8_t *obs)
+{
+    chip8_env_t *e = envs;
+    int workers = n < e->threads ? n : e->threads;
+    int w;
+
+    if (n < 0 || n > e->count)
+    {
+        return -1;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+    e->actions = actions;
+    e->frames = frames_to_run;
+    e->obs = obs;
+
+    // Contiguous shares, so each worker starts on neighbouring machines.
+    for (w = 0; w < e->threads; w++)
+    {
+        int begin = w < workers ? (int)((int64_t)n * w / workers) : n;
+        int end = w < workers ? (int)((int64_t)n * (w + 1) / workers) : n;
+        atomic_store_explicit(&e->queues[w].range, RANGE(begin, end),
+                              memory_order_relaxed);
+    }
+
+    if (workers == 1)
+    {
+        work(e, 0);
+        return count_trapped(e, n);
+    }
+    pthread_mutex_lock(&e->lock);
+    e->generation++;
+    e->active = e->threads - 1;
+    pthread_cond_broadcast(&e->start);
+    pthread_mutex_unlock(&e->lock);
+
+    work(e, 0);
+
+    pthread_mutex_lock(&e->lock);
+    while (e->active > 0)
+    {
+        pthread_cond_wait(&e->done, &e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return count_trapped(e, n);
+}
@@ -0,0 +1,75 @@
+#ifndef CHIP8_ENV_H
+#define CHIP8_ENV_H
+
+#include "chip8.h"
+#include <stddef.h>
+
+// Batched stepping for reinforcement-learning agents, built when CMake is
+// configured with -DCHIP8_ENV=ON on a POSIX host. An environment set owns a
+// number of independent machines and a pool of worker threads. One call to
+// chip8_env_step hands every machine its action, runs it for a number of
+// 60Hz frames and writes its screen straight into the caller's observation
+// buffer, with the machines spread over the workers. Each worker starts on
+// its own contiguous share of the machines and, once that runs dry, steals
+// half of the largest share still left, so machines that run longer than
+// others (or a worker that is preempted) do not hold the whole step up.
+
+// How observations are laid out. Observation i of a step starts at byte
+// i * chip8_obs_size(format) of the buffer. They always show a 64x32 screen,
+// with a pixel lit when it is lit on any plane; at 128x64 each observed pixel
+// is lit when any of the four it covers is.
+typedef enum chip8_obs
+{
+    CHIP8_OBS_NONE,   // Nothing is written.
+    CHIP8_OBS_PACKED, // One bit per pixel, rows top to bottom, 8 bytes per
+                      // row, the most significant bit of each byte leftmost.
+    CHIP8_OBS_PIXELS, // One byte per pixel, 0 or 255, row-major.
+    CHIP8_OBS_HALF,   // 32x16 bytes, each the mean of a 2x2 block of pixels
+                      // scaled to 0-255, row-major.
+} chip8_obs_t;
+
+#define CHIP8_OBS_PACKED_SIZE (CHIP8_SCREEN_SIZE / 8)
+#define CHIP8_OBS_PIXELS_SIZE CHIP8_SCREEN_SIZE
+#define CHIP8_OBS_HALF_SIZE (CHIP8_SCREEN_SIZE / 4)
+
+typedef struct chip8_env chip8_env_t;
+
+// Bytes one observation in format takes.
+size_t chip8_obs_size(chip8_obs_t format);
+
+// Create count machines, each initialised with chip8_init, and threads
+// workers, the calling thread counting as one of them. threads <= 0 uses
+// one per online processor. Returns NULL when out of memory or when the
+// workers cannot be started.
+chip8_env_t *chip8_env_create(int count, int threads, chip8_obs_t format);
+void chip8_env_destroy(chip8_env_t *e);
+int chip8_env_count(const chip8_env_t *e);
+int chip8_env_threads(const chip8_env_t *e);
+
+// Machine i, for setting it up (clock, quirks, seed, state) and reading it
+// back between steps.
+chip8_t *chip8_env_machine(chip8_env_t *e, int i);
+
+// Load the same program into every machine and keep it for
+// chip8_env_reset. Returns false, changing nothing, when it does not fit.
+bool chip8_env_load_rom(chip8_env_t *e, const uint8_t *rom, size_t size);
+
+// Restart machine i on the program last loaded, keeping its clock and quirk
+// profile and reseeding it with seed.
+void chip8_env_reset(chip8_env_t *e, int i, uint64_t seed);
+
+// Advance machines 0 to n - 1 by frames_to_run frames each. Before running,
+// machine i holds down exactly the keys set in actions[i], bit k for key k;
+// actions may be NULL to release every key. A frame is the instructions up
+// to and including the next timer tick, as chip8_step counts them. When obs
+// is not NULL, the screen of every machine after its frames is written to
+// obs in the format chosen at creation. Returns once every machine is done,
+// with the number of them that have trapped: a machine that hits a bad
+// instruction stops on its own, with its trap in chip8_env_machine(e, i)->trap,
+// and idles until chip8_env_reset. Returns -1, running nothing, when n is
+// negative or more than the machines e has. Only one step may run on e at a
+// time.
+int chip8_env_step(chip8_env_t *envs, int n, const uint16_t *actions,
+                   int frames_to_run, uint8_t *obs);
+
+#endif
@@ -0,0 +1,597 @@
+// Declarations shared by the core's translation units. Nothing in here is
+// part of the public API in chip8.h.
+#ifndef CHIP8_INTERNAL_H
+#define CHIP8_INTERNAL_H
+
+#include "chip8.h"
+
+#define CHIP8_ADDRESS_MASK (CHIP8_MEMORY_SIZE - 1)
+#define FONTSET_ADDRESS 0x00
+#define FONTSET_BYTES_PER_CHAR 5
+#define HIRES_FONTSET_ADDRESS (FONTSET_ADDRESS + CHIP8_FONTSET_SIZE)
+#define HIRES_FONTSET_BYTES_PER_CHAR 10
+
+// Memory is shared with a cached ROM, and copied, in pages of this size.
+#define CHIP8_PAGE_SIZE 256
+#define CHIP8_PAGE_COUNT (CHIP8_MEMORY_SIZE / CHIP8_PAGE_SIZE)
+
+// What each quirk profile does differently, as bits. The interpreter is
+// compiled once per profile, with that profile's bits as a constant, so the
+// tests on these fold away instead of running with every instruction.
+#define CHIP8_QUIRK_VF_RESET 0x01     // 8xy1, 8xy2 and 8xy3 clear VF.
+#define CHIP8_QUIRK_MEMORY 0x02       // Fx55 and Fx65 leave I past the last
+                                      // register they touched.
+#define CHIP8_QUIRK_DISPLAY_WAIT 0x04 // Dxyn waits for the next timer tick.
+#define CHIP8_QUIRK_SHIFT 0x08        // 8xy6 and 8xyE shift Vx, not Vy.
+#define CHIP8_QUIRK_JUMP 0x10         // Bxnn jumps to xnn + Vx, not nnn + V0.
+#define CHIP8_QUIRK_WRAP 0x20         // Dxyn wraps sprites around the edges of
+                                      // the screen instead of clipping them.
+
+#define CHIP8_MODERN_QUIRKS (CHIP8_QUIRK_MEMORY | CHIP8_QUIRK_SHIFT)
+#define CHIP8_VIP_QUIRKS                                                       \
+    (CHIP8_QUIRK_VF_RESET | CHIP8_QUIRK_MEMORY | CHIP8_QUIRK_DISPLAY_WAIT)
+#define CHIP8_SCHIP_QUIRKS (CHIP8_QUIRK_SHIFT | CHIP8_QUIRK_JUMP)
+#define CHIP8_XOCHIP_QUIRKS (CHIP8_QUIRK_MEMORY | CHIP8_QUIRK_WRAP)
+
+// Quirk bits of c's profile, for the code that is not compiled per profile.
+static inline unsigned chip8_quirk_bits(const chip8_t *c)
+{
+    static const uint8_t bits[CHIP8_QUIRKS_COUNT] = {
+        [CHIP8_QUIRKS_MODERN] = CHIP8_MODERN_QUIRKS,
+        [CHIP8_QUIRKS_VIP] = CHIP8_VIP_QUIRKS,
+        [CHIP8_QUIRKS_SCHIP] = CHIP8_SCHIP_QUIRKS,
+        [CHIP8_QUIRKS_XOCHIP] = CHIP8_XOCHIP_QUIRKS,
+    };
+
+    return bits[c->quirks];
+}
+
+// 64-bit FNV-1a hash of size bytes of program, which both the ROM cache and
+// the quirk database key programs by.
+static inline uint64_t chip8_hash(const uint8_t *rom, size_t size)
+{
+    uint64_t h = 0xCBF29CE484222325u;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        h = (h ^ rom[i]) * 0x100000001B3u;
+    }
+    return h;
+}
+
+// Next random byte for Cxkk: the top byte of a xorshift64* step.
+static inline uint8_t chip8_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (uint8_t)((x * 0x2545F4914F6CDD1Du) >> 56);
+}
+
+// Every instruction handler except the cache-miss one, in chip8_insn_t.op
+// order. The list is expanded into the op enum, the handler table and the
+// dispatch tables of chip8_run.
+#define CHIP8_EXEC_OPS(X)                                                      \
+    X(UNKNOWN, unknown)                                                        \
+    X(NOP, nop)                                                                \
+    X(CLS, cls)                                                                \
+    X(RET, ret)                                                                \
+    X(JP, jp)                                                                  \
+    X(CALL, call)                                                              \
+    X(SE_VX_KK, se_vx_kk)                                                      \
+    X(SNE_VX_KK, sne_vx_kk)                                                    \
+    X(SE_VX_VY, se_vx_vy)                                                      \
+    X(LD_VX_KK, ld_vx_kk)                                                      \
+    X(ADD_VX_KK, add_vx_kk)                                                    \
+    X(LD_VX_VY, ld_vx_vy)                                                      \
+    X(OR, or)                                                                  \
+    X(AND, and)                                                                \
+    X(XOR, xor)                                                                \
+    X(ADD_VX_VY, add_vx_vy)                                                    \
+    X(SUB, sub)                                                                \
+    X(SHR, shr)                                                                \
+    X(SUBN, subn)                                                              \
+    X(SHL, shl)                                                                \
+    X(SNE_VX_VY, sne_vx_vy)                                                    \
+    X(LD_I, ld_i)                                                              \
+    X(JP_V0, jp_v0)                                                            \
+    X(RND, rnd)                                                                \
+    X(DRW, drw)                                                                \
+    X(SKP, skp)                                                                \
+    X(SKNP, sknp)                                                              \
+    X(LD_VX_DT, ld_vx_dt)                                                      \
+    X(LD_VX_K, ld_vx_k)                                                        \
+    X(LD_DT_VX, ld_dt_vx)                                                      \
+    X(LD_ST_VX, ld_st_vx)                                                      \
+    X(ADD_I_VX, add_i_vx)                                                      \
+    X(LD_F_VX, ld_f_vx)                                                        \
+    X(LD_B_VX, ld_b_vx)                                                        \
+    X(LD_MEM_VX, ld_mem_vx)                                                    \
+    X(LD_VX_MEM, ld_vx_mem)                                                    \
+    X(SCD, scd)                                                                \
+    X(SCU, scu)                                                                \
+    X(SCR, scr)                                                                \
+    X(SCL, scl)                                                                \
+    X(EXIT, exit)                                                              \
+    X(LOW, low)                                                                \
+    X(HIGH, high)                                                              \
+    X(SAVE_RANGE, save_range)                                                  \
+    X(LOAD_RANGE, load_range)                                                  \
+    X(PLANE, plane)                                                            \
+    X(LD_HF_VX, ld_hf_vx)                                                      \
+    X(LD_R_VX, ld_r_vx)                                                        \
+    X(LD_VX_R, ld_vx_r)
+
+// DECODE must stay first so that a zeroed cache entry means "not decoded yet".
+#define CHIP8_OPS(X) X(DECODE, decode) CHIP8_EXEC_OPS(X)
+
+#define OP_ENUM(name, fn) OP_##name,
+enum chip8_op
+{
+    CHIP8_OPS(OP_ENUM) OP_COUNT
+};
+#undef OP_ENUM
+
+// Decode the instruction at addr into its decode cache entry and return it.
+chip8_insn_t *chip8_decode(chip8_t *c, uint16_t addr);
+
+// Forget the decoded instructions overlapping memory[addr, addr + len). The
+// instruction starting one byte before addr is included because its low byte
+// lives at addr.
+void chip8_invalidate(chip8_t *c, uint16_t addr, int len);
+
+// Everything chip8_init does except clearing memory and loading the font,
+// and detaching the JIT, profile, trace and shared-memory export, which it
+// leaves alone. Only the current mode's words of the frame buffer are
+// cleared, since the ones past them are already zero.
+void chip8_reset(chip8_t *c);
+
+#ifdef CHIP8_ROM_CACHE
+#include "chip8_rom.h"
+
+// A cached program, read-only once built and shared by every machine loaded
+// from it.
+struct chip8_rom
+{
+    uint8_t image[CHIP8_MEMORY_SIZE];     // Memory right after loading: the
+                                          // font, the program and zeros.
+    chip8_insn_t code[CHIP8_MEMORY_SIZE]; // image decoded at every address.
+    uint64_t hash;
+    size_t size;                          // Bytes of program.
+    uint8_t quirks;                       // Profile chip8_quirks_for picked.
+};
+
+// Give c its own copy of the shared pages overlapping memory[addr, addr +
+// len), before they are written.
+void chip8_own(chip8_t *c, uint16_t addr, int len);
+
+// Memory page page of c, wherever it currently lives.
+static inline const uint8_t *chip8_page(const chip8_t *c, int page)
+{
+    return (c->shared_pages >> page & 1 ? c->rom->image : c->memory) +
+           page * CHIP8_PAGE_SIZE;
+}
+
+static inline bool chip8_page_shared(const chip8_t *c, int page)
+{
+    return c->shared_pages >> page & 1;
+}
+
+static inline uint8_t chip8_peek(const chip8_t *c, uint16_t addr)
+{
+    addr &= CHIP8_ADDRESS_MASK;
+    return chip8_page(c, addr / CHIP8_PAGE_SIZE)[addr % CHIP8_PAGE_SIZE];
+}
+
+#define CHIP8_OWN(c, addr, len)                                                \
+    do                                                                         \
+    {                                                                          \
+        if ((c)->shared_pages != 0)                                            \
+        {                                                                      \
+            chip8_own((c), (addr), (len));                                     \
+        }                                                                      \
+    } while (0)
+#else
+static inline const uint8_t *chip8_page(const chip8_t *c, int page)
+{
+    return c->memory + page * CHIP8_PAGE_SIZE;
+}
+
+static inline bool chip8_page_shared(const chip8_t *c, int page)
+{
+    (void)c;
+    (void)page;
+    return false;
+}
+
+static inline uint8_t chip8_peek(const chip8_t *c, uint16_t addr)
+{
+    return c->memory[addr & CHIP8_ADDRESS_MASK];
+}
+
+#define CHIP8_OWN(c, addr, len) ((void)0)
+#endif
+
+// Lay out the sprite Dxyn draws on one plane from memory at addr: the bits
+// of sprite row i go into rows[i * words + k] for each of the words of a
+// screen row, ready to be XORed onto the frame buffer from the row stored in
+// *top. n == 0 is a 16x16 sprite of two bytes per row. Returns the rows that
+// are drawn, fewer than the sprite has when it is clipped at the bottom
+// edge; when wrap is set nothing is clipped, and rows that go past the bottom
+// continue at the top.
+static inline int chip8_sprite_rows(const chip8_t *c, uint16_t addr,
+                                    uint8_t vx, uint8_t vy, uint8_t n,
+                                    bool wrap, int *top, uint64_t *rows)
+{
+    int words = chip8_row_words(c);
+    int height = chip8_screen_height(c);
+    int x = vx & (chip8_screen_width(c) - 1); // Both sizes are powers of 2.
+    int y = vy & (height - 1);
+    int first = x / 64;
+    int shift = x % 64;
+    int count = n == 0 ? 16 : n;
+    // The bits shifted out of the first word land in the other one of a
+    // 128-pixel row, unless that means wrapping to the left edge without
+    // wrap set; a 64-pixel row only takes them back when wrapping.
+    uint64_t keep = shift != 0 && (words == 1 ? wrap : first == 0 || wrap)
+                        ? UINT64_MAX
+                        : 0;
+    uint64_t bits;
+    int i;
+
+    if (!wrap && count > height - y)
+    {
+        count = height - y; // Clip at the bottom edge.
+    }
+    if (n != 0 && words == 1) // The plain CHIP-8 case on its own.
+    {
+        for (i = 0; i < count; i++)
+        {
+            bits = (uint64_t)chip8_peek(c, addr + i) << 56;
+            rows[i] = bits >> shift | (bits << (63 - shift) << 1 & keep);
+        }
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            bits = n == 0 ? (uint64_t)(chip8_peek(c, addr + 2 * i) << 8 |
+                                       chip8_peek(c, addr + 2 * i + 1))
+                                << 48
+                          : (uint64_t)chip8_peek(c, addr + i) << 56;
+            if (words == 1)
+            {
+                rows[i] = bits >> shift | (bits << (63 - shift) << 1 & keep);
+            }
+            else
+            {
+                rows[2 * i + first] = bits >> shift;
+                rows[2 * i + (first ^ 1)] = bits << (63 - shift) << 1 & keep;
+            }
+        }
+    }
+    *top = y;
+    return count;
+}
+
+#ifdef CHIP8_PROFILE
+#include "chip8_profile.h"
+
+// Subroutine entries the profile tracks, indexed by SP masked with
+// CHIP8_PROFILE_DEPTH_MASK. SP runs up to CHIP8_STACK_SIZE and a call records
+// its entry at SP + 1, so this is the power of two above both.
+#define CHIP8_PROFILE_DEPTHS (2 * CHIP8_STACK_SIZE)
+#define CHIP8_PROFILE_DEPTH_MASK (CHIP8_PROFILE_DEPTHS - 1)
+
+struct chip8_profile
+{
+    uint64_t kinds[OP_COUNT];
+    uint64_t pcs[CHIP8_MEMORY_SIZE];
+    uint8_t ops[CHIP8_MEMORY_SIZE];     // Handler last run at each address.
+    uint16_t subs[CHIP8_MEMORY_SIZE];   // Subroutine each address last ran in.
+    uint16_t callers[CHIP8_MEMORY_SIZE]; // Subroutine that last called each
+                                         // subroutine entry, or UINT16_MAX.
+    uint16_t entries[CHIP8_PROFILE_DEPTHS]; // Entry of the subroutine running
+                                            // at each SP.
+    chip8_profile_stats_t stats;
+};
+
+// Count e, about to run at PC. Resolves a not yet decoded entry first so that
+// it is counted as what it is.
+static inline void chip8_profile_insn(chip8_t *c, const chip8_insn_t *e)
+{
+    struct chip8_profile *p = c->profile;
+    uint16_t pc = c->PC & CHIP8_ADDRESS_MASK;
+    uint16_t sub;
+
+    if (p == NULL)
+    {
+        return;
+    }
+    if (e->op == OP_DECODE)
+    {
+        e = chip8_decode(c, pc);
+    }
+    sub = p->entries[c->SP & CHIP8_PROFILE_DEPTH_MASK];
+    p->kinds[e->op]++;
+    p->pcs[pc]++;
+    p->ops[pc] = e->op;
+    p->subs[pc] = sub;
+    if (e->op == OP_CALL)
+    {
+        p->entries[(c->SP + 1) & CHIP8_PROFILE_DEPTH_MASK] = e->nnn;
+        p->callers[e->nnn] = sub;
+    }
+}
+
+// Count a Dxyn of n rows at (vx, vy), before it is drawn.
+void chip8_profile_draw(chip8_t *c, uint8_t vx, uint8_t vy, uint8_t n);
+
+#define CHIP8_PROFILING(c) ((c)->profile != NULL)
+#define CHIP8_PROFILE_INSN(c, e) chip8_profile_insn((c), (e))
+#else
+#define CHIP8_PROFILING(c) false
+#define CHIP8_PROFILE_INSN(c, e) ((void)0)
+#endif
+
+#ifdef CHIP8_TRACE
+#include "chip8_trace.h"
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Instruction record flags. A record is its flag byte followed, in this
+// order, by whichever of the fields the flags announce.
+#define CHIP8_TRACE_PC 0x01 // Zigzag varint, PC less the address after the
+                            // previous instruction.
+#define CHIP8_TRACE_OP 0x02 // Big-endian opcode, when it differs from the one
+                            // last recorded at PC.
+#define CHIP8_TRACE_V 0x04  // Varint mask of changed registers, VF in bit 0
+                            // and Vn in bit n + 1, then their values in
+                            // register order.
+#define CHIP8_TRACE_I 0x08  // Zigzag varint, change in I.
+#define CHIP8_TRACE_SP 0x10 // New SP.
+
+// Longest instruction record: flags, 3 + 2 + 3 + 16 + 3 + 1 bytes.
+#define CHIP8_TRACE_RECORD_MAX 32
+
+struct chip8_trace
+{
+    uint8_t *out;           // Next free byte of the block being filled.
+    uint8_t *end;           // Room for one more record while out <= end.
+    uint64_t insns;         // Instructions recorded.
+    uint64_t next_keyframe; // insns at which the next keyframe is due.
+    uint16_t pc;            // Address after the previous instruction.
+    uint16_t prev;          // Opcode of the previous instruction.
+    bool all;               // Registers other than the ones prev writes may
+                            // have changed.
+    uint16_t I;             // I, SP and V as the previous instruction saw
+    uint8_t SP;             // them.
+    uint8_t V[CHIP8_REGISTER_COUNT];
+    uint16_t ops[CHIP8_MEMORY_SIZE]; // Opcode last recorded at each address
+                                     // since the last keyframe, 0 if none.
+    struct chip8_trace_writer *writer;
+};
+
+// Hand the full block to the writer, or write the keyframe that is due.
+void chip8_trace_flush(chip8_t *c);
+
+// Non-instruction records, see chip8_trace.c.
+enum chip8_trace_event
+{
+    CHIP8_TRACE_TICK = 0x80,
+    CHIP8_TRACE_KEY,
+    CHIP8_TRACE_STATE,
+    CHIP8_TRACE_KEYFRAME,
+    CHIP8_TRACE_END = 0xFF,
+};
+
+void chip8_trace_event(chip8_t *c, int event, uint8_t arg);
+
+static inline uint8_t *chip8_trace_varint(uint8_t *o, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        *o++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *o++ = (uint8_t)v;
+    return o;
+}
+
+static inline uint32_t chip8_trace_zigzag(uint16_t delta)
+{
+    int16_t d = (int16_t)delta;
+
+    return (uint16_t)((uint16_t)d << 1) ^ (uint16_t)(d >> 15);
+}
+
+// Bit i is set when a[i] != b[i], over 16 bytes.
+static inline uint32_t chip8_trace_changed(const uint8_t *a, const uint8_t *b)
+{
+#if defined(__SSE2__)
+    __m128i x = _mm_loadu_si128((const __m128i *)a);
+    __m128i y = _mm_loadu_si128((const __m128i *)b);
+
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+#else
+    uint64_t x[2], y[2];
+    uint32_t changed = 0;
+    int i;
+
+    memcpy(x, a, sizeof(x));
+    memcpy(y, b, sizeof(y));
+    if (x[0] == y[0] && x[1] == y[1])
+    {
+        return 0; // Most instructions change nothing or one register.
+    }
+    for (i = 0; i < 16; i++)
+    {
+        changed |= (uint32_t)(a[i] != b[i]) << i;
+    }
+    return changed;
+#endif
+}
+
+static inline int chip8_trace_ctz(uint32_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(v);
+#else
+    int n = 0;
+
+    for (; (v & 1) == 0; v >>= 1)
+    {
+        n++;
+    }
+    return n;
+#endif
+}
+
+// Flush whatever is due, then return how many of the next cycles
+// instructions, at least one, can be recorded before the block fills or the
+// next keyframe is due. Callers check this once per slice of instructions
+// rather than once per instruction.
+static inline int chip8_trace_room(chip8_t *c, int cycles)
+{
+    struct chip8_trace *t = c->trace;
+    uint64_t room;
+
+    if (t->out > t->end || t->insns == t->next_keyframe)
+    {
+        chip8_trace_flush(c);
+    }
+    room = (uint64_t)(t->end - t->out) / CHIP8_TRACE_RECORD_MAX + 1;
+    if (room > t->next_keyframe - t->insns)
+    {
+        room = t->next_keyframe - t->insns;
+    }
+    return room < (uint64_t)cycles ? (int)room : cycles;
+}
+
+// Record the instruction e about to run at PC, which chip8_trace_room has
+// made room for. The opcode comes from e unless the decode cache has not
+// filled it yet. Only Fx65, Fx85 and 5xy3 write registers other than Vx and
+// VF, so after anything but those only the two are compared.
+static inline void chip8_trace_insn(chip8_t *c, const chip8_insn_t *e)
+{
+    struct chip8_trace *t = c->trace;
+    uint16_t pc = c->PC & CHIP8_ADDRESS_MASK;
+    uint16_t opcode;
+    uint32_t changed, m;
+    uint8_t flags = 0;
+    uint8_t *o;
+    int x;
+
+    if (t == NULL)
+    {
+        return;
+    }
+
+    // Flags are stored last, since every byte store may alias t and c.
+    o = t->out + 1;
+    if (pc != t->pc)
+    {
+        flags |= CHIP8_TRACE_PC;
+        o = chip8_trace_varint(o, chip8_trace_zigzag(pc - t->pc));
+    }
+    opcode = e->op != OP_DECODE ? e->opcode
+                                : chip8_peek(c, pc) << 8 | chip8_peek(c, pc + 1);
+    if (opcode != t->ops[pc])
+    {
+        flags |= CHIP8_TRACE_OP;
+        t->ops[pc] = opcode;
+        o[0] = opcode >> 8;
+        o[1] = opcode & 0xFF;
+        o += 2;
+    }
+    if (t->all || (t->prev & 0xF0FF) == 0xF065 ||
+        (t->prev & 0xF0FF) == 0xF085 || (t->prev & 0xF00F) == 0x5003)
+    {
+        changed = chip8_trace_changed(c->V, t->V);
+        t->all = false;
+    }
+    else
+    {
+        x = t->prev >> 8 & 0xF;
+        changed = (uint32_t)(c->V[x] != t->V[x]) << x |
+                  (uint32_t)(c->V[0xF] != t->V[0xF]) << 0xF;
+    }
+    t->prev = opcode;
+    if (changed != 0)
+    {
+        flags |= CHIP8_TRACE_V;
+        o = chip8_trace_varint(o, (changed << 1 | changed >> 15) & 0xFFFF);
+        for (m = changed; m != 0; m &= m - 1)
+        {
+            x = chip8_trace_ctz(m);
+            t->V[x] = c->V[x];
+            *o++ = t->V[x];
+        }
+    }
+    if (c->I != t->I)
+    {
+        flags |= CHIP8_TRACE_I;
+        o = chip8_trace_varint(o, chip8_trace_zigzag(c->I - t->I));
+        t->I = c->I;
+    }
+    if (c->SP != t->SP)
+    {
+        flags |= CHIP8_TRACE_SP;
+        t->SP = c->SP;
+        *o++ = t->SP;
+    }
+    *t->out = flags;
+    t->out = o;
+    t->pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+    t->insns++;
+}
+
+#define CHIP8_TRACING(c) ((c)->trace != NULL)
+#define CHIP8_TRACE_ROOM(c, cycles) chip8_trace_room((c), (cycles))
+#define CHIP8_TRACE_INSN(c, e) chip8_trace_insn((c), (e))
+#define CHIP8_TRACE_EVENT(c, event, arg)                                       \
+    do                                                                         \
+    {                                                                          \
+        if ((c)->trace != NULL)                                                \
+        {                                                                      \
+            chip8_trace_event((c), (event), (arg));                            \
+        }                                                                      \
+    } while (0)
+#else
+#define CHIP8_TRACING(c) false
+#define CHIP8_TRACE_ROOM(c, cycles) (cycles)
+#define CHIP8_TRACE_INSN(c, e) ((void)0)
+#define CHIP8_TRACE_EVENT(c, event, arg) ((void)0)
+#endif
+
+#ifdef CHIP8_SHM
+// Publish c to its slot and apply the keys posted to it. Called at every
+// timer tick of an exported machine.
+void chip8_shm_sync(chip8_t *c);
+
+#define CHIP8_SHM_TICK(c)                                                      \
+    do                                                                         \
+    {                                                                          \
+        if ((c)->shm != NULL)                                                  \
+        {                                                                      \
+            chip8_shm_sync(c);                                                 \
+        }                                                                      \
+    } while (0)
+#else
+#define CHIP8_SHM_TICK(c) ((void)0)
+#endif
+
+#ifdef CHIP8_JIT
+// Run up to cycles instructions, using translated blocks where possible.
+int chip8_jit_run(chip8_t *c, int cycles);
+// Drop translated code overlapping memory[addr, addr + len).
+void chip8_jit_invalidate(chip8_t *c, uint16_t addr, int len);
+#endif
+
+#endif
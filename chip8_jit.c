@@ -0,0 +1,434 @@
+#include "chip8_jit.h"
+#include "chip8_internal.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// Native code for all translated blocks lives in one mapping. When it fills
+// up the whole cache is flushed and blocks are retranslated on demand. The
+// mapping is never writable and executable at once: the pages a block is
+// emitted into are made writable for the emission and executable after it.
+#define CODE_CACHE_SIZE (256 * 1024)
+#define MAX_BLOCK_INSNS 64
+#define MAX_INSN_BYTES 48
+#define MAX_BLOCK_BYTES (MAX_BLOCK_INSNS * MAX_INSN_BYTES + 64)
+
+#define NOT_COMPILED 0        // entry[] value: address not looked at yet.
+#define NO_BLOCK UINT32_MAX   // entry[] value: first instruction untranslatable.
+
+// x86-64 register numbers used in ModRM reg fields.
+#define REG_AL 0
+#define REG_CL 1
+
+// A translated block. Called with the machine in rdi (System V ABI), it
+// returns the number of CHIP-8 instructions it executed.
+typedef int (*block_fn_t)(chip8_t *c);
+
+struct chip8_jit
+{
+    uint8_t *code; // Code cache.
+    size_t used;   // Bytes of code emitted so far.
+    size_t page;   // Host page size, the unit of protection changes.
+    uint32_t entry[CHIP8_MEMORY_SIZE]; // 1 + code offset of the block that
+                                       // starts at each address.
+    uint8_t length[CHIP8_MEMORY_SIZE];  // Instructions in that block.
+    uint8_t covered[CHIP8_MEMORY_SIZE]; // Non-zero for translated bytes.
+    uint8_t quirks; // Profile the cached code was translated for.
+    chip8_jit_stats_t stats;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void emit8(struct chip8_jit *j, uint8_t b)
+{
+    j->code[j->used++] = b;
+}
+
+static void emit16(struct chip8_jit *j, uint16_t v)
+{
+    emit8(j, v & 0xFF);
+    emit8(j, v >> 8);
+}
+
+static void emit32(struct chip8_jit *j, uint32_t v)
+{
+    emit16(j, v & 0xFFFF);
+    emit16(j, v >> 16);
+}
+
+// ModRM + disp32 addressing [rdi + disp] with the given reg field.
+static void emit_mem(struct chip8_jit *j, uint8_t reg, size_t disp)
+{
+    emit8(j, 0x80 | (reg << 3) | 7);
+    emit32(j, (uint32_t)disp);
+}
+
+// Offsets of the machine fields that translated code touches.
+#define OFF_V(r) (offsetof(chip8_t, V) + (r))
+#define OFF_VF OFF_V(0xF)
+#define OFF_I offsetof(chip8_t, I)
+#define OFF_PC offsetof(chip8_t, PC)
+#define OFF_OPCODE offsetof(chip8_t, opcode)
+
+static void mov_r8_mem(struct chip8_jit *j, uint8_t reg, size_t disp)
+{
+    emit8(j, 0x8A); // mov r8, [rdi + disp]
+    emit_mem(j, reg, disp);
+}
+
+static void mov_mem_r8(struct chip8_jit *j, size_t disp, uint8_t reg)
+{
+    emit8(j, 0x88); // mov [rdi + disp], r8
+    emit_mem(j, reg, disp);
+}
+
+static void alu_al_mem(struct chip8_jit *j, uint8_t op, size_t disp)
+{
+    emit8(j, op); // or/and/xor/add/sub/cmp al, [rdi + disp]
+    emit_mem(j, REG_AL, disp);
+}
+
+static void setcc_cl(struct chip8_jit *j, uint8_t cc)
+{
+    emit8(j, 0x0F); // setcc cl
+    emit8(j, cc);
+    emit8(j, 0xC1);
+}
+
+static void mov16_mem_imm(struct chip8_jit *j, size_t disp, uint16_t imm)
+{
+    emit8(j, 0x66); // mov word [rdi + disp], imm16
+    emit8(j, 0xC7);
+    emit_mem(j, 0, disp);
+    emit16(j, imm);
+}
+
+#define ALU_OR 0x0A
+#define ALU_AND 0x22
+#define ALU_XOR 0x32
+#define ALU_ADD 0x02
+#define ALU_SUB 0x2A
+
+#define CC_B 0x92  // setb / setc
+#define CC_AE 0x93 // setae / setnc
+
+// Vx = first <op> second, then VF = the carry flag as condition cc reads it.
+// VF is written after Vx so that with x = F it holds the flag, exactly like
+// the interpreter.
+static void emit_flag_alu(struct chip8_jit *j, const chip8_insn_t *e,
+                          uint8_t first, uint8_t second, uint8_t op,
+                          uint8_t cc)
+{
+    mov_r8_mem(j, REG_AL, OFF_V(first));
+    alu_al_mem(j, op, OFF_V(second));
+    setcc_cl(j, cc);
+    mov_mem_r8(j, OFF_V(e->x), REG_AL);
+    mov_mem_r8(j, OFF_VF, REG_CL);
+}
+
+// Vx = the source shifted by one (reg 5 = shr, 4 = shl), then VF = the bit
+// shifted out, which the shift leaves in the carry flag. The source is Vx
+// or, without the shift quirk, Vy.
+static void emit_shift(struct chip8_jit *j, const chip8_insn_t *e, uint8_t ext,
+                       unsigned q)
+{
+    uint8_t src = q & CHIP8_QUIRK_SHIFT ? e->x : e->y;
+
+    mov_r8_mem(j, REG_AL, OFF_V(src));
+    emit8(j, 0xD0); // shr/shl al, 1
+    emit8(j, 0xC0 | ext << 3);
+    setcc_cl(j, CC_B);
+    mov_mem_r8(j, OFF_V(e->x), REG_AL);
+    mov_mem_r8(j, OFF_VF, REG_CL);
+}
+
+// Emit native code for one instruction, with the quirk bits q of the machine
+// it is translated for. Returns false, without emitting anything, for
+// instructions that must end the block.
+static bool emit_insn(struct chip8_jit *j, const chip8_insn_t *e, unsigned q)
+{
+    switch (e->op)
+    {
+    case OP_LD_VX_KK:
+        emit8(j, 0xC6); // mov byte [Vx], kk
+        emit_mem(j, 0, OFF_V(e->x));
+        emit8(j, e->kk);
+        return true;
+    case OP_ADD_VX_KK:
+        emit8(j, 0x80); // add byte [Vx], kk
+        emit_mem(j, 0, OFF_V(e->x));
+        emit8(j, e->kk);
+        return true;
+    case OP_LD_VX_VY:
+        mov_r8_mem(j, REG_AL, OFF_V(e->y));
+        mov_mem_r8(j, OFF_V(e->x), REG_AL);
+        return true;
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+        mov_r8_mem(j, REG_AL, OFF_V(e->x));
+        alu_al_mem(j,
+                   e->op == OP_OR ? ALU_OR : e->op == OP_AND ? ALU_AND : ALU_XOR,
+                   OFF_V(e->y));
+        mov_mem_r8(j, OFF_V(e->x), REG_AL);
+        if (q & CHIP8_QUIRK_VF_RESET)
+        {
+            emit8(j, 0xC6); // mov byte [VF], 0
+            emit_mem(j, 0, OFF_VF);
+            emit8(j, 0);
+        }
+        return true;
+    case OP_ADD_VX_VY:
+        emit_flag_alu(j, e, e->x, e->y, ALU_ADD, CC_B);
+        return true;
+    case OP_SUB:
+        emit_flag_alu(j, e, e->x, e->y, ALU_SUB, CC_AE);
+        return true;
+    case OP_SUBN:
+        emit_flag_alu(j, e, e->y, e->x, ALU_SUB, CC_AE);
+        return true;
+    case OP_SHR:
+        emit_shift(j, e, 5, q);
+        return true;
+    case OP_SHL:
+        emit_shift(j, e, 4, q);
+        return true;
+    case OP_LD_I:
+        mov16_mem_imm(j, OFF_I, e->nnn);
+        return true;
+    case OP_ADD_I_VX:
+        emit8(j, 0x0F); // movzx eax, byte [Vx]
+        emit8(j, 0xB6);
+        emit_mem(j, REG_AL, OFF_V(e->x));
+        emit8(j, 0x66); // add word [I], ax
+        emit8(j, 0x01);
+        emit_mem(j, REG_AL, OFF_I);
+        return true;
+    case OP_LD_F_VX:
+        emit8(j, 0x0F); // movzx eax, byte [Vx]
+        emit8(j, 0xB6);
+        emit_mem(j, REG_AL, OFF_V(e->x));
+        emit8(j, 0x8D); // lea eax, [rax + rax * 4]
+        emit8(j, 0x04);
+        emit8(j, 0x80);
+        emit8(j, 0x66); // mov word [I], ax
+        emit8(j, 0x89);
+        emit_mem(j, REG_AL, OFF_I);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void flush(struct chip8_jit *j)
+{
+    j->used = 0;
+    memset(j->entry, 0, sizeof(j->entry));
+    memset(j->covered, 0, sizeof(j->covered));
+    j->stats.flushes++;
+}
+
+// Set the protection of the pages holding code bytes [from, to).
+static bool protect(struct chip8_jit *j, size_t from, size_t to, int prot)
+{
+    size_t start = from / j->page * j->page;
+    size_t end = (to + j->page - 1) / j->page * j->page;
+
+    return mprotect(j->code + start, end - start, prot) == 0;
+}
+
+// Translate the straight-line block starting at pc. Returns the new entry[]
+// value for pc. A block that cannot be made writable and then executable is
+// left to the interpreter.
+static uint32_t compile(struct chip8_jit *j, chip8_t *c, uint16_t pc)
+{
+    uint64_t start_ns = now_ns();
+    const chip8_insn_t *e;
+    uint16_t addr = pc;
+    uint16_t last_opcode = 0;
+    size_t start;
+    int count = 0;
+
+    if (j->used + MAX_BLOCK_BYTES > CODE_CACHE_SIZE)
+    {
+        flush(j);
+    }
+    start = j->used;
+    if (!protect(j, start, start + MAX_BLOCK_BYTES, PROT_READ | PROT_WRITE))
+    {
+        j->entry[pc] = NO_BLOCK;
+        return NO_BLOCK;
+    }
+
+    // Blocks never wrap around the end of memory, so the final PC is always
+    // pc + 2 * count exactly as the interpreter would compute it.
+    while (count < MAX_BLOCK_INSNS && addr + 1 < CHIP8_MEMORY_SIZE)
+    {
+        e = &c->decode_cache[addr];
+        if (e->op == OP_DECODE)
+        {
+            e = chip8_decode(c, addr);
+        }
+        if (!emit_insn(j, e, chip8_quirk_bits(c)))
+        {
+            break;
+        }
+        last_opcode = e->opcode;
+        count++;
+        addr += 2;
+    }
+
+    if (count > 0)
+    {
+        mov16_mem_imm(j, OFF_OPCODE, last_opcode);
+        mov16_mem_imm(j, OFF_PC, addr);
+        emit8(j, 0xB8); // mov eax, count
+        emit32(j, count);
+        emit8(j, 0xC3); // ret
+    }
+    if (!protect(j, start, start + MAX_BLOCK_BYTES, PROT_READ | PROT_EXEC))
+    {
+        j->used = start;
+        count = 0;
+    }
+
+    if (count == 0)
+    {
+        j->entry[pc] = NO_BLOCK;
+    }
+    else
+    {
+        memset(&j->covered[pc], 1, addr - pc);
+        j->entry[pc] = (uint32_t)start + 1;
+        j->length[pc] = count;
+        j->stats.blocks_compiled++;
+    }
+
+    j->stats.compile_ns += now_ns() - start_ns;
+    return j->entry[pc];
+}
+
+int chip8_jit_run(chip8_t *c, int cycles)
+{
+    struct chip8_jit *j = c->jit;
+    block_fn_t fn;
+    uint32_t entry;
+    bool compiled;
+    int left = cycles;
+
+    if (c->quirks != j->quirks)
+    {
+        flush(j); // Translated for another profile.
+        j->quirks = c->quirks;
+    }
+    while (left > 0)
+    {
+        if (c->PC < CHIP8_MEMORY_SIZE)
+        {
+            entry = j->entry[c->PC];
+            compiled = entry == NOT_COMPILED;
+            if (compiled)
+            {
+                entry = compile(j, c, c->PC);
+                j->stats.block_misses++;
+            }
+
+            // A block runs to completion, so only enter it when the whole
+            // block fits in what is left of the batch.
+            if (entry != NO_BLOCK && j->length[c->PC] <= left)
+            {
+                j->stats.block_hits += !compiled;
+                j->stats.native_insns += j->length[c->PC];
+                fn = (block_fn_t)(void *)(j->code + entry - 1);
+                left -= fn(c);
+                continue;
+            }
+        }
+
+        chip8_emulate_cycle(c);
+        j->stats.interp_insns++;
+        left--;
+        if (c->state != CHIP8_STATE_RUNNING)
+        {
+            break; // Fx0A is waiting for a key, or the machine trapped.
+        }
+    }
+
+    return cycles - left;
+}
+
+void chip8_jit_invalidate(chip8_t *c, uint16_t addr, int len)
+{
+    struct chip8_jit *j = c->jit;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (j->covered[(addr + i) & CHIP8_ADDRESS_MASK])
+        {
+            flush(j);
+            return;
+        }
+    }
+}
+
+bool chip8_jit_enable(chip8_t *c)
+{
+    struct chip8_jit *j;
+
+    if (c->jit != NULL)
+    {
+        return true;
+    }
+
+    j = calloc(1, sizeof(*j));
+    if (j == NULL)
+    {
+        return false;
+    }
+
+    j->page = (size_t)sysconf(_SC_PAGESIZE);
+    j->code = mmap(NULL, CODE_CACHE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED)
+    {
+        free(j);
+        return false;
+    }
+
+    c->jit = j;
+    return true;
+}
+
+void chip8_jit_disable(chip8_t *c)
+{
+    if (c->jit == NULL)
+    {
+        return;
+    }
+
+    munmap(c->jit->code, CODE_CACHE_SIZE);
+    free(c->jit);
+    c->jit = NULL;
+}
+
+void chip8_jit_get_stats(const chip8_t *c, chip8_jit_stats_t *stats)
+{
+    if (c->jit == NULL)
+    {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    *stats = c->jit->stats;
+    stats->code_bytes = c->jit->used;
+}
@@ -0,0 +1,31 @@
+#ifndef CHIP8_JIT_H
+#define CHIP8_JIT_H
+
+#include "chip8.h"
+#include <stddef.h>
+
+// Optional x86-64 backend for chip8_run, built when CMake is configured with
+// -DCHIP8_JIT=ON. Straight-line runs of register and index instructions are
+// translated into native code once per address; everything else, including
+// the instruction that ends each block, still goes through the interpreter.
+
+typedef struct chip8_jit_stats
+{
+    uint64_t blocks_compiled; // Blocks translated since the JIT was enabled.
+    uint64_t block_hits;      // Times a block translated before was entered.
+    uint64_t block_misses;    // Lookups that had to translate first.
+    uint64_t flushes;         // Code cache flushes caused by stores or loads.
+    uint64_t native_insns;    // Instructions executed as native code.
+    uint64_t interp_insns;    // Instructions executed by the interpreter.
+    uint64_t compile_ns;      // Total time spent translating.
+    size_t code_bytes;        // Bytes of native code currently cached.
+} chip8_jit_stats_t;
+
+// Attach a code cache to c. Returns false when the host cannot map executable
+// memory, in which case c keeps interpreting. chip8_init clears the
+// attachment, so call chip8_jit_disable before re-initialising c.
+bool chip8_jit_enable(chip8_t *c);
+void chip8_jit_disable(chip8_t *c);
+void chip8_jit_get_stats(const chip8_t *c, chip8_jit_stats_t *stats);
+
+#endif
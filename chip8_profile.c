@@ -0,0 +1,285 @@
+#include "chip8_profile.h"
+#include "chip8_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define KIND_NAME(name, fn) #fn,
+static const char *const kind_names[] = {CHIP8_EXEC_OPS(KIND_NAME)};
+#undef KIND_NAME
+
+#define KIND_COUNT ((int)(sizeof(kind_names) / sizeof(kind_names[0])))
+
+// Kind k is handler k + 1; handler 0 is the decode cache miss, which is never
+// counted as itself.
+#define KIND_OP(k) ((k) + 1)
+#define OP_KIND(op) ((op) - 1)
+
+// Subroutines deeper than the stack cannot be told apart, and a chain of
+// callers longer than this must be recursion.
+#define MAX_CHAIN (CHIP8_STACK_SIZE + 1)
+
+static int popcount64(uint64_t v)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(v);
+#else
+    int n = 0;
+
+    for (; v != 0; v &= v - 1)
+    {
+        n++;
+    }
+    return n;
+#endif
+}
+
+static void clear(struct chip8_profile *p)
+{
+    int i;
+
+    memset(p, 0, sizeof(*p));
+    memset(p->callers, 0xFF, sizeof(p->callers));
+    for (i = 0; i < CHIP8_PROFILE_DEPTHS; i++)
+    {
+        p->entries[i] = CHIP8_PROGRAM_START_ADDRESS;
+    }
+}
+
+bool chip8_profile_enable(chip8_t *c)
+{
+    struct chip8_profile *p;
+
+    if (c->profile != NULL)
+    {
+        return true;
+    }
+
+    p = malloc(sizeof(*p));
+    if (p == NULL)
+    {
+        return false;
+    }
+    clear(p);
+
+    c->profile = p;
+    return true;
+}
+
+void chip8_profile_disable(chip8_t *c)
+{
+    free(c->profile);
+    c->profile = NULL;
+}
+
+void chip8_profile_reset(chip8_t *c)
+{
+    if (c->profile != NULL)
+    {
+        clear(c->profile);
+    }
+}
+
+void chip8_profile_get_stats(const chip8_t *c, chip8_profile_stats_t *stats)
+{
+    int k;
+
+    if (c->profile == NULL)
+    {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    *stats = c->profile->stats;
+    stats->insns = 0;
+    for (k = 0; k < KIND_COUNT; k++)
+    {
+        stats->insns += c->profile->kinds[KIND_OP(k)];
+    }
+    stats->draws = c->profile->kinds[OP_DRW];
+    stats->clears = c->profile->kinds[OP_CLS];
+}
+
+int chip8_profile_kinds(void)
+{
+    return KIND_COUNT;
+}
+
+const char *chip8_profile_kind_name(int kind)
+{
+    return kind >= 0 && kind < KIND_COUNT ? kind_names[kind] : NULL;
+}
+
+uint64_t chip8_profile_kind_count(const chip8_t *c, int kind)
+{
+    if (c->profile == NULL || kind < 0 || kind >= KIND_COUNT)
+    {
+        return 0;
+    }
+    return c->profile->kinds[KIND_OP(kind)];
+}
+
+uint64_t chip8_profile_pc_count(const chip8_t *c, uint16_t addr)
+{
+    if (c->profile == NULL)
+    {
+        return 0;
+    }
+    return c->profile->pcs[addr & CHIP8_ADDRESS_MASK];
+}
+
+// Laid out the way draw_sprite in chip8.c does.
+void chip8_profile_draw(chip8_t *c, uint8_t vx, uint8_t vy, uint8_t n)
+{
+    struct chip8_profile *p = c->profile;
+    bool wrap = chip8_quirk_bits(c) & CHIP8_QUIRK_WRAP;
+    int words = chip8_row_words(c);
+    int height = chip8_screen_height(c);
+    uint16_t addr = c->I;
+    uint64_t rows[2 * 16];
+    int on = 0, off = 0;
+    int plane, top, count, i;
+
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        if (!(c->planes >> plane & 1))
+        {
+            continue;
+        }
+        count = chip8_sprite_rows(c, addr, vx, vy, n, wrap, &top, rows);
+        for (i = 0; i < count * words; i++)
+        {
+            int word = (top * words + i) % (height * words); // Wraps.
+            uint64_t old = c->frame_buffer[plane][word];
+
+            on += popcount64(rows[i] & ~old);
+            off += popcount64(rows[i] & old);
+        }
+        addr += n == 0 ? 32 : n;
+    }
+
+    p->stats.pixels_on += on;
+    p->stats.pixels_off += off;
+    p->stats.collisions += off != 0;
+}
+
+void chip8_profile_frame(chip8_t *c, uint64_t ns)
+{
+    chip8_profile_stats_t *s;
+
+    if (c->profile == NULL)
+    {
+        return;
+    }
+
+    s = &c->profile->stats;
+    if (s->frames == 0 || ns < s->frame_ns_min)
+    {
+        s->frame_ns_min = ns;
+    }
+    if (ns > s->frame_ns_max)
+    {
+        s->frame_ns_max = ns;
+    }
+    s->frames++;
+    s->frame_ns += ns;
+}
+
+bool chip8_profile_write_json(const chip8_t *c, FILE *f)
+{
+    const struct chip8_profile *p = c->profile;
+    chip8_profile_stats_t s;
+    const char *sep = "";
+    int k, pc;
+
+    if (p == NULL)
+    {
+        return false;
+    }
+    chip8_profile_get_stats(c, &s);
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"insns\": %llu,\n", (unsigned long long)s.insns);
+    fprintf(f, "  \"draws\": %llu,\n", (unsigned long long)s.draws);
+    fprintf(f, "  \"pixels_on\": %llu,\n", (unsigned long long)s.pixels_on);
+    fprintf(f, "  \"pixels_off\": %llu,\n", (unsigned long long)s.pixels_off);
+    fprintf(f, "  \"collisions\": %llu,\n", (unsigned long long)s.collisions);
+    fprintf(f, "  \"clears\": %llu,\n", (unsigned long long)s.clears);
+    fprintf(f,
+            "  \"frames\": {\"count\": %llu, \"mean_ns\": %.0f, "
+            "\"min_ns\": %llu, \"max_ns\": %llu},\n",
+            (unsigned long long)s.frames,
+            s.frames > 0 ? (double)s.frame_ns / s.frames : 0.0,
+            (unsigned long long)s.frame_ns_min,
+            (unsigned long long)s.frame_ns_max);
+
+    fprintf(f, "  \"kinds\": {");
+    for (k = 0; k < KIND_COUNT; k++)
+    {
+        if (p->kinds[KIND_OP(k)] != 0)
+        {
+            fprintf(f, "%s\"%s\": %llu", sep, kind_names[k],
+                    (unsigned long long)p->kinds[KIND_OP(k)]);
+            sep = ", ";
+        }
+    }
+    fprintf(f, "},\n");
+
+    fprintf(f, "  \"pcs\": [");
+    sep = "\n";
+    for (pc = 0; pc < CHIP8_MEMORY_SIZE; pc++)
+    {
+        if (p->pcs[pc] != 0)
+        {
+            fprintf(f,
+                    "%s    {\"addr\": \"%04x\", \"kind\": \"%s\", "
+                    "\"sub\": \"%04x\", \"count\": %llu}",
+                    sep, pc, kind_names[OP_KIND(p->ops[pc])], p->subs[pc],
+                    (unsigned long long)p->pcs[pc]);
+            sep = ",\n";
+        }
+    }
+    fprintf(f, "\n  ]\n}\n");
+
+    return ferror(f) == 0;
+}
+
+bool chip8_profile_write_folded(const chip8_t *c, FILE *f)
+{
+    const struct chip8_profile *p = c->profile;
+    uint16_t chain[MAX_CHAIN];
+    int depth, pc;
+
+    if (p == NULL)
+    {
+        return false;
+    }
+
+    for (pc = 0; pc < CHIP8_MEMORY_SIZE; pc++)
+    {
+        if (p->pcs[pc] == 0)
+        {
+            continue;
+        }
+
+        // Walk from the subroutine pc ran in back to the program entry.
+        chain[0] = p->subs[pc];
+        for (depth = 1; depth < MAX_CHAIN; depth++)
+        {
+            uint16_t caller = p->callers[chain[depth - 1] & CHIP8_ADDRESS_MASK];
+            if (chain[depth - 1] == CHIP8_PROGRAM_START_ADDRESS ||
+                caller == UINT16_MAX)
+            {
+                break;
+            }
+            chain[depth] = caller;
+        }
+        while (depth-- > 0)
+        {
+            fprintf(f, "sub_%04x;", chain[depth]);
+        }
+        fprintf(f, "%s@%04x %llu\n", kind_names[OP_KIND(p->ops[pc])], pc,
+                (unsigned long long)p->pcs[pc]);
+    }
+
+    return ferror(f) == 0;
+}
@@ -0,0 +1,57 @@
+#ifndef CHIP8_PROFILE_H
+#define CHIP8_PROFILE_H
+
+#include "chip8.h"
+#include <stdio.h>
+
+// Optional instrumentation, built when CMake is configured with
+// -DCHIP8_PROFILE=ON; without it none of the counting code exists. Once
+// enabled on a machine, every instruction the interpreter executes is
+// counted by kind and by address, along with the subroutine it ran in, and
+// every draw is counted with the pixels it turned on and off. Cycles that
+// chip8_step skips as idle are not executed and so not counted. While
+// profiling, chip8_run interprets even if a JIT is attached, so that no
+// instruction goes unseen.
+
+typedef struct chip8_profile_stats
+{
+    uint64_t insns;        // Instructions executed while profiling.
+    uint64_t draws;        // Dxyn executed.
+    uint64_t pixels_on;    // Pixels those draws turned on.
+    uint64_t pixels_off;   // Pixels those draws turned off.
+    uint64_t collisions;   // Draws that set VF.
+    uint64_t clears;       // 00E0 executed.
+    uint64_t frames;       // Host frames passed to chip8_profile_frame.
+    uint64_t frame_ns;     // Their total duration.
+    uint64_t frame_ns_min; // Shortest and longest of them.
+    uint64_t frame_ns_max;
+} chip8_profile_stats_t;
+
+// Attach zeroed counters to c. Returns false when out of memory. chip8_init
+// clears the attachment, so call chip8_profile_disable before re-initialising
+// c.
+bool chip8_profile_enable(chip8_t *c);
+void chip8_profile_disable(chip8_t *c);
+void chip8_profile_reset(chip8_t *c);
+void chip8_profile_get_stats(const chip8_t *c, chip8_profile_stats_t *stats);
+
+// Instruction kinds are the interpreter's handlers, named after them
+// ("ld_vx_kk", "drw", ...).
+int chip8_profile_kinds(void);
+const char *chip8_profile_kind_name(int kind);
+uint64_t chip8_profile_kind_count(const chip8_t *c, int kind);
+
+// Times the instruction at addr was executed.
+uint64_t chip8_profile_pc_count(const chip8_t *c, uint16_t addr);
+
+// Record one host frame that took ns nanoseconds.
+void chip8_profile_frame(chip8_t *c, uint64_t ns);
+
+// Write the counters as one JSON object, or as folded stacks for
+// flamegraph.pl: one "sub_0200;sub_02a0;drw@02a6 count" line per executed
+// address, the frames being the chain of subroutines that last called it.
+// Return false when c is not being profiled or on a write error.
+bool chip8_profile_write_json(const chip8_t *c, FILE *f);
+bool chip8_profile_write_folded(const chip8_t *c, FILE *f);
+
+#endif
@@ -0,0 +1,122 @@
+// Checks an execution trace written by chip8_trace_start against the current
+// core:
+//
+//     chip8-replay [-f instruction] [-s instruction] trace
+//
+// By default the whole trace is re-run on a fresh machine and the first
+// instruction where the machine disagrees with the trace is reported. -f
+// starts from the keyframe at or before the given instruction instead. -s
+// only prints the machine as the trace recorded it at one instruction.
+// Exits with 0 when the run matches, 1 when it diverges and 2 on errors.
+#include "chip8.h"
+#include "chip8_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static chip8_t machine;
+
+static void print_point(const char *label, const chip8_trace_point_t *p)
+{
+    int i;
+
+    printf("%-8s #%llu PC=%03X opcode=%04X I=%03X SP=%u V=", label,
+           (unsigned long long)p->index, p->PC, p->opcode, p->I, p->SP);
+    for (i = 0; i < CHIP8_REGISTER_COUNT; i++)
+    {
+        printf("%s%02X", i == 0 ? "" : " ", p->V[i]);
+    }
+    printf("\n");
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-f instruction] [-s instruction] trace\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    uint64_t from = 0, seek = 0;
+    bool seeking = false;
+    chip8_replay_t *r;
+    chip8_trace_point_t expected, actual;
+    int status = 0;
+    int a;
+
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-f") == 0 && a + 1 < argc)
+        {
+            from = strtoull(argv[++a], NULL, 10);
+        }
+        else if (strcmp(argv[a], "-s") == 0 && a + 1 < argc)
+        {
+            seek = strtoull(argv[++a], NULL, 10);
+            seeking = true;
+        }
+        else if (argv[a][0] != '-' && path == NULL)
+        {
+            path = argv[a];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (path == NULL)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    r = chip8_replay_open(path);
+    if (r == NULL)
+    {
+        fprintf(stderr, "%s: not a trace\n", path);
+        return 2;
+    }
+    printf("%s: %llu instructions, %zu keyframes\n", path,
+           (unsigned long long)chip8_replay_insns(r),
+           chip8_replay_keyframes(r));
+
+    if (seeking)
+    {
+        if (chip8_replay_seek(r, seek, &expected))
+        {
+            print_point("trace", &expected);
+        }
+        else
+        {
+            fprintf(stderr, "No instruction %llu\n", (unsigned long long)seek);
+            status = 2;
+        }
+        chip8_replay_close(r);
+        return status;
+    }
+
+    chip8_init(&machine);
+    switch (chip8_replay_verify(r, &machine, from, &expected, &actual))
+    {
+    case CHIP8_REPLAY_MATCH:
+        printf("match\n");
+        break;
+    case CHIP8_REPLAY_DIVERGED:
+        printf("diverged at instruction %llu\n",
+               (unsigned long long)expected.index);
+        print_point("trace", &expected);
+        print_point("live", &actual);
+        status = 1;
+        break;
+    case CHIP8_REPLAY_CORRUPT:
+        printf("trace is truncated or corrupt\n");
+        status = 1;
+        break;
+    }
+    chip8_replay_close(r);
+
+    return status;
+}
@@ -0,0 +1,307 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_rom.h"
+#include "chip8_internal.h"
+#ifdef CHIP8_JIT
+#include "chip8_jit.h"
+#endif
+#ifdef CHIP8_PROFILE
+#include "chip8_profile.h"
+#endif
+#ifdef CHIP8_SHM
+#include "chip8_shm.h"
+#endif
+#ifdef CHIP8_TRACE
+#include "chip8_trace.h"
+#endif
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BUCKETS 64 // Hash chains. Few programs are ever cached at once.
+
+#define ALL_PAGES ((uint16_t)((1u << CHIP8_PAGE_COUNT) - 1))
+
+// One cached program. The ROM lives in page-aligned memory of its own that
+// is made read-only once built; what the cache keeps track of changes
+// later, so it lives here.
+typedef struct entry
+{
+    struct chip8_rom *rom;
+    size_t rom_bytes;   // Bytes allocated for rom, whole pages.
+    struct entry *next; // Next entry in the same bucket.
+
+    // File the program was last opened from, to recognise it without
+    // reading it again.
+    bool opened;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} entry_t;
+
+struct chip8_rom_cache
+{
+    entry_t *buckets[BUCKETS];
+    int count;
+};
+
+chip8_rom_cache_t *chip8_rom_cache_create(void)
+{
+    return calloc(1, sizeof(chip8_rom_cache_t));
+}
+
+void chip8_rom_cache_destroy(chip8_rom_cache_t *cache)
+{
+    entry_t *e, *next;
+    int b;
+
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (b = 0; b < BUCKETS; b++)
+    {
+        for (e = cache->buckets[b]; e != NULL; e = next)
+        {
+            next = e->next;
+            mprotect(e->rom, e->rom_bytes, PROT_READ | PROT_WRITE);
+            free(e->rom);
+            free(e);
+        }
+    }
+    free(cache);
+}
+
+int chip8_rom_cache_count(const chip8_rom_cache_t *cache)
+{
+    return cache->count;
+}
+
+// Build the shared image of a program on a scratch machine, so that memory
+// and decoded instructions come out exactly as chip8_load_rom leaves them.
+static entry_t *build(const uint8_t *rom, size_t size, uint64_t hash)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    entry_t *e = calloc(1, sizeof(*e));
+    chip8_t *scratch = malloc(sizeof(*scratch));
+    void *mem = NULL;
+    int addr;
+
+    if (page <= 0)
+    {
+        page = 4096;
+    }
+    if (e == NULL || scratch == NULL)
+    {
+        free(e);
+        free(scratch);
+        return NULL;
+    }
+    e->rom_bytes = (sizeof(struct chip8_rom) + page - 1) / page * page;
+    if (posix_memalign(&mem, (size_t)page, e->rom_bytes) != 0)
+    {
+        free(e);
+        free(scratch);
+        return NULL;
+    }
+    e->rom = mem;
+
+    chip8_init(scratch);
+    chip8_load_rom(scratch, rom, size);
+    memcpy(e->rom->image, scratch->memory, sizeof(e->rom->image));
+    for (addr = 0; addr < CHIP8_MEMORY_SIZE; addr++)
+    {
+        e->rom->code[addr] = *chip8_decode(scratch, addr);
+    }
+    e->rom->hash = hash;
+    e->rom->size = size;
+    e->rom->quirks = scratch->quirks;
+    free(scratch);
+
+    // Machines only ever read it from now on; make sure of that.
+    mprotect(e->rom, e->rom_bytes, PROT_READ);
+    return e;
+}
+
+static entry_t *add(chip8_rom_cache_t *cache, const uint8_t *rom,
+                    size_t size)
+{
+    uint64_t hash;
+    entry_t *e;
+
+    if (size > MAX_GAME_SIZE)
+    {
+        return NULL;
+    }
+    hash = chip8_hash(rom, size);
+    for (e = cache->buckets[hash % BUCKETS]; e != NULL; e = e->next)
+    {
+        const uint8_t *program = &e->rom->image[CHIP8_PROGRAM_START_ADDRESS];
+
+        if (e->rom->hash == hash && e->rom->size == size &&
+            memcmp(program, rom, size) == 0)
+        {
+            return e;
+        }
+    }
+    e = build(rom, size, hash);
+    if (e == NULL)
+    {
+        return NULL;
+    }
+    e->next = cache->buckets[hash % BUCKETS];
+    cache->buckets[hash % BUCKETS] = e;
+    cache->count++;
+    return e;
+}
+
+const chip8_rom_t *chip8_rom_cache_add(chip8_rom_cache_t *cache,
+                                       const uint8_t *rom, size_t size)
+{
+    entry_t *e = add(cache, rom, size);
+
+    return e != NULL ? e->rom : NULL;
+}
+
+static bool same_file(const entry_t *e, const struct stat *st)
+{
+    return e->opened && e->dev == st->st_dev && e->ino == st->st_ino &&
+           e->size == st->st_size && e->mtime.tv_sec == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+const chip8_rom_t *chip8_rom_cache_open(chip8_rom_cache_t *cache,
+                                        const char *path)
+{
+    struct stat st;
+    const uint8_t *rom = (const uint8_t *)""; // Empty files map nothing.
+    entry_t *e;
+    int fd, b;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size > MAX_GAME_SIZE)
+    {
+        close(fd);
+        return NULL;
+    }
+    for (b = 0; b < BUCKETS; b++)
+    {
+        for (e = cache->buckets[b]; e != NULL; e = e->next)
+        {
+            if (same_file(e, &st))
+            {
+                close(fd);
+                return e->rom;
+            }
+        }
+    }
+
+    if (st.st_size > 0)
+    {
+        rom = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (rom == MAP_FAILED)
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+    e = add(cache, rom, (size_t)st.st_size);
+    if (st.st_size > 0)
+    {
+        munmap((void *)rom, (size_t)st.st_size);
+    }
+    if (e == NULL)
+    {
+        return NULL;
+    }
+    e->opened = true;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    return e->rom;
+}
+
+uint64_t chip8_rom_hash(const chip8_rom_t *rom)
+{
+    return rom->hash;
+}
+
+size_t chip8_rom_size(const chip8_rom_t *rom)
+{
+    return rom->size;
+}
+
+void chip8_rom_load(chip8_t *c, const chip8_rom_t *rom)
+{
+    c->rom = rom;
+    c->shared_pages = ALL_PAGES;
+    c->quirks = rom->quirks;
+
+    memset(c->decode_cache, 0, sizeof(c->decode_cache)); // Drop stale code.
+#ifdef CHIP8_JIT
+    if (c->jit != NULL)
+    {
+        chip8_jit_invalidate(c, 0, CHIP8_MEMORY_SIZE);
+    }
+#endif
+}
+
+void chip8_rom_init(chip8_t *c, const chip8_rom_t *rom)
+{
+#ifdef CHIP8_JIT
+    chip8_jit_disable(c);
+#endif
+#ifdef CHIP8_PROFILE
+    chip8_profile_disable(c);
+#endif
+#ifdef CHIP8_TRACE
+    chip8_trace_stop(c);
+#endif
+#ifdef CHIP8_SHM
+    chip8_shm_detach(c);
+#endif
+    chip8_reset(c);
+    c->rom = rom;
+    c->shared_pages = ALL_PAGES;
+    c->quirks = rom->quirks;
+}
+
+void chip8_own(chip8_t *c, uint16_t addr, int len)
+{
+    int page = (addr & CHIP8_ADDRESS_MASK) / CHIP8_PAGE_SIZE;
+    int last = ((addr + len - 1) & CHIP8_ADDRESS_MASK) / CHIP8_PAGE_SIZE;
+
+    if (len <= 0)
+    {
+        return;
+    }
+    if (len >= CHIP8_MEMORY_SIZE)
+    {
+        last = (page + CHIP8_PAGE_COUNT - 1) % CHIP8_PAGE_COUNT;
+    }
+    for (;;)
+    {
+        if (chip8_page_shared(c, page))
+        {
+            memcpy(&c->memory[page * CHIP8_PAGE_SIZE],
+                   &c->rom->image[page * CHIP8_PAGE_SIZE], CHIP8_PAGE_SIZE);
+            c->shared_pages &= (uint16_t) ~(1u << page);
+        }
+        if (page == last)
+        {
+            break;
+        }
+        page = (page + 1) % CHIP8_PAGE_COUNT;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef CHIP8_ROM_H
+#define CHIP8_ROM_H
+
+#include "chip8.h"
+#include <stddef.h>
+
+// Programs cached by content, built when CMake is configured with
+// -DCHIP8_ROM_CACHE=ON on a POSIX host. The first time a cache sees a
+// program it validates it and builds the machine's whole starting memory
+// once, font at FONTSET_ADDRESS included, together with every address
+// already decoded. That image is read-only and shared by every machine
+// loaded from it: a machine reads its memory from the image until Fx33, Fx55
+// or 5xy2 first stores into a 256-byte page, and only then copies that page
+// into its own memory array. Starting thousands of machines on one program
+// therefore reads the file once and costs each machine no copy of it.
+//
+// A cache is not thread-safe, but the ROMs it returns never change and can
+// be shared by machines on any thread. They stay valid, and every machine
+// loaded from them must stop being used, before the cache is destroyed.
+
+typedef struct chip8_rom chip8_rom_t;
+typedef struct chip8_rom_cache chip8_rom_cache_t;
+
+// Returns NULL when out of memory.
+chip8_rom_cache_t *chip8_rom_cache_create(void);
+void chip8_rom_cache_destroy(chip8_rom_cache_t *cache);
+
+// Distinct programs in the cache.
+int chip8_rom_cache_count(const chip8_rom_cache_t *cache);
+
+// The cached ROM for the program in the file at path, mapping and reading
+// the file only when it was not opened before or has changed since. Returns
+// NULL when the file cannot be read, is not a regular file, is larger than
+// MAX_GAME_SIZE or when out of memory.
+const chip8_rom_t *chip8_rom_cache_open(chip8_rom_cache_t *cache,
+                                        const char *path);
+
+// The cached ROM for size bytes of program. Returns NULL when the program
+// does not fit or when out of memory.
+const chip8_rom_t *chip8_rom_cache_add(chip8_rom_cache_t *cache,
+                                       const uint8_t *rom, size_t size);
+
+// 64-bit FNV-1a hash of the program, which the cache is keyed by.
+uint64_t chip8_rom_hash(const chip8_rom_t *rom);
+size_t chip8_rom_size(const chip8_rom_t *rom);
+
+// Give c the memory chip8_init and chip8_load_rom would: the font, the
+// program and zeros elsewhere, all of it shared with rom. c also gets the
+// profile chip8_load_rom would pick.
+void chip8_rom_load(chip8_t *c, const chip8_rom_t *rom);
+
+// chip8_init followed by chip8_rom_load, without ever writing c's memory
+// array. Machines that are started this way and never store to memory only
+// keep their registers, screen and decoded instructions to themselves. c must
+// have been set up with chip8_init before; a JIT, profile, trace or
+// shared-memory export still attached to it is released first.
+void chip8_rom_init(chip8_t *c, const chip8_rom_t *rom);
+
+#endif
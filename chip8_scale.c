@@ -0,0 +1,355 @@
+#include "chip8_scale.h"
+#include "chip8.h"
+#include <string.h>
+
+// Pixel-lane vector operations, one 32-bit pixel per lane. As in
+// chip8_batch.c every target provides the same set and the kernels below are
+// written once; without SIMD a "vector" is a single pixel.
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i px_t;
+#define PX_LANES 8
+#define px_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define px_store(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define px_set1(x) _mm256_set1_epi32((int)(x))
+#define px_and _mm256_and_si256
+#define px_or _mm256_or_si256
+#define px_andnot _mm256_andnot_si256
+#define px_eq _mm256_cmpeq_epi32
+#define px_shr1(v) _mm256_srli_epi32((v), 1)
+#define px_blend(m, n, o) _mm256_blendv_epi8((o), (n), (m))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i px_t;
+#define PX_LANES 4
+#define px_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define px_store(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define px_set1(x) _mm_set1_epi32((int)(x))
+#define px_and _mm_and_si128
+#define px_or _mm_or_si128
+#define px_andnot _mm_andnot_si128
+#define px_eq _mm_cmpeq_epi32
+#define px_shr1(v) _mm_srli_epi32((v), 1)
+#define px_blend(m, n, o)                                                      \
+    _mm_or_si128(_mm_and_si128((m), (n)), _mm_andnot_si128((m), (o)))
+#else
+typedef uint32_t px_t;
+#define PX_LANES 1
+#define px_load(p) (*(const uint32_t *)(p))
+#define px_store(p, v) (*(uint32_t *)(p) = (v))
+#define px_set1(x) ((uint32_t)(x))
+#define px_and(a, b) ((a) & (b))
+#define px_or(a, b) ((a) | (b))
+#define px_andnot(a, b) (~(a) & (b))
+#define px_eq(a, b) ((a) == (b) ? 0xFFFFFFFFu : 0)
+#define px_shr1(v) ((v) >> 1)
+#define px_blend(m, n, o) (((m) & (n)) | (~(m) & (o)))
+#endif
+
+// Store a and b interleaved, a[0] b[0] a[1] b[1]..., at out.
+static inline void px_zip(px_t a, px_t b, uint32_t *out)
+{
+#if defined(__AVX2__)
+    __m256i lo = _mm256_unpacklo_epi32(a, b);
+    __m256i hi = _mm256_unpackhi_epi32(a, b);
+
+    // The unpacks work within 128-bit halves; put the halves back in order.
+    px_store(out, _mm256_permute2x128_si256(lo, hi, 0x20));
+    px_store(out + PX_LANES, _mm256_permute2x128_si256(lo, hi, 0x31));
+#elif defined(__SSE2__)
+    px_store(out, _mm_unpacklo_epi32(a, b));
+    px_store(out + PX_LANES, _mm_unpackhi_epi32(a, b));
+#else
+    out[0] = a;
+    out[1] = b;
+#endif
+}
+
+// Store a, b and c interleaved at out. There is no three-way unpack, so the
+// lanes are spilled and interleaved one at a time.
+static inline void px_zip3(px_t a, px_t b, px_t c, uint32_t *out)
+{
+    uint32_t lanes[3][PX_LANES];
+    int i;
+
+    px_store(lanes[0], a);
+    px_store(lanes[1], b);
+    px_store(lanes[2], c);
+    for (i = 0; i < PX_LANES; i++)
+    {
+        out[3 * i] = lanes[0][i];
+        out[3 * i + 1] = lanes[1][i];
+        out[3 * i + 2] = lanes[2][i];
+    }
+}
+
+// Half the brightness of every colour channel, leaving alpha alone.
+static inline px_t px_dim(px_t v)
+{
+    return px_or(px_and(px_shr1(v), px_set1(0x7F7F7F00)),
+                 px_and(v, px_set1(0xFF)));
+}
+
+static const char *const filter_names[CHIP8_FILTER_COUNT] = {
+    [CHIP8_FILTER_NEAREST] = "nearest",
+    [CHIP8_FILTER_SCALE2X] = "scale2x",
+    [CHIP8_FILTER_SCALE3X] = "scale3x",
+    [CHIP8_FILTER_SCANLINES] = "scanlines",
+};
+
+// Scale every filter's own step is a multiple of.
+static const int filter_steps[CHIP8_FILTER_COUNT] = {
+    [CHIP8_FILTER_NEAREST] = 1,
+    [CHIP8_FILTER_SCALE2X] = 2,
+    [CHIP8_FILTER_SCALE3X] = 3,
+    [CHIP8_FILTER_SCANLINES] = 2,
+};
+
+const char *chip8_filter_name(chip8_filter_t filter)
+{
+    return filter < CHIP8_FILTER_COUNT ? filter_names[filter] : "unknown";
+}
+
+int chip8_filter_scale(chip8_filter_t filter, int width, int height,
+                       int out_width, int out_height)
+{
+    int step = filter_steps[filter];
+    int fit = out_width / width;
+
+    if (out_height / height < fit)
+    {
+        fit = out_height / height;
+    }
+    if (CHIP8_SCALE_MAX_WIDTH / width < fit)
+    {
+        fit = CHIP8_SCALE_MAX_WIDTH / width;
+    }
+    fit -= fit % step;
+    return fit > step ? fit : step;
+}
+
+int chip8_filter_reach(chip8_filter_t filter)
+{
+    return filter == CHIP8_FILTER_SCALE2X || filter == CHIP8_FILTER_SCALE3X;
+}
+
+// Repeat each of the count pixels of in k times across out.
+static void widen(const uint32_t *in, int count, int k, uint32_t *out)
+{
+    int i = 0, j;
+
+    if (k == 1)
+    {
+        memcpy(out, in, count * sizeof(uint32_t));
+        return;
+    }
+#if PX_LANES > 1
+    if (k == 2)
+    {
+        for (; i + PX_LANES <= count; i += PX_LANES)
+        {
+            px_t v = px_load(&in[i]);
+
+            px_zip(v, v, &out[2 * i]);
+        }
+    }
+    else
+    {
+        // Each pixel is broadcast and stored as whole vectors. What the last
+        // store writes past the pixel's block is overwritten by the pixels
+        // after it, so only the ones whose stores would leave the row are
+        // left to the scalar loop.
+        int stores = (k + PX_LANES - 1) / PX_LANES;
+
+        for (; i * k + stores * PX_LANES <= count * k; i++)
+        {
+            px_t v = px_set1(in[i]);
+
+            for (j = 0; j < stores; j++)
+            {
+                px_store(&out[i * k + j * PX_LANES], v);
+            }
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        for (j = 0; j < k; j++)
+        {
+            out[i * k + j] = in[i];
+        }
+    }
+}
+
+static void dim(uint32_t *row, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i += PX_LANES)
+    {
+        px_store(&row[i], px_dim(px_load(&row[i])));
+    }
+}
+
+// Write the count pixels of in, each repeated k times, to rows successive
+// rows of *out, then move *out past them. The last dark of them are dimmed.
+static void emit(const uint32_t *in, int count, int k, int rows, int dark,
+                 uint8_t **out, int pitch)
+{
+    uint32_t line[CHIP8_SCALE_MAX_WIDTH];
+    size_t bytes = (size_t)count * k * sizeof(uint32_t);
+    int i;
+
+    widen(in, count, k, line);
+    for (i = 0; i < rows; i++)
+    {
+        if (i == rows - dark)
+        {
+            dim(line, count * k);
+        }
+        memcpy(*out, line, bytes);
+        *out += pitch;
+    }
+}
+
+// Row y of src and its neighbours, edges repeated: around[r][x + 1] is the
+// pixel at (x, y - 1 + r), x from -1 to width.
+static void gather(const uint32_t *src, int width, int height, int y,
+                   uint32_t around[3][CHIP8_HIRES_WIDTH + 2])
+{
+    int r, row;
+
+    for (r = 0; r < 3; r++)
+    {
+        row = y - 1 + r;
+        row = row < 0 ? 0 : row >= height ? height - 1 : row;
+        memcpy(&around[r][1], &src[row * width], width * sizeof(uint32_t));
+        around[r][0] = around[r][1];
+        around[r][width + 1] = around[r][width];
+    }
+}
+
+// Scale2x, also known as AdvMAME2x, turns pixel P of
+//
+//       A
+//     C P B   into E0 E1
+//       D          E2 E3
+//
+// where each quarter takes the colour of the two neighbours it touches when
+// those match and the other two do not.
+static void scale2x_row(const uint32_t *src, int width, int height, int y,
+                        int k, uint8_t **out, int pitch)
+{
+    uint32_t around[3][CHIP8_HIRES_WIDTH + 2];
+    uint32_t top[2 * CHIP8_HIRES_WIDTH];
+    uint32_t bottom[2 * CHIP8_HIRES_WIDTH];
+    int x;
+
+    gather(src, width, height, y, around);
+    for (x = 0; x < width; x += PX_LANES)
+    {
+        px_t a = px_load(&around[0][x + 1]);
+        px_t c = px_load(&around[1][x]);
+        px_t p = px_load(&around[1][x + 1]);
+        px_t b = px_load(&around[1][x + 2]);
+        px_t d = px_load(&around[2][x + 1]);
+        px_t ca = px_eq(c, a);
+        px_t cd = px_eq(c, d);
+        px_t ab = px_eq(a, b);
+        px_t bd = px_eq(b, d);
+        px_t e0 = px_andnot(px_or(cd, ab), ca);
+        px_t e1 = px_andnot(px_or(ca, bd), ab);
+        px_t e2 = px_andnot(px_or(bd, ca), cd);
+        px_t e3 = px_andnot(px_or(ab, cd), bd);
+
+        px_zip(px_blend(e0, a, p), px_blend(e1, b, p), &top[2 * x]);
+        px_zip(px_blend(e2, c, p), px_blend(e3, d, p), &bottom[2 * x]);
+    }
+    emit(top, 2 * width, k, k, 0, out, pitch);
+    emit(bottom, 2 * width, k, k, 0, out, pitch);
+}
+
+// Scale3x, also known as AdvMAME3x, turns pixel E of
+//
+//     A B C        E0 E1 E2
+//     D E F   into E3 E4 E5
+//     G H I        E6 E7 E8
+//
+// with the corners following the Scale2x rule and the edges taking the colour
+// of the neighbour they touch when one of the corners beside them would, and
+// E is not already the colour of the far corner of that side.
+static void scale3x_row(const uint32_t *src, int width, int height, int y,
+                        int k, uint8_t **out, int pitch)
+{
+    uint32_t around[3][CHIP8_HIRES_WIDTH + 2];
+    uint32_t rows[3][3 * CHIP8_HIRES_WIDTH];
+    int x;
+
+    gather(src, width, height, y, around);
+    for (x = 0; x < width; x += PX_LANES)
+    {
+        px_t a = px_load(&around[0][x]);
+        px_t b = px_load(&around[0][x + 1]);
+        px_t c = px_load(&around[0][x + 2]);
+        px_t d = px_load(&around[1][x]);
+        px_t e = px_load(&around[1][x + 1]);
+        px_t f = px_load(&around[1][x + 2]);
+        px_t g = px_load(&around[2][x]);
+        px_t h = px_load(&around[2][x + 1]);
+        px_t i = px_load(&around[2][x + 2]);
+        px_t db = px_eq(d, b);
+        px_t bf = px_eq(b, f);
+        px_t dh = px_eq(d, h);
+        px_t fh = px_eq(f, h);
+        px_t ea = px_eq(e, a);
+        px_t ec = px_eq(e, c);
+        px_t eg = px_eq(e, g);
+        px_t ei = px_eq(e, i);
+        px_t tl = px_andnot(px_or(bf, dh), db); // The corner conditions.
+        px_t tr = px_andnot(px_or(db, fh), bf);
+        px_t bl = px_andnot(px_or(db, fh), dh);
+        px_t br = px_andnot(px_or(dh, bf), fh);
+        px_t e1 = px_or(px_andnot(ec, tl), px_andnot(ea, tr));
+        px_t e3 = px_or(px_andnot(eg, tl), px_andnot(ea, bl));
+        px_t e5 = px_or(px_andnot(ei, tr), px_andnot(ec, br));
+        px_t e7 = px_or(px_andnot(ei, bl), px_andnot(eg, br));
+
+        px_zip3(px_blend(tl, d, e), px_blend(e1, b, e), px_blend(tr, f, e),
+                &rows[0][3 * x]);
+        px_zip3(px_blend(e3, d, e), e, px_blend(e5, f, e), &rows[1][3 * x]);
+        px_zip3(px_blend(bl, d, e), px_blend(e7, h, e), px_blend(br, f, e),
+                &rows[2][3 * x]);
+    }
+    for (x = 0; x < 3; x++)
+    {
+        emit(rows[x], 3 * width, k, k, 0, out, pitch);
+    }
+}
+
+void chip8_scale_rows(chip8_filter_t filter, int scale, const uint32_t *src,
+                      int width, int height, int first, int last, void *dst,
+                      int pitch)
+{
+    uint8_t *out = dst;
+    int dark = scale / 4 > 0 ? scale / 4 : 1;
+    int y;
+
+    for (y = first; y < last; y++)
+    {
+        switch (filter)
+        {
+        case CHIP8_FILTER_SCALE2X:
+            scale2x_row(src, width, height, y, scale / 2, &out, pitch);
+            break;
+        case CHIP8_FILTER_SCALE3X:
+            scale3x_row(src, width, height, y, scale / 3, &out, pitch);
+            break;
+        case CHIP8_FILTER_SCANLINES:
+            emit(&src[y * width], width, scale, scale, dark, &out, pitch);
+            break;
+        default:
+            emit(&src[y * width], width, scale, scale, 0, &out, pitch);
+            break;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef CHIP8_SCALE_H
+#define CHIP8_SCALE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// CPU upscaling of the screen, for frontends whose renderer is too slow or
+// too blurry to stretch a 64x32 texture itself. The input is the screen
+// already expanded to one 32-bit RGBA8888 pixel per CHIP-8 pixel (alpha in
+// the low byte, as SDL_PIXELFORMAT_RGBA8888 stores it), row after row; the
+// output is the same image scale times larger in each direction, written
+// straight into the caller's buffer, typically a locked streaming texture.
+// Filters work a source row at a time, so a frontend that knows which rows
+// changed only rescales those, plus chip8_filter_reach rows around them.
+
+// Widest output row, in pixels.
+#define CHIP8_SCALE_MAX_WIDTH 4096
+
+typedef enum chip8_filter
+{
+    CHIP8_FILTER_NEAREST,   // Every pixel becomes a scale x scale block.
+    CHIP8_FILTER_SCALE2X,   // Scale2x rounds off diagonal edges by doubling,
+                            // then each of its pixels becomes a block.
+    CHIP8_FILTER_SCALE3X,   // The same with Scale3x, tripling.
+    CHIP8_FILTER_SCANLINES, // Nearest, with the bottom quarter of every
+                            // block, at least one row, at half brightness.
+    CHIP8_FILTER_COUNT
+} chip8_filter_t;
+
+// Short name of filter, such as "scale2x".
+const char *chip8_filter_name(chip8_filter_t filter);
+
+// The largest scale filter can use for a width x height screen to fit into
+// out_width x out_height pixels: a whole multiple of 2 for Scale2x and
+// scanlines, of 3 for Scale3x. When even the smallest does not fit, that is
+// returned anyway.
+int chip8_filter_scale(chip8_filter_t filter, int width, int height,
+                       int out_width, int out_height);
+
+// Rows above and below a changed source row whose output changes with it.
+int chip8_filter_reach(chip8_filter_t filter);
+
+// Scale rows first to last - 1 of the width x height image src by scale,
+// one chip8_filter_scale returned for filter. dst receives output row
+// first * scale, the rows after it following pitch bytes apart. width must
+// be a multiple of 8 no larger than CHIP8_HIRES_WIDTH.
+void chip8_scale_rows(chip8_filter_t filter, int scale, const uint32_t *src,
+                      int width, int height, int first, int last, void *dst,
+                      int pitch);
+
+#endif
@@ -0,0 +1,291 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_shm.h"
+#include "chip8_internal.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct chip8_shm
+{
+    chip8_shm_header_t *header;
+    chip8_shm_slot_t *slots;
+    size_t size;     // Bytes mapped.
+    char *name;      // Removed on close when this process created it.
+};
+
+// Attachment of one machine to its slot.
+struct chip8_shm_port
+{
+    chip8_shm_slot_t *slot;
+    uint32_t pid;     // Published as the slot's owner.
+    uint64_t frames;  // Ticks published since attaching.
+    uint32_t release; // Keys pressed and released within one tick, to be
+                      // released at the next one.
+};
+
+// Slots start on a cache line of their own, after the header.
+#define SLOTS_OFFSET                                                           \
+    ((sizeof(chip8_shm_header_t) + _Alignof(chip8_shm_slot_t) - 1) /           \
+     _Alignof(chip8_shm_slot_t) * _Alignof(chip8_shm_slot_t))
+
+static size_t segment_size(int slots)
+{
+    return SLOTS_OFFSET + (size_t)slots * sizeof(chip8_shm_slot_t);
+}
+
+static chip8_shm_t *map(const char *name, int fd, size_t size, bool owner)
+{
+    chip8_shm_t *s = calloc(1, sizeof(*s));
+    void *base;
+
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        free(s);
+        return NULL;
+    }
+    s->header = base;
+    s->slots = (chip8_shm_slot_t *)((uint8_t *)base + SLOTS_OFFSET);
+    s->size = size;
+    if (owner)
+    {
+        s->name = malloc(strlen(name) + 1);
+        if (s->name == NULL)
+        {
+            munmap(base, size);
+            free(s);
+            return NULL;
+        }
+        strcpy(s->name, name);
+    }
+    return s;
+}
+
+chip8_shm_t *chip8_shm_create(const char *name, int slots)
+{
+    chip8_shm_t *s;
+    size_t size;
+    int fd, i;
+
+    if (slots <= 0)
+    {
+        return NULL;
+    }
+    size = segment_size(slots);
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)size) != 0 ||
+        (s = map(name, fd, size, true)) == NULL)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    close(fd);
+
+    // The new pages are zero, which is an empty slot; only the counters
+    // need a proper start.
+    for (i = 0; i < slots; i++)
+    {
+        atomic_init(&s->slots[i].seq, 0);
+        atomic_init(&s->slots[i].keys, 0);
+    }
+    s->header->version = CHIP8_SHM_VERSION;
+    s->header->slots = (uint32_t)slots;
+    s->header->slot_size = sizeof(chip8_shm_slot_t);
+    // Magic last: a reader that sees it sees a complete header.
+    atomic_thread_fence(memory_order_release);
+    memcpy(s->header->magic, CHIP8_SHM_MAGIC, sizeof(CHIP8_SHM_MAGIC));
+    return s;
+}
+
+chip8_shm_t *chip8_shm_open(const char *name)
+{
+    chip8_shm_header_t header;
+    chip8_shm_t *s;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, CHIP8_SHM_MAGIC, sizeof(CHIP8_SHM_MAGIC)) != 0 ||
+        header.version != CHIP8_SHM_VERSION ||
+        header.slot_size != sizeof(chip8_shm_slot_t) || header.slots == 0 ||
+        (size_t)st.st_size < segment_size((int)header.slots))
+    {
+        close(fd);
+        return NULL;
+    }
+    s = map(name, fd, segment_size((int)header.slots), false);
+    close(fd);
+    return s;
+}
+
+void chip8_shm_close(chip8_shm_t *s)
+{
+    if (s == NULL)
+    {
+        return;
+    }
+    munmap(s->header, s->size);
+    if (s->name != NULL)
+    {
+        shm_unlink(s->name);
+        free(s->name);
+    }
+    free(s);
+}
+
+int chip8_shm_slots(const chip8_shm_t *s)
+{
+    return (int)s->header->slots;
+}
+
+chip8_shm_slot_t *chip8_shm_slot(chip8_shm_t *s, int slot)
+{
+    if (slot < 0 || (uint32_t)slot >= s->header->slots)
+    {
+        return NULL;
+    }
+    return &s->slots[slot];
+}
+
+// Make the sequence counter odd before the owner writes the slot, and even
+// again after. Every field but keys is only written in between.
+static uint32_t write_begin(chip8_shm_slot_t *slot)
+{
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return seq;
+}
+
+static void write_end(chip8_shm_slot_t *slot, uint32_t seq)
+{
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+// Copy c into its slot under the sequence counter.
+static void publish(chip8_t *c, struct chip8_shm_port *p)
+{
+    chip8_shm_slot_t *slot = p->slot;
+    size_t screen = chip8_screen_height(c) * chip8_row_words(c) *
+                    sizeof(uint64_t);
+    uint32_t seq = write_begin(slot);
+    int plane;
+
+    slot->pid = p->pid;
+    slot->ips = c->ips;
+    slot->frames = ++p->frames;
+    slot->cycles = c->cycles;
+    slot->PC = c->PC;
+    slot->I = c->I;
+    slot->opcode = c->opcode;
+    slot->SP = c->SP;
+    slot->delay_timer = chip8_delay_timer(c);
+    slot->sound_timer = chip8_sound_timer(c);
+    slot->state = c->state;
+    slot->trap = c->trap;
+    slot->hires = c->hires;
+    memcpy(slot->V, c->V, sizeof(slot->V));
+    memcpy(slot->stack, c->stack, sizeof(slot->stack));
+    memcpy(slot->keypad, c->keypad, sizeof(slot->keypad));
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        memcpy(slot->frame_buffer[plane], c->frame_buffer[plane], screen);
+    }
+
+    write_end(slot, seq);
+}
+
+void chip8_shm_sync(chip8_t *c)
+{
+    struct chip8_shm_port *p = c->shm;
+    uint32_t keys = atomic_exchange_explicit(&p->slot->keys, 0,
+                                             memory_order_acquire);
+    uint32_t release = p->release;
+    int k;
+
+    // Taps from the last tick come up first, so a new press of the same key
+    // in this one still lands.
+    p->release = 0;
+    for (k = 0; k < CHIP8_KEY_SIZE; k++)
+    {
+        if (release & (1u << k))
+        {
+            chip8_set_key(c, (uint8_t)k, false);
+        }
+    }
+    for (k = 0; k < CHIP8_KEY_SIZE; k++)
+    {
+        bool press = keys & (1u << k);
+        bool up = keys & (1u << (16 + k));
+
+        if (press)
+        {
+            chip8_set_key(c, (uint8_t)k, true);
+            if (up)
+            {
+                p->release |= 1u << k;
+            }
+        }
+        else if (up)
+        {
+            chip8_set_key(c, (uint8_t)k, false);
+        }
+    }
+
+    publish(c, p);
+}
+
+bool chip8_shm_attach(chip8_t *c, chip8_shm_t *s, int slot)
+{
+    struct chip8_shm_port *p;
+
+    if (chip8_shm_slot(s, slot) == NULL ||
+        (p = calloc(1, sizeof(*p))) == NULL)
+    {
+        return false;
+    }
+    chip8_shm_detach(c);
+    p->slot = &s->slots[slot];
+    p->pid = (uint32_t)getpid();
+    c->shm = p;
+    publish(c, p);
+    return true;
+}
+
+void chip8_shm_detach(chip8_t *c)
+{
+    chip8_shm_slot_t *slot;
+    uint32_t seq;
+
+    if (c->shm == NULL)
+    {
+        return;
+    }
+    slot = c->shm->slot;
+    seq = write_begin(slot);
+    slot->pid = 0;
+    write_end(slot, seq);
+    free(c->shm);
+    c->shm = NULL;
+}
@@ -0,0 +1,117 @@
+#ifndef CHIP8_SHM_H
+#define CHIP8_SHM_H
+
+#include "chip8.h"
+#include <stdatomic.h>
+
+// Machines exported through POSIX shared memory, built when CMake is
+// configured with -DCHIP8_SHM=ON on a POSIX host. A segment holds a header
+// and a number of slots, one per exported machine, so one monitor process can
+// watch hundreds of machines through a single mapping. At every timer tick an
+// attached machine copies its registers, keypad and frame buffer into its
+// slot, and picks up the key presses and releases other processes have posted
+// to it. Ticks that chip8_step skips over while the program waits for a key
+// are published once, at the end. Readers look at the slot in place: a
+// sequence counter, odd while the owner is writing, tells them whether what
+// they read was torn.
+//
+// The layout below is the interface to other processes, so it only uses
+// fixed-width fields and changes only together with CHIP8_SHM_VERSION.
+
+#define CHIP8_SHM_VERSION 3
+#define CHIP8_SHM_MAGIC "CHIP8SH"
+
+typedef struct chip8_shm_header
+{
+    char magic[8];      // CHIP8_SHM_MAGIC.
+    uint32_t version;   // CHIP8_SHM_VERSION.
+    uint32_t slots;     // Slots following the header.
+    uint32_t slot_size; // sizeof(chip8_shm_slot_t), for readers to check.
+    uint32_t reserved;
+} chip8_shm_header_t;
+
+typedef struct chip8_shm_slot
+{
+    _Alignas(64) _Atomic uint32_t seq; // Odd while the owner writes the slot.
+    _Atomic uint32_t keys; // Posted by other processes: bit k presses key k,
+                           // bit 16 + k releases it. Cleared by the owner.
+    uint32_t pid;          // Owner's process, 0 while nobody is attached.
+    uint32_t ips;
+    uint64_t frames;       // Ticks published since the machine attached.
+    uint64_t cycles;
+    uint16_t PC;
+    uint16_t I;
+    uint16_t opcode;
+    uint8_t SP;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t state;         // A chip8_state_t.
+    uint8_t trap;          // A chip8_trap_t.
+    uint8_t hires;         // Non-zero at 128x64.
+    uint8_t V[CHIP8_REGISTER_COUNT];
+    uint16_t stack[CHIP8_STACK_SIZE];
+    uint8_t keypad[CHIP8_KEY_SIZE];
+    // Same layout as in chip8_t. Only the rows of the current mode are
+    // published; the words after them are left over from before.
+    uint64_t frame_buffer[CHIP8_PLANES][CHIP8_PLANE_WORDS];
+} chip8_shm_slot_t;
+
+typedef struct chip8_shm chip8_shm_t;
+
+// Create a segment called name ("/chip8", see shm_open) with slots empty
+// slots, replacing any segment of that name. Returns NULL on failure.
+chip8_shm_t *chip8_shm_create(const char *name, int slots);
+
+// Map an existing segment, for reading slots and posting keys. Returns NULL
+// when it cannot be mapped or is not a segment of this version.
+chip8_shm_t *chip8_shm_open(const char *name);
+
+// Unmap the segment. The process that created it also removes the name.
+void chip8_shm_close(chip8_shm_t *s);
+
+int chip8_shm_slots(const chip8_shm_t *s);
+// Slot slot of s, or NULL when s has no such slot.
+chip8_shm_slot_t *chip8_shm_slot(chip8_shm_t *s, int slot);
+
+// Export c through a slot, publishing it right away. Returns false when s has
+// no such slot or when out of memory. chip8_init clears the attachment, so
+// detach before re-initialising c; detaching also marks the slot as unowned.
+bool chip8_shm_attach(chip8_t *c, chip8_shm_t *s, int slot);
+void chip8_shm_detach(chip8_t *c);
+
+// Post a key press or release to the machine exported through slot. It is
+// applied at the machine's next tick; a key both pressed and released
+// between two ticks is held down for one tick.
+static inline void chip8_shm_post_key(chip8_shm_slot_t *slot, uint8_t key,
+                                      bool state)
+{
+    atomic_fetch_or_explicit(&slot->keys,
+                             1u << ((key & 0xF) + (state ? 0 : 16)),
+                             memory_order_release);
+}
+
+// Reading a slot in place:
+//
+//     do
+//     {
+//         seq = chip8_shm_read_begin(slot);
+//         ... read fields of slot ...
+//     } while (chip8_shm_read_retry(slot, seq));
+static inline uint32_t chip8_shm_read_begin(const chip8_shm_slot_t *slot)
+{
+    uint32_t seq;
+
+    while ((seq = atomic_load_explicit(&slot->seq, memory_order_acquire)) & 1)
+    {
+    }
+    return seq;
+}
+
+static inline bool chip8_shm_read_retry(const chip8_shm_slot_t *slot,
+                                        uint32_t seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq;
+}
+
+#endif
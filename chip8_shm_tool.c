@@ -0,0 +1,164 @@
+// Looks at machines exported through a shared-memory segment:
+//
+//     chip8-shm name                  list every slot
+//     chip8-shm -s slot name          print one slot's registers and screen
+//     chip8-shm -k slot key name      tap a key (hex digit) on one slot
+//
+// Exits with 0 on success and 2 on errors.
+#include "chip8.h"
+#include "chip8_shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void list(chip8_shm_t *s)
+{
+    int i;
+
+    printf("slot      pid      frames          cycles    PC  state\n");
+    for (i = 0; i < chip8_shm_slots(s); i++)
+    {
+        const chip8_shm_slot_t *slot = chip8_shm_slot(s, i);
+        uint64_t frames, cycles;
+        uint32_t pid, seq;
+        uint16_t pc;
+        uint8_t state, trap;
+
+        do
+        {
+            seq = chip8_shm_read_begin(slot);
+            pid = slot->pid;
+            frames = slot->frames;
+            cycles = slot->cycles;
+            pc = slot->PC;
+            state = slot->state;
+            trap = slot->trap;
+        } while (chip8_shm_read_retry(slot, seq));
+
+        if (pid == 0)
+        {
+            continue;
+        }
+        printf("%4d %8u %11llu %15llu   %03X  %s\n", i, pid,
+               (unsigned long long)frames, (unsigned long long)cycles, pc,
+               state == CHIP8_STATE_TRAPPED     ? chip8_trap_name(trap)
+               : state == CHIP8_STATE_WAIT_KEY  ? "wait-key"
+               : state == CHIP8_STATE_WAIT_TICK ? "wait-tick"
+                                                : "running");
+    }
+}
+
+static void show(const chip8_shm_slot_t *slot)
+{
+    static const char colours[] = ".#+@"; // Lit on no plane, 0, 1, both.
+    chip8_shm_slot_t copy;
+    uint32_t seq;
+    int words, x, y;
+
+    // Copy the fields after the counters, which the copy does not need.
+    do
+    {
+        seq = chip8_shm_read_begin(slot);
+        memcpy((char *)&copy + offsetof(chip8_shm_slot_t, pid),
+               (const char *)slot + offsetof(chip8_shm_slot_t, pid),
+               sizeof(copy) - offsetof(chip8_shm_slot_t, pid));
+    } while (chip8_shm_read_retry(slot, seq));
+
+    printf("pid %u, frame %llu, cycle %llu\n", copy.pid,
+           (unsigned long long)copy.frames, (unsigned long long)copy.cycles);
+    if (copy.state == CHIP8_STATE_TRAPPED)
+    {
+        printf("trapped: %s\n", chip8_trap_name(copy.trap));
+    }
+    printf("PC=%03X opcode=%04X I=%03X SP=%u DT=%u ST=%u V=", copy.PC,
+           copy.opcode, copy.I, copy.SP, copy.delay_timer, copy.sound_timer);
+    for (x = 0; x < CHIP8_REGISTER_COUNT; x++)
+    {
+        printf("%s%02X", x == 0 ? "" : " ", copy.V[x]);
+    }
+    printf("\n");
+    words = copy.hires ? 2 : 1;
+    for (y = 0; y < CHIP8_SCREEN_HEIGHT * words; y++)
+    {
+        for (x = 0; x < CHIP8_SCREEN_WIDTH * words; x++)
+        {
+            int word = y * words + x / 64;
+            int shift = 63 - x % 64;
+
+            putchar(colours[(copy.frame_buffer[0][word] >> shift & 1) |
+                            (copy.frame_buffer[1][word] >> shift & 1) << 1]);
+        }
+        putchar('\n');
+    }
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-s slot | -k slot key] name\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *name = NULL;
+    int slot = -1, key = -1;
+    chip8_shm_t *s;
+    int a;
+
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "-s") == 0 && a + 1 < argc)
+        {
+            slot = atoi(argv[++a]);
+        }
+        else if (strcmp(argv[a], "-k") == 0 && a + 2 < argc)
+        {
+            slot = atoi(argv[++a]);
+            key = (int)strtol(argv[++a], NULL, 16) & 0xF;
+        }
+        else if (argv[a][0] != '-' && name == NULL)
+        {
+            name = argv[a];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (name == NULL)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    s = chip8_shm_open(name);
+    if (s == NULL)
+    {
+        fprintf(stderr, "%s: not a chip8 segment\n", name);
+        return 2;
+    }
+    if (slot >= chip8_shm_slots(s))
+    {
+        fprintf(stderr, "%s: no slot %d\n", name, slot);
+        chip8_shm_close(s);
+        return 2;
+    }
+
+    if (key >= 0)
+    {
+        chip8_shm_post_key(chip8_shm_slot(s, slot), (uint8_t)key, true);
+        chip8_shm_post_key(chip8_shm_slot(s, slot), (uint8_t)key, false);
+    }
+    else if (slot >= 0)
+    {
+        show(chip8_shm_slot(s, slot));
+    }
+    else
+    {
+        list(s);
+    }
+    chip8_shm_close(s);
+
+    return 0;
+}
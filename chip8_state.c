@@ -0,0 +1,482 @@
+#include "chip8_state.h"
+#include "chip8_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// State layout, all multi-byte values little-endian:
+//
+//     magic[8] version:16 PC:16 I:16 opcode:16
+//     SP:8 delay_timer:8 sound_timer:8 draw_flag:8 state:8 wait_reg:8 trap:8
+//     quirks:8 hires:8 planes:8
+//     V[16] stack[16]:16 keypad[16] flags[16] frame_buffer[2][128]:64
+//     memory[4096]
+//     cycles:64 idle_cycles:64 ips:32 tick_phase:32 rng:64
+static const uint8_t state_magic[8] = {'C', 'H', 'I', 'P', '8', 'S', 'T', 0};
+
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    p = put16(p, v & 0xFFFF);
+    return put16(p, v >> 16);
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v)
+{
+    p = put32(p, v & 0xFFFFFFFF);
+    return put32(p, v >> 32);
+}
+
+static uint16_t get16(const uint8_t **p)
+{
+    uint16_t v = (*p)[0] | (*p)[1] << 8;
+    *p += 2;
+    return v;
+}
+
+static uint32_t get32(const uint8_t **p)
+{
+    uint32_t lo = get16(p);
+    return lo | (uint32_t)get16(p) << 16;
+}
+
+static uint64_t get64(const uint8_t **p)
+{
+    uint64_t lo = get32(p);
+    return lo | (uint64_t)get32(p) << 32;
+}
+
+size_t chip8_save_state(const chip8_t *c, uint8_t *buf, size_t size)
+{
+    uint8_t *p = buf;
+    int i;
+
+    if (size < CHIP8_STATE_SIZE)
+    {
+        return 0;
+    }
+
+    memcpy(p, state_magic, sizeof(state_magic));
+    p += sizeof(state_magic);
+    p = put16(p, CHIP8_STATE_VERSION);
+    p = put16(p, c->PC);
+    p = put16(p, c->I);
+    p = put16(p, c->opcode);
+    *p++ = c->SP;
+    *p++ = chip8_delay_timer(c);
+    *p++ = chip8_sound_timer(c);
+    *p++ = c->draw_flag;
+    *p++ = c->state;
+    *p++ = c->wait_reg;
+    *p++ = c->trap;
+    *p++ = c->quirks;
+    *p++ = c->hires;
+    *p++ = c->planes;
+    memcpy(p, c->V, CHIP8_REGISTER_COUNT);
+    p += CHIP8_REGISTER_COUNT;
+    for (i = 0; i < CHIP8_STACK_SIZE; i++)
+    {
+        p = put16(p, c->stack[i]);
+    }
+    memcpy(p, c->keypad, CHIP8_KEY_SIZE);
+    p += CHIP8_KEY_SIZE;
+    memcpy(p, c->flags, CHIP8_FLAG_COUNT);
+    p += CHIP8_FLAG_COUNT;
+    for (i = 0; i < CHIP8_PLANES * CHIP8_PLANE_WORDS; i++)
+    {
+        p = put64(p, c->frame_buffer[i / CHIP8_PLANE_WORDS]
+                                    [i % CHIP8_PLANE_WORDS]);
+    }
+    for (i = 0; i < CHIP8_PAGE_COUNT; i++)
+    {
+        memcpy(p, chip8_page(c, i), CHIP8_PAGE_SIZE);
+        p += CHIP8_PAGE_SIZE;
+    }
+    p = put64(p, c->cycles);
+    p = put64(p, c->idle_cycles);
+    p = put32(p, c->ips);
+    p = put32(p, c->tick_phase);
+    p = put64(p, c->rng);
+
+    return p - buf;
+}
+
+// Copy the saved memory[addr, end) into c, which owns those pages, dropping
+// decoded instructions and translated code only where the contents actually
+// change. Rewinding one frame typically touches a handful of bytes, so the
+// caches survive it.
+static void load_range(chip8_t *c, const uint8_t *mem, int addr, int end)
+{
+    int start;
+
+    while (addr < end)
+    {
+        if (c->memory[addr] == mem[addr])
+        {
+            // Whole words at a time through unchanged memory.
+            addr++;
+            while (addr % 8 != 0 && c->memory[addr] == mem[addr])
+            {
+                addr++;
+            }
+            while (addr < end && memcmp(&c->memory[addr], &mem[addr], 8) == 0)
+            {
+                addr += 8;
+            }
+            continue;
+        }
+        start = addr;
+        while (addr < end && c->memory[addr] != mem[addr])
+        {
+            addr++;
+        }
+        memcpy(&c->memory[start], &mem[start], addr - start);
+        chip8_invalidate(c, start, addr - start);
+    }
+}
+
+// Copy the saved memory into c. Pages still shared with a cached ROM stay
+// shared unless the state changes them.
+static void load_memory(chip8_t *c, const uint8_t *mem)
+{
+    int page, addr;
+
+    for (page = 0; page < CHIP8_PAGE_COUNT; page++)
+    {
+        addr = page * CHIP8_PAGE_SIZE;
+        if (chip8_page_shared(c, page))
+        {
+            if (memcmp(chip8_page(c, page), &mem[addr], CHIP8_PAGE_SIZE) == 0)
+            {
+                continue;
+            }
+            CHIP8_OWN(c, addr, CHIP8_PAGE_SIZE);
+        }
+        load_range(c, mem, addr, addr + CHIP8_PAGE_SIZE);
+    }
+}
+
+bool chip8_load_state(chip8_t *c, const uint8_t *buf, size_t size)
+{
+    const uint8_t *p = buf + sizeof(state_magic);
+    uint64_t word, rng;
+    int i, words, height;
+
+    if (size < CHIP8_STATE_SIZE ||
+        memcmp(buf, state_magic, sizeof(state_magic)) != 0 ||
+        get16(&p) != CHIP8_STATE_VERSION)
+    {
+        return false;
+    }
+
+    c->PC = get16(&p);
+    c->I = get16(&p);
+    c->opcode = get16(&p);
+    c->SP = *p++;
+    chip8_set_timers(c, p[0], p[1]);
+    p += 2;
+    c->draw_flag = true; // The screen may differ from what was last drawn.
+    p++;
+    c->state = *p++;
+    c->wait_reg = *p++ & 0xF;
+    c->trap = *p++;
+    c->quirks = *p < CHIP8_QUIRKS_COUNT ? *p : CHIP8_QUIRKS_MODERN;
+    p++;
+    if (c->hires != (*p != 0))
+    {
+        c->dirty_rows = UINT64_MAX; // The rows changed shape.
+    }
+    c->hires = *p++ != 0;
+    c->planes = *p++ & ((1 << CHIP8_PLANES) - 1);
+    words = chip8_row_words(c);
+    height = chip8_screen_height(c);
+    memcpy(c->V, p, CHIP8_REGISTER_COUNT);
+    p += CHIP8_REGISTER_COUNT;
+    for (i = 0; i < CHIP8_STACK_SIZE; i++)
+    {
+        c->stack[i] = get16(&p);
+    }
+    memcpy(c->keypad, p, CHIP8_KEY_SIZE);
+    p += CHIP8_KEY_SIZE;
+    memcpy(c->flags, p, CHIP8_FLAG_COUNT);
+    p += CHIP8_FLAG_COUNT;
+    for (i = 0; i < CHIP8_PLANES * CHIP8_PLANE_WORDS; i++)
+    {
+        uint64_t *fb = &c->frame_buffer[i / CHIP8_PLANE_WORDS]
+                                       [i % CHIP8_PLANE_WORDS];
+        int row = i % CHIP8_PLANE_WORDS / words;
+
+        word = get64(&p);
+        if (row >= height)
+        {
+            word = 0; // Words past the last row of the mode are only zero.
+        }
+        if (word != *fb)
+        {
+            *fb = word;
+            c->dirty_rows |= (uint64_t)1 << (row & 63);
+        }
+    }
+    load_memory(c, p);
+    p += CHIP8_MEMORY_SIZE;
+    c->cycles = get64(&p);
+    c->idle_cycles = get64(&p);
+    c->ips = get32(&p);
+    c->tick_phase = get32(&p);
+    rng = get64(&p);
+    c->rng = rng != 0 ? rng : c->rng; // A zero state would only give zeros.
+    CHIP8_TRACE_EVENT(c, CHIP8_TRACE_STATE, 0);
+
+    return true;
+}
+
+// Largest encoded delta. Every run of changed bytes after the first is
+// preceded by at least four unchanged ones and costs at most four bytes of
+// lengths, so the encoding never grows past twice the state.
+#define MAX_DELTA_SIZE (2 * CHIP8_STATE_SIZE)
+
+// Each frame in the ring is stored as a delta record framed by its length
+// on both sides, so records can be dropped from the oldest end and popped
+// from the newest one.
+#define RECORD_OVERHEAD 8
+
+struct chip8_rewind
+{
+    uint8_t *ring;   // Delta records, oldest first, wrapping at capacity.
+    size_t capacity; // Size of ring.
+    size_t head;     // Offset of the oldest record.
+    size_t used;     // Bytes of records in the ring.
+    size_t frames;   // Records in the ring.
+    bool started;    // Whether newest holds a frame yet.
+    uint8_t newest[CHIP8_STATE_SIZE]; // Newest frame, whole.
+    uint8_t next[CHIP8_STATE_SIZE];   // Frame being pushed.
+    uint8_t delta[MAX_DELTA_SIZE];    // Encoded delta being moved.
+};
+
+static size_t put_varint(uint8_t *p, size_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80)
+    {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static size_t get_varint(const uint8_t *p, size_t *pos)
+{
+    size_t v = 0;
+    int shift = 0;
+
+    while (p[*pos] & 0x80)
+    {
+        v |= (size_t)(p[(*pos)++] & 0x7F) << shift;
+        shift += 7;
+    }
+    return v | (size_t)p[(*pos)++] << shift;
+}
+
+// Encode a XOR b as a list of (unchanged bytes, changed bytes, XORed bytes)
+// runs. Short stretches of unchanged bytes stay inside a changed run, since
+// ending the run would cost more than it saves. Returns the encoded size.
+static size_t encode_delta(const uint8_t *a, const uint8_t *b, uint8_t *out)
+{
+    size_t pos = 0;
+    size_t n = 0;
+    size_t start, lit, same, i;
+    uint64_t x, y;
+
+    while (pos < CHIP8_STATE_SIZE)
+    {
+        start = pos;
+        while (pos + 8 <= CHIP8_STATE_SIZE)
+        {
+            memcpy(&x, a + pos, 8);
+            memcpy(&y, b + pos, 8);
+            if (x != y)
+            {
+                break;
+            }
+            pos += 8;
+        }
+        while (pos < CHIP8_STATE_SIZE && a[pos] == b[pos])
+        {
+            pos++;
+        }
+        if (pos == CHIP8_STATE_SIZE)
+        {
+            break; // Trailing unchanged bytes need no record.
+        }
+
+        lit = 0;
+        while (pos + lit < CHIP8_STATE_SIZE)
+        {
+            for (same = 0; pos + lit + same < CHIP8_STATE_SIZE &&
+                           a[pos + lit + same] == b[pos + lit + same];
+                 same++)
+            {
+            }
+            if (same >= 4 || pos + lit + same == CHIP8_STATE_SIZE)
+            {
+                break;
+            }
+            lit += same + 1;
+        }
+
+        n += put_varint(out + n, pos - start);
+        n += put_varint(out + n, lit);
+        for (i = 0; i < lit; i++)
+        {
+            out[n++] = a[pos + i] ^ b[pos + i];
+        }
+        pos += lit;
+    }
+
+    return n;
+}
+
+// XOR an encoded delta into state.
+static void apply_delta(uint8_t *state, const uint8_t *delta, size_t size)
+{
+    size_t in = 0;
+    size_t pos = 0;
+    size_t lit;
+
+    while (in < size)
+    {
+        pos += get_varint(delta, &in);
+        lit = get_varint(delta, &in);
+        while (lit-- > 0)
+        {
+            state[pos++] ^= delta[in++];
+        }
+    }
+}
+
+// Copy len bytes between the ring, starting at offset off, and buf.
+static void ring_write(chip8_rewind_t *r, size_t off, const void *buf,
+                       size_t len)
+{
+    size_t first;
+
+    off %= r->capacity;
+    first = len < r->capacity - off ? len : r->capacity - off;
+    memcpy(r->ring + off, buf, first);
+    memcpy(r->ring, (const uint8_t *)buf + first, len - first);
+}
+
+static void ring_read(const chip8_rewind_t *r, size_t off, void *buf,
+                      size_t len)
+{
+    size_t first;
+
+    off %= r->capacity;
+    first = len < r->capacity - off ? len : r->capacity - off;
+    memcpy(buf, r->ring + off, first);
+    memcpy((uint8_t *)buf + first, r->ring, len - first);
+}
+
+chip8_rewind_t *chip8_rewind_create(size_t capacity)
+{
+    chip8_rewind_t *r = calloc(1, sizeof(*r));
+
+    if (r == NULL)
+    {
+        return NULL;
+    }
+    r->capacity = capacity > RECORD_OVERHEAD ? capacity : RECORD_OVERHEAD;
+    r->ring = malloc(r->capacity);
+    if (r->ring == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void chip8_rewind_destroy(chip8_rewind_t *r)
+{
+    if (r != NULL)
+    {
+        free(r->ring);
+        free(r);
+    }
+}
+
+void chip8_rewind_push(chip8_rewind_t *r, const chip8_t *c)
+{
+    uint32_t len;
+    size_t record;
+
+    chip8_save_state(c, r->next, sizeof(r->next));
+    if (!r->started)
+    {
+        memcpy(r->newest, r->next, sizeof(r->newest));
+        r->started = true;
+        return;
+    }
+
+    // The record holds the delta that turns the new frame back into the old
+    // newest one.
+    len = (uint32_t)encode_delta(r->newest, r->next, r->delta);
+    record = len + RECORD_OVERHEAD;
+    memcpy(r->newest, r->next, sizeof(r->newest));
+
+    if (record > r->capacity)
+    {
+        r->head = r->used = r->frames = 0; // Cannot keep this one at all.
+        return;
+    }
+    while (r->used + record > r->capacity)
+    {
+        uint32_t old;
+        ring_read(r, r->head, &old, sizeof(old));
+        r->head = (r->head + old + RECORD_OVERHEAD) % r->capacity;
+        r->used -= old + RECORD_OVERHEAD;
+        r->frames--;
+    }
+
+    ring_write(r, r->head + r->used, &len, sizeof(len));
+    ring_write(r, r->head + r->used + sizeof(len), r->delta, len);
+    ring_write(r, r->head + r->used + sizeof(len) + len, &len, sizeof(len));
+    r->used += record;
+    r->frames++;
+}
+
+bool chip8_rewind_pop(chip8_rewind_t *r, chip8_t *c)
+{
+    uint32_t len;
+    size_t end;
+
+    if (r->frames == 0)
+    {
+        return false;
+    }
+
+    end = r->head + r->used;
+    ring_read(r, end - sizeof(len), &len, sizeof(len));
+    ring_read(r, end - sizeof(len) - len, r->delta, len);
+    r->used -= len + RECORD_OVERHEAD;
+    r->frames--;
+
+    apply_delta(r->newest, r->delta, len);
+    return chip8_load_state(c, r->newest, sizeof(r->newest));
+}
+
+size_t chip8_rewind_frames(const chip8_rewind_t *r)
+{
+    return r->frames;
+}
+
+size_t chip8_rewind_bytes(const chip8_rewind_t *r)
+{
+    return r->used;
+}
@@ -0,0 +1,53 @@
+#ifndef CHIP8_STATE_H
+#define CHIP8_STATE_H
+
+#include "chip8.h"
+#include <stddef.h>
+
+// Save states. A state is a fixed-size, little-endian image of everything a
+// program can observe: registers, timers, stack, keypad, flags, display mode,
+// frame buffer, memory, the emulated clock, the random number generator and
+// the quirk profile the machine runs with. Caches (decoded instructions,
+// translated code) are not saved; loading a state drops the parts that no
+// longer match.
+
+#define CHIP8_STATE_VERSION 5
+
+// Bytes chip8_save_state writes.
+#define CHIP8_STATE_SIZE                                                       \
+    (8 + 2 + 3 * 2 + 10 + CHIP8_REGISTER_COUNT + 2 * CHIP8_STACK_SIZE +        \
+     CHIP8_KEY_SIZE + CHIP8_FLAG_COUNT +                                       \
+     8 * CHIP8_PLANES * CHIP8_PLANE_WORDS + CHIP8_MEMORY_SIZE + 2 * 8 +        \
+     2 * 4 + 8)
+
+// Write c into buf. Returns the number of bytes written, or 0 when size is
+// smaller than CHIP8_STATE_SIZE.
+size_t chip8_save_state(const chip8_t *c, uint8_t *buf, size_t size);
+
+// Restore c from a state written by chip8_save_state. Returns false, leaving
+// c untouched, when buf is not a state of this version.
+bool chip8_load_state(chip8_t *c, const uint8_t *buf, size_t size);
+
+// Rewind history. Every pushed frame is kept as the XOR of its state with
+// the frame pushed after it, run-length encoded, so only the bytes that
+// changed between frames take space. The newest frame is kept whole.
+// Once the history outgrows its capacity the oldest frames are dropped.
+typedef struct chip8_rewind chip8_rewind_t;
+
+// Create a history holding at most capacity bytes of deltas. Returns NULL
+// when out of memory.
+chip8_rewind_t *chip8_rewind_create(size_t capacity);
+void chip8_rewind_destroy(chip8_rewind_t *r);
+
+// Record the current state of c as the newest frame.
+void chip8_rewind_push(chip8_rewind_t *r, const chip8_t *c);
+
+// Drop the newest frame and load c with the one before it. Returns false
+// when there is no earlier frame.
+bool chip8_rewind_pop(chip8_rewind_t *r, chip8_t *c);
+
+// Frames that can still be popped, and bytes of deltas held for them.
+size_t chip8_rewind_frames(const chip8_rewind_t *r);
+size_t chip8_rewind_bytes(const chip8_rewind_t *r);
+
+#endif
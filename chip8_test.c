@@ -0,0 +1,2325 @@
+// Differential tests for the interpreter core:
+//
+//     chip8-test [--jit]
+//
+// Every test runs a program on a chip8_t and, next to it, on the reference
+// interpreter below, which keeps the machine in the most obvious form there
+// is: memory fetched and decoded anew for every instruction, one byte per
+// pixel, and timers that count down one tick at a time. After every batch of
+// instructions the two must agree on the registers, stack, memory, screen,
+// timers and buzzer edges, so the decode cache, the interpreter core the
+// library was built with, the bit-packed frame buffer and the lazy timers all
+// have to reproduce what the reference does. The programs are IBM_Logo.ch8
+// and generated ones that draw, scroll, read keys, call a subroutine and
+// overwrite their own code, under every quirk profile, run through both
+// chip8_run and chip8_step. A few hand-written programs whose results are
+// known in advance come first. Save states have to load back into machines
+// that run on the same, also over memory shared with a cached ROM, and a
+// rewind history has to pop back the states pushed onto it. Machines started
+// from a cached ROM have to copy exactly the pages they store into, and the
+// cache has to notice a file that changed. An environment set stepped by
+// several workers has to leave every machine as chip8_step would, and a
+// machine exported through shared memory has to show up whole in another
+// mapping and take the keys posted there. Every chip8_scale filter has to
+// give what its definition does, pixel by pixel. With CHIP8_TRACE a recorded
+// trace has to replay without diverging. Prints one line per test and exits
+// with 1 when any of them fails.
+//
+// With --jit the generated programs run on machines with the block
+// translator attached instead, the code cache must never be mapped writable
+// and executable at once, and only blocks actually entered count as hits.
+#define _POSIX_C_SOURCE 200809L
+#include "chip8.h"
+#include "chip8_batch.h"
+#include "chip8_internal.h"
+#include "chip8_scale.h"
+#include "chip8_state.h"
+#ifdef CHIP8_ENV
+#include "chip8_env.h"
+#endif
+#ifdef CHIP8_SHM
+#include "chip8_shm.h"
+#endif
+#ifdef CHIP8_JIT
+#include "chip8_jit.h"
+#endif
+#ifdef CHIP8_TRACE
+#include "chip8_trace.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef CHIP8_ROM_CACHE
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#endif
+#ifdef CHIP8_SHM
+#include <stddef.h>
+#include <unistd.h>
+#endif
+
+#ifndef CHIP8_TEST_CORE
+#define CHIP8_TEST_CORE "unknown"
+#endif
+#ifndef CHIP8_TEST_ROM_DIR
+#define CHIP8_TEST_ROM_DIR "."
+#endif
+
+// Instructions each generated program is run for, unless it traps first.
+#define PROGRAM_INSNS 4000
+// Generated programs per profile and entry point.
+#define PROGRAM_COUNT 48
+
+// The reference machine.
+typedef struct ref
+{
+    uint16_t PC;
+    uint16_t I;
+    uint8_t SP;
+    uint8_t V[CHIP8_REGISTER_COUNT];
+    uint16_t stack[CHIP8_STACK_SIZE];
+    uint8_t keypad[CHIP8_KEY_SIZE];
+    uint8_t flags[CHIP8_FLAG_COUNT];
+    uint8_t memory[CHIP8_MEMORY_SIZE];
+    uint8_t screen[CHIP8_PLANES][CHIP8_HIRES_HEIGHT][CHIP8_HIRES_WIDTH];
+    uint8_t hires;
+    uint8_t planes;
+    uint8_t state;
+    uint8_t trap;
+    uint8_t wait_reg;
+    unsigned quirks; // CHIP8_QUIRK_* bits.
+    uint64_t rng;
+    uint8_t delay;
+    uint8_t sound;
+    uint64_t ticks;
+    uint64_t cycles;
+    uint32_t ips;
+    uint32_t phase;
+    chip8_sound_event_t sound_events[CHIP8_SOUND_EVENTS];
+    int sound_head;
+    int sound_count;
+} ref_t;
+
+static chip8_t machine;
+static ref_t reference;
+static int failures;
+
+// Start r as a copy of c, which has just loaded its program.
+static void ref_init(ref_t *r, const chip8_t *c)
+{
+    memset(r, 0, sizeof(*r));
+    r->PC = c->PC;
+    memcpy(r->memory, c->memory, sizeof(r->memory));
+    r->planes = 1;
+    r->state = CHIP8_STATE_RUNNING;
+    r->quirks = chip8_quirk_bits(c);
+    r->rng = c->rng;
+    r->ips = c->ips;
+}
+
+static void ref_trap(ref_t *r, chip8_trap_t trap)
+{
+    r->state = CHIP8_STATE_TRAPPED;
+    r->trap = trap;
+}
+
+static void ref_push_sound(ref_t *r, bool on)
+{
+    chip8_sound_event_t *event;
+
+    if (r->sound_count == CHIP8_SOUND_EVENTS)
+    {
+        r->sound_head = (r->sound_head + 1) % CHIP8_SOUND_EVENTS;
+        r->sound_count--;
+    }
+    event = &r->sound_events[(r->sound_head + r->sound_count++) %
+                             CHIP8_SOUND_EVENTS];
+    event->tick = r->ticks;
+    event->on = on;
+}
+
+static void ref_tick(ref_t *r)
+{
+    r->ticks++;
+    if (r->delay > 0)
+    {
+        r->delay--;
+    }
+    if (r->sound > 0 && --r->sound == 0)
+    {
+        ref_push_sound(r, false);
+    }
+    if (r->state == CHIP8_STATE_WAIT_TICK)
+    {
+        r->state = CHIP8_STATE_RUNNING;
+    }
+}
+
+static void ref_set_key(ref_t *r, uint8_t key, bool down)
+{
+    r->keypad[key & 0xF] = down;
+    if (down && r->state == CHIP8_STATE_WAIT_KEY)
+    {
+        r->V[r->wait_reg] = key & 0xF;
+        r->PC += 2;
+        r->state = CHIP8_STATE_RUNNING;
+    }
+}
+
+static uint8_t ref_peek(const ref_t *r, int addr)
+{
+    return r->memory[addr & CHIP8_ADDRESS_MASK];
+}
+
+static int ref_width(const ref_t *r)
+{
+    return r->hires ? CHIP8_HIRES_WIDTH : CHIP8_SCREEN_WIDTH;
+}
+
+static int ref_height(const ref_t *r)
+{
+    return r->hires ? CHIP8_HIRES_HEIGHT : CHIP8_SCREEN_HEIGHT;
+}
+
+// XOR a sprite onto the selected planes pixel by pixel.
+static uint8_t ref_draw(ref_t *r, uint8_t vx, uint8_t vy, int n)
+{
+    int w = ref_width(r), h = ref_height(r);
+    int rows = n == 0 ? 16 : n, cols = n == 0 ? 16 : 8;
+    int addr = r->I;
+    uint8_t hit = 0;
+    int plane, row, col;
+
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        if (!(r->planes >> plane & 1))
+        {
+            continue;
+        }
+        for (row = 0; row < rows; row++)
+        {
+            int bits = n == 0 ? ref_peek(r, addr + 2 * row) << 8 |
+                                    ref_peek(r, addr + 2 * row + 1)
+                              : ref_peek(r, addr + row);
+
+            for (col = 0; col < cols; col++)
+            {
+                int px = vx % w + col, py = vy % h + row;
+
+                if (!(bits >> (cols - 1 - col) & 1))
+                {
+                    continue;
+                }
+                if (r->quirks & CHIP8_QUIRK_WRAP)
+                {
+                    px %= w;
+                    py %= h;
+                }
+                else if (px >= w || py >= h)
+                {
+                    continue;
+                }
+                hit |= r->screen[plane][py][px];
+                r->screen[plane][py][px] ^= 1;
+            }
+        }
+        addr += n == 0 ? 32 : n;
+    }
+    return hit;
+}
+
+// Move the selected planes by (dx, dy), clearing what comes in.
+static void ref_scroll(ref_t *r, int dx, int dy)
+{
+    static uint8_t old[CHIP8_HIRES_HEIGHT][CHIP8_HIRES_WIDTH];
+    int w = ref_width(r), h = ref_height(r);
+    int plane, x, y;
+
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        if (!(r->planes >> plane & 1))
+        {
+            continue;
+        }
+        memcpy(old, r->screen[plane], sizeof(old));
+        for (y = 0; y < h; y++)
+        {
+            for (x = 0; x < w; x++)
+            {
+                int sx = x - dx, sy = y - dy;
+
+                r->screen[plane][y][x] =
+                    sx >= 0 && sx < w && sy >= 0 && sy < h ? old[sy][sx] : 0;
+            }
+        }
+    }
+}
+
+static void ref_set_mode(ref_t *r, bool hires)
+{
+    r->hires = hires;
+    memset(r->screen, 0, sizeof(r->screen));
+}
+
+// Traps unless memory[I, I + len) lies inside memory.
+static bool ref_out_of_memory(ref_t *r, int len)
+{
+    if (r->I + len <= CHIP8_MEMORY_SIZE)
+    {
+        return false;
+    }
+    ref_trap(r, CHIP8_TRAP_BAD_ADDRESS);
+    return true;
+}
+
+// Fetch, decode and execute the instruction at PC.
+static void ref_exec(ref_t *r)
+{
+    uint16_t op = ref_peek(r, r->PC) << 8 | ref_peek(r, r->PC + 1);
+    int x = op >> 8 & 0xF, y = op >> 4 & 0xF, n = op & 0xF;
+    uint8_t kk = op & 0xFF;
+    uint16_t nnn = op & 0xFFF;
+    uint8_t *V = r->V;
+    unsigned q = r->quirks;
+    int step = x <= y ? 1 : -1;
+    int len, i, src, flag;
+    bool was_on;
+
+    switch (op >> 12)
+    {
+    case 0x0:
+        if ((op & 0x0FF0) == 0x00C0)
+        {
+            ref_scroll(r, 0, n);
+            break;
+        }
+        if ((op & 0x0FF0) == 0x00D0)
+        {
+            ref_scroll(r, 0, -n);
+            break;
+        }
+        switch (kk)
+        {
+        case 0xE0:
+            for (i = 0; i < CHIP8_PLANES; i++)
+            {
+                if (r->planes >> i & 1)
+                {
+                    memset(r->screen[i], 0, sizeof(r->screen[i]));
+                }
+            }
+            break;
+        case 0xEE:
+            if (r->SP == 0)
+            {
+                ref_trap(r, CHIP8_TRAP_STACK_UNDERFLOW);
+                return;
+            }
+            r->PC = r->stack[--r->SP];
+            return;
+        case 0xFB:
+            ref_scroll(r, 4, 0);
+            break;
+        case 0xFC:
+            ref_scroll(r, -4, 0);
+            break;
+        case 0xFD:
+            ref_trap(r, CHIP8_TRAP_HALTED);
+            return;
+        case 0xFE:
+            ref_set_mode(r, false);
+            break;
+        case 0xFF:
+            ref_set_mode(r, true);
+            break;
+        default:
+            ref_trap(r, CHIP8_TRAP_BAD_OPCODE);
+            return;
+        }
+        break;
+    case 0x1:
+        r->PC = nnn;
+        return;
+    case 0x2:
+        if (r->SP >= CHIP8_STACK_SIZE)
+        {
+            ref_trap(r, CHIP8_TRAP_STACK_OVERFLOW);
+            return;
+        }
+        r->stack[r->SP++] = r->PC + 2;
+        r->PC = nnn;
+        return;
+    case 0x3:
+        r->PC += V[x] == kk ? 2 : 0;
+        break;
+    case 0x4:
+        r->PC += V[x] != kk ? 2 : 0;
+        break;
+    case 0x5:
+        len = (y - x) * step + 1;
+        if (n == 2 || n == 3)
+        {
+            if (ref_out_of_memory(r, len))
+            {
+                return;
+            }
+            for (i = 0; i < len; i++)
+            {
+                if (n == 2)
+                {
+                    r->memory[(r->I + i) & CHIP8_ADDRESS_MASK] =
+                        V[x + i * step];
+                }
+                else
+                {
+                    V[x + i * step] = ref_peek(r, r->I + i);
+                }
+            }
+            break;
+        }
+        r->PC += V[x] == V[y] ? 2 : 0;
+        break;
+    case 0x6:
+        V[x] = kk;
+        break;
+    case 0x7:
+        V[x] += kk;
+        break;
+    case 0x8:
+        src = q & CHIP8_QUIRK_SHIFT ? x : y;
+        switch (n)
+        {
+        case 0x0:
+            V[x] = V[y];
+            break;
+        case 0x1:
+        case 0x2:
+        case 0x3:
+            V[x] = n == 1 ? V[x] | V[y] : n == 2 ? V[x] & V[y] : V[x] ^ V[y];
+            if (q & CHIP8_QUIRK_VF_RESET)
+            {
+                V[0xF] = 0;
+            }
+            break;
+        // The rest set VF after Vx, so that with x = F it holds the flag.
+        case 0x4:
+            flag = V[x] + V[y] > 0xFF;
+            V[x] += V[y];
+            V[0xF] = flag;
+            break;
+        case 0x5:
+            flag = V[x] >= V[y];
+            V[x] -= V[y];
+            V[0xF] = flag;
+            break;
+        case 0x6:
+            flag = V[src] & 1;
+            V[x] = V[src] >> 1;
+            V[0xF] = flag;
+            break;
+        case 0x7:
+            flag = V[y] >= V[x];
+            V[x] = V[y] - V[x];
+            V[0xF] = flag;
+            break;
+        case 0xE:
+            flag = V[src] >> 7;
+            V[x] = V[src] << 1;
+            V[0xF] = flag;
+            break;
+        default:
+            ref_trap(r, CHIP8_TRAP_BAD_OPCODE);
+            return;
+        }
+        break;
+    case 0x9:
+        r->PC += V[x] != V[y] ? 2 : 0;
+        break;
+    case 0xA:
+        r->I = nnn;
+        break;
+    case 0xB:
+        r->PC = nnn + V[q & CHIP8_QUIRK_JUMP ? x : 0];
+        return;
+    case 0xC:
+        V[x] = chip8_random(&r->rng) & kk;
+        break;
+    case 0xD:
+        len = (n == 0 ? 32 : n) * ((r->planes & 1) + (r->planes >> 1 & 1));
+        if (ref_out_of_memory(r, len))
+        {
+            return;
+        }
+        V[0xF] = ref_draw(r, V[x], V[y], n);
+        if (q & CHIP8_QUIRK_DISPLAY_WAIT)
+        {
+            r->state = CHIP8_STATE_WAIT_TICK;
+        }
+        break;
+    case 0xE:
+        if (kk == 0x9E)
+        {
+            r->PC += r->keypad[V[x] & 0xF] ? 2 : 0;
+        }
+        else if (kk == 0xA1)
+        {
+            r->PC += r->keypad[V[x] & 0xF] ? 0 : 2;
+        }
+        else
+        {
+            return; // Ignored without advancing.
+        }
+        break;
+    default:
+        switch (kk)
+        {
+        case 0x01:
+            r->planes = x & 3;
+            break;
+        case 0x07:
+            V[x] = r->delay;
+            break;
+        case 0x0A:
+            for (i = 0; i < CHIP8_KEY_SIZE && !r->keypad[i]; i++)
+            {
+            }
+            if (i == CHIP8_KEY_SIZE)
+            {
+                r->state = CHIP8_STATE_WAIT_KEY;
+                r->wait_reg = x;
+                return;
+            }
+            V[x] = i;
+            break;
+        case 0x15:
+            r->delay = V[x];
+            break;
+        case 0x18:
+            was_on = r->sound > 0;
+            r->sound = V[x];
+            if (was_on != (V[x] > 0))
+            {
+                ref_push_sound(r, V[x] > 0);
+            }
+            break;
+        case 0x1E:
+            r->I += V[x];
+            break;
+        case 0x29:
+            r->I = V[x] * 5;
+            break;
+        case 0x30:
+            r->I = CHIP8_FONTSET_SIZE + V[x] * 10;
+            break;
+        case 0x33:
+            if (ref_out_of_memory(r, 3))
+            {
+                return;
+            }
+            r->memory[r->I & CHIP8_ADDRESS_MASK] = V[x] / 100;
+            r->memory[(r->I + 1) & CHIP8_ADDRESS_MASK] = V[x] / 10 % 10;
+            r->memory[(r->I + 2) & CHIP8_ADDRESS_MASK] = V[x] % 10;
+            break;
+        case 0x55:
+        case 0x65:
+            if (ref_out_of_memory(r, x + 1))
+            {
+                return;
+            }
+            for (i = 0; i <= x; i++)
+            {
+                if (kk == 0x55)
+                {
+                    r->memory[(r->I + i) & CHIP8_ADDRESS_MASK] = V[i];
+                }
+                else
+                {
+                    V[i] = ref_peek(r, r->I + i);
+                }
+            }
+            if (q & CHIP8_QUIRK_MEMORY)
+            {
+                r->I += x + 1;
+            }
+            break;
+        case 0x75:
+            memcpy(r->flags, V, x + 1);
+            break;
+        case 0x85:
+            memcpy(V, r->flags, x + 1);
+            break;
+        default:
+            ref_trap(r, CHIP8_TRAP_BAD_OPCODE);
+            return;
+        }
+        break;
+    }
+    r->PC += 2;
+}
+
+// What chip8_run does: up to cycles instructions, stopping after one leaves
+// the RUNNING state.
+static int ref_run(ref_t *r, int cycles)
+{
+    int i;
+
+    for (i = 0; i < cycles && r->state == CHIP8_STATE_RUNNING; i++)
+    {
+        ref_exec(r);
+    }
+    r->cycles += i;
+    return i;
+}
+
+// What chip8_step does, one cycle at a time: a stopped machine lets the
+// cycle pass, and a tick follows every instruction that completes one.
+static void ref_step(ref_t *r, int cycles)
+{
+    int i;
+
+    for (i = 0; i < cycles; i++)
+    {
+        if (r->state == CHIP8_STATE_RUNNING)
+        {
+            ref_exec(r);
+        }
+        r->cycles++;
+        r->phase += CHIP8_TIMER_HZ;
+        while (r->phase >= r->ips)
+        {
+            r->phase -= r->ips;
+            ref_tick(r);
+        }
+    }
+}
+
+// Describe the first difference between c and r in what, or return false
+// when they agree.
+static bool differ(chip8_t *c, ref_t *r, char *what, size_t size)
+{
+    chip8_sound_event_t event;
+    int words = chip8_row_words(c);
+    int plane, x, y, i;
+
+#define DIFFER(cond, ...)                                                      \
+    do                                                                         \
+    {                                                                          \
+        if (cond)                                                              \
+        {                                                                      \
+            snprintf(what, size, __VA_ARGS__);                                 \
+            return true;                                                       \
+        }                                                                      \
+    } while (0)
+
+    DIFFER(c->state != r->state, "state %u, expected %u", c->state, r->state);
+    DIFFER(c->trap != r->trap, "trap %u, expected %u", c->trap, r->trap);
+    DIFFER(c->PC != r->PC, "PC %03X, expected %03X", c->PC, r->PC);
+    DIFFER(c->I != r->I, "I %03X, expected %03X", c->I, r->I);
+    DIFFER(c->SP != r->SP, "SP %u, expected %u", c->SP, r->SP);
+    for (i = 0; i < CHIP8_REGISTER_COUNT; i++)
+    {
+        DIFFER(c->V[i] != r->V[i], "V%X %02X, expected %02X", i, c->V[i],
+               r->V[i]);
+    }
+    for (i = 0; i < r->SP && i < CHIP8_STACK_SIZE; i++)
+    {
+        DIFFER(c->stack[i] != r->stack[i], "stack[%d] %03X, expected %03X", i,
+               c->stack[i], r->stack[i]);
+    }
+    DIFFER(memcmp(c->flags, r->flags, sizeof(r->flags)) != 0, "flags");
+    for (i = 0; i < CHIP8_MEMORY_SIZE; i++)
+    {
+        DIFFER(c->memory[i] != r->memory[i], "memory[%03X] %02X, expected %02X",
+               i, c->memory[i], r->memory[i]);
+    }
+    DIFFER(c->hires != r->hires, "hires %u, expected %u", c->hires, r->hires);
+    DIFFER(c->planes != r->planes, "planes %u, expected %u", c->planes,
+           r->planes);
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        for (y = 0; y < ref_height(r); y++)
+        {
+            for (x = 0; x < ref_width(r); x++)
+            {
+                int bit = c->frame_buffer[plane][y * words + x / 64] >>
+                              (63 - x % 64) &
+                          1;
+
+                DIFFER(bit != r->screen[plane][y][x],
+                       "pixel (%d, %d) of plane %d is %d", x, y, plane, bit);
+            }
+        }
+        for (i = ref_height(r) * words; i < CHIP8_PLANE_WORDS; i++)
+        {
+            DIFFER(c->frame_buffer[plane][i] != 0,
+                   "word %d of plane %d, past the screen, is set", i, plane);
+        }
+    }
+    DIFFER(c->ticks != r->ticks, "tick %llu, expected %llu",
+           (unsigned long long)c->ticks, (unsigned long long)r->ticks);
+    DIFFER(c->cycles != r->cycles, "cycle %llu, expected %llu",
+           (unsigned long long)c->cycles, (unsigned long long)r->cycles);
+    DIFFER(chip8_delay_timer(c) != r->delay, "delay timer %u, expected %u",
+           chip8_delay_timer(c), r->delay);
+    DIFFER(chip8_sound_timer(c) != r->sound, "sound timer %u, expected %u",
+           chip8_sound_timer(c), r->sound);
+    while (chip8_poll_sound(c, &event))
+    {
+        chip8_sound_event_t *expected = &r->sound_events[r->sound_head];
+
+        DIFFER(r->sound_count == 0, "extra buzzer edge at tick %llu",
+               (unsigned long long)event.tick);
+        DIFFER(event.tick != expected->tick || event.on != expected->on,
+               "buzzer %s at tick %llu, expected %s at tick %llu",
+               event.on ? "on" : "off", (unsigned long long)event.tick,
+               expected->on ? "on" : "off",
+               (unsigned long long)expected->tick);
+        r->sound_head = (r->sound_head + 1) % CHIP8_SOUND_EVENTS;
+        r->sound_count--;
+    }
+    DIFFER(r->sound_count != 0, "missing buzzer edge at tick %llu",
+           (unsigned long long)r->sound_events[r->sound_head].tick);
+#undef DIFFER
+
+    return false;
+}
+
+// xorshift32 for the test's own choices, apart from the machines'.
+static uint32_t next(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Run c, just loaded with a program, and a reference copy of it side by side
+// for up to insns instructions in random batches, pressing and releasing
+// random keys in between, and compare them after every batch. step runs
+// them through chip8_step, otherwise through chip8_run with the odd timer
+// tick. Returns false after reporting the first difference.
+static bool run_both(const char *name, chip8_t *c, uint32_t seed, bool step,
+                     uint64_t insns)
+{
+    ref_t *r = &reference;
+    uint32_t rng = seed * 2654435761u + 1;
+    char what[128];
+
+    ref_init(r, c);
+    while (r->cycles < insns && r->state != CHIP8_STATE_TRAPPED)
+    {
+        uint64_t before = r->cycles;
+        int batch = 1 + next(&rng) % 48;
+
+        if (next(&rng) % 8 == 0)
+        {
+            uint8_t key = next(&rng) % CHIP8_KEY_SIZE;
+            bool down = !r->keypad[key];
+
+            chip8_set_key(c, key, down);
+            ref_set_key(r, key, down);
+        }
+        if (step)
+        {
+            chip8_step(c, batch);
+            ref_step(r, batch);
+        }
+        else
+        {
+            int ran = chip8_run(c, batch);
+
+            if (ran != ref_run(r, batch))
+            {
+                printf("FAIL %s: ran %d of %d instructions, expected %d\n",
+                       name, ran, batch, (int)(r->cycles - before));
+                return false;
+            }
+            if (next(&rng) % 4 == 0)
+            {
+                chip8_tick(c);
+                ref_tick(r);
+            }
+        }
+        if (differ(c, r, what, sizeof(what)))
+        {
+            printf("FAIL %s: %s after instruction %llu\n", name, what,
+                   (unsigned long long)r->cycles);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Instruction shapes for generated programs: the opcode with the bits in
+// random filled in at random, picked weight times as often as the others.
+typedef struct shape
+{
+    uint16_t opcode;
+    uint16_t random;
+    int weight;
+} shape_t;
+
+static const shape_t shapes[] = {
+    {0x6000, 0x0FFF, 8}, // LD Vx, byte
+    {0x7000, 0x0FFF, 8}, // ADD Vx, byte
+    {0x8000, 0x0FF7, 8}, // 8xy0 - 8xy7
+    {0x800E, 0x0FF0, 2}, // SHL Vx, Vy
+    {0x8008, 0x0FF7, 1}, // 8xy8 - 8xyF, mostly bad
+    {0x3000, 0x0F03, 3}, // SE Vx, byte, often taken
+    {0x4000, 0x0F03, 3}, // SNE Vx, byte
+    {0x5000, 0x0FF0, 2}, // SE Vx, Vy
+    {0x9000, 0x0FF0, 2}, // SNE Vx, Vy
+    {0xC000, 0x0FFF, 3}, // RND Vx, byte
+    {0xD000, 0x0FFF, 8}, // DRW Vx, Vy, nibble
+    {0xE09E, 0x0F00, 1}, // SKP Vx
+    {0xE0A1, 0x0F00, 1}, // SKNP Vx
+    {0xF007, 0x0F00, 2}, // LD Vx, DT
+    {0xF00A, 0x0F00, 1}, // LD Vx, K
+    {0xF015, 0x0F00, 2}, // LD DT, Vx
+    {0xF018, 0x0F00, 2}, // LD ST, Vx
+    {0xF01E, 0x0300, 1}, // ADD I, Vx
+    {0xF029, 0x0F00, 1}, // LD F, Vx
+    {0xF030, 0x0F00, 1}, // LD HF, Vx
+    {0xF033, 0x0F00, 2}, // LD B, Vx
+    {0xF055, 0x0F00, 2}, // LD [I], Vx
+    {0xF065, 0x0F00, 2}, // LD Vx, [I]
+    {0xF075, 0x0F00, 1}, // LD R, Vx
+    {0xF085, 0x0F00, 1}, // LD Vx, R
+    {0x00E0, 0x0000, 1}, // CLS
+    {0x00C0, 0x000F, 1}, // SCD nibble
+    {0x00D0, 0x000F, 1}, // SCU nibble
+    {0x00FB, 0x0000, 2}, // SCR
+    {0x00FC, 0x0000, 2}, // SCL
+    {0x00FE, 0x0000, 1}, // LOW
+    {0x00FF, 0x0000, 2}, // HIGH
+    {0x5002, 0x0FF0, 1}, // LD [I], Vx-Vy
+    {0x5003, 0x0FF0, 2}, // LD Vx-Vy, [I]
+    {0xF001, 0x0300, 1}, // PLANE n
+};
+
+// Pick a shape by weight and fill it in.
+static uint16_t random_opcode(uint32_t *rng)
+{
+    int total = 0, pick;
+    size_t i;
+
+    for (i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++)
+    {
+        total += shapes[i].weight;
+    }
+    pick = next(rng) % total;
+    for (i = 0; pick >= shapes[i].weight; i++)
+    {
+        pick -= shapes[i].weight;
+    }
+    return shapes[i].opcode | (next(rng) & shapes[i].random);
+}
+
+// Generate a program: a loop of body random instructions that sometimes
+// point I somewhere and call a subroutine, which ends with two 00EE in case
+// it skips the first, followed by 64 bytes of sprite data. Some of the
+// Annn point into the code, so that the Fx33, Fx55 and 5xy2 after them
+// overwrite instructions that run later. Returns the size of the program.
+static size_t generate(uint8_t *rom, uint32_t seed, int body)
+{
+    uint32_t rng = seed * 2246822519u + 7;
+    uint16_t sub = CHIP8_PROGRAM_START_ADDRESS + 2 * (body + 1);
+    int sub_length = 4 + next(&rng) % 8;
+    uint16_t data = sub + 2 * (sub_length + 2);
+    uint16_t target;
+    size_t size = 0;
+    int i;
+
+#define EMIT(opcode)                                                           \
+    do                                                                         \
+    {                                                                          \
+        uint16_t op = (opcode);                                                \
+                                                                               \
+        rom[size++] = (uint8_t)(op >> 8);                                      \
+        rom[size++] = (uint8_t)op;                                             \
+    } while (0)
+
+    for (i = 0; i < body + sub_length; i++)
+    {
+        uint32_t kind = next(&rng) % 16;
+
+        if (i == body)
+        {
+            EMIT(0x1000 | CHIP8_PROGRAM_START_ADDRESS); // Back to the start.
+        }
+        if (kind < 2)
+        {
+            switch (next(&rng) % 8)
+            {
+            case 0:
+                target = sub + 2 * (next(&rng) % sub_length);
+                break;
+            case 1:
+            case 2:
+                target = CHIP8_PROGRAM_START_ADDRESS + 2 * (next(&rng) % body);
+                break;
+            case 3:
+                target = next(&rng) % (CHIP8_FONTSET_SIZE +
+                                       CHIP8_HIRES_FONTSET_SIZE);
+                break;
+            default:
+                target = data + next(&rng) % 32;
+                break;
+            }
+            EMIT(0xA000 | target);
+        }
+        else if (kind == 2 && i < body)
+        {
+            EMIT(0x2000 | sub);
+        }
+        else
+        {
+            EMIT(random_opcode(&rng));
+        }
+    }
+    EMIT(0x00EE);
+    EMIT(0x00EE);
+    for (i = 0; i < 64; i++)
+    {
+        rom[size++] = (uint8_t)next(&rng);
+    }
+#undef EMIT
+
+    return size;
+}
+
+static void report(const char *name, bool passed)
+{
+    if (passed)
+    {
+        printf("ok   %s\n", name);
+    }
+    else
+    {
+        failures++;
+    }
+}
+
+// A hand-written program and what it must leave behind: PC and one register
+// after running insns instructions with key held down.
+typedef struct fixed_case
+{
+    const char *name;
+    chip8_quirks_t quirks;
+    int key; // -1 for none.
+    uint8_t rom[8];
+    int insns;
+    uint16_t pc;
+    uint8_t reg;
+    uint8_t value;
+} fixed_case_t;
+
+// The skips once advanced by 4 when the condition failed and by 2 when it
+// held, and 8xyE set VF from bit 0 while 8xy6 shifted Vx under every
+// profile. 8xy5 and 8xy7 cleared VF when Vx equalled Vy, and the 8xy_
+// instructions that set VF lost the flag when x was F. These pin the
+// behaviour down for each on its own.
+static const fixed_case_t fixed_cases[] = {
+    {"3xkk taken", CHIP8_QUIRKS_MODERN, -1, {0x60, 0x05, 0x30, 0x05}, 2,
+     0x206, 0, 0x05},
+    {"3xkk not taken", CHIP8_QUIRKS_MODERN, -1, {0x60, 0x05, 0x30, 0x06}, 2,
+     0x204, 0, 0x05},
+    {"4xkk taken", CHIP8_QUIRKS_MODERN, -1, {0x60, 0x05, 0x40, 0x06}, 2,
+     0x206, 0, 0x05},
+    {"4xkk not taken", CHIP8_QUIRKS_MODERN, -1, {0x60, 0x05, 0x40, 0x05}, 2,
+     0x204, 0, 0x05},
+    {"5xy0 taken", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x05, 0x61, 0x05, 0x50, 0x10}, 3, 0x208, 1, 0x05},
+    {"5xy0 not taken", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x05, 0x61, 0x06, 0x50, 0x10}, 3, 0x206, 1, 0x06},
+    {"9xy0 taken", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x05, 0x61, 0x06, 0x90, 0x10}, 3, 0x208, 1, 0x06},
+    {"9xy0 not taken", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x05, 0x61, 0x05, 0x90, 0x10}, 3, 0x206, 1, 0x05},
+    {"Ex9E taken", CHIP8_QUIRKS_MODERN, 5, {0x60, 0x05, 0xE0, 0x9E}, 2,
+     0x206, 0, 0x05},
+    {"Ex9E not taken", CHIP8_QUIRKS_MODERN, -1, {0x60, 0x05, 0xE0, 0x9E}, 2,
+     0x204, 0, 0x05},
+    {"ExA1 taken", CHIP8_QUIRKS_MODERN, -1, {0x60, 0x05, 0xE0, 0xA1}, 2,
+     0x206, 0, 0x05},
+    {"ExA1 not taken", CHIP8_QUIRKS_MODERN, 5, {0x60, 0x05, 0xE0, 0xA1}, 2,
+     0x204, 0, 0x05},
+    {"8xyE sets VF from bit 7", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x80, 0x80, 0x0E}, 2, 0x204, 0xF, 1},
+    {"8xyE clears VF from bit 7", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x01, 0x80, 0x0E}, 2, 0x204, 0xF, 0},
+    {"8xy6 sets VF from bit 0", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x01, 0x80, 0x06}, 2, 0x204, 0xF, 1},
+    {"8xy6 clears VF from bit 0", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x80, 0x80, 0x06}, 2, 0x204, 0xF, 0},
+    {"8xy6 shifts Vx", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x80, 0x61, 0x03, 0x80, 0x16}, 3, 0x206, 0, 0x40},
+    {"8xy6 shifts Vy on the VIP", CHIP8_QUIRKS_VIP, -1,
+     {0x60, 0x80, 0x61, 0x03, 0x80, 0x16}, 3, 0x206, 0, 0x01},
+    {"8xyE shifts Vy on the VIP", CHIP8_QUIRKS_VIP, -1,
+     {0x60, 0x01, 0x61, 0x81, 0x80, 0x1E}, 3, 0x206, 0, 0x02},
+    {"8xy5 sets VF when Vx equals Vy", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x05, 0x61, 0x05, 0x80, 0x15}, 3, 0x206, 0xF, 1},
+    {"8xy7 sets VF when Vx equals Vy", CHIP8_QUIRKS_MODERN, -1,
+     {0x60, 0x05, 0x61, 0x05, 0x80, 0x17}, 3, 0x206, 0xF, 1},
+    {"8Fy4 leaves the carry in VF", CHIP8_QUIRKS_MODERN, -1,
+     {0x6F, 0x10, 0x61, 0x20, 0x8F, 0x14}, 3, 0x206, 0xF, 0},
+    {"8Fy5 leaves NOT borrow in VF", CHIP8_QUIRKS_MODERN, -1,
+     {0x6F, 0x30, 0x61, 0x10, 0x8F, 0x15}, 3, 0x206, 0xF, 1},
+    {"8Fy7 leaves NOT borrow in VF", CHIP8_QUIRKS_MODERN, -1,
+     {0x6F, 0x10, 0x61, 0x30, 0x8F, 0x17}, 3, 0x206, 0xF, 1},
+    {"8F06 leaves the bit shifted out in VF", CHIP8_QUIRKS_MODERN, -1,
+     {0x6F, 0x05, 0x8F, 0x06}, 2, 0x204, 0xF, 1},
+    {"8F0E leaves the bit shifted out in VF", CHIP8_QUIRKS_MODERN, -1,
+     {0x6F, 0x81, 0x8F, 0x0E}, 2, 0x204, 0xF, 1},
+};
+
+static void test_fixed_cases(void)
+{
+    chip8_t *c = &machine;
+    bool passed = true;
+    size_t i;
+
+    for (i = 0; i < sizeof(fixed_cases) / sizeof(fixed_cases[0]); i++)
+    {
+        const fixed_case_t *t = &fixed_cases[i];
+
+        chip8_init(c);
+        chip8_load_rom(c, t->rom, sizeof(t->rom));
+        chip8_set_quirks(c, t->quirks);
+        if (t->key >= 0)
+        {
+            chip8_set_key(c, (uint8_t)t->key, true);
+        }
+        chip8_run(c, t->insns);
+        if (c->PC != t->pc || c->V[t->reg] != t->value)
+        {
+            printf("FAIL fixed: %s: PC %03X V%X %02X, expected PC %03X V%X "
+                   "%02X\n",
+                   t->name, c->PC, t->reg, c->V[t->reg], t->pc, t->reg,
+                   t->value);
+            passed = false;
+        }
+    }
+    report("fixed", passed);
+}
+
+// chip8_emulate_cycle on a machine parked after Dxyn on the VIP must leave it
+// parked instead of running the next instruction.
+static void test_parked(void)
+{
+    static const uint8_t rom[] = {0xD0, 0x01, 0x60, 0x05};
+    chip8_t *c = &machine;
+    bool passed = true;
+
+    chip8_init(c);
+    chip8_load_rom(c, rom, sizeof(rom));
+    chip8_set_quirks(c, CHIP8_QUIRKS_VIP);
+    chip8_emulate_cycle(c);
+    if (chip8_emulate_cycle(c) != CHIP8_TRAP_NONE ||
+        c->state != CHIP8_STATE_WAIT_TICK || c->PC != 0x202 || c->V[0] != 0)
+    {
+        printf("FAIL parked: state %d PC %03X V0 %02X, expected state %d PC "
+               "202 V0 00\n",
+               c->state, c->PC, c->V[0], CHIP8_STATE_WAIT_TICK);
+        passed = false;
+    }
+    report("parked", passed);
+}
+
+// Lanes of a batch keep their timers across scalar steps and ticks, and
+// restoring them between steps is not the buzzer starting.
+static void test_batch_timers(void)
+{
+    static const uint8_t rom[] = {0x60, 0x05, 0xF0, 0x18, 0xF0, 0x15,
+                                  0x12, 0x06};
+    chip8_batch_t *b = chip8_batch_create(2);
+    chip8_sound_event_t event;
+    chip8_t *c = &machine;
+    bool passed = true;
+    int i;
+
+    if (b == NULL || !chip8_batch_load_rom(b, rom, sizeof(rom)))
+    {
+        printf("FAIL batch-timers: cannot create the batch\n");
+        chip8_batch_destroy(b);
+        report("batch-timers", false);
+        return;
+    }
+    for (i = 0; i < 3; i++)
+    {
+        chip8_batch_run(b, 10);
+        chip8_batch_tick(b);
+    }
+    chip8_batch_run(b, 10);
+    chip8_batch_get(b, 1, c);
+    if (c->ticks != 3 || chip8_delay_timer(c) != 2 ||
+        chip8_sound_timer(c) != 2 || chip8_poll_sound(c, &event))
+    {
+        printf("FAIL batch-timers: ticks %llu DT %u ST %u, expected ticks 3 "
+               "DT 2 ST 2 and no buzzer edges\n",
+               (unsigned long long)c->ticks, chip8_delay_timer(c),
+               chip8_sound_timer(c));
+        passed = false;
+    }
+    chip8_batch_destroy(b);
+    report("batch-timers", passed);
+}
+
+// Restarting clears only the rows of the current mode, which is the whole
+// screen as long as the rows past them are kept zero: chip8_init must clear
+// a machine that held anything before, and a 128x64 program drawing on both
+// planes at the bottom right must leave nothing lit after chip8_reset.
+static void test_reset_screen(void)
+{
+    static const uint8_t rom[] = {
+        0x00, 0xFF, // 200: HIGH
+        0xF3, 0x01, // 202: PLANE 3
+        0x60, 0x78, // 204: LD V0, 120
+        0x61, 0x3A, // 206: LD V1, 58
+        0xA0, 0x00, // 208: LD I, 000
+        0xD0, 0x15, // 20A: DRW V0, V1, 5
+        0x12, 0x0C, // 20C: JP 20C
+    };
+    chip8_t *c = &machine;
+    bool passed = true;
+    int plane, word, lit = 0;
+
+    memset(c, 0xA5, sizeof(*c));
+    chip8_init(c);
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        for (word = 0; word < CHIP8_PLANE_WORDS; word++)
+        {
+            lit += c->frame_buffer[plane][word] != 0;
+        }
+    }
+    if (lit != 0)
+    {
+        printf("FAIL reset-screen: %d words lit after chip8_init\n", lit);
+        passed = false;
+    }
+
+    chip8_load_rom(c, rom, sizeof(rom));
+    chip8_step(c, 100);
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        if (c->frame_buffer[plane][62 * 2 + 1] == 0)
+        {
+            printf("FAIL reset-screen: plane %d not drawn at 128x64\n",
+                   plane);
+            passed = false;
+        }
+    }
+    chip8_reset(c);
+    lit = 0;
+    for (plane = 0; plane < CHIP8_PLANES; plane++)
+    {
+        for (word = 0; word < CHIP8_PLANE_WORDS; word++)
+        {
+            lit += c->frame_buffer[plane][word] != 0;
+        }
+    }
+    if (lit != 0 || c->hires)
+    {
+        printf("FAIL reset-screen: %d words lit, hires %d after chip8_reset\n",
+               lit, c->hires);
+        passed = false;
+    }
+    report("reset-screen", passed);
+}
+
+// IBM_Logo.ch8 as the database loads it, drawing and then jumping to itself.
+static void test_ibm_logo(void)
+{
+    chip8_t *c = &machine;
+    bool passed;
+
+    chip8_init(c);
+    passed = chip8_load_game(c, CHIP8_TEST_ROM_DIR "/IBM_Logo.ch8");
+    if (!passed)
+    {
+        printf("FAIL ibm-logo: cannot load IBM_Logo.ch8\n");
+    }
+    else
+    {
+        passed = run_both("ibm-logo", c, 1, false, 2000);
+    }
+    report("ibm-logo", passed);
+}
+
+#ifdef CHIP8_TRACE
+// Record a program that loads ranges of registers with 5xy3, in both
+// directions, and stores them back reversed with 5xy2, so that every pass
+// changes registers other than Vx and VF. Replaying the trace on a fresh
+// machine must match it instruction for instruction.
+static void test_trace_replay(void)
+{
+    static const uint8_t rom[] = {
+        0xA2, 0x10, // 200: LD I, 210
+        0x51, 0x93, // 202: LD V1-V9, [I]
+        0x59, 0x12, // 204: LD [I], V9-V1
+        0x7A, 0x01, // 206: ADD VA, 1
+        0x5A, 0xA2, // 208: LD [I], VA-VA
+        0x5D, 0xB3, // 20A: LD VD-VB, [I]
+        0x12, 0x02, // 20C: JP 202
+        0x00, 0x00, // 20E:
+        0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, // 210: data
+    };
+    const char *path = "chip8-test.trace";
+    chip8_t *c = &machine;
+    chip8_trace_point_t expected, actual;
+    chip8_replay_t *r;
+    bool passed = false;
+
+    chip8_init(c);
+    chip8_load_rom(c, rom, sizeof(rom));
+    chip8_set_quirks(c, CHIP8_QUIRKS_XOCHIP);
+    if (!chip8_trace_start(c, path))
+    {
+        printf("FAIL trace-replay: cannot create %s\n", path);
+        report("trace-replay", false);
+        return;
+    }
+    chip8_run(c, 1000);
+    chip8_trace_stop(c);
+
+    r = chip8_replay_open(path);
+    if (r == NULL)
+    {
+        printf("FAIL trace-replay: cannot open %s\n", path);
+    }
+    else
+    {
+        chip8_init(c);
+        switch (chip8_replay_verify(r, c, 0, &expected, &actual))
+        {
+        case CHIP8_REPLAY_MATCH:
+            passed = true;
+            break;
+        case CHIP8_REPLAY_DIVERGED:
+            printf("FAIL trace-replay: diverged at instruction %llu, PC %03X\n",
+                   (unsigned long long)expected.index, expected.PC);
+            break;
+        case CHIP8_REPLAY_CORRUPT:
+            printf("FAIL trace-replay: trace is corrupt\n");
+            break;
+        }
+        chip8_replay_close(r);
+    }
+    remove(path);
+    report("trace-replay", passed);
+}
+#endif
+
+// Offset of the draw flag in a state. chip8_load_state sets the flag instead
+// of loading it, so states are compared without it.
+#define STATE_DRAW_FLAG (8 + 2 + 3 * 2 + 3)
+
+static chip8_t other;
+static uint8_t state_a[CHIP8_STATE_SIZE], state_b[CHIP8_STATE_SIZE];
+
+// Whether c saves to the state in buf, apart from the draw flag.
+static bool saves_to(const chip8_t *c, const uint8_t *buf)
+{
+    chip8_save_state(c, state_b, sizeof(state_b));
+    state_b[STATE_DRAW_FLAG] = buf[STATE_DRAW_FLAG];
+    return memcmp(state_b, buf, CHIP8_STATE_SIZE) == 0;
+}
+
+// Start c on generated program seed and run it for a while.
+static void run_generated(chip8_t *c, uint32_t seed, int insns)
+{
+    uint8_t rom[MAX_GAME_SIZE];
+    size_t size = generate(rom, seed, 8 + seed % 40);
+
+    chip8_init(c);
+    chip8_load_rom(c, rom, size);
+    chip8_set_quirks(c, CHIP8_QUIRKS_XOCHIP);
+    chip8_seed(c, seed);
+    chip8_set_key(c, seed % CHIP8_KEY_SIZE, true);
+    chip8_step(c, insns);
+}
+
+// A saved machine loads into a fresh one, which saves to the same state and
+// then runs on exactly like the original.
+static void test_state_round_trip(void)
+{
+    chip8_t *a = &machine, *b = &other;
+    bool passed = true;
+    uint32_t seed;
+
+    for (seed = 1; seed <= 8 && passed; seed++)
+    {
+        run_generated(a, seed, 1500);
+        if (chip8_save_state(a, state_a, sizeof(state_a)) != CHIP8_STATE_SIZE)
+        {
+            printf("FAIL state-round-trip: save did not write %d bytes\n",
+                   CHIP8_STATE_SIZE);
+            passed = false;
+            break;
+        }
+        chip8_init(b);
+        if (!chip8_load_state(b, state_a, sizeof(state_a)) ||
+            !saves_to(b, state_a))
+        {
+            printf("FAIL state-round-trip: program %u does not load back\n",
+                   seed);
+            passed = false;
+            break;
+        }
+        chip8_step(a, 1500);
+        chip8_step(b, 1500);
+        chip8_save_state(a, state_a, sizeof(state_a));
+        if (!saves_to(b, state_a))
+        {
+            printf("FAIL state-round-trip: program %u runs differently after "
+                   "loading\n",
+                   seed);
+            passed = false;
+        }
+    }
+    report("state-round-trip", passed);
+}
+
+// States with the wrong magic or version, or cut short, are refused and
+// leave the machine untouched, and a short buffer is not written.
+static void test_state_rejects(void)
+{
+    chip8_t *a = &machine, *b = &other;
+    static uint8_t bad[CHIP8_STATE_SIZE], before[CHIP8_STATE_SIZE];
+    bool passed = true;
+
+    run_generated(a, 3, 1000);
+    chip8_save_state(a, state_a, sizeof(state_a));
+    run_generated(b, 4, 1000);
+    chip8_save_state(b, before, sizeof(before));
+
+    memcpy(bad, state_a, sizeof(bad));
+    bad[0] ^= 0xFF;
+    if (chip8_load_state(b, bad, sizeof(bad)))
+    {
+        printf("FAIL state-rejects: loaded a state with the wrong magic\n");
+        passed = false;
+    }
+    memcpy(bad, state_a, sizeof(bad));
+    bad[8] = (CHIP8_STATE_VERSION + 1) & 0xFF;
+    bad[9] = (CHIP8_STATE_VERSION + 1) >> 8;
+    if (chip8_load_state(b, bad, sizeof(bad)))
+    {
+        printf("FAIL state-rejects: loaded a state of version %d\n",
+               CHIP8_STATE_VERSION + 1);
+        passed = false;
+    }
+    if (chip8_load_state(b, state_a, sizeof(state_a) - 1))
+    {
+        printf("FAIL state-rejects: loaded a state one byte short\n");
+        passed = false;
+    }
+    if (!saves_to(b, before))
+    {
+        printf("FAIL state-rejects: a refused state changed the machine\n");
+        passed = false;
+    }
+
+    memset(bad, 0xA5, sizeof(bad));
+    if (chip8_save_state(a, bad, sizeof(bad) - 1) != 0 || bad[0] != 0xA5)
+    {
+        printf("FAIL state-rejects: saved into a buffer one byte short\n");
+        passed = false;
+    }
+    report("state-rejects", passed);
+}
+
+// Frames pushed onto a rewind history pop back, newest first, as exactly the
+// states saved when they were pushed. With room for only some deltas the
+// oldest frames go first and the rest still pop back whole.
+static void test_rewind(void)
+{
+    enum
+    {
+        FRAMES = 40
+    };
+    static uint8_t states[FRAMES][CHIP8_STATE_SIZE];
+    static const size_t capacities[] = {1 << 20, 512};
+    chip8_t *c = &machine;
+    chip8_rewind_t *r;
+    bool passed = true;
+    size_t i, kept;
+    int frame;
+
+    for (i = 0; i < sizeof(capacities) / sizeof(capacities[0]) && passed; i++)
+    {
+        r = chip8_rewind_create(capacities[i]);
+        if (r == NULL)
+        {
+            printf("FAIL rewind: cannot create a history\n");
+            passed = false;
+            break;
+        }
+        run_generated(c, 5, 100);
+        for (frame = 0; frame < FRAMES; frame++)
+        {
+            chip8_step(c, 50 + frame);
+            chip8_save_state(c, states[frame], CHIP8_STATE_SIZE);
+            chip8_rewind_push(r, c);
+        }
+        kept = chip8_rewind_frames(r);
+        if (kept == 0 || (i == 0) != (kept == FRAMES - 1) ||
+            chip8_rewind_bytes(r) > capacities[i])
+        {
+            printf("FAIL rewind: %zu frames in %zu bytes after %d pushes into "
+                   "%zu bytes\n",
+                   kept, chip8_rewind_bytes(r), FRAMES, capacities[i]);
+            passed = false;
+        }
+        for (frame = FRAMES - 2; frame >= FRAMES - 1 - (int)kept && passed;
+             frame--)
+        {
+            chip8_init(c);
+            if (!chip8_rewind_pop(r, c) || !saves_to(c, states[frame]))
+            {
+                printf("FAIL rewind: frame %d of %d does not pop back with "
+                       "%zu bytes\n",
+                       frame, FRAMES, capacities[i]);
+                passed = false;
+            }
+        }
+        if (passed && chip8_rewind_pop(r, c))
+        {
+            printf("FAIL rewind: popped past the oldest frame kept\n");
+            passed = false;
+        }
+        chip8_rewind_destroy(r);
+    }
+    report("rewind", passed);
+}
+
+#ifdef CHIP8_ROM_CACHE
+// Loading a state into a machine started from a cached ROM copies only the
+// pages the state changes, and the others stay shared with the ROM.
+static void test_state_shared_pages(void)
+{
+    // Stores into page 3 and then jumps to itself.
+    static const uint8_t rom[] = {0xA3, 0x00, 0x60, 0x2A, 0xF0, 0x55,
+                                  0x12, 0x06};
+    chip8_rom_cache_t *cache = chip8_rom_cache_create();
+    const chip8_rom_t *image;
+    chip8_t *a = &machine, *b = &other;
+    uint16_t all;
+    bool passed = true;
+
+    image = cache != NULL ? chip8_rom_cache_add(cache, rom, sizeof(rom)) : NULL;
+    if (image == NULL)
+    {
+        printf("FAIL state-shared-pages: cannot cache the program\n");
+        chip8_rom_cache_destroy(cache);
+        report("state-shared-pages", false);
+        return;
+    }
+    chip8_init(a);
+    chip8_init(b);
+    chip8_rom_init(a, image);
+    all = a->shared_pages;
+    chip8_run(a, 10);
+    chip8_save_state(a, state_a, sizeof(state_a));
+
+    chip8_rom_init(b, image);
+    if (!chip8_load_state(b, state_a, sizeof(state_a)) ||
+        !saves_to(b, state_a) || b->shared_pages != (all & ~(1u << 3)))
+    {
+        printf("FAIL state-shared-pages: shared pages %04X after loading, "
+               "expected %04X\n",
+               b->shared_pages, all & ~(1u << 3));
+        passed = false;
+    }
+    if (b->memory[0x300] != 0x2A)
+    {
+        printf("FAIL state-shared-pages: page 3 was not copied\n");
+        passed = false;
+    }
+    chip8_init(a); // Nothing may point into the cache once it is gone.
+    chip8_init(b);
+    chip8_rom_cache_destroy(cache);
+    report("state-shared-pages", passed);
+}
+#endif
+
+#ifdef CHIP8_ROM_CACHE
+// Start c on rom from cache, with V0 to V3 set to v, v + 1 and so on.
+// Returns false when the program cannot be cached.
+static bool start_cached(chip8_t *c, chip8_rom_cache_t *cache,
+                         const uint8_t *rom, size_t size, uint8_t v)
+{
+    const chip8_rom_t *image = chip8_rom_cache_add(cache, rom, size);
+    int i;
+
+    if (image == NULL)
+    {
+        return false;
+    }
+    chip8_init(c);
+    chip8_rom_init(c, image);
+    chip8_set_quirks(c, CHIP8_QUIRKS_XOCHIP);
+    for (i = 0; i < 4; i++)
+    {
+        c->V[i] = (uint8_t)(v + i);
+    }
+    return true;
+}
+
+// chip8_own copies the shared pages a range overlaps, wrapping past 0xFFF,
+// and Fx33, Fx55 and 5xy2 own exactly the pages they store into. Every
+// machine keeps reading the rest from the ROM.
+static void test_rom_own(void)
+{
+    static const struct
+    {
+        const char *what;
+        uint8_t rom[6];
+        uint16_t owned; // Pages the program ends up owning.
+        uint16_t addr;  // Where the first byte goes.
+        uint8_t a, b;   // The byte there on the two machines.
+    } stores[] = {
+        {"Fx33", {0xA4, 0x10, 0xF0, 0x33, 0x12, 0x04}, 1 << 4, 0x410, 1, 0},
+        {"Fx55", {0xA5, 0xF0, 0xF3, 0x55, 0x12, 0x04}, 1 << 5, 0x5F0, 0x9C,
+         0x41},
+        {"Fx55 across pages",
+         {0xA4, 0xFE, 0xF3, 0x55, 0x12, 0x04},
+         1 << 4 | 1 << 5,
+         0x4FE,
+         0x9C,
+         0x41},
+        {"5xy2", {0xA6, 0x00, 0x50, 0x32, 0x12, 0x04}, 1 << 6, 0x600, 0x9C,
+         0x41},
+    };
+    chip8_rom_cache_t *cache = chip8_rom_cache_create();
+    chip8_t *a = &machine, *b = &other;
+    const chip8_rom_t *image;
+    bool passed = true;
+    size_t i;
+
+    image = cache != NULL ? chip8_rom_cache_add(cache, stores[0].rom, 6) : NULL;
+    if (image == NULL)
+    {
+        printf("FAIL rom-own: cannot cache a program\n");
+        chip8_rom_cache_destroy(cache);
+        report("rom-own", false);
+        return;
+    }
+    chip8_init(a);
+    chip8_rom_init(a, image);
+    chip8_own(a, 0xFF0, 0x20);
+    if (a->shared_pages != (0xFFFF & ~(1u << 15 | 1u << 0)) ||
+        memcmp(a->memory, image->image, CHIP8_PAGE_SIZE) != 0 ||
+        memcmp(a->memory + 0xF00, image->image + 0xF00, CHIP8_PAGE_SIZE) != 0)
+    {
+        printf("FAIL rom-own: shared pages %04X after owning 0xFF0 to 0x00F, "
+               "expected 7FFE\n",
+               a->shared_pages);
+        passed = false;
+    }
+    chip8_own(a, 0x345, CHIP8_MEMORY_SIZE);
+    if (a->shared_pages != 0 ||
+        memcmp(a->memory, image->image, CHIP8_MEMORY_SIZE) != 0)
+    {
+        printf("FAIL rom-own: shared pages %04X after owning all of memory\n",
+               a->shared_pages);
+        passed = false;
+    }
+
+    for (i = 0; i < sizeof(stores) / sizeof(stores[0]) && passed; i++)
+    {
+        if (!start_cached(a, cache, stores[i].rom, 6, 0x9C) ||
+            !start_cached(b, cache, stores[i].rom, 6, 0x41))
+        {
+            printf("FAIL rom-own: cannot cache the %s program\n",
+                   stores[i].what);
+            passed = false;
+            break;
+        }
+        chip8_run(a, 3);
+        if (a->shared_pages != (0xFFFF & ~stores[i].owned) ||
+            chip8_peek(a, stores[i].addr) != stores[i].a)
+        {
+            printf("FAIL rom-own: %s left shared pages %04X and %02X at %03X\n",
+                   stores[i].what, a->shared_pages,
+                   chip8_peek(a, stores[i].addr), stores[i].addr);
+            passed = false;
+        }
+        if (b->shared_pages != 0xFFFF || chip8_peek(b, stores[i].addr) != 0)
+        {
+            printf("FAIL rom-own: %s on one machine reached another\n",
+                   stores[i].what);
+            passed = false;
+        }
+        chip8_run(b, 3);
+        if (chip8_peek(b, stores[i].addr) != stores[i].b ||
+            chip8_peek(a, stores[i].addr) != stores[i].a)
+        {
+            printf("FAIL rom-own: two machines on one ROM see each other's "
+                   "%s\n",
+                   stores[i].what);
+            passed = false;
+        }
+        chip8_init(b);
+        chip8_rom_init(b, chip8_rom_cache_add(cache, stores[i].rom, 6));
+        if (chip8_peek(b, stores[i].addr) != 0)
+        {
+            printf("FAIL rom-own: %s wrote into the ROM\n", stores[i].what);
+            passed = false;
+        }
+    }
+    chip8_init(a); // Nothing may point into the cache once it is gone.
+    chip8_init(b);
+    chip8_rom_cache_destroy(cache);
+    report("rom-own", passed);
+}
+
+// Write size bytes of rom to path, dated seconds after the epoch so that a
+// rewrite never looks like the file opened before.
+static bool write_rom(const char *path, const uint8_t *rom, size_t size,
+                      time_t seconds)
+{
+    struct timespec times[2] = {{seconds, 0}, {seconds, 0}};
+    FILE *f = fopen(path, "wb");
+    bool written;
+
+    if (f == NULL)
+    {
+        return false;
+    }
+    written = fwrite(rom, 1, size, f) == size;
+    return fclose(f) == 0 && written &&
+           utimensat(AT_FDCWD, path, times, 0) == 0;
+}
+
+// chip8_rom_cache_open reads a file again only once it has changed, and then
+// returns the new program.
+static void test_rom_cache_open(void)
+{
+    static const uint8_t first[] = {0x60, 0x01, 0x12, 0x02};
+    static const uint8_t second[] = {0x60, 0x02, 0x12, 0x02};
+    const char *path = "chip8-test.ch8";
+    chip8_rom_cache_t *cache = chip8_rom_cache_create();
+    const chip8_rom_t *before = NULL, *after = NULL;
+    bool passed = false;
+
+    if (cache == NULL || !write_rom(path, first, sizeof(first), 1000000))
+    {
+        printf("FAIL rom-cache-open: cannot write %s\n", path);
+    }
+    else if ((before = chip8_rom_cache_open(cache, path)) == NULL ||
+             chip8_rom_cache_open(cache, path) != before)
+    {
+        printf("FAIL rom-cache-open: %s does not open to one ROM\n", path);
+    }
+    else if (!write_rom(path, second, sizeof(second), 2000000))
+    {
+        printf("FAIL rom-cache-open: cannot rewrite %s\n", path);
+    }
+    else if ((after = chip8_rom_cache_open(cache, path)) == before ||
+             after == NULL ||
+             after->image[CHIP8_PROGRAM_START_ADDRESS + 1] != 2 ||
+             before->image[CHIP8_PROGRAM_START_ADDRESS + 1] != 1 ||
+             chip8_rom_cache_count(cache) != 2)
+    {
+        printf("FAIL rom-cache-open: the rewritten %s was not read again\n",
+               path);
+    }
+    else
+    {
+        passed = true;
+    }
+    remove(path);
+    chip8_rom_cache_destroy(cache);
+    report("rom-cache-open", passed);
+}
+#endif
+
+#ifdef CHIP8_ENV
+// Machines in the environment set, workers stepping them, and steps.
+#define ENV_MACHINES 7
+#define ENV_THREADS 3
+#define ENV_STEPS 40
+
+// Set up machine i of an environment set the way test_env does.
+static void env_setup(chip8_t *c, int i)
+{
+    chip8_set_quirks(c, CHIP8_QUIRKS_XOCHIP);
+    chip8_set_clock(c, 500 + 97 * i);
+    chip8_seed(c, i + 1);
+}
+
+// What chip8_env_step does for one machine: hold down the keys in action and
+// run frames ticks' worth of chip8_step.
+static void env_reference_step(chip8_t *c, uint16_t action, int frames)
+{
+    int f, k;
+
+    for (k = 0; k < CHIP8_KEY_SIZE; k++)
+    {
+        if ((c->keypad[k] != 0) != ((action >> k & 1) != 0))
+        {
+            chip8_set_key(c, (uint8_t)k, action >> k & 1);
+        }
+    }
+    for (f = 0; f < frames; f++)
+    {
+        chip8_step(c, (int)((c->ips - c->tick_phase + CHIP8_TIMER_HZ - 1) /
+                            CHIP8_TIMER_HZ));
+    }
+}
+
+// Whether obs shows c's screen as CHIP8_OBS_PIXELS does.
+static bool env_observes(const chip8_t *c, const uint8_t *obs)
+{
+    int scale = c->hires ? 2 : 1;
+    int x, y, dx, dy;
+    bool lit;
+
+    for (y = 0; y < CHIP8_SCREEN_HEIGHT; y++)
+    {
+        for (x = 0; x < CHIP8_SCREEN_WIDTH; x++)
+        {
+            lit = false;
+            for (dy = 0; dy < scale; dy++)
+            {
+                for (dx = 0; dx < scale; dx++)
+                {
+                    lit |= chip8_pixel(c, scale * x + dx, scale * y + dy) != 0;
+                }
+            }
+            if (obs[y * CHIP8_SCREEN_WIDTH + x] != (lit ? 255 : 0))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// chip8_env_step spread over several workers leaves every machine, and its
+// observation, as chip8_step leaves a lone machine on the same program with
+// the same keys, and refuses to step more machines than it has.
+static void test_env(void)
+{
+    static chip8_t references[ENV_MACHINES];
+    static uint8_t obs[ENV_MACHINES * CHIP8_OBS_PIXELS_SIZE];
+    chip8_env_t *e = chip8_env_create(ENV_MACHINES, ENV_THREADS,
+                                      CHIP8_OBS_PIXELS);
+    // Draws random digits at random places, clearing the screen while key 3
+    // is down, switching to 128x64 while key 7 is and back while key 9 is.
+    static const uint8_t rom[] = {
+        0xC0, 0x3F, // 200: RND V0, 3F
+        0xC1, 0x1F, // 202: RND V1, 1F
+        0xC2, 0x0F, // 204: RND V2, 0F
+        0xF2, 0x29, // 206: LD F, V2
+        0xD0, 0x15, // 208: DRW V0, V1, 5
+        0x63, 0x03, // 20A: LD V3, 3
+        0xE3, 0xA1, // 20C: SKNP V3
+        0x00, 0xE0, // 20E: CLS
+        0x64, 0x07, // 210: LD V4, 7
+        0xE4, 0xA1, // 212: SKNP V4
+        0x00, 0xFF, // 214: HIGH
+        0x65, 0x09, // 216: LD V5, 9
+        0xE5, 0xA1, // 218: SKNP V5
+        0x00, 0xFE, // 21A: LOW
+        0x12, 0x00, // 21C: JP 200
+    };
+    uint16_t actions[ENV_MACHINES];
+    size_t size = sizeof(rom);
+    uint32_t rng = 11;
+    bool passed = true;
+    int i, step, frames, trapped, expected;
+
+    if (e == NULL || !chip8_env_load_rom(e, rom, size))
+    {
+        printf("FAIL env: cannot create the environment set\n");
+        chip8_env_destroy(e);
+        report("env", false);
+        return;
+    }
+    for (i = 0; i < ENV_MACHINES; i++)
+    {
+        env_setup(chip8_env_machine(e, i), i);
+        chip8_init(&references[i]);
+        chip8_load_rom(&references[i], rom, size);
+        env_setup(&references[i], i);
+    }
+    if (chip8_env_step(e, ENV_MACHINES + 1, NULL, 1, NULL) != -1 ||
+        chip8_env_step(e, -1, NULL, 1, NULL) != -1)
+    {
+        printf("FAIL env: stepped more machines than the set has\n");
+        passed = false;
+    }
+
+    for (step = 0; step < ENV_STEPS && passed; step++)
+    {
+        frames = 1 + next(&rng) % 4;
+        expected = 0;
+        for (i = 0; i < ENV_MACHINES; i++)
+        {
+            actions[i] = (uint16_t)(next(&rng) & next(&rng));
+            env_reference_step(&references[i], actions[i], frames);
+            expected += references[i].state == CHIP8_STATE_TRAPPED;
+        }
+        trapped = chip8_env_step(e, ENV_MACHINES, actions, frames, obs);
+        if (trapped != expected)
+        {
+            printf("FAIL env: step %d trapped %d machines, expected %d\n", step,
+                   trapped, expected);
+            passed = false;
+        }
+        for (i = 0; i < ENV_MACHINES && passed; i++)
+        {
+            chip8_save_state(&references[i], state_a, sizeof(state_a));
+            if (!saves_to(chip8_env_machine(e, i), state_a) ||
+                !env_observes(&references[i],
+                              obs + (size_t)i * CHIP8_OBS_PIXELS_SIZE))
+            {
+                printf("FAIL env: machine %d differs from chip8_step after "
+                       "step %d\n",
+                       i, step);
+                passed = false;
+            }
+        }
+    }
+    chip8_env_destroy(e);
+    report("env", passed);
+}
+#endif
+
+#ifdef CHIP8_SHM
+// Read slot as a monitor does, into copy, retrying while the owner writes.
+static void read_slot(const chip8_shm_slot_t *slot, chip8_shm_slot_t *copy)
+{
+    uint32_t seq;
+
+    do
+    {
+        seq = chip8_shm_read_begin(slot);
+        memcpy((uint8_t *)copy + offsetof(chip8_shm_slot_t, pid),
+               (const uint8_t *)slot + offsetof(chip8_shm_slot_t, pid),
+               sizeof(*copy) - offsetof(chip8_shm_slot_t, pid));
+    } while (chip8_shm_read_retry(slot, seq));
+}
+
+// Whether copy, read from c's slot, shows c.
+static bool shows(const chip8_shm_slot_t *copy, const chip8_t *c)
+{
+    return copy->pid == (uint32_t)getpid() && copy->PC == c->PC &&
+           copy->I == c->I && copy->cycles == c->cycles &&
+           copy->hires == c->hires &&
+           memcmp(copy->V, c->V, sizeof(copy->V)) == 0 &&
+           memcmp(copy->keypad, c->keypad, sizeof(copy->keypad)) == 0 &&
+           memcmp(copy->frame_buffer[0], c->frame_buffer[0],
+                  CHIP8_SCREEN_HEIGHT * sizeof(uint64_t)) == 0;
+}
+
+// A machine attached to a slot publishes itself as it ticks, which a second
+// mapping of the segment reads back whole, noticing when the slot was
+// rewritten during a read. Keys posted through that mapping are applied at
+// the next tick. Slots past the segment are refused.
+static void test_shm(void)
+{
+    static chip8_shm_slot_t copy;
+    char name[64];
+    chip8_shm_t *owner, *monitor = NULL;
+    chip8_shm_slot_t *slot = NULL;
+    chip8_t *c = &machine;
+    bool passed = true;
+    uint32_t seq;
+
+    snprintf(name, sizeof(name), "/chip8-test-%ld", (long)getpid());
+    owner = chip8_shm_create(name, 2);
+    if (owner != NULL)
+    {
+        monitor = chip8_shm_open(name);
+        slot = monitor != NULL ? chip8_shm_slot(monitor, 1) : NULL;
+    }
+    chip8_init(c);
+    chip8_load_game(c, CHIP8_TEST_ROM_DIR "/IBM_Logo.ch8");
+    if (slot == NULL)
+    {
+        printf("FAIL shm: cannot create and open %s\n", name);
+        chip8_shm_close(monitor);
+        chip8_shm_close(owner);
+        report("shm", false);
+        return;
+    }
+
+    if (chip8_shm_slot(owner, 2) != NULL || chip8_shm_slot(owner, -1) != NULL ||
+        chip8_shm_attach(c, owner, 2) || c->shm != NULL)
+    {
+        printf("FAIL shm: slot 2 of a segment of 2 was handed out\n");
+        passed = false;
+    }
+
+    chip8_shm_attach(c, owner, 1);
+    read_slot(slot, &copy);
+    if (copy.frames != 1 || !shows(&copy, c))
+    {
+        printf("FAIL shm: the slot does not show the machine once attached\n");
+        passed = false;
+    }
+    chip8_step(c, 200);
+    read_slot(slot, &copy);
+    if (copy.frames <= 1 || !shows(&copy, c))
+    {
+        printf("FAIL shm: the slot does not show the machine after %llu "
+               "ticks\n",
+               (unsigned long long)c->ticks);
+        passed = false;
+    }
+
+    seq = chip8_shm_read_begin(slot);
+    if (chip8_shm_read_retry(slot, seq))
+    {
+        printf("FAIL shm: a read with no tick in between was torn\n");
+        passed = false;
+    }
+    chip8_tick(c);
+    if (!chip8_shm_read_retry(slot, seq))
+    {
+        printf("FAIL shm: a read with a tick in between was not torn\n");
+        passed = false;
+    }
+
+    chip8_shm_post_key(slot, 5, true);
+    if (c->keypad[5] != 0)
+    {
+        printf("FAIL shm: a posted press was applied before the tick\n");
+        passed = false;
+    }
+    chip8_tick(c);
+    if (c->keypad[5] == 0)
+    {
+        printf("FAIL shm: a posted press was not applied at the tick\n");
+        passed = false;
+    }
+    chip8_shm_post_key(slot, 5, false);
+    chip8_tick(c);
+    if (c->keypad[5] != 0)
+    {
+        printf("FAIL shm: a posted release was not applied at the tick\n");
+        passed = false;
+    }
+    chip8_shm_post_key(slot, 9, true);
+    chip8_shm_post_key(slot, 9, false);
+    chip8_tick(c);
+    if (c->keypad[9] == 0)
+    {
+        printf("FAIL shm: a tap was not held down at the next tick\n");
+        passed = false;
+    }
+    chip8_tick(c);
+    if (c->keypad[9] != 0)
+    {
+        printf("FAIL shm: a tap was held down past the next tick\n");
+        passed = false;
+    }
+
+    chip8_shm_detach(c);
+    read_slot(slot, &copy);
+    if (copy.pid != 0)
+    {
+        printf("FAIL shm: the slot is still owned after detaching\n");
+        passed = false;
+    }
+    chip8_shm_close(monitor);
+    chip8_shm_close(owner);
+    report("shm", passed);
+}
+#endif
+
+// Source pixel (x, y) of a width x height image, with the edges repeated.
+static uint32_t ref_pixel(const uint32_t *src, int width, int height, int x,
+                          int y)
+{
+    x = x < 0 ? 0 : x >= width ? width - 1 : x;
+    y = y < 0 ? 0 : y >= height ? height - 1 : y;
+    return src[y * width + x];
+}
+
+// filter applied to src as its definition reads, one output pixel at a
+// time: the colour of output pixel (x, y) at scale.
+static uint32_t ref_scaled(chip8_filter_t filter, int scale,
+                           const uint32_t *src, int width, int height, int x,
+                           int y)
+{
+    int k, sx, sy, q;
+    uint32_t a, b, c, d, e, f, g, h, i, v;
+
+    switch (filter)
+    {
+    case CHIP8_FILTER_SCALE2X:
+        // Quarter q of the source pixel, then k x k blocks of those.
+        k = scale / 2;
+        sx = x / k / 2;
+        sy = y / k / 2;
+        q = (y / k % 2) * 2 + x / k % 2;
+        a = ref_pixel(src, width, height, sx, sy - 1);
+        c = ref_pixel(src, width, height, sx - 1, sy);
+        e = ref_pixel(src, width, height, sx, sy);
+        b = ref_pixel(src, width, height, sx + 1, sy);
+        d = ref_pixel(src, width, height, sx, sy + 1);
+        switch (q)
+        {
+        case 0:
+            return c == a && c != d && a != b ? a : e;
+        case 1:
+            return a == b && a != c && b != d ? b : e;
+        case 2:
+            return d == c && d != b && c != a ? c : e;
+        default:
+            return b == d && b != a && d != c ? d : e;
+        }
+    case CHIP8_FILTER_SCALE3X:
+        k = scale / 3;
+        sx = x / k / 3;
+        sy = y / k / 3;
+        q = (y / k % 3) * 3 + x / k % 3;
+        a = ref_pixel(src, width, height, sx - 1, sy - 1);
+        b = ref_pixel(src, width, height, sx, sy - 1);
+        c = ref_pixel(src, width, height, sx + 1, sy - 1);
+        d = ref_pixel(src, width, height, sx - 1, sy);
+        e = ref_pixel(src, width, height, sx, sy);
+        f = ref_pixel(src, width, height, sx + 1, sy);
+        g = ref_pixel(src, width, height, sx - 1, sy + 1);
+        h = ref_pixel(src, width, height, sx, sy + 1);
+        i = ref_pixel(src, width, height, sx + 1, sy + 1);
+        switch (q)
+        {
+        case 0:
+            return d == b && d != h && b != f ? d : e;
+        case 1:
+            return (d == b && d != h && b != f && e != c) ||
+                           (b == f && b != d && f != h && e != a)
+                       ? b
+                       : e;
+        case 2:
+            return b == f && b != d && f != h ? f : e;
+        case 3:
+            return (d == b && d != h && b != f && e != g) ||
+                           (d == h && d != b && h != f && e != a)
+                       ? d
+                       : e;
+        case 4:
+            return e;
+        case 5:
+            return (b == f && b != d && f != h && e != i) ||
+                           (h == f && h != d && f != b && e != c)
+                       ? f
+                       : e;
+        case 6:
+            return d == h && d != b && h != f ? d : e;
+        case 7:
+            return (d == h && d != b && h != f && e != i) ||
+                           (h == f && h != d && f != b && e != g)
+                       ? h
+                       : e;
+        default:
+            return h == f && h != d && f != b ? f : e;
+        }
+    case CHIP8_FILTER_SCANLINES:
+        v = src[y / scale * width + x / scale];
+        if (y % scale < scale - (scale / 4 > 0 ? scale / 4 : 1))
+        {
+            return v;
+        }
+        return (v >> 1 & 0x7F7F7F00) | (v & 0xFF);
+    default:
+        return src[y / scale * width + x / scale];
+    }
+}
+
+// Every filter at a few scales, on a 64x32 and a 128x64 screen of lit and
+// dark pixels with a few other colours among them, against ref_scaled: once
+// for the whole screen and once for a band of rows on its own. Output rows
+// have padding after them, which must not be written, and neither may rows
+// outside the band.
+static void test_scale(void)
+{
+    static const uint32_t colours[] = {0x000000FF, 0xFFFFFFFF, 0x33CC66FF,
+                                       0x80808080};
+    static uint32_t src[CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT];
+    const int pad = 5; // Pixels after every output row.
+    uint32_t rng = 1, pick, expected, *dst;
+    bool passed = true;
+    int filter, hires, m, scale, width, height, stride, first, last, x, y;
+
+    dst = malloc((size_t)(CHIP8_HIRES_WIDTH * 15 + pad) *
+                 CHIP8_HIRES_HEIGHT * 15 * sizeof(uint32_t));
+    if (dst == NULL)
+    {
+        printf("FAIL scale: out of memory\n");
+        report("scale", false);
+        return;
+    }
+    for (hires = 0; hires < 2 && passed; hires++)
+    {
+        width = hires ? CHIP8_HIRES_WIDTH : CHIP8_SCREEN_WIDTH;
+        height = hires ? CHIP8_HIRES_HEIGHT : CHIP8_SCREEN_HEIGHT;
+        for (y = 0; y < height; y++)
+        {
+            for (x = 0; x < width; x++)
+            {
+                // Diagonal strokes for the edge filters to round off, and
+                // noise, mostly lit and dark.
+                pick = next(&rng) % 16;
+                src[y * width + x] = (x + y) % 7 == 0 || (x - y) % 11 == 0
+                                         ? colours[1]
+                                         : colours[pick < 13 ? 0 : pick - 12];
+            }
+        }
+        for (filter = 0; filter < CHIP8_FILTER_COUNT && passed; filter++)
+        {
+            for (m = 1; m <= 5 && passed; m += 2)
+            {
+                scale = m * (filter == CHIP8_FILTER_SCALE3X  ? 3
+                             : filter == CHIP8_FILTER_NEAREST ? 1
+                                                              : 2);
+                stride = width * scale + pad;
+                for (first = 0; first <= height / 3 && passed;
+                     first += height / 3)
+                {
+                    last = first == 0 ? height : height / 2;
+                    memset(dst, 0xA5, (size_t)stride * height * scale * 4);
+                    chip8_scale_rows(filter, scale, src, width, height, first,
+                                     last, dst + (size_t)first * scale * stride,
+                                     stride * 4);
+                    for (y = 0; y < height * scale && passed; y++)
+                    {
+                        for (x = 0; x < stride && passed; x++)
+                        {
+                            expected = x < width * scale &&
+                                               y >= first * scale &&
+                                               y < last * scale
+                                           ? ref_scaled(filter, scale, src,
+                                                        width, height, x, y)
+                                           : 0xA5A5A5A5;
+                            if (dst[(size_t)y * stride + x] == expected)
+                            {
+                                continue;
+                            }
+                            printf("FAIL scale: %s x%d of %dx%d, rows %d to "
+                                   "%d, gives %08X at (%d, %d), expected "
+                                   "%08X\n",
+                                   chip8_filter_name(filter), scale, width,
+                                   height, first, last - 1,
+                                   dst[(size_t)y * stride + x], x, y,
+                                   expected);
+                            passed = false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    free(dst);
+    report("scale", passed);
+}
+
+// Generated programs under every profile, through chip8_run and chip8_step,
+// translated by the JIT when jit is set.
+static void test_generated(chip8_quirks_t quirks, bool step, bool jit)
+{
+    chip8_t *c = &machine;
+    uint8_t rom[MAX_GAME_SIZE];
+    char name[64];
+    bool passed = true;
+    uint32_t seed;
+
+    snprintf(name, sizeof(name), "generated-%s-%s%s",
+             chip8_quirks_name(quirks), step ? "step" : "run",
+             jit ? "-jit" : "");
+    for (seed = 1; seed <= PROGRAM_COUNT && passed; seed++)
+    {
+        size_t size = generate(rom, seed, 8 + seed % 40);
+
+        chip8_init(c);
+        chip8_load_rom(c, rom, size);
+        chip8_set_quirks(c, quirks);
+        chip8_seed(c, seed);
+        chip8_set_clock(c, 500 + 37 * seed);
+#ifdef CHIP8_JIT
+        if (jit && !chip8_jit_enable(c))
+        {
+            printf("FAIL %s: cannot enable the JIT\n", name);
+            passed = false;
+            break;
+        }
+#endif
+        passed = run_both(name, c, seed, step, PROGRAM_INSNS);
+#ifdef CHIP8_JIT
+        chip8_jit_disable(c);
+#endif
+        if (!passed)
+        {
+            printf("     program %u of %zu bytes\n", seed, size);
+        }
+    }
+    report(name, passed);
+}
+
+#ifdef CHIP8_JIT
+// Run IBM_Logo.ch8 translated and look for a mapping of this process that
+// is writable and executable at the same time.
+static void test_jit_wx(void)
+{
+    chip8_t *c = &machine;
+    chip8_jit_stats_t stats;
+    bool passed = true;
+#ifdef __linux__
+    char line[512], perms[8];
+    FILE *maps;
+#endif
+
+    chip8_init(c);
+    if (!chip8_load_game(c, CHIP8_TEST_ROM_DIR "/IBM_Logo.ch8") ||
+        !chip8_jit_enable(c))
+    {
+        printf("FAIL jit-wx: cannot load IBM_Logo.ch8 with the JIT\n");
+        report("jit-wx", false);
+        return;
+    }
+    chip8_run(c, 2000);
+    chip8_jit_get_stats(c, &stats);
+    if (stats.blocks_compiled == 0)
+    {
+        printf("FAIL jit-wx: no block was translated\n");
+        passed = false;
+    }
+#ifdef __linux__
+    maps = fopen("/proc/self/maps", "r");
+    while (maps != NULL && fgets(line, sizeof(line), maps) != NULL)
+    {
+        if (sscanf(line, "%*s %7s", perms) == 1 &&
+            strncmp(perms, "rwx", 3) == 0)
+        {
+            printf("FAIL jit-wx: writable and executable: %s", line);
+            passed = false;
+        }
+    }
+    if (maps != NULL)
+    {
+        fclose(maps);
+    }
+#endif
+    chip8_jit_disable(c);
+    report("jit-wx", passed);
+}
+
+// block_hits counts the times a block translated before is entered, and not
+// the times one is looked up but too long for what is left of the batch.
+static void test_jit_hits(void)
+{
+    // A block of five loads from 200 and the jump back, which is interpreted.
+    static const uint8_t rom[] = {0x60, 0x01, 0x61, 0x02, 0x62, 0x03,
+                                  0x63, 0x04, 0x64, 0x05, 0x12, 0x00};
+    chip8_t *c = &machine;
+    chip8_jit_stats_t stats;
+    uint64_t hits[3];
+
+    chip8_init(c);
+    chip8_load_rom(c, rom, sizeof(rom));
+    if (!chip8_jit_enable(c))
+    {
+        printf("FAIL jit-hits: cannot enable the JIT\n");
+        report("jit-hits", false);
+        return;
+    }
+    chip8_run(c, 6); // Translates and enters the block, then jumps back.
+    chip8_jit_get_stats(c, &stats);
+    hits[0] = stats.block_hits;
+    chip8_run(c, 3); // Too short for the block.
+    chip8_jit_get_stats(c, &stats);
+    hits[1] = stats.block_hits;
+    chip8_run(c, 3); // Finishes the loop.
+    chip8_run(c, 6); // Enters the block again.
+    chip8_jit_get_stats(c, &stats);
+    hits[2] = stats.block_hits;
+    chip8_jit_disable(c);
+    if (hits[0] != 0 || hits[1] != 0 || hits[2] != 1)
+    {
+        printf("FAIL jit-hits: %llu, %llu and %llu hits, expected 0, 0 and "
+               "1\n",
+               (unsigned long long)hits[0], (unsigned long long)hits[1],
+               (unsigned long long)hits[2]);
+    }
+    report("jit-hits", hits[0] == 0 && hits[1] == 0 && hits[2] == 1);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    bool jit = false;
+    int q;
+
+    if (argc == 2 && strcmp(argv[1], "--jit") == 0)
+    {
+#ifdef CHIP8_JIT
+        jit = true;
+#else
+        fprintf(stderr, "Built without CHIP8_JIT\n");
+        return 2;
+#endif
+    }
+    else if (argc != 1)
+    {
+        fprintf(stderr, "Usage: %s [--jit]\n", argv[0]);
+        return 2;
+    }
+
+    printf("core: %s%s\n", CHIP8_TEST_CORE, jit ? ", jit" : "");
+    if (!jit)
+    {
+        test_fixed_cases();
+        test_parked();
+        test_batch_timers();
+        test_reset_screen();
+        test_ibm_logo();
+        test_state_round_trip();
+        test_state_rejects();
+        test_rewind();
+#ifdef CHIP8_ROM_CACHE
+        test_state_shared_pages();
+        test_rom_own();
+        test_rom_cache_open();
+#endif
+#ifdef CHIP8_ENV
+        test_env();
+#endif
+#ifdef CHIP8_SHM
+        test_shm();
+#endif
+        test_scale();
+#ifdef CHIP8_TRACE
+        test_trace_replay();
+#endif
+    }
+#ifdef CHIP8_JIT
+    else
+    {
+        test_jit_wx();
+        test_jit_hits();
+    }
+#endif
+    for (q = 0; q < CHIP8_QUIRKS_COUNT; q++)
+    {
+        test_generated((chip8_quirks_t)q, false, jit);
+        test_generated((chip8_quirks_t)q, true, jit);
+    }
+
+    if (failures != 0)
+    {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
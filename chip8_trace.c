@@ -0,0 +1,874 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8_trace.h"
+#include "chip8_internal.h"
+#include "chip8_state.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// File layout, all multi-byte values little-endian unless noted:
+//
+//     magic[8] version:16 reserved:16 keyframe_interval:32 state_size:32
+//     record...  end
+//     (insns:64 offset:64)[keyframes] insns:64 keyframes:64 index_magic[8]
+//
+// A record starts with one byte. Values below 0x80 are the flags of an
+// instruction record, laid out as described next to CHIP8_TRACE_PC. The
+// others are events, each applied to the machine before the instruction
+// that follows it:
+//
+//     tick      80
+//     key       81 key:8 (bit 7 set when pressed) cycles:varint ns:varint
+//     state     82 state[state_size]   chip8_load_state replaced everything
+//     keyframe  83 insns:varint state[state_size]
+//     end       FF
+//
+// Key events carry the machine's cycle count and the host time since the
+// trace started. Instruction deltas are relative to the previous
+// instruction, or to the last keyframe, which also forgets every opcode
+// recorded so far, so decoding can start at any keyframe.
+static const uint8_t trace_magic[8] = {'C', 'H', 'I', 'P', '8', 'T', 'R', 0};
+static const uint8_t index_magic[8] = {'C', 'H', 'I', 'P', '8', 'I', 'X', 0};
+
+#define HEADER_SIZE (8 + 2 + 2 + 4 + 4)
+#define INDEX_ENTRY_SIZE 16
+#define INDEX_TAIL_SIZE (8 + 8 + sizeof(index_magic))
+
+// Records are written into one of BLOCK_COUNT blocks; full ones are queued
+// for the writer thread, so the emulator only waits when every block is
+// still queued.
+#define BLOCK_SIZE (64 * 1024)
+#define BLOCK_COUNT 8
+
+typedef struct keyframe
+{
+    uint64_t insns;
+    uint64_t offset; // From the start of the file.
+} keyframe_t;
+
+struct chip8_trace_writer
+{
+    FILE *f;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  // A block was queued, or the trace is stopping.
+    pthread_cond_t drained; // A queued block was written.
+    uint8_t *blocks;        // BLOCK_COUNT blocks of BLOCK_SIZE bytes.
+    size_t lengths[BLOCK_COUNT];
+    int head;      // Block being filled.
+    int queued;    // Full blocks before head, oldest first, not yet written.
+    bool stopping; // No more blocks will be queued.
+    bool failed;   // A write failed. Only touched by the writer thread
+                   // until it is joined.
+    uint64_t offset;   // File offset of the start of the head block.
+    uint64_t start_ns; // Host time chip8_trace_start was called.
+    keyframe_t *index;
+    size_t keyframes;
+    size_t capacity;
+    uint8_t state[CHIP8_STATE_SIZE];
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint8_t *put_varint64(uint8_t *o, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *o++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *o++ = (uint8_t)v;
+    return o;
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    p = put16(p, v & 0xFFFF);
+    return put16(p, v >> 16);
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v)
+{
+    p = put32(p, v & 0xFFFFFFFF);
+    return put32(p, v >> 32);
+}
+
+static void *write_blocks(void *arg)
+{
+    struct chip8_trace_writer *w = arg;
+    int tail;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (w->queued == 0 && !w->stopping)
+        {
+            pthread_cond_wait(&w->filled, &w->lock);
+        }
+        if (w->queued == 0)
+        {
+            break;
+        }
+        tail = (w->head - w->queued + BLOCK_COUNT) % BLOCK_COUNT;
+        pthread_mutex_unlock(&w->lock);
+
+        if (fwrite(w->blocks + (size_t)tail * BLOCK_SIZE, 1, w->lengths[tail],
+                   w->f) != w->lengths[tail])
+        {
+            w->failed = true;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        w->queued--;
+        pthread_cond_signal(&w->drained);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static uint8_t *block_start(struct chip8_trace_writer *w)
+{
+    return w->blocks + (size_t)w->head * BLOCK_SIZE;
+}
+
+// Queue the head block and move on to the next free one.
+static void submit(struct chip8_trace *t)
+{
+    struct chip8_trace_writer *w = t->writer;
+    size_t length = t->out - block_start(w);
+
+    pthread_mutex_lock(&w->lock);
+    w->lengths[w->head] = length;
+    w->queued++;
+    pthread_cond_signal(&w->filled);
+    while (w->queued == BLOCK_COUNT)
+    {
+        pthread_cond_wait(&w->drained, &w->lock);
+    }
+    w->head = (w->head + 1) % BLOCK_COUNT;
+    pthread_mutex_unlock(&w->lock);
+
+    w->offset += length;
+    t->out = block_start(w);
+    t->end = t->out + BLOCK_SIZE - CHIP8_TRACE_RECORD_MAX;
+}
+
+static void put(struct chip8_trace *t, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t room = block_start(t->writer) + BLOCK_SIZE - t->out;
+        size_t n = size < room ? size : room;
+
+        if (room == 0)
+        {
+            submit(t);
+            continue;
+        }
+        memcpy(t->out, data, n);
+        t->out += n;
+        data += n;
+        size -= n;
+    }
+}
+
+static bool write_keyframe(chip8_t *c)
+{
+    struct chip8_trace *t = c->trace;
+    struct chip8_trace_writer *w = t->writer;
+    uint8_t head[1 + 10];
+    uint8_t *o = head;
+
+    if (w->keyframes == w->capacity)
+    {
+        size_t capacity = w->capacity > 0 ? 2 * w->capacity : 64;
+        keyframe_t *index = realloc(w->index, capacity * sizeof(*index));
+
+        if (index == NULL)
+        {
+            return false; // Still a valid trace, just with a sparser index.
+        }
+        w->index = index;
+        w->capacity = capacity;
+    }
+    w->index[w->keyframes].insns = t->insns;
+    w->index[w->keyframes].offset = w->offset + (t->out - block_start(w));
+    w->keyframes++;
+
+    *o++ = CHIP8_TRACE_KEYFRAME;
+    o = put_varint64(o, t->insns);
+    put(t, head, o - head);
+    chip8_save_state(c, w->state, sizeof(w->state));
+    put(t, w->state, sizeof(w->state));
+
+    t->pc = c->PC & CHIP8_ADDRESS_MASK;
+    t->I = c->I;
+    t->SP = c->SP;
+    memcpy(t->V, c->V, sizeof(t->V));
+    t->all = false;
+    memset(t->ops, 0, sizeof(t->ops));
+    return true;
+}
+
+void chip8_trace_flush(chip8_t *c)
+{
+    struct chip8_trace *t = c->trace;
+
+    if (t->insns == t->next_keyframe)
+    {
+        write_keyframe(c);
+        t->next_keyframe += CHIP8_TRACE_KEYFRAME_INTERVAL;
+    }
+    if (t->out > t->end)
+    {
+        submit(t);
+    }
+}
+
+void chip8_trace_event(chip8_t *c, int event, uint8_t arg)
+{
+    struct chip8_trace *t = c->trace;
+    uint8_t record[2 + 2 * 10];
+    uint8_t *o = record;
+
+    *o++ = (uint8_t)event;
+    t->all = t->all || event != CHIP8_TRACE_TICK; // Fx0A, or a whole state.
+    switch (event)
+    {
+    case CHIP8_TRACE_KEY:
+        *o++ = arg;
+        o = put_varint64(o, c->cycles);
+        o = put_varint64(o, now_ns() - t->writer->start_ns);
+        break;
+    case CHIP8_TRACE_STATE:
+        put(t, record, 1);
+        chip8_save_state(c, t->writer->state, sizeof(t->writer->state));
+        put(t, t->writer->state, sizeof(t->writer->state));
+        return;
+    }
+    put(t, record, o - record);
+}
+
+static void destroy(struct chip8_trace *t)
+{
+    struct chip8_trace_writer *w = t->writer;
+
+    if (w != NULL)
+    {
+        free(w->index);
+        free(w->blocks);
+        free(w);
+    }
+    free(t);
+}
+
+bool chip8_trace_start(chip8_t *c, const char *path)
+{
+    struct chip8_trace *t;
+    struct chip8_trace_writer *w;
+    uint8_t header[HEADER_SIZE];
+    uint8_t *p = header;
+
+    if (c->trace != NULL)
+    {
+        return false;
+    }
+
+    t = calloc(1, sizeof(*t));
+    w = calloc(1, sizeof(*w));
+    if (t != NULL)
+    {
+        t->writer = w;
+    }
+    if (t == NULL || w == NULL ||
+        (w->blocks = malloc((size_t)BLOCK_COUNT * BLOCK_SIZE)) == NULL)
+    {
+        free(w);
+        free(t);
+        return false;
+    }
+
+    memcpy(p, trace_magic, sizeof(trace_magic));
+    p += sizeof(trace_magic);
+    p = put16(p, CHIP8_TRACE_VERSION);
+    p = put16(p, 0);
+    p = put32(p, CHIP8_TRACE_KEYFRAME_INTERVAL);
+    p = put32(p, CHIP8_STATE_SIZE);
+
+    w->f = fopen(path, "wb");
+    if (w->f == NULL)
+    {
+        destroy(t);
+        return false;
+    }
+    if (fwrite(header, 1, sizeof(header), w->f) != sizeof(header))
+    {
+        fclose(w->f);
+        destroy(t);
+        return false;
+    }
+    w->offset = sizeof(header);
+    w->start_ns = now_ns();
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->filled, NULL);
+    pthread_cond_init(&w->drained, NULL);
+    if (pthread_create(&w->thread, NULL, write_blocks, w) != 0)
+    {
+        pthread_cond_destroy(&w->drained);
+        pthread_cond_destroy(&w->filled);
+        pthread_mutex_destroy(&w->lock);
+        fclose(w->f);
+        destroy(t);
+        return false;
+    }
+
+    t->out = block_start(w);
+    t->end = t->out + BLOCK_SIZE - CHIP8_TRACE_RECORD_MAX;
+    c->trace = t;
+    chip8_trace_flush(c); // The first keyframe is due at once.
+    return true;
+}
+
+bool chip8_trace_stop(chip8_t *c)
+{
+    struct chip8_trace *t = c->trace;
+    struct chip8_trace_writer *w;
+    uint8_t entry[INDEX_ENTRY_SIZE];
+    uint8_t end = CHIP8_TRACE_END;
+    bool ok;
+    size_t i;
+
+    if (t == NULL)
+    {
+        return false;
+    }
+    w = t->writer;
+
+    put(t, &end, 1);
+    submit(t);
+    pthread_mutex_lock(&w->lock);
+    w->stopping = true;
+    pthread_cond_signal(&w->filled);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->drained);
+    pthread_cond_destroy(&w->filled);
+    pthread_mutex_destroy(&w->lock);
+
+    ok = !w->failed;
+    for (i = 0; i < w->keyframes; i++)
+    {
+        put64(put64(entry, w->index[i].insns), w->index[i].offset);
+        ok = ok && fwrite(entry, 1, sizeof(entry), w->f) == sizeof(entry);
+    }
+    put64(put64(entry, t->insns), w->keyframes);
+    ok = ok && fwrite(entry, 1, sizeof(entry), w->f) == sizeof(entry);
+    ok = ok && fwrite(index_magic, 1, sizeof(index_magic), w->f) ==
+                   sizeof(index_magic);
+    ok = fclose(w->f) == 0 && ok;
+
+    destroy(t);
+    c->trace = NULL;
+    return ok;
+}
+
+uint64_t chip8_trace_insns(const chip8_t *c)
+{
+    return c->trace != NULL ? c->trace->insns : 0;
+}
+
+enum record_kind
+{
+    RECORD_INSN,
+    RECORD_TICK,
+    RECORD_KEY,
+    RECORD_STATE,
+    RECORD_KEYFRAME,
+    RECORD_END,
+    RECORD_BAD, // Truncated or unknown.
+};
+
+// Decoding position in a trace, with the machine as the last decoded
+// instruction found it.
+typedef struct cursor
+{
+    const uint8_t *p;
+    uint64_t next; // Index of the next instruction record.
+    uint16_t pc;   // Address after the last instruction.
+    chip8_trace_point_t at;
+    uint16_t ops[CHIP8_MEMORY_SIZE];
+} cursor_t;
+
+struct chip8_replay
+{
+    uint8_t *map;
+    size_t size;
+    const uint8_t *end; // Past the last record.
+    keyframe_t *index;
+    size_t keyframes;
+    uint64_t insns;
+    cursor_t cursor;
+    chip8_t scratch; // Holds keyframes while their registers are read.
+    uint8_t key;     // Argument of the last key record.
+    const uint8_t *state; // State of the last state or keyframe record.
+};
+
+static uint64_t get64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+    {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    int shift;
+
+    *v = 0;
+    for (shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+        uint8_t b = *(*p)++;
+
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (b < 0x80)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint16_t unzigzag(uint64_t v)
+{
+    return (uint16_t)((v >> 1) ^ (0 - (v & 1)));
+}
+
+static bool reset_cursor(chip8_replay_t *r, uint64_t insns)
+{
+    cursor_t *k = &r->cursor;
+
+    if (!chip8_load_state(&r->scratch, r->state, CHIP8_STATE_SIZE))
+    {
+        return false;
+    }
+    k->next = insns;
+    k->pc = r->scratch.PC & CHIP8_ADDRESS_MASK;
+    k->at.I = r->scratch.I;
+    k->at.SP = r->scratch.SP;
+    memcpy(k->at.V, r->scratch.V, sizeof(k->at.V));
+    memset(k->ops, 0, sizeof(k->ops));
+    return true;
+}
+
+static int next_record(chip8_replay_t *r)
+{
+    cursor_t *k = &r->cursor;
+    const uint8_t *end = r->end;
+    uint64_t v;
+    uint8_t flags;
+    uint16_t pc;
+    int i;
+
+    if (k->p >= end)
+    {
+        return RECORD_BAD;
+    }
+    flags = *k->p++;
+    switch (flags)
+    {
+    case CHIP8_TRACE_TICK:
+        return RECORD_TICK;
+    case CHIP8_TRACE_KEY:
+        if (k->p >= end)
+        {
+            return RECORD_BAD;
+        }
+        r->key = *k->p++;
+        return get_varint(&k->p, end, &v) && get_varint(&k->p, end, &v)
+                   ? RECORD_KEY
+                   : RECORD_BAD;
+    case CHIP8_TRACE_STATE:
+    case CHIP8_TRACE_KEYFRAME:
+        if ((flags == CHIP8_TRACE_KEYFRAME && !get_varint(&k->p, end, &v)) ||
+            end - k->p < CHIP8_STATE_SIZE)
+        {
+            return RECORD_BAD;
+        }
+        r->state = k->p;
+        k->p += CHIP8_STATE_SIZE;
+        if (flags == CHIP8_TRACE_STATE)
+        {
+            return RECORD_STATE;
+        }
+        return reset_cursor(r, v) ? RECORD_KEYFRAME : RECORD_BAD;
+    case CHIP8_TRACE_END:
+        return RECORD_END;
+    }
+    if (flags >= 0x20)
+    {
+        return RECORD_BAD;
+    }
+
+    pc = k->pc;
+    if (flags & CHIP8_TRACE_PC)
+    {
+        if (!get_varint(&k->p, end, &v))
+        {
+            return RECORD_BAD;
+        }
+        pc = (pc + unzigzag(v)) & CHIP8_ADDRESS_MASK;
+    }
+    if (flags & CHIP8_TRACE_OP)
+    {
+        if (end - k->p < 2)
+        {
+            return RECORD_BAD;
+        }
+        k->ops[pc] = k->p[0] << 8 | k->p[1];
+        k->p += 2;
+    }
+    if (flags & CHIP8_TRACE_V)
+    {
+        if (!get_varint(&k->p, end, &v))
+        {
+            return RECORD_BAD;
+        }
+        v = (v >> 1 | v << 15) & 0xFFFF; // Bit n is Vn again.
+        for (i = 0; i < CHIP8_REGISTER_COUNT; i++)
+        {
+            if (v >> i & 1)
+            {
+                if (k->p >= end)
+                {
+                    return RECORD_BAD;
+                }
+                k->at.V[i] = *k->p++;
+            }
+        }
+    }
+    if (flags & CHIP8_TRACE_I)
+    {
+        if (!get_varint(&k->p, end, &v))
+        {
+            return RECORD_BAD;
+        }
+        k->at.I += unzigzag(v);
+    }
+    if (flags & CHIP8_TRACE_SP)
+    {
+        if (k->p >= end)
+        {
+            return RECORD_BAD;
+        }
+        k->at.SP = *k->p++;
+    }
+    k->at.index = k->next++;
+    k->at.PC = pc;
+    k->at.opcode = k->ops[pc];
+    k->pc = (pc + 2) & CHIP8_ADDRESS_MASK;
+    return RECORD_INSN;
+}
+
+static bool add_keyframe(chip8_replay_t *r, uint64_t insns, uint64_t offset,
+                         size_t *capacity)
+{
+    if (r->keyframes == *capacity)
+    {
+        size_t grown = *capacity > 0 ? 2 * *capacity : 64;
+        keyframe_t *index = realloc(r->index, grown * sizeof(*index));
+
+        if (index == NULL)
+        {
+            return false;
+        }
+        r->index = index;
+        *capacity = grown;
+    }
+    r->index[r->keyframes].insns = insns;
+    r->index[r->keyframes].offset = offset;
+    r->keyframes++;
+    return true;
+}
+
+// Read the index at the end of the file. Returns false when it is missing,
+// as it is when the recording was cut short.
+static bool read_index(chip8_replay_t *r)
+{
+    const uint8_t *tail = r->map + r->size - INDEX_TAIL_SIZE;
+    uint64_t count;
+    size_t i;
+
+    if (r->size < HEADER_SIZE + 1 + INDEX_TAIL_SIZE ||
+        memcmp(tail + 16, index_magic, sizeof(index_magic)) != 0)
+    {
+        return false;
+    }
+    count = get64(tail + 8);
+    if (count == 0 ||
+        count > (r->size - HEADER_SIZE - INDEX_TAIL_SIZE) / INDEX_ENTRY_SIZE)
+    {
+        return false;
+    }
+    r->end = tail - count * INDEX_ENTRY_SIZE;
+    r->index = malloc(count * sizeof(*r->index));
+    if (r->index == NULL)
+    {
+        return false;
+    }
+    for (i = 0; i < count; i++)
+    {
+        const uint8_t *e = r->end + i * INDEX_ENTRY_SIZE;
+
+        r->index[i].insns = get64(e);
+        r->index[i].offset = get64(e + 8);
+        if (r->index[i].offset < HEADER_SIZE ||
+            r->index[i].offset >= (uint64_t)(r->end - r->map))
+        {
+            free(r->index);
+            r->index = NULL;
+            return false;
+        }
+    }
+    r->keyframes = count;
+    r->insns = get64(tail);
+    return true;
+}
+
+// Rebuild the index by decoding every record that made it to disk.
+static bool scan_index(chip8_replay_t *r)
+{
+    size_t capacity = 0;
+    const uint8_t *at;
+    int kind;
+
+    r->end = r->map + r->size;
+    r->cursor.p = r->map + HEADER_SIZE;
+    r->cursor.next = 0;
+    for (;;)
+    {
+        at = r->cursor.p;
+        kind = next_record(r);
+        if (kind == RECORD_KEYFRAME &&
+            !add_keyframe(r, r->cursor.next, at - r->map, &capacity))
+        {
+            return false;
+        }
+        if (kind == RECORD_END || kind == RECORD_BAD)
+        {
+            break;
+        }
+    }
+    r->insns = r->cursor.next;
+    return r->keyframes > 0;
+}
+
+chip8_replay_t *chip8_replay_open(const char *path)
+{
+    chip8_replay_t *r;
+    struct stat st;
+    const uint8_t *p;
+    int fd;
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+    {
+        return NULL;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        free(r);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE)
+    {
+        close(fd);
+        free(r);
+        return NULL;
+    }
+    r->size = st.st_size;
+    r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED)
+    {
+        free(r);
+        return NULL;
+    }
+
+    p = r->map;
+    if (memcmp(p, trace_magic, sizeof(trace_magic)) != 0 ||
+        p[8] != (CHIP8_TRACE_VERSION & 0xFF) ||
+        p[9] != (CHIP8_TRACE_VERSION >> 8) ||
+        (p[16] | p[17] << 8 | p[18] << 16 | (uint32_t)p[19] << 24) !=
+            CHIP8_STATE_SIZE ||
+        (!read_index(r) && !scan_index(r)))
+    {
+        chip8_replay_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void chip8_replay_close(chip8_replay_t *r)
+{
+    if (r == NULL)
+    {
+        return;
+    }
+    munmap(r->map, r->size);
+    free(r->index);
+    free(r);
+}
+
+uint64_t chip8_replay_insns(const chip8_replay_t *r)
+{
+    return r->insns;
+}
+
+size_t chip8_replay_keyframes(const chip8_replay_t *r)
+{
+    return r->keyframes;
+}
+
+// Position the cursor on the last keyframe at or before instruction index
+// and decode the keyframe.
+static bool seek_keyframe(chip8_replay_t *r, uint64_t index)
+{
+    size_t lo = 0, hi = r->keyframes;
+
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (r->index[mid].insns <= index)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    r->cursor.p = r->map + r->index[lo].offset;
+    return next_record(r) == RECORD_KEYFRAME;
+}
+
+bool chip8_replay_seek(chip8_replay_t *r, uint64_t index,
+                       chip8_trace_point_t *p)
+{
+    int kind;
+
+    if (index >= r->insns || !seek_keyframe(r, index))
+    {
+        return false;
+    }
+    do
+    {
+        kind = next_record(r);
+        if (kind == RECORD_END || kind == RECORD_BAD)
+        {
+            return false;
+        }
+    } while (kind != RECORD_INSN || r->cursor.at.index < index);
+
+    *p = r->cursor.at;
+    return true;
+}
+
+static void observe(const chip8_t *c, uint64_t index, chip8_trace_point_t *p)
+{
+    uint16_t pc = c->PC & CHIP8_ADDRESS_MASK;
+
+    p->index = index;
+    p->PC = pc;
+    p->opcode = chip8_peek(c, pc) << 8 | chip8_peek(c, pc + 1);
+    p->I = c->I;
+    p->SP = c->SP;
+    memcpy(p->V, c->V, sizeof(p->V));
+}
+
+static bool same_point(const chip8_trace_point_t *a,
+                       const chip8_trace_point_t *b)
+{
+    return a->PC == b->PC && a->opcode == b->opcode && a->I == b->I &&
+           a->SP == b->SP && memcmp(a->V, b->V, sizeof(a->V)) == 0;
+}
+
+chip8_replay_result_t chip8_replay_verify(chip8_replay_t *r, chip8_t *c,
+                                          uint64_t from,
+                                          chip8_trace_point_t *expected,
+                                          chip8_trace_point_t *actual)
+{
+    const chip8_trace_point_t *want = &r->cursor.at;
+    chip8_trace_point_t live;
+
+    if (!seek_keyframe(r, from) ||
+        !chip8_load_state(c, r->state, CHIP8_STATE_SIZE))
+    {
+        return CHIP8_REPLAY_CORRUPT;
+    }
+
+    for (;;)
+    {
+        switch (next_record(r))
+        {
+        case RECORD_INSN:
+            observe(c, want->index, &live);
+            if (!same_point(want, &live))
+            {
+                if (expected != NULL)
+                {
+                    *expected = *want;
+                }
+                if (actual != NULL)
+                {
+                    *actual = live;
+                }
+                return CHIP8_REPLAY_DIVERGED;
+            }
+            chip8_emulate_cycle(c);
+            break;
+        case RECORD_TICK:
+            chip8_tick(c);
+            break;
+        case RECORD_KEY:
+            chip8_set_key(c, r->key & 0xF, r->key & 0x80);
+            break;
+        case RECORD_STATE:
+            chip8_load_state(c, r->state, CHIP8_STATE_SIZE);
+            break;
+        case RECORD_KEYFRAME:
+            break; // Only moves the deltas' base.
+        case RECORD_END:
+            return CHIP8_REPLAY_MATCH;
+        default:
+            return CHIP8_REPLAY_CORRUPT;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef CHIP8_TRACE_H
+#define CHIP8_TRACE_H
+
+#include "chip8.h"
+
+// Execution traces, built when CMake is configured with -DCHIP8_TRACE=ON on
+// a POSIX host. While a machine is being traced, every instruction the
+// interpreter executes is logged with its address and opcode and with the
+// registers, I and SP that changed since the previous one, next to the timer
+// ticks, key events and state loads that happened in between. Records are
+// small varint deltas, buffered and written out by a background thread, so
+// the emulator thread never waits on the disk unless the disk falls behind.
+// While tracing, chip8_run interprets even if a JIT is attached.
+//
+// Every CHIP8_TRACE_KEYFRAME_INTERVAL instructions the whole machine state is
+// written out as a keyframe, and a sparse index of the keyframes closes the
+// file. A replay maps the file, seeks to any instruction through that index,
+// and re-runs the trace on a live machine to find the first instruction where
+// the two disagree.
+
+#define CHIP8_TRACE_VERSION 2
+#define CHIP8_TRACE_KEYFRAME_INTERVAL 65536
+
+// Start tracing c to a new file at path. The current state of c is the first
+// keyframe. Returns false when the file cannot be created or out of memory.
+// chip8_init clears the attachment, so stop tracing before re-initialising c.
+bool chip8_trace_start(chip8_t *c, const char *path);
+
+// Flush the remaining records, write the index and close the file. Returns
+// false when c was not being traced or a write failed along the way.
+bool chip8_trace_stop(chip8_t *c);
+
+// Instructions recorded so far.
+uint64_t chip8_trace_insns(const chip8_t *c);
+
+// The machine as an instruction found it, just before executing it.
+typedef struct chip8_trace_point
+{
+    uint64_t index;                  // Instructions executed before this one.
+    uint16_t PC;
+    uint16_t opcode;
+    uint16_t I;
+    uint8_t SP;
+    uint8_t V[CHIP8_REGISTER_COUNT];
+} chip8_trace_point_t;
+
+typedef enum chip8_replay_result
+{
+    CHIP8_REPLAY_MATCH,    // Every instruction matched the trace.
+    CHIP8_REPLAY_DIVERGED, // The live machine disagreed with the trace.
+    CHIP8_REPLAY_CORRUPT,  // The trace ended without its end record.
+} chip8_replay_result_t;
+
+typedef struct chip8_replay chip8_replay_t;
+
+// Map a trace file. Returns NULL when it cannot be read or is not a trace of
+// this version. A trace whose recording was cut short has no index; one is
+// rebuilt from the keyframes that made it to disk.
+chip8_replay_t *chip8_replay_open(const char *path);
+void chip8_replay_close(chip8_replay_t *r);
+
+// Instructions and keyframes in the trace.
+uint64_t chip8_replay_insns(const chip8_replay_t *r);
+size_t chip8_replay_keyframes(const chip8_replay_t *r);
+
+// Fill p with instruction index, decoding forward from the nearest keyframe
+// at or before it. Returns false when the trace has no such instruction.
+bool chip8_replay_seek(chip8_replay_t *r, uint64_t index,
+                       chip8_trace_point_t *p);
+
+// Load c with the nearest keyframe at or before instruction from, then run it
+// through the rest of the trace, feeding it the recorded ticks, keys and
+// state loads and checking every instruction against the trace before
+// executing it. On divergence, expected and actual describe the first
+// instruction that differs; either may be NULL. c must not be traced.
+chip8_replay_result_t chip8_replay_verify(chip8_replay_t *r, chip8_t *c,
+                                          uint64_t from,
+                                          chip8_trace_point_t *expected,
+                                          chip8_trace_point_t *actual);
+
+#endif
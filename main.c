@@ -14,51 +14,691 @@
 #include <SDL3/SDL_main.h>
 #include <stdio.h>
 #include <chip8.h>
-#include <sys/time.h>
+#include <chip8_state.h>
+#include <chip8_scale.h>
+#ifdef CHIP8_JIT
+#include <chip8_jit.h>
+#endif
+#ifdef CHIP8_PROFILE
+#include <chip8_profile.h>
+#endif
+#ifdef CHIP8_TRACE
+#include <chip8_trace.h>
+#endif
+#ifdef CHIP8_SHM
+#include <chip8_shm.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
 static SDL_Texture *texture = NULL;
-static SDL_AudioDeviceID audio_device;
+static SDL_AudioStream *audio_stream;
 
-#define PIXEL_SIZE 5
+#define PIXEL_SIZE 10 // 初始窗口是 64x32 画面的几倍
 
-#define CLOCK_HZ 60
-#define CLOCK_RATE_MS ((int) ((1.0 / CLOCK_HZ) * 1000 + 0.5))
+#define NS_PER_SEC 1000000000ull
+#define MAX_CATCHUP_NS (NS_PER_SEC / 10) // 最多追赶 100ms，落后更多时丢弃（跳帧）
 
-#define BLACK 0
-#define WHITE 255
+#define PIXEL_OFF    0x000000FF // RGBA8888 black
+#define PIXEL_ON     0xFFFFFFFF // RGBA8888 white，只在第一个平面点亮
+#define PIXEL_PLANE1 0x5599FFFF // 只在第二个平面点亮（XO-CHIP）
+#define PIXEL_BOTH   0xFFCC00FF // 两个平面都点亮
 
 #define SCREEN_ROWS (CHIP8_SCREEN_HEIGHT * PIXEL_SIZE)
 #define SCREEN_COLS (CHIP8_SCREEN_WIDTH * PIXEL_SIZE)
 
-static uint32_t pixels[CHIP8_SCREEN_HEIGHT * CHIP8_SCREEN_WIDTH]; // 像素缓冲区
+static uint32_t pixels[CHIP8_HIRES_HEIGHT * CHIP8_HIRES_WIDTH]; // 像素缓冲区，每个 CHIP-8 像素一个
 
-extern uint8_t keypad[];
-extern uint8_t frame_buffer[CHIP8_SCREEN_HEIGHT][CHIP8_SCREEN_WIDTH];
-extern bool draw_flag;
+static chip8_filter_t filter = CHIP8_FILTER_NEAREST; // CPU 放大滤镜
+static int scale = 1;                                // 纹理是画面的几倍
 
-struct timeval clock_prev;
+static chip8_t chip8;
 
-void AudioCallback(void *userdata, Uint8 *stream, int len) {
-    static int tone_phase = 0;
-    const int amplitude = 28000; // 方波振幅
-    
-    Sint16 *samples = (Sint16*)stream;
-    len /= sizeof(Sint16);
-    
-    for(int i = 0; i < len; i++) {
-        samples[i] = (tone_phase < 100) ? amplitude : -amplitude; // 方波
-        tone_phase = (tone_phase + 1) % 200; // 440Hz方波（假设采样率44100）
+// 回退历史：每帧记录一次，按住退格键倒放；F5/F9 快速存档/读档
+#define REWIND_CAPACITY (512 * 1024)
+static chip8_rewind_t *rewind_history;
+static char state_path[1024];
+
+#ifdef CHIP8_PROFILE
+// 性能剖析：退出时写出 <前缀>.json 和 <前缀>.folded（火焰图）
+static const char *profile_prefix;
+#endif
+
+#ifdef CHIP8_TRACE
+// 执行轨迹：记录每条指令和按键，用 chip8-replay 回放校验
+static const char *trace_path;
+#endif
+
+#ifdef CHIP8_SHM
+// 共享内存导出：其他进程可以读取画面和寄存器、发送按键，见 chip8-shm
+static const char *shm_name;
+static chip8_shm_t *shm;
+#endif
+
+// 窗口内容需要重新呈现（首次显示、被遮挡后重新暴露、尺寸变化）
+static bool present_needed = true;
+
+// 模拟线程：CPU 在独立线程上按自己的时钟分片运行，呈现（可能因垂直同步阻塞）不会拖慢模拟
+#define EMU_SLICE_NS (NS_PER_SEC / 240)               // 每片时长，也是按键的最大延迟
+#define REWIND_FRAME_NS (NS_PER_SEC / CHIP8_TIMER_HZ) // 回退历史每帧的时长
+
+static SDL_Thread *emu_thread;
+static SDL_AtomicInt emu_running;
+
+// 键位表：扫描码直接查出键盘上的 CHIP-8 键（与键盘布局无关），可用 --keymap 文件改绑
+static int8_t keypad_of[SDL_SCANCODE_COUNT];
+static const char *keymap_path;
+
+// 按键从主线程传给模拟线程：带时间戳的单生产者单消费者队列，模拟线程按时间戳
+// 换算出对应的指令，在那条指令之前生效
+#define INPUT_EVENTS 256 // 队列容量，必须是 2 的幂
+typedef struct {
+    uint64_t ns; // 事件发生的主机时间
+    uint8_t key;
+    bool down;
+} input_event_t;
+static input_event_t input_events[INPUT_EVENTS];
+static SDL_AtomicInt input_head; // 只由模拟线程写
+static SDL_AtomicInt input_tail; // 只由主线程写
+
+// 主线程发给模拟线程的请求
+#define REQUEST_SAVE 1
+#define REQUEST_LOAD 2
+static SDL_AtomicInt requests;
+static SDL_AtomicInt rewind_held;
+
+// 音频：模拟线程把蜂鸣器的开关沿（换算成主机时间）放进单生产者单消费者队列，
+// 音频线程按采样点取出，整个过程不加锁
+#define AUDIO_FREQ 44100
+#define AUDIO_FRAMES "256"                  // 设备缓冲区帧数，约 5.8ms
+#define AUDIO_TONE_HZ 440
+#define AUDIO_AMPLITUDE 8000                // 方波振幅
+#define AUDIO_DELAY_NS (2 * EMU_SLICE_NS)   // 开关沿晚于模拟的时间，保证到达时还没播放
+#define AUDIO_EDGES 64                      // 队列容量，必须是 2 的幂
+typedef struct {
+    uint64_t ns; // 开关沿对应的主机时间
+    bool on;
+} audio_edge_t;
+static audio_edge_t audio_edges[AUDIO_EDGES];
+static SDL_AtomicInt audio_head; // 只由音频线程写
+static SDL_AtomicInt audio_tail; // 只由模拟线程写
+
+// 三缓冲：模拟线程写 back，主线程读 front，两者通过 middle 交换，互不等待
+#define FRAME_FRESH 4 // middle 中有主线程还没取走的新帧
+typedef struct {
+    uint64_t planes[CHIP8_PLANES][CHIP8_PLANE_WORDS]; // 只有当前模式的行有效
+    bool hires;        // 128x64 模式
+    uint64_t seq;      // 帧序号
+    uint64_t ready_ns; // 发布时刻
+} frame_t;
+static frame_t frames[3];
+static SDL_AtomicInt frame_middle; // 中间槽下标，可能带 FRAME_FRESH
+static int frame_back = 0;         // 只由模拟线程访问
+static int frame_front = 2;        // 只由主线程访问
+static uint64_t shown[CHIP8_PLANES][CHIP8_PLANE_WORDS]; // 纹理中当前的内容
+static bool texture_valid;                              // 纹理已经完整上传过
+static bool texture_hires;                              // 纹理是 128x64
+static bool texture_stale;                              // 窗口大小变了，要重建纹理
+
+// 帧节奏统计
+static struct {
+    uint64_t published;     // 模拟线程发布的帧
+    uint64_t overwritten;   // 主线程取走前就被新帧覆盖的帧
+    uint64_t presented;     // 呈现的帧
+    uint64_t present_ns;    // 呈现耗时累计
+    uint64_t max_present_ns;
+    uint64_t latency_ns;    // 发布到呈现完成的延迟累计
+    uint64_t max_latency_ns;
+    uint64_t scaled;        // 放大过的帧
+    uint64_t scale_ns;      // 放大并写入纹理的耗时累计
+    uint64_t max_scale_ns;
+} pacing;
+
+// 调度器：按单调时钟给 CPU 分配指令预算，与宿主帧率无关；只由模拟线程访问
+static struct {
+    uint32_t ips;            // 每秒执行的指令数
+    uint64_t start_ns;       // 开始运行的时刻
+    uint64_t last_ns;        // 上一片的时刻
+    uint64_t budget;         // 尚未执行的时间，单位 ns * ips
+    uint64_t start_cycles;   // 开始时的指令计数
+    uint64_t dropped_ns;     // 负载过高时丢弃的时间
+    uint64_t frames;         // 片数
+    uint64_t skipped_frames; // 触发追赶上限的片数
+    uint64_t max_frame_ns;   // 最长片间隔
+    double mean_frame_ns;    // 片间隔均值
+    double m2_frame_ns;      // 片间隔方差累积量（Welford）
+} sched;
+
+// 模拟线程：放入一个开关沿，队列满时丢弃
+static void audio_push_edge(uint64_t ns, bool on) {
+    int tail = SDL_GetAtomicInt(&audio_tail);
+    if (tail - SDL_GetAtomicInt(&audio_head) == AUDIO_EDGES) {
+        return;
+    }
+    audio_edges[tail & (AUDIO_EDGES - 1)] = (audio_edge_t){ ns, on };
+    SDL_SetAtomicInt(&audio_tail, tail + 1);
+}
+
+// 音频线程：生成方波，开关沿精确到采样点。本次生成的第一个采样在
+// 当前时刻播放，开关沿统一推迟 AUDIO_DELAY_NS
+static void SDLCALL audio_callback(void *userdata, SDL_AudioStream *stream,
+                                   int additional_amount, int total_amount) {
+    static bool tone_on;
+    static uint32_t tone_phase;
+    const uint32_t tone_step = (uint32_t)(((uint64_t)AUDIO_TONE_HZ << 32) / AUDIO_FREQ);
+    Sint16 samples[256];
+    uint64_t start_ns = SDL_GetTicksNS();
+    int frames = additional_amount / (int)sizeof(Sint16);
+    int done = 0;
+
+    (void)userdata;
+    (void)total_amount;
+    while (done < frames) {
+        int n = frames - done < 256 ? frames - done : 256;
+        for (int i = 0; i < n; i++) {
+            uint64_t sample_ns = start_ns + (uint64_t)(done + i) * NS_PER_SEC / AUDIO_FREQ;
+            int head = SDL_GetAtomicInt(&audio_head);
+            while (head != SDL_GetAtomicInt(&audio_tail) &&
+                   audio_edges[head & (AUDIO_EDGES - 1)].ns + AUDIO_DELAY_NS <= sample_ns) {
+                tone_on = audio_edges[head & (AUDIO_EDGES - 1)].on;
+                SDL_SetAtomicInt(&audio_head, ++head);
+                if (tone_on) {
+                    tone_phase = 0;
+                }
+            }
+            samples[i] = tone_on ? (tone_phase < 0x80000000u ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE) : 0;
+            tone_phase += tone_step;
+        }
+        SDL_PutAudioStreamData(stream, samples, n * (int)sizeof(Sint16));
+        done += n;
+    }
+}
+
+// 模拟线程：取出本片的声音事件。事件以定时器滴答计时，按模拟时钟
+// 与 now_ns 的对应关系换算成主机时间
+static void drain_sound(uint64_t now_ns) {
+    chip8_sound_event_t sound;
+    double now_ticks = (double)chip8.ticks + (double)chip8.tick_phase / chip8.ips;
+
+    while (chip8_poll_sound(&chip8, &sound)) {
+        double behind_ns = (now_ticks - (double)sound.tick) * NS_PER_SEC / CHIP8_TIMER_HZ;
+        uint64_t ns = behind_ns > 0 && behind_ns < (double)now_ns ? now_ns - (uint64_t)behind_ns : now_ns;
+        audio_push_edge(ns, sound.on);
+    }
+}
+
+// 把一行位图（每个平面 words 个字）展开为 RGBA8888 像素。颜色按两个平面
+// 的位异或合成：OFF ^ (p0 & A) ^ (p1 & B) ^ (p0 & p1 & C)
+static void expand_row(const uint64_t *p0, const uint64_t *p1, int words, uint32_t *out) {
+    const uint32_t a = PIXEL_ON ^ PIXEL_OFF;
+    const uint32_t b = PIXEL_PLANE1 ^ PIXEL_OFF;
+    const uint32_t c = PIXEL_BOTH ^ PIXEL_OFF ^ a ^ b;
+    for (int k = 0; k < words; k++, out += 64) {
+        uint64_t r0 = p0[k], r1 = p1[k];
+#if defined(__AVX2__)
+        const __m256i bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+        for (int x = 0; x < 64; x += 8) {
+            __m256i b0 = _mm256_set1_epi32((int)(r0 >> (56 - x)) & 0xFF);
+            __m256i b1 = _mm256_set1_epi32((int)(r1 >> (56 - x)) & 0xFF);
+            __m256i lit0 = _mm256_cmpeq_epi32(_mm256_and_si256(b0, bits), bits);
+            __m256i lit1 = _mm256_cmpeq_epi32(_mm256_and_si256(b1, bits), bits);
+            __m256i px = _mm256_xor_si256(_mm256_set1_epi32((int)PIXEL_OFF),
+                                          _mm256_and_si256(lit0, _mm256_set1_epi32((int)a)));
+            px = _mm256_xor_si256(px, _mm256_and_si256(lit1, _mm256_set1_epi32((int)b)));
+            px = _mm256_xor_si256(px, _mm256_and_si256(_mm256_and_si256(lit0, lit1),
+                                                       _mm256_set1_epi32((int)c)));
+            _mm256_storeu_si256((__m256i *)&out[x], px);
+        }
+#elif defined(__SSE2__)
+        const __m128i bits = _mm_setr_epi32(0x8, 0x4, 0x2, 0x1);
+        for (int x = 0; x < 64; x += 4) {
+            __m128i b0 = _mm_set1_epi32((int)(r0 >> (60 - x)) & 0xF);
+            __m128i b1 = _mm_set1_epi32((int)(r1 >> (60 - x)) & 0xF);
+            __m128i lit0 = _mm_cmpeq_epi32(_mm_and_si128(b0, bits), bits);
+            __m128i lit1 = _mm_cmpeq_epi32(_mm_and_si128(b1, bits), bits);
+            __m128i px = _mm_xor_si128(_mm_set1_epi32((int)PIXEL_OFF),
+                                       _mm_and_si128(lit0, _mm_set1_epi32((int)a)));
+            px = _mm_xor_si128(px, _mm_and_si128(lit1, _mm_set1_epi32((int)b)));
+            px = _mm_xor_si128(px, _mm_and_si128(_mm_and_si128(lit0, lit1),
+                                                 _mm_set1_epi32((int)c)));
+            _mm_storeu_si128((__m128i *)&out[x], px);
+        }
+#else
+        for (int x = 0; x < 64; x++) {
+            uint32_t lit0 = (r0 >> (63 - x)) & 1 ? 0xFFFFFFFFu : 0;
+            uint32_t lit1 = (r1 >> (63 - x)) & 1 ? 0xFFFFFFFFu : 0;
+            out[x] = PIXEL_OFF ^ (lit0 & a) ^ (lit1 & b) ^ (lit0 & lit1 & c);
+        }
+#endif
+    }
+}
+
+// 模拟线程：把有变化的画面发布到 back 槽并与 middle 交换
+static void publish_frame(void) {
+    frame_t *f = &frames[frame_back];
+
+    if (chip8.dirty_rows == 0) {
+        return;
+    }
+    chip8.dirty_rows = 0;
+    chip8.draw_flag = false;
+    // 只复制当前模式用到的字
+    int words = chip8_screen_height(&chip8) * chip8_row_words(&chip8);
+    for (int p = 0; p < CHIP8_PLANES; p++) {
+        SDL_memcpy(f->planes[p], chip8.frame_buffer[p], words * sizeof(uint64_t));
+    }
+    f->hires = chip8.hires != 0;
+    f->seq = ++pacing.published;
+    f->ready_ns = SDL_GetTicksNS();
+
+    int old = SDL_SetAtomicInt(&frame_middle, frame_back | FRAME_FRESH);
+    if (old & FRAME_FRESH) {
+        pacing.overwritten++;
+    }
+    frame_back = old & 3;
+}
+
+// 主线程：取最新的一帧，没有新帧时返回 NULL
+static const frame_t *take_frame(void) {
+    if (!(SDL_GetAtomicInt(&frame_middle) & FRAME_FRESH)) {
+        return NULL;
+    }
+    frame_front = SDL_SetAtomicInt(&frame_middle, frame_front) & 3;
+    return &frames[frame_front];
+}
+
+// 按画面模式和窗口大小创建纹理：画面由 CPU 放大到滤镜能放进窗口的最大倍数，
+// 呈现时不再由渲染器拉伸
+static bool create_texture(bool hires) {
+    int width = hires ? CHIP8_HIRES_WIDTH : CHIP8_SCREEN_WIDTH;
+    int height = hires ? CHIP8_HIRES_HEIGHT : CHIP8_SCREEN_HEIGHT;
+    int w = width, h = height;
+
+    if (texture) {
+        SDL_DestroyTexture(texture);
+    }
+    SDL_GetWindowSizeInPixels(window, &w, &h);
+    scale = chip8_filter_scale(filter, width, height, w, h);
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                                SDL_TEXTUREACCESS_STREAMING, width * scale, height * scale);
+    if (texture) {
+        // 窗口比最小倍数还小时才会缩放
+        SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
+    }
+    texture_hires = hires;
+    texture_stale = false;
+    texture_valid = false;
+    return texture != NULL;
+}
+
+// 第 y 行（每个平面 words 个字）是否与纹理中的内容不同
+static bool row_changed(const frame_t *f, int y, int words) {
+    for (int p = 0; p < CHIP8_PLANES; p++) {
+        if (SDL_memcmp(&f->planes[p][y * words], &shown[p][y * words],
+                       words * sizeof(uint64_t)) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 只展开与纹理内容不同的行，连同滤镜要用到它们的相邻行一起放大，直接写入锁定的
+// 纹理（连续的行合并为一次锁定），返回是否有更新。画面模式切换或窗口大小变化时重建纹理
+static bool upload_dirty_rows(const frame_t *f) {
+    int words = f->hires ? 2 : 1;
+    int width = CHIP8_SCREEN_WIDTH * words;
+    int height = CHIP8_SCREEN_HEIGHT * words;
+    uint64_t changed = 0;
+
+    if ((f->hires != texture_hires || texture_stale) && !create_texture(f->hires)) {
+        SDL_Log("Couldn't create texture: %s", SDL_GetError());
+        return false;
+    }
+    for (int y = 0; y < height; y++) {
+        if (texture_valid && !row_changed(f, y, words)) {
+            continue;
+        }
+        for (int p = 0; p < CHIP8_PLANES; p++) {
+            SDL_memcpy(&shown[p][y * words], &f->planes[p][y * words],
+                       words * sizeof(uint64_t));
+        }
+        expand_row(&f->planes[0][y * words], &f->planes[1][y * words], words,
+                   &pixels[y * width]);
+        changed |= (uint64_t)1 << y;
+    }
+    if (changed == 0) {
+        return false;
+    }
+    // Scale2x/3x 的输出还取决于上下相邻的行
+    if (chip8_filter_reach(filter) > 0) {
+        changed |= changed << 1 | changed >> 1;
+        if (height < 64) {
+            changed &= ((uint64_t)1 << height) - 1;
+        }
+    }
+
+    uint64_t start_ns = SDL_GetTicksNS();
+    int y = 0;
+    while (y < height) {
+        if (!(changed >> y & 1)) {
+            y++;
+            continue;
+        }
+        int first = y;
+        while (y < height && (changed >> y & 1)) {
+            y++;
+        }
+        SDL_Rect rect = { 0, first * scale, width * scale, (y - first) * scale };
+        void *out;
+        int pitch;
+        if (!SDL_LockTexture(texture, &rect, &out, &pitch)) {
+            SDL_Log("Couldn't lock texture: %s", SDL_GetError());
+            return false;
+        }
+        chip8_scale_rows(filter, scale, pixels, width, height, first, y, out, pitch);
+        SDL_UnlockTexture(texture);
+    }
+    uint64_t scale_ns = SDL_GetTicksNS() - start_ns;
+    pacing.scaled++;
+    pacing.scale_ns += scale_ns;
+    if (scale_ns > pacing.max_scale_ns) {
+        pacing.max_scale_ns = scale_ns;
+    }
+    texture_valid = true;
+    return true;
+}
+
+// 主线程：放入一个按键事件，队列满时丢弃
+static void input_push(uint64_t ns, int key, bool down) {
+    int tail = SDL_GetAtomicInt(&input_tail);
+    if (tail - SDL_GetAtomicInt(&input_head) == INPUT_EVENTS) {
+        SDL_Log("Input queue full, dropping key %X", key);
+        return;
+    }
+    input_events[tail & (INPUT_EVENTS - 1)] = (input_event_t){ ns, (uint8_t)key, down };
+    SDL_SetAtomicInt(&input_tail, tail + 1);
+}
+
+// 模拟线程：查看最早的按键事件，不取出
+static const input_event_t *input_peek(void) {
+    int head = SDL_GetAtomicInt(&input_head);
+    if (head == SDL_GetAtomicInt(&input_tail)) {
+        return NULL;
+    }
+    return &input_events[head & (INPUT_EVENTS - 1)];
+}
+
+// 模拟线程：让最早的按键事件生效并取出
+static void input_apply(const input_event_t *event) {
+    chip8_set_key(&chip8, event->key, event->down);
+    SDL_SetAtomicInt(&input_head, SDL_GetAtomicInt(&input_head) + 1);
+}
+
+// 按经过的时间执行应得的指令数，返回本片执行的指令数。时间戳落在本片内的
+// 按键事件按比例换算成指令数，恰好在对应的指令边界生效
+static int sched_run(uint64_t now_ns) {
+    uint64_t start_ns = sched.last_ns;
+    uint64_t elapsed = now_ns - start_ns;
+    sched.last_ns = now_ns;
+
+    // 片间隔统计（抖动）
+    double delta = (double)elapsed - sched.mean_frame_ns;
+    sched.frames++;
+    sched.mean_frame_ns += delta / (double)sched.frames;
+    sched.m2_frame_ns += delta * ((double)elapsed - sched.mean_frame_ns);
+    if (elapsed > sched.max_frame_ns) {
+        sched.max_frame_ns = elapsed;
+    }
+
+    // 落后太多（窗口被拖动、调试暂停等）时不再追赶，丢弃多出的时间
+    if (elapsed > MAX_CATCHUP_NS) {
+        sched.dropped_ns += elapsed - MAX_CATCHUP_NS;
+        sched.skipped_frames++;
+        elapsed = MAX_CATCHUP_NS;
+    }
+
+    // 余数留在 budget 里，长期运行不会累积误差
+    sched.budget += elapsed * sched.ips;
+    int cycles = (int)(sched.budget / NS_PER_SEC);
+    sched.budget %= NS_PER_SEC;
+
+    const input_event_t *event;
+    int done = 0;
+    while ((event = input_peek()) != NULL && event->ns <= now_ns) {
+        int at = event->ns <= start_ns ? 0
+               : (int)((event->ns - start_ns) * (uint64_t)cycles / (now_ns - start_ns));
+        if (at > done) {
+            chip8_step(&chip8, at - done);
+            done = at;
+        }
+        input_apply(event);
+    }
+    chip8_step(&chip8, cycles - done);
+    return cycles;
+}
+
+// 回退时模拟时间停止，这段实际时间不计入漂移
+static void sched_pause(uint64_t now_ns) {
+    sched.dropped_ns += now_ns - sched.last_ns;
+    sched.last_ns = now_ns;
+}
+
+// 快速存档
+static void save_state_file(void) {
+    uint8_t buf[CHIP8_STATE_SIZE];
+    size_t size = chip8_save_state(&chip8, buf, sizeof(buf));
+    FILE *f = fopen(state_path, "wb");
+    if (!f || fwrite(buf, 1, size, f) != size) {
+        SDL_Log("Couldn't save %s", state_path);
+    } else {
+        SDL_Log("Saved %s", state_path);
+    }
+    if (f) {
+        fclose(f);
+    }
+}
+
+// 快速读档
+static void load_state_file(void) {
+    uint8_t buf[CHIP8_STATE_SIZE];
+    size_t size = 0;
+    FILE *f = fopen(state_path, "rb");
+    if (f) {
+        size = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+    }
+    if (!chip8_load_state(&chip8, buf, size)) {
+        SDL_Log("Couldn't load %s", state_path);
+        return;
+    }
+    SDL_Log("Loaded %s", state_path);
+}
+
+// 原子地置位、清除标志位
+static void atomic_update(SDL_AtomicInt *a, int set, int clear) {
+    int old;
+    do {
+        old = SDL_GetAtomicInt(a);
+    } while (!SDL_CompareAndSwapAtomicInt(a, old, (old | set) & ~clear));
+}
+
+// 默认键位：键盘左侧 4x4 区域对应 CHIP-8 的 16 键键盘
+static const struct {
+    SDL_Scancode scancode;
+    int key;
+} default_keymap[CHIP8_KEY_SIZE] = {
+    { SDL_SCANCODE_1, 0x1 }, { SDL_SCANCODE_2, 0x2 }, { SDL_SCANCODE_3, 0x3 }, { SDL_SCANCODE_4, 0xC },
+    { SDL_SCANCODE_Q, 0x4 }, { SDL_SCANCODE_W, 0x5 }, { SDL_SCANCODE_E, 0x6 }, { SDL_SCANCODE_R, 0xD },
+    { SDL_SCANCODE_A, 0x7 }, { SDL_SCANCODE_S, 0x8 }, { SDL_SCANCODE_D, 0x9 }, { SDL_SCANCODE_F, 0xE },
+    { SDL_SCANCODE_Z, 0xA }, { SDL_SCANCODE_X, 0x0 }, { SDL_SCANCODE_C, 0xB }, { SDL_SCANCODE_V, 0xF },
+};
+
+// 读取键位文件，每行 "<CHIP-8 键（十六进制）> <SDL 键名>"，# 开头为注释。
+// 文件中出现的 CHIP-8 键先解除默认绑定，一个键可以绑定多个按键
+static bool load_keymap(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[128], name[64];
+    bool rebound[CHIP8_KEY_SIZE] = { false };
+    int number = 0;
+    unsigned key;
+
+    if (!f) {
+        SDL_Log("Couldn't open keymap %s", path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        number++;
+        if (line[0] == '#' || sscanf(line, "%x %63[^\r\n]", &key, name) != 2) {
+            continue;
+        }
+        SDL_Scancode scancode = SDL_GetScancodeFromName(name);
+        if (key >= CHIP8_KEY_SIZE || scancode == SDL_SCANCODE_UNKNOWN) {
+            SDL_Log("%s:%d: can't bind %s", path, number, line);
+            continue;
+        }
+        if (!rebound[key]) {
+            for (int s = 0; s < SDL_SCANCODE_COUNT; s++) {
+                if (keypad_of[s] == (int8_t)key) {
+                    keypad_of[s] = -1;
+                }
+            }
+            rebound[key] = true;
+        }
+        keypad_of[scancode] = (int8_t)key;
+    }
+    fclose(f);
+    return true;
+}
+
+// 机器停机时报告一次原因；回退或读档越过停机点后可以继续运行
+static void report_trap(void) {
+    static uint8_t reported = CHIP8_TRAP_NONE;
+
+    uint8_t trap = chip8.state == CHIP8_STATE_TRAPPED ? chip8.trap : CHIP8_TRAP_NONE;
+    if (trap != reported && trap != CHIP8_TRAP_NONE) {
+        SDL_Log("Stopped at %03X (opcode %04X): %s", chip8.PC, chip8.opcode,
+                chip8_trap_name((chip8_trap_t)trap));
+    }
+    reported = trap;
+}
+
+// 模拟线程主循环：每片先处理按键和请求，再按经过的时间执行指令，最后发布画面
+static int SDLCALL emu_main(void *data) {
+    uint64_t next_ns = SDL_GetTicksNS();
+    uint64_t rewind_ns = next_ns;
+
+    (void)data;
+    while (SDL_GetAtomicInt(&emu_running)) {
+        uint64_t now_ns = SDL_GetTicksNS();
+
+        int request = SDL_SetAtomicInt(&requests, 0);
+        if (request & REQUEST_SAVE) {
+            save_state_file();
+        }
+        if (request & REQUEST_LOAD) {
+            load_state_file();
+        }
+
+        // 回退历史按 60Hz 记录和倒放，与分片长度无关
+        bool rewind_frame = now_ns - rewind_ns >= REWIND_FRAME_NS;
+        if (rewind_frame) {
+            rewind_ns = now_ns;
+        }
+        if (SDL_GetAtomicInt(&rewind_held) && rewind_history) {
+            if (rewind_frame) {
+                chip8_rewind_pop(rewind_history, &chip8);
+            }
+            sched_pause(now_ns);
+            // 倒放时按键立即生效
+            const input_event_t *event;
+            while ((event = input_peek()) != NULL) {
+                input_apply(event);
+            }
+        } else {
+            sched_run(now_ns);
+            if (rewind_frame && rewind_history) {
+                chip8_rewind_push(rewind_history, &chip8);
+            }
+        }
+        report_trap();
+        publish_frame();
+        drain_sound(now_ns);
+#ifdef CHIP8_PROFILE
+        chip8_profile_frame(&chip8, SDL_GetTicksNS() - now_ns);
+#endif
+
+        // 睡到下一片；落后太多时不再追赶
+        next_ns += EMU_SLICE_NS;
+        now_ns = SDL_GetTicksNS();
+        if (now_ns + MAX_CATCHUP_NS < next_ns || now_ns > next_ns + MAX_CATCHUP_NS) {
+            next_ns = now_ns;
+        } else if (next_ns > now_ns) {
+            SDL_DelayPrecise(next_ns - now_ns);
+        }
     }
+    return 0;
 }
 
-int timediff_ms(struct timeval *end, struct timeval *start) {
-    int diff =  (end->tv_sec - start->tv_sec) * 1000 +
-                (end->tv_usec - start->tv_usec) / 1000;
-    //printf("timediff = %d\n", diff);
-    return diff;
+// 输出调度统计：抖动为片间隔的标准差，漂移为模拟时间与（扣除丢弃时间后的）实际时间之差
+static void sched_report(void) {
+    uint64_t wall_ns = sched.last_ns - sched.start_ns - sched.dropped_ns;
+    double emulated_ns = (double)(chip8.cycles - sched.start_cycles) * NS_PER_SEC / sched.ips;
+    double jitter_ns = sched.frames > 1 ? SDL_sqrt(sched.m2_frame_ns / (double)(sched.frames - 1)) : 0.0;
+
+    SDL_Log("ips %u, %llu cycles, %llu slices (%llu over catch-up limit)",
+            sched.ips, (unsigned long long)(chip8.cycles - sched.start_cycles),
+            (unsigned long long)sched.frames, (unsigned long long)sched.skipped_frames);
+    SDL_Log("slice interval mean %.3f ms, jitter %.3f ms, max %.3f ms",
+            sched.mean_frame_ns / 1e6, jitter_ns / 1e6, sched.max_frame_ns / 1e6);
+    SDL_Log("drift %.3f ms, dropped %.3f ms, idle %.1f%%",
+            (emulated_ns - (double)wall_ns) / 1e6, sched.dropped_ns / 1e6,
+            chip8.cycles > 0 ? 100.0 * chip8.idle_cycles / chip8.cycles : 0.0);
+    SDL_Log("frames published %llu, presented %llu, overwritten unseen %llu",
+            (unsigned long long)pacing.published, (unsigned long long)pacing.presented,
+            (unsigned long long)pacing.overwritten);
+    if (pacing.presented > 0) {
+        SDL_Log("present mean %.3f ms, max %.3f ms; publish-to-present latency mean %.3f ms, max %.3f ms",
+                pacing.present_ns / 1e6 / pacing.presented, pacing.max_present_ns / 1e6,
+                pacing.latency_ns / 1e6 / pacing.presented, pacing.max_latency_ns / 1e6);
+    }
+    if (pacing.scaled > 0) {
+        SDL_Log("%s x%d mean %.3f ms, max %.3f ms per frame", chip8_filter_name(filter), scale,
+                pacing.scale_ns / 1e6 / pacing.scaled, pacing.max_scale_ns / 1e6);
+    }
+}
+
+#ifdef CHIP8_PROFILE
+static void write_profile(void) {
+    char path[1024];
+    FILE *f;
+
+    SDL_snprintf(path, sizeof(path), "%s.json", profile_prefix);
+    f = fopen(path, "w");
+    if (!f || !chip8_profile_write_json(&chip8, f)) {
+        SDL_Log("Couldn't write %s", path);
+    }
+    if (f) {
+        fclose(f);
+    }
+
+    SDL_snprintf(path, sizeof(path), "%s.folded", profile_prefix);
+    f = fopen(path, "w");
+    if (!f || !chip8_profile_write_folded(&chip8, f)) {
+        SDL_Log("Couldn't write %s", path);
+    }
+    if (f) {
+        fclose(f);
+    }
 }
+#endif
 
 /* This function runs once at startup. */
 SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
@@ -86,70 +726,179 @@ SDL_AppResult SDL_AppInit(void **appstate, int argc, char *argv[])
         return SDL_APP_FAILURE;
     }
     
-    // 创建纹理用于像素渲染（RGBA8888格式）
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, 
-                               SDL_TEXTUREACCESS_STREAMING, 
-                               CHIP8_SCREEN_WIDTH, CHIP8_SCREEN_HEIGHT);
-    if (!texture) {
+    // 创建纹理用于像素渲染（RGBA8888格式），画面模式切换时重建
+    if (!create_texture(false)) {
         SDL_Log("Couldn't create texture: %s", SDL_GetError());
         return SDL_APP_FAILURE;
     }
     
-    // 初始化音频设备
+    // 初始化音频流：回调按需生成方波，缓冲区尽量小以降低延迟；打不开时静音运行
     SDL_AudioSpec spec = {
-        .freq = 44100,
+        .freq = AUDIO_FREQ,
         .format = SDL_AUDIO_S16,
         .channels = 1,
     };
-#if 0
-    audio_device = SDL_OpenAudioDevice(0, &spec);
-    if (!audio_device) {
+    SDL_SetHint(SDL_HINT_AUDIO_DEVICE_SAMPLE_FRAMES, AUDIO_FRAMES);
+    audio_stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec,
+                                             audio_callback, NULL);
+    if (!audio_stream) {
         SDL_Log("Couldn't open audio: %s", SDL_GetError());
+    } else {
+        SDL_ResumeAudioStreamDevice(audio_stream);
     }
-#endif
     
-    // 初始化像素缓冲区为黑色
-    memset(pixels, 0, sizeof(pixels));
-
     // 初始化Chip8
-    chip8_init();
-    // 加载ROM
-    if (argc > 1) {
-        chip8_load_game(argv[1]);
-    }else {
-        printf("Usage: %s <rom_path>\n", argv[0]);
-        return SDL_APP_FAILURE;
+    chip8_init(&chip8);
+#ifdef CHIP8_JIT
+    if (!chip8_jit_enable(&chip8)) {
+        SDL_Log("JIT unavailable, interpreting");
     }
-    
 #endif
+    // 解析命令行参数
+    const char *rom_path = NULL;
+    uint32_t ips = CHIP8_DEFAULT_IPS;
+    uint64_t seed = SDL_GetPerformanceCounter(); // 默认每次运行随机数不同
+    int quirks = -1; // -1：按 ROM 数据库自动选择
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+            ips = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--keymap") == 0 && i + 1 < argc) {
+            keymap_path = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            int k;
+            for (k = 0; k < CHIP8_FILTER_COUNT; k++) {
+                if (strcmp(name, chip8_filter_name(k)) == 0) {
+                    break;
+                }
+            }
+            if (k == CHIP8_FILTER_COUNT) {
+                rom_path = NULL;
+                break;
+            }
+            filter = k;
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            for (quirks = 0; quirks < CHIP8_QUIRKS_COUNT; quirks++) {
+                if (strcmp(name, chip8_quirks_name(quirks)) == 0) {
+                    break;
+                }
+            }
+            if (quirks == CHIP8_QUIRKS_COUNT) {
+                rom_path = NULL;
+                break;
+            }
+#ifdef CHIP8_PROFILE
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_prefix = argv[++i];
+#endif
+#ifdef CHIP8_TRACE
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+#endif
+#ifdef CHIP8_SHM
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+#endif
+        } else if (argv[i][0] != '-' && rom_path == NULL) {
+            rom_path = argv[i];
+        } else {
+            rom_path = NULL;
+            break;
+        }
+    }
+    if (rom_path == NULL || ips == 0) {
+        printf("Usage: %s [--ips N] [--seed N] [--keymap file] [--quirks modern|vip|schip|xochip] [--filter nearest|scale2x|scale3x|scanlines]%s%s%s <rom_path>\n",
+               argv[0],
+#ifdef CHIP8_PROFILE
+               " [--profile prefix]",
+#else
+               "",
+#endif
+#ifdef CHIP8_TRACE
+               " [--trace file]",
+#else
+               "",
+#endif
+#ifdef CHIP8_SHM
+               " [--shm name]");
+#else
+               "");
+#endif
+        return SDL_APP_FAILURE;
+    }
+    texture_stale = true; // 按选定的滤镜重建纹理
 
-    return SDL_APP_CONTINUE;
-}
+    // 键位表：先填默认键位，再用键位文件改绑
+    SDL_memset(keypad_of, -1, sizeof(keypad_of));
+    for (int i = 0; i < CHIP8_KEY_SIZE; i++) {
+        keypad_of[default_keymap[i].scancode] = (int8_t)default_keymap[i].key;
+    }
+    if (keymap_path && !load_keymap(keymap_path)) {
+        return SDL_APP_FAILURE;
+    }
+#ifdef CHIP8_PROFILE
+    if (profile_prefix && !chip8_profile_enable(&chip8)) {
+        SDL_Log("Couldn't allocate profile counters");
+        profile_prefix = NULL;
+    }
+#endif
 
-int keymap(unsigned char k) {
-    switch (k) {
-        case '1': return 0x1;
-        case '2': return 0x2;
-        case '3': return 0x3;
-        case '4': return 0xc;
+    // 加载ROM
+    if (!chip8_load_game(&chip8, rom_path)) {
+        SDL_Log("Couldn't load %s", rom_path);
+        return SDL_APP_FAILURE;
+    }
+    // 命令行指定的兼容模式优先于数据库
+    if (quirks >= 0) {
+        chip8_set_quirks(&chip8, (chip8_quirks_t)quirks);
+    }
+    SDL_Log("Quirks: %s", chip8_quirks_name(chip8.quirks));
+    chip8_set_clock(&chip8, ips);
+    chip8_seed(&chip8, seed);
+#ifdef CHIP8_TRACE
+    // 从载入 ROM 后的状态开始记录
+    if (trace_path && !chip8_trace_start(&chip8, trace_path)) {
+        SDL_Log("Couldn't create trace %s", trace_path);
+        trace_path = NULL;
+    }
+#endif
+#ifdef CHIP8_SHM
+    // 单个槽位，在每次定时器滴答时更新
+    if (shm_name) {
+        shm = chip8_shm_create(shm_name, 1);
+        if (!shm || !chip8_shm_attach(&chip8, shm, 0)) {
+            SDL_Log("Couldn't export to shared memory %s", shm_name);
+        }
+    }
+#endif
 
-        case 'q': return 0x4;
-        case 'w': return 0x5;
-        case 'e': return 0x6;
-        case 'r': return 0xd;
+    // 存档文件放在 ROM 旁边
+    SDL_snprintf(state_path, sizeof(state_path), "%s.state", rom_path);
+    rewind_history = chip8_rewind_create(REWIND_CAPACITY);
+    if (!rewind_history) {
+        SDL_Log("Couldn't allocate rewind history");
+    }
 
-        case 'a': return 0x7;
-        case 's': return 0x8;
-        case 'd': return 0x9;
-        case 'f': return 0xe;
-                  
-        case 'z': return 0xa;
-        case 'x': return 0x0;
-        case 'c': return 0xb;
-        case 'v': return 0xf;
+    sched.ips = ips;
+    sched.start_ns = sched.last_ns = SDL_GetTicksNS();
+    sched.start_cycles = chip8.cycles;
 
-        default:  return -1;
+    // 呈现等待垂直同步，模拟线程按自己的节奏运行
+    SDL_SetRenderVSync(renderer, 1);
+    SDL_SetAtomicInt(&frame_middle, 1);
+    SDL_SetAtomicInt(&emu_running, 1);
+    emu_thread = SDL_CreateThread(emu_main, "chip8", NULL);
+    if (!emu_thread) {
+        SDL_Log("Couldn't create emulator thread: %s", SDL_GetError());
+        return SDL_APP_FAILURE;
     }
+    
+#endif
+
+    return SDL_APP_CONTINUE;
 }
 
 /* This function runs when a new event (mouse input, keypresses, etc) occurs. */
@@ -158,15 +907,31 @@ SDL_AppResult SDL_AppEvent(void *appstate, SDL_Event *event)
     if (event->type == SDL_EVENT_QUIT) {
         return SDL_APP_SUCCESS;  /* end the program, reporting success to the OS. */
     }
-        // 处理键盘事件
-    if (event->type == SDL_EVENT_KEY_DOWN || event->type == SDL_EVENT_KEY_UP) {
+    if (event->type == SDL_EVENT_WINDOW_EXPOSED) {
+        present_needed = true;
+    }
+    // 纹理按窗口分辨率放大，窗口大小变了就要按新的倍数重建
+    if (event->type == SDL_EVENT_WINDOW_PIXEL_SIZE_CHANGED) {
+        texture_stale = true;
+        present_needed = true;
+    }
+    // 处理键盘事件，忽略按住时的自动重复
+    if ((event->type == SDL_EVENT_KEY_DOWN || event->type == SDL_EVENT_KEY_UP) &&
+        !event->key.repeat) {
         SDL_Keycode key = event->key.key;
-        // 查找键位映射
-        for (int i = 0; i < 16; i++) {
-            if (key == keymap(i)) {
-                keypad[i] = (event->type == SDL_EVENT_KEY_DOWN) ? 1 : 0;
-                break;
-            }
+        bool down = event->type == SDL_EVENT_KEY_DOWN;
+        // 存档、读档和回退交给模拟线程处理
+        if (key == SDLK_BACKSPACE) {
+            SDL_SetAtomicInt(&rewind_held, down);
+        } else if (key == SDLK_F5 && down) {
+            atomic_update(&requests, REQUEST_SAVE, 0);
+        } else if (key == SDLK_F9 && down) {
+            atomic_update(&requests, REQUEST_LOAD, 0);
+        }
+        // 查表得到 CHIP-8 键，连同事件时间戳交给模拟线程
+        SDL_Scancode scancode = event->key.scancode;
+        if (scancode >= 0 && scancode < SDL_SCANCODE_COUNT && keypad_of[scancode] >= 0) {
+            input_push(event->key.timestamp, keypad_of[scancode], down);
         }
     }
 
@@ -195,38 +960,40 @@ SDL_AppResult SDL_AppIterate(void *appstate)
     SDL_RenderDebugText(renderer, x, y, message);
     SDL_RenderPresent(renderer);
 #endif
-    struct timeval clock_now;
-    gettimeofday(&clock_now, NULL);
-
-    chip8_emulate_cycle();
-
-    if (draw_flag) {
-        // draw();
-        draw_flag = false;
+    // 取模拟线程发布的最新一帧，只上传变化的行；画面没有变化时跳过呈现。
+    // 纹理要重建时用主线程手上的那一帧重新上传
+    const frame_t *frame = take_frame();
+    if (!frame && texture_stale) {
+        frame = &frames[frame_front];
     }
+    if ((frame && upload_dirty_rows(frame)) || present_needed) {
+        uint64_t start_ns = SDL_GetTicksNS();
+        // 纹理已是窗口分辨率，按原大小居中绘制；比窗口大时才缩小
+        int w = 0, h = 0;
+        float tw = 0, th = 0;
+        SDL_GetRenderOutputSize(renderer, &w, &h);
+        SDL_GetTextureSize(texture, &tw, &th);
+        SDL_FRect dst = { SDL_floorf((w - tw) / 2), SDL_floorf((h - th) / 2), tw, th };
+        SDL_RenderClear(renderer);
+        SDL_RenderTexture(renderer, texture, NULL, tw <= w && th <= h ? &dst : NULL);
+        SDL_RenderPresent(renderer);
+        present_needed = false;
 
-    if (timediff_ms(&clock_now, &clock_prev) >= CLOCK_RATE_MS) {
-        chip8_tick();
-        clock_prev = clock_now;
-    }
-
-    
-    // 更新像素缓冲区
-    // UpdateDisplay(dummy_display);
-    
-    // 更新纹理并渲染
-    SDL_UpdateTexture(texture, NULL, pixels, CHIP8_SCREEN_WIDTH * sizeof(uint32_t));
-    SDL_RenderClear(renderer);
-    SDL_RenderTexture(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
-    
-    // 控制声音（假设有一个sound_timer变量）
-    static int sound_timer = 0;
-    if (sound_timer > 0) {
-        // SDL_PlayAudioDevice(audio_device);
-        sound_timer--;
+        uint64_t end_ns = SDL_GetTicksNS();
+        uint64_t present_ns = end_ns - start_ns;
+        uint64_t latency_ns = frame ? end_ns - frame->ready_ns : 0;
+        pacing.presented++;
+        pacing.present_ns += present_ns;
+        pacing.latency_ns += latency_ns;
+        if (present_ns > pacing.max_present_ns) {
+            pacing.max_present_ns = present_ns;
+        }
+        if (latency_ns > pacing.max_latency_ns) {
+            pacing.max_latency_ns = latency_ns;
+        }
     } else {
-        SDL_PauseAudioDevice(audio_device);
+        // 没有新画面时让出 CPU，不空转
+        SDL_Delay(1);
     }
 
     return SDL_APP_CONTINUE;
@@ -235,4 +1002,31 @@ SDL_AppResult SDL_AppIterate(void *appstate)
 /* This function runs once at shutdown. */
 void SDL_AppQuit(void *appstate, SDL_AppResult result)
 {
+    // 先停下模拟线程，之后主线程才能访问 chip8
+    if (emu_thread) {
+        SDL_SetAtomicInt(&emu_running, 0);
+        SDL_WaitThread(emu_thread, NULL);
+    }
+    if (audio_stream) {
+        SDL_DestroyAudioStream(audio_stream);
+    }
+    if (sched.frames > 0) {
+        sched_report();
+    }
+    chip8_rewind_destroy(rewind_history);
+#ifdef CHIP8_PROFILE
+    if (profile_prefix) {
+        write_profile();
+    }
+    chip8_profile_disable(&chip8);
+#endif
+#ifdef CHIP8_TRACE
+    if (trace_path && !chip8_trace_stop(&chip8)) {
+        SDL_Log("Couldn't write trace %s", trace_path);
+    }
+#endif
+#ifdef CHIP8_SHM
+    chip8_shm_detach(&chip8);
+    chip8_shm_close(shm);
+#endif
 }